@@ -0,0 +1,1105 @@
+/*
+ * jpeg_bench.c
+ * ============
+ * 
+ * Measure decode, encode, echo, lossless transcode, and shrink
+ * throughput of sophistry_jpeg and jpegshrink over a corpus of JPEG
+ * files.
+ * 
+ * Syntax
+ * ------
+ * 
+ *   jpeg_bench [dir]
+ *   jpeg_bench [dir] [reps]
+ * 
+ * [dir] is a directory containing the corpus.  Every regular file in
+ * the directory with a .jpg or .jpeg extension (in any letter case) is
+ * loaded into memory before any measurements are made, so that disk
+ * speed does not affect the results.  Subdirectories are not searched.
+ * 
+ * [reps] is the number of times each benchmark goes through the whole
+ * corpus, in range [1, 1000].  If not specified, it defaults to 3.
+ * 
+ * Benchmarks
+ * ----------
+ * 
+ * The following benchmarks are run, each with reused reader, writer,
+ * and shrink context objects as a throughput-oriented client would:
+ * 
+ *   decode     memory to pixels with sph_jpeg_reader_get_rows()
+ *   encode     pixels to memory at several qualities
+ *   echo       decode followed by encode at several qualities
+ *   transcode  sph_jpeg_transcode() with and without optimization
+ *   shrink     jpegshrink_ctx_run() at several scaling values
+ *   fit        jpegshrink_ctx_fit() to a 256 pixel long dimension
+ * 
+ * Pixels for the encode benchmark are decoded before timing starts.
+ * Benchmarks that need file handles read from fmemopen() streams and
+ * write to the null device.
+ * 
+ * Output
+ * ------
+ * 
+ * A line is written to standard output for each benchmark setting,
+ * with the benchmark name, the setting, the number of images
+ * processed, the throughput in megapixels per second of full-size input
+ * image, and the 50th, 90th, and 99th percentile latencies per image in
+ * milliseconds.  Images that fail in a benchmark are counted in a
+ * separate column and excluded from the throughput and latencies.
+ * 
+ * The libjpeg version the program was compiled against is reported
+ * first, and the peak resident set size of the process is reported
+ * last, so that results from libjpeg 6b and libjpeg-turbo builds can be
+ * compared.
+ * 
+ * Compilation
+ * -----------
+ * 
+ * Compile with sophistry_jpeg and jpegshrink.  Requires a POSIX
+ * platform for directory listing, fmemopen(), clock_gettime(), and
+ * getrusage().
+ */
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <jpeglib.h>
+
+#include "sophistry_jpeg.h"
+#include "jpegshrink.h"
+
+/*
+ * The default number of repetitions if none is specified.
+ */
+#define DEFAULT_REPS (3)
+
+/*
+ * The maximum number of repetitions.
+ */
+#define MAX_REPS (1000)
+
+/*
+ * The number of rows to decode per call in the decode benchmarks.
+ */
+#define DECODE_ROWS (16)
+
+/*
+ * The long dimension used for the fit benchmark.
+ */
+#define FIT_LONG (256)
+
+/*
+ * A JPEG file of the corpus, loaded into memory.
+ */
+typedef struct {
+  
+  /*
+   * The file name, dynamically allocated.
+   */
+  char *pName;
+  
+  /*
+   * The file data, dynamically allocated.
+   */
+  uint8_t *pData;
+  
+  /*
+   * The length of the file data in bytes.
+   */
+  size_t len;
+  
+  /*
+   * The full-size image dimensions and channel count from probing.
+   */
+  int32_t width;
+  int32_t height;
+  int chcount;
+  
+} BENCH_IMAGE;
+
+/*
+ * The corpus of loaded JPEG files.
+ */
+typedef struct {
+  
+  /*
+   * The dynamically allocated array of images.
+   */
+  BENCH_IMAGE *pImages;
+  
+  /*
+   * The number of images in the array, and its capacity.
+   */
+  int32_t count;
+  int32_t cap;
+  
+} BENCH_CORPUS;
+
+/*
+ * Statistics collected for a single benchmark setting.
+ */
+typedef struct {
+  
+  /*
+   * The dynamically allocated array of per-image latencies in seconds.
+   */
+  double *pLat;
+  
+  /*
+   * The number of latencies recorded, and the capacity of the array.
+   */
+  int32_t count;
+  int32_t cap;
+  
+  /*
+   * The total number of full-size input pixels processed.
+   */
+  double pixels;
+  
+  /*
+   * The total time of all recorded latencies in seconds.
+   */
+  double total;
+  
+  /*
+   * The number of failed images.
+   */
+  int32_t fail;
+  
+} BENCH_STATS;
+
+/*
+ * Parse the given string as a signed integer.
+ * 
+ * pstr is the string to parse.
+ * 
+ * pv points to the integer value to use to return the parsed numeric
+ * value if the function is successful.
+ * 
+ * In two's complement, this function will not successfully parse the
+ * least negative value.
+ * 
+ * Parameters:
+ * 
+ *   pstr - the string to parse
+ * 
+ *   pv - pointer to the return numeric value
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if failure
+ */
+static int parseInt(const char *pstr, int32_t *pv) {
+  
+  int negflag = 0;
+  int32_t result = 0;
+  int status = 1;
+  int32_t d = 0;
+  
+  /* Check parameters */
+  if ((pstr == NULL) || (pv == NULL)) {
+    abort();
+  }
+  
+  /* If first character is a sign character, set negflag appropriately
+   * and skip it */
+  if (*pstr == '+') {
+    negflag = 0;
+    pstr++;
+  } else if (*pstr == '-') {
+    negflag = 1;
+    pstr++;
+  } else {
+    negflag = 0;
+  }
+  
+  /* Make sure we have at least one digit */
+  if (*pstr == 0) {
+    status = 0;
+  }
+  
+  /* Parse all digits */
+  if (status) {
+    for( ; *pstr != 0; pstr++) {
+      
+      /* Make sure in range of digits */
+      if ((*pstr < '0') || (*pstr > '9')) {
+        status = 0;
+      }
+      
+      /* Get numeric value of digit */
+      if (status) {
+        d = (int32_t) (*pstr - '0');
+      }
+      
+      /* Multiply result by 10, watching for overflow */
+      if (status) {
+        if (result <= INT32_MAX / 10) {
+          result = result * 10;
+        } else {
+          status = 0; /* overflow */
+        }
+      }
+      
+      /* Add in digit value, watching for overflow */
+      if (status) {
+        if (result <= INT32_MAX - d) {
+          result = result + d;
+        } else {
+          status = 0; /* overflow */
+        }
+      }
+      
+      /* Leave loop if error */
+      if (!status) {
+        break;
+      }
+    }
+  }
+  
+  /* Invert result if negative mode */
+  if (status && negflag) {
+    result = -(result);
+  }
+  
+  /* Write result if successful */
+  if (status) {
+    *pv = result;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Get the current time from a monotonic clock.
+ * 
+ * Return:
+ * 
+ *   the current time in seconds
+ */
+static double nowSec(void) {
+  
+  struct timespec ts;
+  
+  memset(&ts, 0, sizeof(struct timespec));
+  if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+    abort();
+  }
+  
+  return ((double) ts.tv_sec) + (((double) ts.tv_nsec) / 1.0e9);
+}
+
+/*
+ * Make sure that a dynamically allocated buffer has at least a given
+ * size.
+ * 
+ * pBuf is the current buffer or NULL, and pCap points to its current
+ * size in bytes.  The contents are not preserved when the buffer grows.
+ * 
+ * Parameters:
+ * 
+ *   pBuf - the current buffer, or NULL
+ * 
+ *   pCap - pointer to the current size
+ * 
+ *   need - the required size in bytes
+ * 
+ * Return:
+ * 
+ *   the buffer with at least the required size
+ */
+static void *growBuf(void *pBuf, size_t *pCap, size_t need) {
+  
+  if (pCap == NULL) {
+    abort();
+  }
+  
+  if ((pBuf == NULL) || (*pCap < need)) {
+    free(pBuf);
+    pBuf = malloc(need);
+    if (pBuf == NULL) {
+      abort();
+    }
+    *pCap = need;
+  }
+  
+  return pBuf;
+}
+
+/*
+ * Check whether a file name has a .jpg or .jpeg extension, ignoring
+ * letter case.
+ * 
+ * Parameters:
+ * 
+ *   pName - the file name
+ * 
+ * Return:
+ * 
+ *   non-zero if the name has a JPEG extension, zero otherwise
+ */
+static int isJpegName(const char *pName) {
+  
+  const char *pExt = NULL;
+  char ext[6];
+  size_t i = 0;
+  
+  /* Initialize arrays */
+  memset(ext, 0, sizeof(ext));
+  
+  /* Check parameter */
+  if (pName == NULL) {
+    abort();
+  }
+  
+  /* Find the extension */
+  pExt = strrchr(pName, '.');
+  if (pExt == NULL) {
+    return 0;
+  }
+  pExt++;
+  if (strlen(pExt) >= sizeof(ext)) {
+    return 0;
+  }
+  
+  /* Lowercase the extension and compare */
+  for(i = 0; pExt[i] != 0; i++) {
+    if ((pExt[i] >= 'A') && (pExt[i] <= 'Z')) {
+      ext[i] = (char) (pExt[i] - 'A' + 'a');
+    } else {
+      ext[i] = pExt[i];
+    }
+  }
+  
+  return ((strcmp(ext, "jpg") == 0) || (strcmp(ext, "jpeg") == 0));
+  /* CAUTION: alternate return statements earlier! */
+}
+
+/*
+ * Load every JPEG file in a directory into a corpus.
+ * 
+ * Files that can't be read, or that can't be probed as JPEG files
+ * within the limits of sophistry_jpeg, are reported to standard error
+ * and skipped.
+ * 
+ * Parameters:
+ * 
+ *   pc - the corpus to add to
+ * 
+ *   pDir - the directory path
+ * 
+ *   pModule - the module name for error reports
+ * 
+ * Return:
+ * 
+ *   non-zero if the directory could be listed, zero otherwise
+ */
+static int loadCorpus(
+          BENCH_CORPUS * pc,
+    const char         * pDir,
+    const char         * pModule) {
+  
+  DIR *pd = NULL;
+  struct dirent *pe = NULL;
+  struct stat st;
+  FILE *fh = NULL;
+  char *pPath = NULL;
+  size_t plen = 0;
+  BENCH_IMAGE img;
+  SPH_JPEG_PROBE info;
+  int ok = 0;
+  
+  /* Initialize structures */
+  memset(&st, 0, sizeof(struct stat));
+  memset(&img, 0, sizeof(BENCH_IMAGE));
+  memset(&info, 0, sizeof(SPH_JPEG_PROBE));
+  
+  /* Check parameters */
+  if ((pc == NULL) || (pDir == NULL) || (pModule == NULL)) {
+    abort();
+  }
+  
+  /* Open the directory */
+  pd = opendir(pDir);
+  if (pd == NULL) {
+    return 0;
+  }
+  
+  /* Go through all directory entries */
+  for(pe = readdir(pd); pe != NULL; pe = readdir(pd)) {
+    
+    /* Skip files without a JPEG extension */
+    if (!isJpegName(pe->d_name)) {
+      continue;
+    }
+    
+    /* Build the full path */
+    plen = strlen(pDir) + strlen(pe->d_name) + 2;
+    pPath = (char *) malloc(plen);
+    if (pPath == NULL) {
+      abort();
+    }
+    sprintf(pPath, "%s/%s", pDir, pe->d_name);
+    
+    /* Read the whole file if it is a regular file */
+    memset(&img, 0, sizeof(BENCH_IMAGE));
+    ok = 0;
+    if (stat(pPath, &st) == 0) {
+      if (S_ISREG(st.st_mode) && (st.st_size > 0)) {
+        fh = fopen(pPath, "rb");
+        if (fh != NULL) {
+          img.len = (size_t) st.st_size;
+          img.pData = (uint8_t *) malloc(img.len);
+          if (img.pData == NULL) {
+            abort();
+          }
+          if (fread(img.pData, 1, img.len, fh) == img.len) {
+            ok = 1;
+          }
+          (void) fclose(fh);
+          fh = NULL;
+        }
+      }
+    }
+    
+    /* Probe the image */
+    if (ok) {
+      if (sph_jpeg_probe_mem(img.pData, img.len, &info) !=
+            SPH_JPEG_ERR_OK) {
+        ok = 0;
+      }
+    }
+    
+    /* Add the image to the corpus, or report and skip it */
+    if (ok) {
+      img.width = info.width;
+      img.height = info.height;
+      img.chcount = info.chcount;
+      img.pName = (char *) malloc(strlen(pe->d_name) + 1);
+      if (img.pName == NULL) {
+        abort();
+      }
+      strcpy(img.pName, pe->d_name);
+      
+      if (pc->count >= pc->cap) {
+        if (pc->cap < 1) {
+          pc->cap = 64;
+        } else {
+          pc->cap *= 2;
+        }
+        pc->pImages = (BENCH_IMAGE *) realloc(
+                        pc->pImages,
+                        ((size_t) pc->cap) * sizeof(BENCH_IMAGE));
+        if (pc->pImages == NULL) {
+          abort();
+        }
+      }
+      pc->pImages[pc->count] = img;
+      (pc->count)++;
+      
+    } else {
+      fprintf(stderr, "%s: Skipping %s\n", pModule, pPath);
+      free(img.pData);
+    }
+    
+    free(pPath);
+    pPath = NULL;
+  }
+  
+  (void) closedir(pd);
+  return 1;
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * Record the latency of one image in benchmark statistics.
+ * 
+ * Parameters:
+ * 
+ *   ps - the statistics
+ * 
+ *   pImg - the image that was processed
+ * 
+ *   sec - the latency in seconds
+ */
+static void statsAdd(
+          BENCH_STATS * ps,
+    const BENCH_IMAGE * pImg,
+          double        sec) {
+  
+  /* Check parameters */
+  if ((ps == NULL) || (pImg == NULL)) {
+    abort();
+  }
+  
+  /* Grow the latency array if necessary */
+  if (ps->count >= ps->cap) {
+    if (ps->cap < 1) {
+      ps->cap = 256;
+    } else {
+      ps->cap *= 2;
+    }
+    ps->pLat = (double *) realloc(
+                  ps->pLat, ((size_t) ps->cap) * sizeof(double));
+    if (ps->pLat == NULL) {
+      abort();
+    }
+  }
+  
+  /* Record the sample */
+  ps->pLat[ps->count] = sec;
+  (ps->count)++;
+  ps->total += sec;
+  ps->pixels += ((double) pImg->width) * ((double) pImg->height);
+}
+
+/*
+ * Comparison function for sorting latencies with qsort().
+ */
+static int cmpDouble(const void *pA, const void *pB) {
+  
+  double a = *((const double *) pA);
+  double b = *((const double *) pB);
+  
+  if (a < b) {
+    return -1;
+  } else if (a > b) {
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Get a percentile of sorted latencies by the nearest-rank method.
+ * 
+ * Parameters:
+ * 
+ *   ps - the statistics, with latencies already sorted
+ * 
+ *   pct - the percentile, in range [1, 100]
+ * 
+ * Return:
+ * 
+ *   the latency in milliseconds, or zero if there are no samples
+ */
+static double statsPct(const BENCH_STATS *ps, int pct) {
+  
+  int32_t rank = 0;
+  
+  if (ps == NULL) {
+    abort();
+  }
+  if (ps->count < 1) {
+    return 0.0;
+  }
+  
+  rank = (int32_t) ((((int64_t) ps->count) * pct + 99) / 100);
+  if (rank < 1) {
+    rank = 1;
+  }
+  if (rank > ps->count) {
+    rank = ps->count;
+  }
+  
+  return ps->pLat[rank - 1] * 1000.0;
+}
+
+/*
+ * Print the title line of the benchmark report.
+ */
+static void reportTitle(void) {
+  printf("%-10s %-10s %7s %5s %9s %9s %9s %9s\n",
+          "benchmark", "setting", "images", "fail",
+          "MP/s", "p50_ms", "p90_ms", "p99_ms");
+}
+
+/*
+ * Print the report line for a benchmark setting and then reset the
+ * statistics for the next setting.
+ * 
+ * Parameters:
+ * 
+ *   pName - the benchmark name
+ * 
+ *   pSetting - the setting description
+ * 
+ *   ps - the statistics
+ */
+static void statsReport(
+    const char        * pName,
+    const char        * pSetting,
+          BENCH_STATS * ps) {
+  
+  double mps = 0.0;
+  
+  /* Check parameters */
+  if ((pName == NULL) || (pSetting == NULL) || (ps == NULL)) {
+    abort();
+  }
+  
+  /* Sort the latencies and compute throughput */
+  if (ps->count > 0) {
+    qsort(ps->pLat, (size_t) ps->count, sizeof(double), &cmpDouble);
+  }
+  if (ps->total > 0.0) {
+    mps = (ps->pixels / 1.0e6) / ps->total;
+  }
+  
+  /* Print the line */
+  printf("%-10s %-10s %7ld %5ld %9.2f %9.3f %9.3f %9.3f\n",
+          pName, pSetting, (long) ps->count, (long) ps->fail, mps,
+          statsPct(ps, 50), statsPct(ps, 90), statsPct(ps, 99));
+  fflush(stdout);
+  
+  /* Reset the statistics, keeping the latency array */
+  ps->count = 0;
+  ps->pixels = 0.0;
+  ps->total = 0.0;
+  ps->fail = 0;
+}
+
+/*
+ * Run the decode benchmark.
+ * 
+ * Parameters:
+ * 
+ *   pc - the corpus
+ * 
+ *   reps - the number of repetitions
+ * 
+ *   ps - the statistics to record into
+ */
+static void benchDecode(
+    const BENCH_CORPUS * pc,
+          int32_t        reps,
+          BENCH_STATS  * ps) {
+  
+  SPH_JPEG_READER *pr = NULL;
+  BENCH_IMAGE *pImg = NULL;
+  uint8_t *pBuf = NULL;
+  size_t cap = 0;
+  size_t stride = 0;
+  int32_t r = 0;
+  int32_t i = 0;
+  int32_t y = 0;
+  int32_t got = 0;
+  int ok = 0;
+  double t = 0.0;
+  
+  for(r = 0; r < reps; r++) {
+    for(i = 0; i < pc->count; i++) {
+      pImg = &(pc->pImages[i]);
+      stride = ((size_t) pImg->width) * ((size_t) pImg->chcount);
+      pBuf = (uint8_t *) growBuf(pBuf, &cap, stride * DECODE_ROWS);
+      
+      t = nowSec();
+      
+      /* Open or reuse the reader */
+      if (pr == NULL) {
+        pr = sph_jpeg_reader_new_mem(pImg->pData, pImg->len);
+        if (pr == NULL) {
+          abort();
+        }
+      } else {
+        sph_jpeg_reader_reset_mem(pr, pImg->pData, pImg->len);
+      }
+      ok = (sph_jpeg_reader_status(pr) == SPH_JPEG_ERR_OK);
+      
+      /* Decode all the rows */
+      for(y = 0; ok && (y < sph_jpeg_reader_height(pr)); y += got) {
+        got = sph_jpeg_reader_get_rows(pr, pBuf, stride, DECODE_ROWS);
+        if (got < 1) {
+          ok = 0;
+        }
+      }
+      
+      t = nowSec() - t;
+      
+      if (ok) {
+        statsAdd(ps, pImg, t);
+      } else {
+        (ps->fail)++;
+      }
+    }
+  }
+  
+  sph_jpeg_reader_free(pr);
+  free(pBuf);
+}
+
+/*
+ * Run the encode or echo benchmark at a given quality.
+ * 
+ * If echo is non-zero, the decode is timed together with the encode.
+ * Otherwise, each image is decoded into memory before timing starts,
+ * and only the encode is timed.
+ * 
+ * Parameters:
+ * 
+ *   pc - the corpus
+ * 
+ *   reps - the number of repetitions
+ * 
+ *   q - the compression quality
+ * 
+ *   echo - non-zero to also time the decode
+ * 
+ *   ps - the statistics to record into
+ */
+static void benchEncode(
+    const BENCH_CORPUS * pc,
+          int32_t        reps,
+          int            q,
+          int            echo,
+          BENCH_STATS  * ps) {
+  
+  SPH_JPEG_READER *pr = NULL;
+  SPH_JPEG_WRITER *pw = NULL;
+  SPH_JPEG_MEMBUF out;
+  BENCH_IMAGE *pImg = NULL;
+  uint8_t *pPix = NULL;
+  size_t cap = 0;
+  size_t stride = 0;
+  int32_t r = 0;
+  int32_t i = 0;
+  int32_t y = 0;
+  int32_t got = 0;
+  int32_t w = 0;
+  int32_t h = 0;
+  int ch = 0;
+  int ok = 0;
+  double t = 0.0;
+  
+  /* Initialize structures */
+  sph_jpeg_membuf_init(&out);
+  
+  for(r = 0; r < reps; r++) {
+    for(i = 0; i < pc->count; i++) {
+      pImg = &(pc->pImages[i]);
+      
+      /* Start timing here only for the echo benchmark */
+      if (echo) {
+        t = nowSec();
+      }
+      
+      /* Decode the whole image */
+      if (pr == NULL) {
+        pr = sph_jpeg_reader_new_mem(pImg->pData, pImg->len);
+        if (pr == NULL) {
+          abort();
+        }
+      } else {
+        sph_jpeg_reader_reset_mem(pr, pImg->pData, pImg->len);
+      }
+      ok = (sph_jpeg_reader_status(pr) == SPH_JPEG_ERR_OK);
+      if (ok) {
+        w = sph_jpeg_reader_width(pr);
+        h = sph_jpeg_reader_height(pr);
+        ch = sph_jpeg_reader_channels(pr);
+        stride = ((size_t) w) * ((size_t) ch);
+        pPix = (uint8_t *) growBuf(pPix, &cap, stride * ((size_t) h));
+      }
+      for(y = 0; ok && (y < h); y += got) {
+        got = sph_jpeg_reader_get_rows(
+                pr, pPix + (((size_t) y) * stride), stride, h - y);
+        if (got < 1) {
+          ok = 0;
+        }
+      }
+      
+      /* Start timing here for the encode benchmark */
+      if (!echo) {
+        t = nowSec();
+      }
+      
+      /* Encode the whole image, overwriting the previous output */
+      if (ok) {
+        out.len = 0;
+        if (pw == NULL) {
+          pw = sph_jpeg_writer_new_mem(&out, w, h, ch, q);
+          if (pw == NULL) {
+            abort();
+          }
+        } else {
+          sph_jpeg_writer_reset_mem(pw, &out, w, h, ch, q);
+        }
+        sph_jpeg_writer_put_rows(pw, pPix, stride, h);
+        ok = (sph_jpeg_writer_status(pw) == SPH_JPEG_ERR_OK);
+      }
+      
+      t = nowSec() - t;
+      
+      if (ok) {
+        statsAdd(ps, pImg, t);
+      } else {
+        (ps->fail)++;
+      }
+    }
+  }
+  
+  sph_jpeg_reader_free(pr);
+  sph_jpeg_writer_free(pw);
+  sph_jpeg_membuf_free(&out);
+  free(pPix);
+}
+
+/*
+ * Run one of the benchmarks that work on file handles.
+ * 
+ * mode selects the operation: zero for jpegshrink_ctx_run() with the
+ * given sval, one for jpegshrink_ctx_fit() to FIT_LONG, and two for
+ * sph_jpeg_transcode() with sval used as the flags.
+ * 
+ * Parameters:
+ * 
+ *   pc - the corpus
+ * 
+ *   reps - the number of repetitions
+ * 
+ *   mode - the operation
+ * 
+ *   sval - the scaling value or transcode flags
+ * 
+ *   q - the compression quality
+ * 
+ *   pNull - the output file handle
+ * 
+ *   ps - the statistics to record into
+ */
+static void benchStream(
+    const BENCH_CORPUS * pc,
+          int32_t        reps,
+          int            mode,
+          int            sval,
+          int            q,
+          FILE         * pNull,
+          BENCH_STATS  * ps) {
+  
+  JPEGSHRINK_CTX *pctx = NULL;
+  JPEGSHRINK_BOUNDS bounds;
+  BENCH_IMAGE *pImg = NULL;
+  FILE *pIn = NULL;
+  int32_t r = 0;
+  int32_t i = 0;
+  int retval = 0;
+  double t = 0.0;
+  
+  /* Initialize structures */
+  bounds.max_long = FIT_LONG;
+  bounds.max_short = -1;
+  bounds.max_width = -1;
+  bounds.max_height = -1;
+  bounds.max_pixels = -1;
+  
+  pctx = jpegshrink_ctx_new();
+  if (pctx == NULL) {
+    abort();
+  }
+  
+  for(r = 0; r < reps; r++) {
+    for(i = 0; i < pc->count; i++) {
+      pImg = &(pc->pImages[i]);
+      
+      t = nowSec();
+      
+      pIn = fmemopen(pImg->pData, pImg->len, "rb");
+      if (pIn == NULL) {
+        abort();
+      }
+      
+      if (mode == 0) {
+        retval = jpegshrink_ctx_run(pctx, pIn, pNull, sval, q, NULL);
+      } else if (mode == 1) {
+        retval = jpegshrink_ctx_fit(pctx, pIn, pNull, q, &bounds);
+      } else {
+        retval = sph_jpeg_transcode(pIn, pNull, sval);
+      }
+      
+      (void) fclose(pIn);
+      pIn = NULL;
+      
+      t = nowSec() - t;
+      
+      if (retval == SPH_JPEG_ERR_OK) {
+        statsAdd(ps, pImg, t);
+      } else {
+        (ps->fail)++;
+      }
+    }
+  }
+  
+  jpegshrink_ctx_free(pctx);
+}
+
+/*
+ * Program entrypoint.
+ */
+int main(int argc, char *argv[]) {
+  
+  static const int qvals[] = {75, 90};
+  static const int svals[] = {2, 3, 4, 8};
+  
+  int status = 1;
+  int i = 0;
+  const char *pModule = NULL;
+  int32_t reps = DEFAULT_REPS;
+  BENCH_CORPUS corpus;
+  BENCH_STATS stats;
+  FILE *pNull = NULL;
+  struct rusage ru;
+  char setting[32];
+  
+  /* Initialize structures */
+  memset(&corpus, 0, sizeof(BENCH_CORPUS));
+  memset(&stats, 0, sizeof(BENCH_STATS));
+  memset(&ru, 0, sizeof(struct rusage));
+  memset(setting, 0, sizeof(setting));
+  
+  /* Get the module name */
+  if (argc > 0) {
+    if (argv != NULL) {
+      if (argv[0] != NULL) {
+        pModule = argv[0];
+      }
+    }
+  }
+  if (pModule == NULL) {
+    pModule = "jpeg_bench";
+  }
+  
+  /* Check that parameters are present */
+  if (argv == NULL) {
+    abort();
+  }
+  for(i = 0; i < argc; i++) {
+    if (argv[i] == NULL) {
+      abort();
+    }
+  }
+  
+  /* Check that either one extra parameter or two extra parameters */
+  if ((argc != 2) && (argc != 3)) {
+    fprintf(stderr, "%s: Wrong number of parameters!\n", pModule);
+    status = 0;
+  }
+  
+  /* If a second parameter is there, parse it as a repetition count */
+  if (status && (argc > 2)) {
+    if (!parseInt(argv[2], &reps)) {
+      fprintf(stderr, "%s: Can't parse repetition count!\n", pModule);
+      status = 0;
+    }
+    if (status && ((reps < 1) || (reps > MAX_REPS))) {
+      fprintf(stderr, "%s: Repetition count out of range!\n", pModule);
+      status = 0;
+    }
+  }
+  
+  /* Load the corpus */
+  if (status) {
+    if (!loadCorpus(&corpus, argv[1], pModule)) {
+      fprintf(stderr, "%s: Can't read corpus directory!\n", pModule);
+      status = 0;
+    }
+  }
+  if (status && (corpus.count < 1)) {
+    fprintf(stderr, "%s: No JPEG files in corpus!\n", pModule);
+    status = 0;
+  }
+  
+  /* Open the null device for benchmarks that write to files */
+  if (status) {
+    pNull = fopen("/dev/null", "wb");
+    if (pNull == NULL) {
+      fprintf(stderr, "%s: Can't open null device!\n", pModule);
+      status = 0;
+    }
+  }
+  
+  /* Report the configuration */
+  if (status) {
+#ifdef LIBJPEG_TURBO_VERSION
+    printf("libjpeg API version %d (libjpeg-turbo)\n",
+            JPEG_LIB_VERSION);
+#else
+    printf("libjpeg API version %d\n", JPEG_LIB_VERSION);
+#endif
+    printf("%ld images, %ld repetitions\n\n",
+            (long) corpus.count, (long) reps);
+    reportTitle();
+  }
+  
+  /* Run the benchmarks */
+  if (status) {
+    benchDecode(&corpus, reps, &stats);
+    statsReport("decode", "-", &stats);
+    
+    for(i = 0; i < (int) (sizeof(qvals) / sizeof(int)); i++) {
+      sprintf(setting, "q=%d", qvals[i]);
+      benchEncode(&corpus, reps, qvals[i], 0, &stats);
+      statsReport("encode", setting, &stats);
+    }
+    
+    for(i = 0; i < (int) (sizeof(qvals) / sizeof(int)); i++) {
+      sprintf(setting, "q=%d", qvals[i]);
+      benchEncode(&corpus, reps, qvals[i], 1, &stats);
+      statsReport("echo", setting, &stats);
+    }
+    
+    benchStream(&corpus, reps, 2, 0, 0, pNull, &stats);
+    statsReport("transcode", "plain", &stats);
+    benchStream(
+      &corpus, reps, 2, SPH_JPEG_TRANS_OPTIMIZE, 0, pNull, &stats);
+    statsReport("transcode", "optimize", &stats);
+    
+    for(i = 0; i < (int) (sizeof(svals) / sizeof(int)); i++) {
+      sprintf(setting, "sval=%d", svals[i]);
+      benchStream(&corpus, reps, 0, svals[i], 85, pNull, &stats);
+      statsReport("shrink", setting, &stats);
+    }
+    
+    sprintf(setting, "long=%d", FIT_LONG);
+    benchStream(&corpus, reps, 1, 0, 85, pNull, &stats);
+    statsReport("fit", setting, &stats);
+  }
+  
+  /* Report peak memory use */
+  if (status) {
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+      printf("\npeak RSS: %ld KiB\n", (long) ru.ru_maxrss);
+    }
+  }
+  
+  /* Release everything */
+  if (pNull != NULL) {
+    (void) fclose(pNull);
+    pNull = NULL;
+  }
+  for(i = 0; i < corpus.count; i++) {
+    free(corpus.pImages[i].pName);
+    free(corpus.pImages[i].pData);
+  }
+  free(corpus.pImages);
+  free(stats.pLat);
+  
+  /* Invert status and return */
+  if (status) {
+    status = 0;
+  } else {
+    status = 1;
+  }
+  return status;
+}
@@ -6,13 +6,15 @@
  * file on standard output.
  * 
  * Note that metadata from the input JPEG file is NOT carried over to
- * the output file.  Also note that the JPEG image is fully re-encoded.
+ * the output file.  Also note that the JPEG image is fully re-encoded,
+ * unless the --lossless option is given.
  * 
  * Syntax
  * ------
  * 
  *   jpeg_echo
  *   jpeg_echo [q]
+ *   jpeg_echo --lossless [options]
  * 
  * The optional [q] parameter is an integer specifying the compression
  * quality to use for output.  This is in range 0-100, with higher
@@ -20,6 +22,14 @@
  * values meaning less image quality but more compression.  If not
  * specified, it defaults to 90.
  * 
+ * With --lossless, the DCT coefficients of the input are copied to the
+ * output without decoding to pixels, so there is no quality loss and
+ * no [q] parameter.  See sph_jpeg_transcode() for details.  The
+ * following options may follow --lossless:
+ * 
+ *   --optimize   compute optimal Huffman tables for the output
+ *   --markers    keep APPn and COM metadata markers
+ * 
  * Compilation
  * -----------
  * 
@@ -153,6 +163,8 @@ int main(int argc, char *argv[]) {
   int32_t qval = DEFAULT_Q_VAL;
   int32_t y = 0;
   int32_t ih = 0;
+  int lossless = 0;
+  int flags = 0;
   
   SPH_JPEG_READER *pr = NULL;
   SPH_JPEG_WRITER *pw = NULL;
@@ -180,14 +192,40 @@ int main(int argc, char *argv[]) {
     }
   }
   
+  /* If the first parameter is --lossless, parse the lossless options
+   * and copy DCT coefficients instead of re-encoding */
+  if ((argc > 1) && (strcmp(argv[1], "--lossless") == 0)) {
+    lossless = 1;
+    for(i = 2; i < argc; i++) {
+      if (strcmp(argv[i], "--optimize") == 0) {
+        flags |= SPH_JPEG_TRANS_OPTIMIZE;
+      } else if (strcmp(argv[i], "--markers") == 0) {
+        flags |= SPH_JPEG_TRANS_MARKERS;
+      } else {
+        fprintf(stderr, "%s: Unrecognized option %s!\n",
+                  pModule, argv[i]);
+        status = 0;
+        break;
+      }
+    }
+    
+    if (status) {
+      i = sph_jpeg_transcode(stdin, stdout, flags);
+      if (i != SPH_JPEG_ERR_OK) {
+        fprintf(stderr, "%s: %s!\n", pModule, sph_jpeg_errstr(i));
+        status = 0;
+      }
+    }
+  }
+  
   /* Check that either no parameters or one parameter */
-  if ((argc != 1) && (argc != 2)) {
+  if ((!lossless) && (argc != 1) && (argc != 2)) {
     fprintf(stderr, "%s: Wrong number of parameters!\n", pModule);
     status = 0;
   }
   
   /* If a parameter is there, parse it as a quality value */
-  if (status && (argc > 1)) {
+  if (status && (!lossless) && (argc > 1)) {
     
     /* Parse quality value */
     if (!parseInt(argv[1], &qval)) {
@@ -203,8 +241,11 @@ int main(int argc, char *argv[]) {
   }
   
   /* Establish a reader object on standard input */
-  if (status) {
+  if (status && (!lossless)) {
     pr = sph_jpeg_reader_new(stdin);
+    if (pr == NULL) {
+      abort();
+    }
     i = sph_jpeg_reader_status(pr);
     if (i != SPH_JPEG_ERR_OK) {
       fprintf(stderr, "%s: %s!\n", pModule, sph_jpeg_errstr(i));
@@ -213,17 +254,20 @@ int main(int argc, char *argv[]) {
   }
   
   /* Establish a writer object on standard output */
-  if (status) {
+  if (status && (!lossless)) {
     pw = sph_jpeg_writer_new(
             stdout,
             sph_jpeg_reader_width(pr),
             sph_jpeg_reader_height(pr),
             sph_jpeg_reader_channels(pr),
             (int) qval);
+    if (pw == NULL) {
+      abort();
+    }
   }
   
   /* Allocate scanline buffer */
-  if (status) {
+  if (status && (!lossless)) {
     pscan = (uint8_t *) calloc(
                           (size_t) sph_jpeg_reader_width(pr),
                           (size_t) sph_jpeg_reader_channels(pr));
@@ -233,7 +277,7 @@ int main(int argc, char *argv[]) {
   }
   
   /* Transfer scanlines to output */
-  if (status) {
+  if (status && (!lossless)) {
     ih = sph_jpeg_reader_height(pr);
     for(y = 0; y < ih; y++) {
       
@@ -248,6 +292,11 @@ int main(int argc, char *argv[]) {
       /* Write a scanline */
       if (status) {
         sph_jpeg_writer_put(pw, pscan);
+        i = sph_jpeg_writer_status(pw);
+        if (i != SPH_JPEG_ERR_OK) {
+          status = 0;
+          fprintf(stderr, "%s: %s!\n", pModule, sph_jpeg_errstr(i));
+        }
       }
       
       /* Leave loop if error */
@@ -13,14 +13,22 @@
  * 
  *   jpeg_reduce [rval]
  *   jpeg_reduce [rval] [q]
+ *   jpeg_reduce --pipe [kib] [rval]
+ *   jpeg_reduce --pipe [kib] [rval] [q]
+ *   jpeg_reduce --cache [path] [rval]
+ *   jpeg_reduce --cache [path] [rval] [q]
+ *   jpeg_reduce --manifest [list] [rval]
+ *   jpeg_reduce --manifest [list] [rval] [q]
+ *   jpeg_reduce --jobs [n] --manifest [list] [rval]
+ *   jpeg_reduce --jobs [n] --manifest [list] [rval] [q]
  * 
- * [rval] is the reduction value.  It must be in range [1, 16].  A value
- * of one means that no reduction is performed.  Values greater than one
- * mean that the width and height of the input image are each divided by
- * that reduction value to get the dimensions of the shrunk output
- * image.  The input image is padded at the end of each scanlines and
- * beyond the bottom of the image by duplication as necessary to get the
- * width and height up to a multiple of [rval].
+ * [rval] is the reduction value.  It must be in range [1, 256].  A
+ * value of one means that no reduction is performed.  Values greater
+ * than one mean that the width and height of the input image are each
+ * divided by that reduction value to get the dimensions of the shrunk
+ * output image.  The input image is padded at the end of each
+ * scanlines and beyond the bottom of the image by duplication as
+ * necessary to get the width and height up to a multiple of [rval].
  * 
  * The optional [q] parameter is an integer specifying the compression
  * quality to use for output.  This is in range 0-100, with higher
@@ -28,10 +36,52 @@
  * values meaning less image quality but more compression.  If not
  * specified, it defaults to 90.
  * 
+ * Pipelined mode
+ * --------------
+ * 
+ * If the --pipe option is given, standard input is decoded on a
+ * separate thread that feeds the shrink and encode stages through a
+ * ring buffer of at most [kib] kilobytes, in range [1, 1048576].  This
+ * overlaps slow input and output with the decoding and encoding work.
+ * The option can't be combined with batch mode.
+ * 
+ * Cached mode
+ * -----------
+ * 
+ * If the --cache option is given, standard input is read into memory
+ * and shrunk through the jpegshrink_cache file at [path], which is
+ * created if it does not exist.  If the same input has already been
+ * shrunk with the same [rval] and [q] by any process using that cache
+ * file, the cached output is written without decoding anything.  New
+ * cache files hold CACHE_ENTRIES outputs of up to CACHE_ENTRY_BYTES
+ * bytes each.  The option can't be combined with pipelined mode or
+ * batch mode.
+ * 
+ * Batch mode
+ * ----------
+ * 
+ * If the --manifest option is given, then instead of reading standard
+ * input and writing standard output, the program shrinks every file
+ * listed in the manifest file [list].  Each non-blank line of the
+ * manifest has an input file path and an output file path, separated
+ * by a single tab character.  Lines may be at most 4000 characters.
+ * 
+ * The --jobs option gives the number of worker threads [n] to use in
+ * batch mode, in range [1, 256].  If not specified, it defaults to one.
+ * 
+ * For each file, a status line is written to standard output with the
+ * numeric status code, the input path, and a message, separated by tab
+ * characters.  A status code of zero means success.  Status lines may
+ * be written in a different order than the manifest.  The program
+ * fails if any file fails.
+ * 
  * Compilation
  * -----------
  * 
- * Compile with sophistry_jpeg and jpegshrink.
+ * Compile with sophistry_jpeg, jpegshrink, jpegshrink_batch,
+ * jpegshrink_pipe, and jpegshrink_cache.  Batch mode, pipelined mode,
+ * and cached mode require POSIX threads, and cached mode requires a
+ * POSIX.1-2008 platform.
  */
 
 #include <stddef.h>
@@ -42,12 +92,71 @@
 
 #include "sophistry_jpeg.h"
 #include "jpegshrink.h"
+#include "jpegshrink_batch.h"
+#include "jpegshrink_pipe.h"
+#include "jpegshrink_cache.h"
 
 /* 
  * The default quality value if none is specified.
  */
 #define DEFAULT_Q_VAL (90)
 
+/*
+ * The maximum length of a manifest line, including the line break and
+ * terminating nul.
+ */
+#define MAX_LINE (4096)
+
+/*
+ * The maximum ring size in kilobytes for pipelined mode.
+ */
+#define MAX_PIPE_KIB (1048576)
+
+/*
+ * The geometry of new cache files in cached mode, which is 2048
+ * outputs of up to 256 KiB each.
+ */
+#define CACHE_ENTRIES (2048)
+#define CACHE_ENTRY_BYTES (262144)
+
+/*
+ * The initial size of the buffer that standard input is read into in
+ * cached mode.
+ */
+#define INPUT_INIT (65536)
+
+/*
+ * State used while reading the manifest in batch mode.
+ */
+typedef struct {
+  
+  /*
+   * The open manifest file.
+   */
+  FILE *pList;
+  
+  /*
+   * The module name for error messages.
+   */
+  const char *pModule;
+  
+  /*
+   * The current line number in the manifest.
+   */
+  int32_t line_num;
+  
+  /*
+   * The number of manifest lines that could not be parsed.
+   */
+  int32_t bad_count;
+  
+  /*
+   * The line buffer.
+   */
+  char line[MAX_LINE];
+  
+} MANIFEST;
+
 /*
  * Parse the given string as a signed integer.
  * 
@@ -151,6 +260,193 @@ static int parseInt(const char *pstr, int32_t *pv) {
   return status;
 }
 
+/*
+ * Make a dynamically allocated copy of part of a string.
+ * 
+ * pstr points to the start of the string, and len is the number of
+ * characters to copy.  The copy is nul-terminated.  Allocation failures
+ * cause faults.
+ * 
+ * Parameters:
+ * 
+ *   pstr - the string to copy from
+ * 
+ *   len - the number of characters to copy
+ * 
+ * Return:
+ * 
+ *   the dynamically allocated copy
+ */
+static char *copyStr(const char *pstr, size_t len) {
+  
+  char *pCopy = NULL;
+  
+  /* Check parameter */
+  if (pstr == NULL) {
+    abort();
+  }
+  
+  /* Allocate and copy */
+  pCopy = (char *) malloc(len + 1);
+  if (pCopy == NULL) {
+    abort();
+  }
+  memcpy(pCopy, pstr, len);
+  pCopy[len] = (char) 0;
+  
+  return pCopy;
+}
+
+/*
+ * Read the whole of a file into memory.
+ * 
+ * The buffer is allocated with malloc() and grown as needed.
+ * Allocation failures cause faults.
+ * 
+ * Parameters:
+ * 
+ *   pIn - the file to read
+ * 
+ *   pLen - receives the number of bytes read
+ * 
+ * Return:
+ * 
+ *   the buffer, or NULL if there was a read error
+ */
+static uint8_t *readAll(FILE *pIn, size_t *pLen) {
+  
+  uint8_t *pBuf = NULL;
+  uint8_t *pNew = NULL;
+  size_t cap = INPUT_INIT;
+  size_t len = 0;
+  
+  /* Check parameters */
+  if ((pIn == NULL) || (pLen == NULL)) {
+    abort();
+  }
+  
+  /* Read until end of file, doubling the buffer when it is full */
+  pBuf = (uint8_t *) malloc(cap);
+  if (pBuf == NULL) {
+    abort();
+  }
+  for(;;) {
+    len += fread(pBuf + len, 1, cap - len, pIn);
+    if (len < cap) {
+      break;
+    }
+    if (cap > SIZE_MAX / 2) {
+      abort();
+    }
+    pNew = (uint8_t *) realloc(pBuf, cap * 2);
+    if (pNew == NULL) {
+      abort();
+    }
+    pBuf = pNew;
+    cap = cap * 2;
+  }
+  
+  /* Check for read errors */
+  if (ferror(pIn)) {
+    free(pBuf);
+    pBuf = NULL;
+    len = 0;
+  }
+  
+  *pLen = len;
+  return pBuf;
+}
+
+/*
+ * JPEGSHRINK_NEXT callback that reads jobs from the manifest.
+ * 
+ * pCustom points to the MANIFEST state.  Lines that can't be parsed are
+ * reported to standard error and skipped.
+ */
+static int nextJob(void *pCustom, JPEGSHRINK_JOB *pJob) {
+  
+  MANIFEST *pm = NULL;
+  char *pTab = NULL;
+  size_t len = 0;
+  int c = 0;
+  int got = 0;
+  
+  /* Check parameters */
+  if ((pCustom == NULL) || (pJob == NULL)) {
+    abort();
+  }
+  pm = (MANIFEST *) pCustom;
+  
+  /* Read lines until a valid job is found or end of file */
+  while (!got && (fgets(pm->line, MAX_LINE, pm->pList) != NULL)) {
+    (pm->line_num)++;
+    
+    /* Strip the line break; if there is no line break before the end
+     * of the buffer, the line is too long, so skip the rest of it */
+    len = strlen(pm->line);
+    if ((len > 0) && (pm->line[len - 1] == '\n')) {
+      len--;
+    } else if (len >= MAX_LINE - 1) {
+      fprintf(stderr, "%s: Manifest line %ld is too long!\n",
+                pm->pModule, (long) pm->line_num);
+      (pm->bad_count)++;
+      do {
+        c = getc(pm->pList);
+      } while ((c != EOF) && (c != '\n'));
+      continue;
+    }
+    if ((len > 0) && (pm->line[len - 1] == '\r')) {
+      len--;
+    }
+    pm->line[len] = (char) 0;
+    
+    /* Skip blank lines */
+    if (len < 1) {
+      continue;
+    }
+    
+    /* Split the line at the tab */
+    pTab = strchr(pm->line, '\t');
+    if ((pTab == NULL) || (pTab == pm->line) || (pTab[1] == 0)) {
+      fprintf(stderr, "%s: Manifest line %ld is invalid!\n",
+                pm->pModule, (long) pm->line_num);
+      (pm->bad_count)++;
+      continue;
+    }
+    
+    /* Copy the paths into the job */
+    pJob->pInPath = copyStr(pm->line, (size_t) (pTab - pm->line));
+    pJob->pOutPath = copyStr(pTab + 1, strlen(pTab + 1));
+    got = 1;
+  }
+  
+  return got;
+}
+
+/*
+ * JPEGSHRINK_DONE callback that reports the status of a job.
+ * 
+ * The job paths are released.
+ */
+static void doneJob(
+          void           * pCustom,
+    const JPEGSHRINK_JOB * pJob,
+          int              status) {
+  
+  /* Check parameters */
+  if ((pCustom == NULL) || (pJob == NULL)) {
+    abort();
+  }
+  
+  /* Report the status */
+  printf("%d\t%s\t%s\n",
+          status, pJob->pInPath, jpegshrink_batch_errstr(status));
+  
+  /* Release the paths */
+  free(pJob->pInPath);
+  free(pJob->pOutPath);
+}
+
 /*
  * Program entrypoint.
  */
@@ -158,10 +454,22 @@ int main(int argc, char *argv[]) {
   
   int status = 1;
   int i = 0;
+  int argi = 1;
   int retval = 0;
   const char *pModule = NULL;
+  const char *pListPath = NULL;
+  const char *pCachePath = NULL;
   int32_t rval = 0;
   int32_t qval = DEFAULT_Q_VAL;
+  int32_t jval = 1;
+  int jobs_given = 0;
+  int32_t pipe_kib = 0;
+  int32_t fail_count = 0;
+  MANIFEST *pm = NULL;
+  JPEGSHRINK_CTX *pc = NULL;
+  JPEGSHRINK_CACHE *pCache = NULL;
+  uint8_t *pInput = NULL;
+  size_t input_len = 0;
   
   /* Get the module name */
   if (argc > 0) {
@@ -185,8 +493,86 @@ int main(int argc, char *argv[]) {
     }
   }
   
+  /* Parse any options, each of which takes a value */
+  while (status && (argi < argc)) {
+    
+    /* Stop at the first parameter that is not an option */
+    if (strncmp(argv[argi], "--", 2) != 0) {
+      break;
+    }
+    
+    /* Make sure option has a value */
+    if (argi + 1 >= argc) {
+      fprintf(stderr, "%s: Option %s requires a value!\n",
+                pModule, argv[argi]);
+      status = 0;
+      break;
+    }
+    
+    if (strcmp(argv[argi], "--jobs") == 0) {
+      /* Parse and range-check job count */
+      if (!parseInt(argv[argi + 1], &jval)) {
+        fprintf(stderr, "%s: Can't parse job count!\n", pModule);
+        status = 0;
+      }
+      if (status && ((jval < 1) || (jval > JPEGSHRINK_MAXJOBS))) {
+        fprintf(stderr, "%s: Job count out of range!\n", pModule);
+        status = 0;
+      }
+      jobs_given = 1;
+      
+    } else if (strcmp(argv[argi], "--pipe") == 0) {
+      /* Parse and range-check ring size */
+      if (!parseInt(argv[argi + 1], &pipe_kib)) {
+        fprintf(stderr, "%s: Can't parse ring size!\n", pModule);
+        status = 0;
+      }
+      if (status && ((pipe_kib < 1) || (pipe_kib > MAX_PIPE_KIB))) {
+        fprintf(stderr, "%s: Ring size out of range!\n", pModule);
+        status = 0;
+      }
+      
+    } else if (strcmp(argv[argi], "--manifest") == 0) {
+      /* Record manifest path */
+      pListPath = argv[argi + 1];
+      
+    } else if (strcmp(argv[argi], "--cache") == 0) {
+      /* Record cache path */
+      pCachePath = argv[argi + 1];
+      
+    } else {
+      fprintf(stderr, "%s: Unrecognized option %s!\n",
+                pModule, argv[argi]);
+      status = 0;
+    }
+    
+    argi += 2;
+  }
+  
+  /* Job count is only meaningful in batch mode */
+  if (status && jobs_given && (pListPath == NULL)) {
+    fprintf(stderr, "%s: --jobs requires --manifest!\n", pModule);
+    status = 0;
+  }
+  
+  /* Pipelined mode is only available on standard input */
+  if (status && (pipe_kib > 0) && (pListPath != NULL)) {
+    fprintf(stderr, "%s: --pipe can't be used with --manifest!\n",
+              pModule);
+    status = 0;
+  }
+  
+  /* Cached mode is only available on standard input, unpipelined */
+  if (status && (pCachePath != NULL) &&
+      ((pipe_kib > 0) || (pListPath != NULL))) {
+    fprintf(stderr,
+      "%s: --cache can't be used with --pipe or --manifest!\n",
+      pModule);
+    status = 0;
+  }
+  
   /* Check that either one extra parameter or two extra parameters */
-  if ((argc != 2) && (argc != 3)) {
+  if (status && (argc - argi != 1) && (argc - argi != 2)) {
     fprintf(stderr, "%s: Wrong number of parameters!\n", pModule);
     status = 0;
   }
@@ -194,7 +580,7 @@ int main(int argc, char *argv[]) {
   /* Parse the reduction value parameter */
   if (status) {
     /* Parse value */
-    if (!parseInt(argv[1], &rval)) {
+    if (!parseInt(argv[argi], &rval)) {
       fprintf(stderr, "%s: Can't parse reduction value!\n", pModule);
       status = 0;
     }
@@ -208,10 +594,10 @@ int main(int argc, char *argv[]) {
   
   /* If a second extra parameter is there, parse it as a quality
    * value */
-  if (status && (argc > 2)) {
+  if (status && (argc - argi > 1)) {
     
     /* Parse quality value */
-    if (!parseInt(argv[2], &qval)) {
+    if (!parseInt(argv[argi + 1], &qval)) {
       fprintf(stderr, "%s: Can't parse quality value!\n", pModule);
       status = 0;
     }
@@ -223,14 +609,88 @@ int main(int argc, char *argv[]) {
     }
   }
   
-  /* Perform the shrink operation */
-  if (status) {
-    retval = jpegshrink(stdin, stdout, (int) rval, (int) qval, NULL);
-    if (retval != SPH_JPEG_ERR_OK) {
+  /* Perform the shrink operation on standard input and output if not
+   * in batch mode */
+  if (status && (pListPath == NULL)) {
+    if (pCachePath != NULL) {
+      pCache = jpegshrink_cache_open(
+                pCachePath, CACHE_ENTRIES, CACHE_ENTRY_BYTES);
+      if (pCache == NULL) {
+        fprintf(stderr, "%s: Can't open cache file!\n", pModule);
+        status = 0;
+      }
+      if (status) {
+        pInput = readAll(stdin, &input_len);
+        if (pInput == NULL) {
+          fprintf(stderr, "%s: Error reading input!\n", pModule);
+          status = 0;
+        } else if (input_len < 1) {
+          fprintf(stderr, "%s: Input is empty!\n", pModule);
+          status = 0;
+        }
+      }
+      if (status) {
+        retval = jpegshrink_cache_run(
+                  pCache, NULL, pInput, input_len, NULL, 0, stdout,
+                  (int) rval, (int) qval, NULL);
+      }
+      free(pInput);
+      pInput = NULL;
+      jpegshrink_cache_close(pCache);
+      pCache = NULL;
+    } else if (pipe_kib > 0) {
+      pc = jpegshrink_ctx_new();
+      if (pc == NULL) {
+        abort();
+      }
+      retval = jpegshrink_pipe_run(
+                pc, stdin, stdout, (int) rval, (int) qval, NULL,
+                ((size_t) pipe_kib) * 1024);
+      jpegshrink_ctx_free(pc);
+      pc = NULL;
+    } else {
+      retval = jpegshrink(stdin, stdout, (int) rval, (int) qval, NULL);
+    }
+    if (status && (retval != SPH_JPEG_ERR_OK)) {
       fprintf(stderr, "%s: %s!\n", pModule, sph_jpeg_errstr(retval));
       status = 0;
     }
   }
+  
+  /* In batch mode, open the manifest and shrink every file in it */
+  if (status && (pListPath != NULL)) {
+    pm = (MANIFEST *) calloc(1, sizeof(MANIFEST));
+    if (pm == NULL) {
+      abort();
+    }
+    pm->pModule = pModule;
+    
+    pm->pList = fopen(pListPath, "rb");
+    if (pm->pList == NULL) {
+      fprintf(stderr, "%s: Can't open manifest file!\n", pModule);
+      status = 0;
+    }
+    
+    if (status) {
+      fail_count = jpegshrink_batch(
+                    &nextJob, &doneJob, pm,
+                    (int) jval, (int) rval, (int) qval, NULL);
+      if (ferror(pm->pList)) {
+        fprintf(stderr, "%s: Error reading manifest file!\n", pModule);
+        status = 0;
+      }
+      if ((fail_count > 0) || (pm->bad_count > 0)) {
+        status = 0;
+      }
+    }
+    
+    if (pm->pList != NULL) {
+      (void) fclose(pm->pList);
+      pm->pList = NULL;
+    }
+    free(pm);
+    pm = NULL;
+  }
 
   /* Invert status and return */
   if (status) {
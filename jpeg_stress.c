@@ -0,0 +1,2313 @@
+/*
+ * jpeg_stress.c
+ * =============
+ * 
+ * Check that sophistry_jpeg and jpegshrink give the same results when
+ * many threads use them at the same time, and measure how throughput
+ * scales with the number of threads.
+ * 
+ * Syntax
+ * ------
+ * 
+ *   jpeg_stress [dir]
+ *   jpeg_stress [dir] [threads]
+ *   jpeg_stress [dir] [threads] [reps]
+ * 
+ * [dir] is a directory containing the corpus.  Every regular file in
+ * the directory with a .jpg or .jpeg extension (in any letter case) is
+ * loaded into memory and fully decoded before any threads are started.
+ * Files that can't be decoded are skipped.  Subdirectories are not
+ * searched.
+ * 
+ * [threads] is the largest number of threads to run, in range
+ * [1, 256].  If not specified, it defaults to 8.
+ * 
+ * [reps] is the number of times each thread goes through the whole
+ * job list, in range [1, 1000].  If not specified, it defaults to 3.
+ * 
+ * Jobs
+ * ----
+ * 
+ * Each image of the corpus gives the following jobs:
+ * 
+ *   decode     decode the file with sph_jpeg_reader_get_rows()
+ *   truncated  decode the first half of the file
+ *   corrupt    decode a copy with damaged entropy-coded data
+ *   badheader  decode a copy with an unsupported sample precision
+ *   encode     encode the decoded pixels to memory
+ *   shrink     jpegshrink_ctx_run() from and to memory streams
+ *   transcode  sph_jpeg_transcode() from and to memory streams
+ *   pardecode  decode a restart copy with sophistry_jpeg_par
+ *   parencode  encode the decoded pixels with a striped writer
+ *   pipe       jpegshrink_pipe_run() from and to memory streams
+ *   failwrite  encode to a sink that stops accepting data
+ * 
+ * The restart copy is the decoded image encoded again with a restart
+ * marker after every MCU row, so that it can be split into bands.  The
+ * pardecode and parencode jobs each use STRESS_PAR_THREADS worker
+ * threads of their own.  The failwrite sink accepts output up to half
+ * the length of the restart copy, which is always less than the whole
+ * encoded file, and then returns zero.
+ * 
+ * The truncated, corrupt, and badheader jobs drive libjpeg into its
+ * warning and error paths, which sophistry_jpeg handles with setjmp()
+ * and longjmp(), so that these paths run on several threads at once
+ * while other threads decode and encode valid data.
+ * 
+ * The transcode job also checks that its output is progressive if and
+ * only if the input is, that it has the same restart interval as the
+ * input, and that it decodes to exactly the same pixels.  The
+ * failwrite job checks that the writer stops with SPH_JPEG_ERR_WRIT.
+ * A job that fails its check on the main thread is reported to
+ * standard error and makes the program fail.
+ * 
+ * The result of each job is its status code and a hash of its output,
+ * which is the decoded pixels or the encoded file, or for failwrite
+ * jobs the part of the file that the sink accepted.  All jobs are first
+ * run on the main thread to get the reference results.  Then for each
+ * thread count of 1, 2, 4, and so forth up to [threads], and [threads]
+ * itself, that many threads are started at the same time.  Each thread
+ * runs every job [reps] times with its own reused reader, writer, and
+ * shrink context, starting at a different point of the job list so
+ * that different kinds of jobs run together, and compares every result
+ * to the reference.
+ * 
+ * Cache check
+ * -----------
+ * 
+ * After the reference results and before any threads are started, the
+ * first image that shrinks successfully is shrunk through a new
+ * jpegshrink_cache file in the directory given by the TMPDIR
+ * environment variable, or in /tmp.  The length of its stored entry is
+ * then overwritten in the file with a value far larger than an entry,
+ * and the next lookup must be a miss that shrinks the image again and
+ * gives the same output.  A failed check is reported to standard error
+ * and makes the program fail.  The cache file is removed afterwards.
+ * 
+ * Output
+ * ------
+ * 
+ * A line is written to standard output for each thread count, with the
+ * number of threads, the number of jobs run, the number of results
+ * that did not match the reference, the elapsed time in seconds, the
+ * throughput in jobs per second in total and per thread, and the
+ * scaling of throughput relative to a single thread.  Each job
+ * processes one image, so jobs per second is images per second.
+ * Mismatches are also reported by job kind to standard error.
+ * 
+ * libjpeg writes its warnings about the truncated and corrupt data to
+ * standard error as well, once for every such job that is run.
+ * 
+ * The program fails if any result does not match the reference, if a
+ * transcode or failwrite job fails its check, or if the cache check
+ * fails.
+ * 
+ * Compilation
+ * -----------
+ * 
+ * Compile with sophistry_jpeg, sophistry_jpeg_par, jpegshrink,
+ * jpegshrink_pipe, and jpegshrink_cache.  Requires a POSIX.1-2008
+ * platform for directory listing, fmemopen(), open_memstream(),
+ * mkstemp(), and clock_gettime(), and POSIX threads, so use -pthread
+ * (or -lpthread) when compiling and linking.
+ */
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sophistry_jpeg.h"
+#include "sophistry_jpeg_par.h"
+#include "jpegshrink.h"
+#include "jpegshrink_cache.h"
+#include "jpegshrink_pipe.h"
+
+/*
+ * The default and maximum number of threads.
+ */
+#define DEFAULT_THREADS (8)
+#define MAX_THREADS (256)
+
+/*
+ * The default and maximum number of repetitions.
+ */
+#define DEFAULT_REPS (3)
+#define MAX_REPS (1000)
+
+/*
+ * The number of rows to decode per call in decode jobs.
+ */
+#define DECODE_ROWS (16)
+
+/*
+ * The quality used for encode and shrink jobs, and the scaling value
+ * used for shrink jobs.
+ */
+#define STRESS_Q (85)
+#define STRESS_SVAL (3)
+
+/*
+ * The number of worker threads used by each pardecode and parencode
+ * job.
+ */
+#define STRESS_PAR_THREADS (2)
+
+/*
+ * The number of bytes damaged in a corrupt copy, and the sample
+ * precision written into the frame header of a badheader copy.
+ */
+#define CORRUPT_BYTES (64)
+#define BAD_PRECISION (3)
+
+/*
+ * The offset of the entry table in a cache file, and the length that
+ * the cache check writes into a stored entry.
+ */
+#define STRESS_CACHE_TABLE (4096)
+#define CACHE_BAD_LEN (INT32_C(0x7ffffff0))
+
+/*
+ * The job kinds.
+ */
+#define JOB_DECODE    (0)
+#define JOB_TRUNCATED (1)
+#define JOB_CORRUPT   (2)
+#define JOB_BADHEADER (3)
+#define JOB_ENCODE    (4)
+#define JOB_SHRINK    (5)
+#define JOB_TRANSCODE (6)
+#define JOB_PARDECODE (7)
+#define JOB_PARENCODE (8)
+#define JOB_PIPE      (9)
+#define JOB_FAILWRITE (10)
+#define JOB_KINDS     (11)
+
+/*
+ * The status a transcode or failwrite job gives if it fails its check.
+ */
+#define STRESS_ERR_CHECK (-2)
+
+/*
+ * The names of the job kinds, indexed by kind.
+ */
+static const char *m_kind_names[JOB_KINDS] = {
+  "decode", "truncated", "corrupt", "badheader", "encode", "shrink",
+  "transcode", "pardecode", "parencode", "pipe", "failwrite"
+};
+
+/*
+ * A JPEG file of the corpus, loaded into memory and decoded.
+ */
+typedef struct {
+  
+  /*
+   * The file name, dynamically allocated.
+   */
+  char *pName;
+  
+  /*
+   * The file data, dynamically allocated.
+   */
+  uint8_t *pData;
+  
+  /*
+   * The length of the file data in bytes.
+   */
+  size_t len;
+  
+  /*
+   * Damaged copies of the file data for the corrupt and badheader
+   * jobs, dynamically allocated, each of len bytes.  pBadHead is NULL
+   * if no frame header was found.
+   */
+  uint8_t *pCorrupt;
+  uint8_t *pBadHead;
+  
+  /*
+   * The decoded pixels, dynamically allocated, with a stride of width
+   * times chcount bytes.
+   */
+  uint8_t *pPix;
+  
+  /*
+   * The image dimensions and channel count.
+   */
+  int32_t width;
+  int32_t height;
+  int chcount;
+  
+  /*
+   * The restart copy for the pardecode job, which is the decoded
+   * pixels encoded with a restart marker after every MCU row.
+   */
+  SPH_JPEG_MEMBUF rst;
+  
+} STRESS_IMAGE;
+
+/*
+ * The corpus of loaded JPEG files.
+ */
+typedef struct {
+  
+  /*
+   * The dynamically allocated array of images.
+   */
+  STRESS_IMAGE *pImages;
+  
+  /*
+   * The number of images in the array, and its capacity.
+   */
+  int32_t count;
+  int32_t cap;
+  
+} STRESS_CORPUS;
+
+/*
+ * A job and its reference result.
+ */
+typedef struct {
+  
+  /*
+   * The job kind, one of the JOB_ constants.
+   */
+  int kind;
+  
+  /*
+   * The image the job works on.
+   */
+  const STRESS_IMAGE *pImg;
+  
+  /*
+   * The input data for jobs that read JPEG data, and its length in
+   * bytes.
+   */
+  const uint8_t *pData;
+  size_t len;
+  
+  /*
+   * The reference status code and output hash.
+   */
+  int ref_status;
+  uint64_t ref_hash;
+  
+} STRESS_JOB;
+
+/*
+ * The state of the sink callback of failwrite jobs.
+ */
+typedef struct {
+  
+  /*
+   * The number of bytes the sink accepts before it fails.
+   */
+  size_t limit;
+  
+  /*
+   * The number of bytes accepted so far, and their running hash.
+   */
+  size_t total;
+  uint64_t hash;
+  
+} STRESS_FAILSINK;
+
+/*
+ * The objects a thread reuses from job to job.
+ * 
+ * All fields are NULL or empty until a job first needs them.
+ */
+typedef struct {
+  
+  /*
+   * The reader, writer, and shrink context.
+   */
+  SPH_JPEG_READER *pr;
+  SPH_JPEG_WRITER *pw;
+  JPEGSHRINK_CTX *pc;
+  
+  /*
+   * The memory buffer that encode and parencode jobs write into.
+   */
+  SPH_JPEG_MEMBUF out;
+  
+  /*
+   * The sink state of failwrite jobs.
+   */
+  STRESS_FAILSINK fail;
+  
+  /*
+   * The row buffer for decode jobs, and its size in bytes.
+   */
+  uint8_t *pBuf;
+  size_t cap;
+  
+} STRESS_WORKER;
+
+/*
+ * The state of one thread during a run.
+ */
+typedef struct {
+  
+  /*
+   * The job list and its length.
+   */
+  const STRESS_JOB *pJobs;
+  int32_t job_count;
+  
+  /*
+   * The index of the first job this thread runs, and the number of
+   * times it runs the job list.
+   */
+  int32_t first;
+  int32_t reps;
+  
+  /*
+   * The objects reused by this thread.
+   */
+  STRESS_WORKER w;
+  
+  /*
+   * The number of jobs run, and the number of mismatches by job kind.
+   */
+  int32_t done;
+  int32_t bad[JOB_KINDS];
+  
+} STRESS_THREAD;
+
+/*
+ * Parse the given string as a signed integer.
+ * 
+ * pstr is the string to parse.
+ * 
+ * pv points to the integer value to use to return the parsed numeric
+ * value if the function is successful.
+ * 
+ * In two's complement, this function will not successfully parse the
+ * least negative value.
+ * 
+ * Parameters:
+ * 
+ *   pstr - the string to parse
+ * 
+ *   pv - pointer to the return numeric value
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if failure
+ */
+static int parseInt(const char *pstr, int32_t *pv) {
+  
+  int negflag = 0;
+  int32_t result = 0;
+  int status = 1;
+  int32_t d = 0;
+  
+  /* Check parameters */
+  if ((pstr == NULL) || (pv == NULL)) {
+    abort();
+  }
+  
+  /* If first character is a sign character, set negflag appropriately
+   * and skip it */
+  if (*pstr == '+') {
+    negflag = 0;
+    pstr++;
+  } else if (*pstr == '-') {
+    negflag = 1;
+    pstr++;
+  } else {
+    negflag = 0;
+  }
+  
+  /* Make sure we have at least one digit */
+  if (*pstr == 0) {
+    status = 0;
+  }
+  
+  /* Parse all digits */
+  if (status) {
+    for( ; *pstr != 0; pstr++) {
+      
+      /* Make sure in range of digits */
+      if ((*pstr < '0') || (*pstr > '9')) {
+        status = 0;
+      }
+      
+      /* Get numeric value of digit */
+      if (status) {
+        d = (int32_t) (*pstr - '0');
+      }
+      
+      /* Multiply result by 10, watching for overflow */
+      if (status) {
+        if (result <= INT32_MAX / 10) {
+          result = result * 10;
+        } else {
+          status = 0; /* overflow */
+        }
+      }
+      
+      /* Add in digit value, watching for overflow */
+      if (status) {
+        if (result <= INT32_MAX - d) {
+          result = result + d;
+        } else {
+          status = 0; /* overflow */
+        }
+      }
+      
+      /* Leave loop if error */
+      if (!status) {
+        break;
+      }
+    }
+  }
+  
+  /* Invert result if negative mode */
+  if (status && negflag) {
+    result = -(result);
+  }
+  
+  /* Write result if successful */
+  if (status) {
+    *pv = result;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Get the current time from a monotonic clock.
+ * 
+ * Return:
+ * 
+ *   the current time in seconds
+ */
+static double nowSec(void) {
+  
+  struct timespec ts;
+  
+  memset(&ts, 0, sizeof(struct timespec));
+  if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+    abort();
+  }
+  
+  return ((double) ts.tv_sec) + (((double) ts.tv_nsec) / 1.0e9);
+}
+
+/*
+ * Make sure that a dynamically allocated buffer has at least a given
+ * size.
+ * 
+ * pBuf is the current buffer or NULL, and pCap points to its current
+ * size in bytes.  The contents are not preserved when the buffer grows.
+ * 
+ * Parameters:
+ * 
+ *   pBuf - the current buffer, or NULL
+ * 
+ *   pCap - pointer to the current size
+ * 
+ *   need - the required size in bytes
+ * 
+ * Return:
+ * 
+ *   the buffer with at least the required size
+ */
+static void *growBuf(void *pBuf, size_t *pCap, size_t need) {
+  
+  if (pCap == NULL) {
+    abort();
+  }
+  
+  if ((pBuf == NULL) || (*pCap < need)) {
+    free(pBuf);
+    pBuf = malloc(need);
+    if (pBuf == NULL) {
+      abort();
+    }
+    *pCap = need;
+  }
+  
+  return pBuf;
+}
+
+/*
+ * Add bytes to a running 64-bit hash.
+ * 
+ * The hash only needs to detect differing outputs, so it mixes eight
+ * bytes at a time with a multiply in the manner of FNV-1a.  Start with
+ * hashStart().
+ * 
+ * Parameters:
+ * 
+ *   h - the running hash
+ * 
+ *   pData - the bytes to add
+ * 
+ *   len - the number of bytes
+ * 
+ * Return:
+ * 
+ *   the updated hash
+ */
+static uint64_t hashBytes(uint64_t h, const void *pData, size_t len) {
+  
+  const uint8_t *pb = NULL;
+  uint64_t v = 0;
+  
+  if ((pData == NULL) && (len > 0)) {
+    abort();
+  }
+  pb = (const uint8_t *) pData;
+  
+  for( ; len >= 8; len -= 8) {
+    memcpy(&v, pb, 8);
+    h = (h ^ v) * UINT64_C(0x100000001b3);
+    h ^= h >> 29;
+    pb += 8;
+  }
+  for( ; len > 0; len--) {
+    h = (h ^ ((uint64_t) *pb)) * UINT64_C(0x100000001b3);
+    pb++;
+  }
+  
+  return h;
+}
+
+/*
+ * Get the starting value of a running hash.
+ */
+static uint64_t hashStart(void) {
+  return UINT64_C(0xcbf29ce484222325);
+}
+
+/*
+ * Check whether a file name has a .jpg or .jpeg extension, ignoring
+ * letter case.
+ * 
+ * Parameters:
+ * 
+ *   pName - the file name
+ * 
+ * Return:
+ * 
+ *   non-zero if the name has a JPEG extension, zero otherwise
+ */
+static int isJpegName(const char *pName) {
+  
+  const char *pExt = NULL;
+  char ext[6];
+  size_t i = 0;
+  
+  /* Initialize arrays */
+  memset(ext, 0, sizeof(ext));
+  
+  /* Check parameter */
+  if (pName == NULL) {
+    abort();
+  }
+  
+  /* Find the extension */
+  pExt = strrchr(pName, '.');
+  if (pExt == NULL) {
+    return 0;
+  }
+  pExt++;
+  if (strlen(pExt) >= sizeof(ext)) {
+    return 0;
+  }
+  
+  /* Lowercase the extension and compare */
+  for(i = 0; pExt[i] != 0; i++) {
+    if ((pExt[i] >= 'A') && (pExt[i] <= 'Z')) {
+      ext[i] = (char) (pExt[i] - 'A' + 'a');
+    } else {
+      ext[i] = pExt[i];
+    }
+  }
+  
+  return ((strcmp(ext, "jpg") == 0) || (strcmp(ext, "jpeg") == 0));
+  /* CAUTION: alternate return statements earlier! */
+}
+
+/*
+ * Decode an image of the corpus into its pixel buffer, and make its
+ * damaged copies and its restart copy.
+ * 
+ * The corrupt copy has CORRUPT_BYTES bytes inverted three quarters of
+ * the way through the file, which is normally in the entropy-coded
+ * data.  The badheader copy has BAD_PRECISION written over the sample
+ * precision of the first SOF0, SOF1, or SOF2 marker segment.  The
+ * restart copy is encoded at quality STRESS_Q.
+ * 
+ * Parameters:
+ * 
+ *   pImg - the image, with the file data loaded
+ * 
+ * Return:
+ * 
+ *   non-zero if the image was decoded, zero otherwise
+ */
+static int prepareImage(STRESS_IMAGE *pImg) {
+  
+  SPH_JPEG_READER *pr = NULL;
+  SPH_JPEG_WRITER *pw = NULL;
+  SPH_JPEG_WRITER_OPTS opts;
+  size_t stride = 0;
+  size_t i = 0;
+  size_t start = 0;
+  int32_t y = 0;
+  int32_t got = 0;
+  int ok = 0;
+  
+  /* Initialize structures */
+  sph_jpeg_writer_opts_init(&opts);
+  
+  /* Check parameter */
+  if (pImg == NULL) {
+    abort();
+  }
+  sph_jpeg_membuf_init(&(pImg->rst));
+  
+  /* Decode the whole image */
+  pr = sph_jpeg_reader_new_mem(pImg->pData, pImg->len);
+  if (pr == NULL) {
+    abort();
+  }
+  ok = (sph_jpeg_reader_status(pr) == SPH_JPEG_ERR_OK);
+  if (ok) {
+    pImg->width = sph_jpeg_reader_width(pr);
+    pImg->height = sph_jpeg_reader_height(pr);
+    pImg->chcount = sph_jpeg_reader_channels(pr);
+    stride = ((size_t) pImg->width) * ((size_t) pImg->chcount);
+    pImg->pPix = (uint8_t *) malloc(stride * ((size_t) pImg->height));
+    if (pImg->pPix == NULL) {
+      abort();
+    }
+  }
+  for(y = 0; ok && (y < pImg->height); y += got) {
+    got = sph_jpeg_reader_get_rows(
+            pr, pImg->pPix + (((size_t) y) * stride), stride,
+            pImg->height - y);
+    if (got < 1) {
+      ok = 0;
+    }
+  }
+  if (ok) {
+    ok = (sph_jpeg_reader_status(pr) == SPH_JPEG_ERR_OK);
+  }
+  sph_jpeg_reader_free(pr);
+  pr = NULL;
+  
+  /* Make the corrupt copy */
+  if (ok) {
+    pImg->pCorrupt = (uint8_t *) malloc(pImg->len);
+    if (pImg->pCorrupt == NULL) {
+      abort();
+    }
+    memcpy(pImg->pCorrupt, pImg->pData, pImg->len);
+    
+    start = (pImg->len / 4) * 3;
+    for(i = start; (i < pImg->len) && (i - start < CORRUPT_BYTES);
+        i++) {
+      pImg->pCorrupt[i] = (uint8_t) ~(pImg->pCorrupt[i]);
+    }
+  }
+  
+  /* Make the badheader copy if a frame header can be found */
+  if (ok) {
+    for(i = 0; i + 4 < pImg->len; i++) {
+      if ((pImg->pData[i] == 0xff) &&
+          (pImg->pData[i + 1] >= 0xc0) &&
+          (pImg->pData[i + 1] <= 0xc2)) {
+        break;
+      }
+    }
+    if (i + 4 < pImg->len) {
+      pImg->pBadHead = (uint8_t *) malloc(pImg->len);
+      if (pImg->pBadHead == NULL) {
+        abort();
+      }
+      memcpy(pImg->pBadHead, pImg->pData, pImg->len);
+      pImg->pBadHead[i + 4] = (uint8_t) BAD_PRECISION;
+    }
+  }
+  
+  /* Make the restart copy */
+  if (ok) {
+    opts.restart_rows = 1;
+    pw = sph_jpeg_writer_new_mem_ex(
+            &(pImg->rst), pImg->width, pImg->height, pImg->chcount,
+            STRESS_Q, &opts);
+    if (pw == NULL) {
+      abort();
+    }
+    sph_jpeg_writer_put_rows(pw, pImg->pPix, stride, pImg->height);
+    ok = (sph_jpeg_writer_status(pw) == SPH_JPEG_ERR_OK);
+    sph_jpeg_writer_free(pw);
+    pw = NULL;
+  }
+  
+  return ok;
+}
+
+/*
+ * Load every JPEG file in a directory into a corpus.
+ * 
+ * Files that can't be read or decoded are reported to standard error
+ * and skipped.
+ * 
+ * Parameters:
+ * 
+ *   pc - the corpus to add to
+ * 
+ *   pDir - the directory path
+ * 
+ *   pModule - the module name for error reports
+ * 
+ * Return:
+ * 
+ *   non-zero if the directory could be listed, zero otherwise
+ */
+static int loadCorpus(
+          STRESS_CORPUS * pc,
+    const char          * pDir,
+    const char          * pModule) {
+  
+  DIR *pd = NULL;
+  struct dirent *pe = NULL;
+  struct stat st;
+  FILE *fh = NULL;
+  char *pPath = NULL;
+  size_t plen = 0;
+  STRESS_IMAGE img;
+  int ok = 0;
+  
+  /* Initialize structures */
+  memset(&st, 0, sizeof(struct stat));
+  memset(&img, 0, sizeof(STRESS_IMAGE));
+  
+  /* Check parameters */
+  if ((pc == NULL) || (pDir == NULL) || (pModule == NULL)) {
+    abort();
+  }
+  
+  /* Open the directory */
+  pd = opendir(pDir);
+  if (pd == NULL) {
+    return 0;
+  }
+  
+  /* Go through all directory entries */
+  for(pe = readdir(pd); pe != NULL; pe = readdir(pd)) {
+    
+    /* Skip files without a JPEG extension */
+    if (!isJpegName(pe->d_name)) {
+      continue;
+    }
+    
+    /* Build the full path */
+    plen = strlen(pDir) + strlen(pe->d_name) + 2;
+    pPath = (char *) malloc(plen);
+    if (pPath == NULL) {
+      abort();
+    }
+    sprintf(pPath, "%s/%s", pDir, pe->d_name);
+    
+    /* Read the whole file if it is a regular file */
+    memset(&img, 0, sizeof(STRESS_IMAGE));
+    ok = 0;
+    if (stat(pPath, &st) == 0) {
+      if (S_ISREG(st.st_mode) && (st.st_size > 1)) {
+        fh = fopen(pPath, "rb");
+        if (fh != NULL) {
+          img.len = (size_t) st.st_size;
+          img.pData = (uint8_t *) malloc(img.len);
+          if (img.pData == NULL) {
+            abort();
+          }
+          if (fread(img.pData, 1, img.len, fh) == img.len) {
+            ok = 1;
+          }
+          (void) fclose(fh);
+          fh = NULL;
+        }
+      }
+    }
+    
+    /* Decode the image */
+    if (ok) {
+      ok = prepareImage(&img);
+    }
+    
+    /* Add the image to the corpus, or report and skip it */
+    if (ok) {
+      img.pName = (char *) malloc(strlen(pe->d_name) + 1);
+      if (img.pName == NULL) {
+        abort();
+      }
+      strcpy(img.pName, pe->d_name);
+      
+      if (pc->count >= pc->cap) {
+        if (pc->cap < 1) {
+          pc->cap = 64;
+        } else {
+          pc->cap *= 2;
+        }
+        pc->pImages = (STRESS_IMAGE *) realloc(
+                        pc->pImages,
+                        ((size_t) pc->cap) * sizeof(STRESS_IMAGE));
+        if (pc->pImages == NULL) {
+          abort();
+        }
+      }
+      pc->pImages[pc->count] = img;
+      (pc->count)++;
+      
+    } else {
+      fprintf(stderr, "%s: Skipping %s\n", pModule, pPath);
+      free(img.pData);
+      free(img.pCorrupt);
+      free(img.pBadHead);
+      free(img.pPix);
+      sph_jpeg_membuf_free(&(img.rst));
+    }
+    
+    free(pPath);
+    pPath = NULL;
+  }
+  
+  (void) closedir(pd);
+  return 1;
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * Build the job list of a corpus.
+ * 
+ * The jobs of each image are next to each other in the list, so that
+ * threads starting at different points run different kinds of jobs.
+ * The reference results are not filled in.
+ * 
+ * Parameters:
+ * 
+ *   pc - the corpus
+ * 
+ *   pCount - receives the number of jobs
+ * 
+ * Return:
+ * 
+ *   the dynamically allocated job list
+ */
+static STRESS_JOB *buildJobs(const STRESS_CORPUS *pc, int32_t *pCount) {
+  
+  STRESS_JOB *pJobs = NULL;
+  STRESS_JOB *pj = NULL;
+  const STRESS_IMAGE *pImg = NULL;
+  int32_t i = 0;
+  int k = 0;
+  
+  /* Check parameters */
+  if ((pc == NULL) || (pCount == NULL)) {
+    abort();
+  }
+  
+  /* Allocate the largest possible list */
+  pJobs = (STRESS_JOB *) calloc(
+            ((size_t) pc->count) * JOB_KINDS, sizeof(STRESS_JOB));
+  if (pJobs == NULL) {
+    abort();
+  }
+  
+  /* Add the jobs of each image */
+  pj = pJobs;
+  for(i = 0; i < pc->count; i++) {
+    pImg = &(pc->pImages[i]);
+    for(k = 0; k < JOB_KINDS; k++) {
+      if ((k == JOB_BADHEADER) && (pImg->pBadHead == NULL)) {
+        continue;
+      }
+      
+      pj->kind = k;
+      pj->pImg = pImg;
+      pj->pData = pImg->pData;
+      pj->len = pImg->len;
+      
+      if (k == JOB_TRUNCATED) {
+        pj->len = pImg->len / 2;
+      } else if (k == JOB_CORRUPT) {
+        pj->pData = pImg->pCorrupt;
+      } else if (k == JOB_BADHEADER) {
+        pj->pData = pImg->pBadHead;
+      } else if (k == JOB_PARDECODE) {
+        pj->pData = (pImg->rst).pData;
+        pj->len = (pImg->rst).len;
+      }
+      
+      pj++;
+    }
+  }
+  
+  *pCount = (int32_t) (pj - pJobs);
+  return pJobs;
+}
+
+/*
+ * Release the objects of a worker and return it to an empty state.
+ * 
+ * Parameters:
+ * 
+ *   pw - the worker
+ */
+static void workerFree(STRESS_WORKER *pw) {
+  
+  if (pw == NULL) {
+    abort();
+  }
+  
+  sph_jpeg_reader_free(pw->pr);
+  sph_jpeg_writer_free(pw->pw);
+  jpegshrink_ctx_free(pw->pc);
+  sph_jpeg_membuf_free(&(pw->out));
+  free(pw->pBuf);
+  
+  memset(pw, 0, sizeof(STRESS_WORKER));
+  sph_jpeg_membuf_init(&(pw->out));
+}
+
+/*
+ * Run a decode, truncated, corrupt, or badheader job.
+ * 
+ * The hash covers the image dimensions and every row that was decoded
+ * before decoding stopped.
+ * 
+ * Parameters:
+ * 
+ *   pw - the worker
+ * 
+ *   pj - the job
+ * 
+ *   pHash - receives the output hash
+ * 
+ * Return:
+ * 
+ *   the final status of the reader
+ */
+static int runDecode(
+          STRESS_WORKER * pw,
+    const STRESS_JOB    * pj,
+          uint64_t      * pHash) {
+  
+  uint64_t h = 0;
+  int32_t dim[3];
+  size_t stride = 0;
+  int32_t y = 0;
+  int32_t got = 0;
+  int ok = 0;
+  
+  /* Initialize arrays */
+  memset(dim, 0, sizeof(dim));
+  
+  /* Open or reuse the reader */
+  if (pw->pr == NULL) {
+    pw->pr = sph_jpeg_reader_new_mem(pj->pData, pj->len);
+    if (pw->pr == NULL) {
+      abort();
+    }
+  } else {
+    sph_jpeg_reader_reset_mem(pw->pr, pj->pData, pj->len);
+  }
+  
+  /* Hash the dimensions */
+  h = hashStart();
+  ok = (sph_jpeg_reader_status(pw->pr) == SPH_JPEG_ERR_OK);
+  if (ok) {
+    dim[0] = sph_jpeg_reader_width(pw->pr);
+    dim[1] = sph_jpeg_reader_height(pw->pr);
+    dim[2] = (int32_t) sph_jpeg_reader_channels(pw->pr);
+    h = hashBytes(h, dim, sizeof(dim));
+    
+    stride = ((size_t) dim[0]) * ((size_t) dim[2]);
+    pw->pBuf = (uint8_t *) growBuf(
+                  pw->pBuf, &(pw->cap), stride * DECODE_ROWS);
+  }
+  
+  /* Decode and hash all the rows */
+  for(y = 0; ok && (y < dim[1]); y += got) {
+    got = sph_jpeg_reader_get_rows(
+            pw->pr, pw->pBuf, stride, DECODE_ROWS);
+    if (got < 1) {
+      ok = 0;
+    } else {
+      h = hashBytes(h, pw->pBuf, stride * ((size_t) got));
+    }
+  }
+  
+  *pHash = h;
+  return sph_jpeg_reader_status(pw->pr);
+}
+
+/*
+ * Run an encode job.
+ * 
+ * The hash covers the encoded file.
+ * 
+ * Parameters:
+ * 
+ *   pw - the worker
+ * 
+ *   pj - the job
+ * 
+ *   pHash - receives the output hash
+ * 
+ * Return:
+ * 
+ *   the final status of the writer
+ */
+static int runEncode(
+          STRESS_WORKER * pw,
+    const STRESS_JOB    * pj,
+          uint64_t      * pHash) {
+  
+  const STRESS_IMAGE *pImg = pj->pImg;
+  size_t stride = 0;
+  int status = 0;
+  
+  /* Open or reuse the writer, overwriting the previous output */
+  pw->out.len = 0;
+  if (pw->pw == NULL) {
+    pw->pw = sph_jpeg_writer_new_mem(
+                &(pw->out), pImg->width, pImg->height, pImg->chcount,
+                STRESS_Q);
+    if (pw->pw == NULL) {
+      abort();
+    }
+  } else {
+    sph_jpeg_writer_reset_mem(
+      pw->pw, &(pw->out), pImg->width, pImg->height, pImg->chcount,
+      STRESS_Q);
+  }
+  
+  /* Encode the whole image */
+  stride = ((size_t) pImg->width) * ((size_t) pImg->chcount);
+  sph_jpeg_writer_put_rows(pw->pw, pImg->pPix, stride, pImg->height);
+  
+  /* Hash the output */
+  status = sph_jpeg_writer_status(pw->pw);
+  *pHash = hashBytes(hashStart(), pw->out.pData, pw->out.len);
+  
+  return status;
+}
+
+/*
+ * Run a shrink job.
+ * 
+ * The hash covers the encoded file.
+ * 
+ * Parameters:
+ * 
+ *   pw - the worker
+ * 
+ *   pj - the job
+ * 
+ *   pHash - receives the output hash
+ * 
+ * Return:
+ * 
+ *   the return value of jpegshrink_ctx_run()
+ */
+static int runShrink(
+          STRESS_WORKER * pw,
+    const STRESS_JOB    * pj,
+          uint64_t      * pHash) {
+  
+  FILE *pIn = NULL;
+  FILE *pOut = NULL;
+  char *pOutBuf = NULL;
+  size_t out_len = 0;
+  int retval = 0;
+  
+  /* Get or reuse the shrink context */
+  if (pw->pc == NULL) {
+    pw->pc = jpegshrink_ctx_new();
+    if (pw->pc == NULL) {
+      abort();
+    }
+  }
+  
+  /* Open the memory streams */
+  pIn = fmemopen((void *) pj->pData, pj->len, "rb");
+  if (pIn == NULL) {
+    abort();
+  }
+  pOut = open_memstream(&pOutBuf, &out_len);
+  if (pOut == NULL) {
+    abort();
+  }
+  
+  /* Shrink the image */
+  retval = jpegshrink_ctx_run(
+              pw->pc, pIn, pOut, STRESS_SVAL, STRESS_Q, NULL);
+  
+  /* Close the streams and hash the output */
+  (void) fclose(pIn);
+  pIn = NULL;
+  if (fclose(pOut)) {
+    abort();
+  }
+  pOut = NULL;
+  
+  *pHash = hashBytes(hashStart(), pOutBuf, out_len);
+  free(pOutBuf);
+  
+  return retval;
+}
+
+/*
+ * Get the restart interval of a JPEG file in memory.
+ * 
+ * The marker segments are scanned up to the first SOS marker.  The
+ * file must be well formed up to that point.
+ * 
+ * Parameters:
+ * 
+ *   pData - the JPEG file
+ * 
+ *   len - the length of the file in bytes
+ * 
+ * Return:
+ * 
+ *   the restart interval of the last DRI marker before the first scan,
+ *   or zero if there is none
+ */
+static int32_t restartInterval(const uint8_t *pData, size_t len) {
+  
+  size_t i = 2;
+  size_t seglen = 0;
+  int32_t interval = 0;
+  
+  if (pData == NULL) {
+    abort();
+  }
+  
+  while (i + 4 <= len) {
+    /* Stop at anything that isn't a marker segment, or at SOS */
+    if ((pData[i] != 0xff) || (pData[i + 1] == 0xda)) {
+      break;
+    }
+    
+    /* Skip fill bytes */
+    if (pData[i + 1] == 0xff) {
+      i++;
+      continue;
+    }
+    
+    /* Read the DRI parameter */
+    seglen = (((size_t) pData[i + 2]) << 8) | ((size_t) pData[i + 3]);
+    if ((pData[i + 1] == 0xdd) && (seglen >= 4) && (i + 6 <= len)) {
+      interval = (((int32_t) pData[i + 4]) << 8) |
+                  ((int32_t) pData[i + 5]);
+    }
+    
+    i += 2 + seglen;
+  }
+  
+  return interval;
+}
+
+/*
+ * Run a transcode job.
+ * 
+ * The hash covers the transcoded file.  If the transcode succeeds but
+ * its output fails the check described in the program header,
+ * STRESS_ERR_CHECK is returned.
+ * 
+ * Parameters:
+ * 
+ *   pw - the worker
+ * 
+ *   pj - the job
+ * 
+ *   pHash - receives the output hash
+ * 
+ * Return:
+ * 
+ *   the return value of sph_jpeg_transcode(), or STRESS_ERR_CHECK
+ */
+static int runTranscode(
+          STRESS_WORKER * pw,
+    const STRESS_JOB    * pj,
+          uint64_t      * pHash) {
+  
+  const STRESS_IMAGE *pImg = pj->pImg;
+  FILE *pIn = NULL;
+  FILE *pOut = NULL;
+  char *pOutBuf = NULL;
+  size_t out_len = 0;
+  size_t stride = 0;
+  SPH_JPEG_PROBE in_info;
+  SPH_JPEG_PROBE out_info;
+  int32_t y = 0;
+  int32_t got = 0;
+  int retval = 0;
+  
+  /* Initialize structures */
+  memset(&in_info, 0, sizeof(SPH_JPEG_PROBE));
+  memset(&out_info, 0, sizeof(SPH_JPEG_PROBE));
+  
+  /* Open the memory streams */
+  pIn = fmemopen((void *) pj->pData, pj->len, "rb");
+  if (pIn == NULL) {
+    abort();
+  }
+  pOut = open_memstream(&pOutBuf, &out_len);
+  if (pOut == NULL) {
+    abort();
+  }
+  
+  /* Transcode the file */
+  retval = sph_jpeg_transcode(pIn, pOut, 0);
+  
+  /* Close the streams and hash the output */
+  (void) fclose(pIn);
+  pIn = NULL;
+  if (fclose(pOut)) {
+    abort();
+  }
+  pOut = NULL;
+  
+  *pHash = hashBytes(hashStart(), pOutBuf, out_len);
+  
+  /* Check the scan mode and restart interval */
+  if (retval == SPH_JPEG_ERR_OK) {
+    if ((sph_jpeg_probe_mem(pj->pData, pj->len, &in_info) !=
+            SPH_JPEG_ERR_OK) ||
+        (sph_jpeg_probe_mem(pOutBuf, out_len, &out_info) !=
+            SPH_JPEG_ERR_OK)) {
+      retval = STRESS_ERR_CHECK;
+      
+    } else if ((in_info.progressive != out_info.progressive) ||
+        (restartInterval(pj->pData, pj->len) !=
+          restartInterval((const uint8_t *) pOutBuf, out_len))) {
+      retval = STRESS_ERR_CHECK;
+    }
+  }
+  
+  /* Check that the output decodes to the same pixels */
+  if (retval == SPH_JPEG_ERR_OK) {
+    if (pw->pr == NULL) {
+      pw->pr = sph_jpeg_reader_new_mem(pOutBuf, out_len);
+      if (pw->pr == NULL) {
+        abort();
+      }
+    } else {
+      sph_jpeg_reader_reset_mem(pw->pr, pOutBuf, out_len);
+    }
+    
+    if ((sph_jpeg_reader_status(pw->pr) != SPH_JPEG_ERR_OK) ||
+        (sph_jpeg_reader_width(pw->pr) != pImg->width) ||
+        (sph_jpeg_reader_height(pw->pr) != pImg->height) ||
+        (sph_jpeg_reader_channels(pw->pr) != pImg->chcount)) {
+      retval = STRESS_ERR_CHECK;
+    }
+  }
+  if (retval == SPH_JPEG_ERR_OK) {
+    stride = ((size_t) pImg->width) * ((size_t) pImg->chcount);
+    pw->pBuf = (uint8_t *) growBuf(
+                  pw->pBuf, &(pw->cap), stride * DECODE_ROWS);
+    
+    for(y = 0; y < pImg->height; y += got) {
+      got = sph_jpeg_reader_get_rows(
+              pw->pr, pw->pBuf, stride, DECODE_ROWS);
+      if ((got < 1) ||
+          (memcmp(pw->pBuf, pImg->pPix + (((size_t) y) * stride),
+                  stride * ((size_t) got)) != 0)) {
+        retval = STRESS_ERR_CHECK;
+        break;
+      }
+    }
+  }
+  
+  free(pOutBuf);
+  return retval;
+}
+
+/*
+ * Sink callback that appends to a memory buffer.
+ * 
+ * Parameters:
+ * 
+ *   pCustom - the SPH_JPEG_MEMBUF to append to
+ * 
+ *   pData - the data to append
+ * 
+ *   len - the number of bytes
+ * 
+ * Return:
+ * 
+ *   non-zero
+ */
+static int sinkMem(void *pCustom, const uint8_t *pData, size_t len) {
+  
+  SPH_JPEG_MEMBUF *pb = NULL;
+  size_t cap = 0;
+  
+  /* Check parameters */
+  if ((pCustom == NULL) || (pData == NULL)) {
+    abort();
+  }
+  pb = (SPH_JPEG_MEMBUF *) pCustom;
+  
+  /* Grow the buffer if necessary */
+  if (pb->cap - pb->len < len) {
+    cap = (pb->cap < 4096) ? 4096 : pb->cap;
+    while (cap - pb->len < len) {
+      cap *= 2;
+    }
+    pb->pData = (uint8_t *) realloc(pb->pData, cap);
+    if (pb->pData == NULL) {
+      abort();
+    }
+    pb->cap = cap;
+  }
+  
+  /* Append the data */
+  memcpy(pb->pData + pb->len, pData, len);
+  pb->len += len;
+  
+  return 1;
+}
+
+/*
+ * Sink callback of failwrite jobs, which accepts data until the limit
+ * would be passed and then fails.
+ * 
+ * Parameters:
+ * 
+ *   pCustom - the STRESS_FAILSINK state
+ * 
+ *   pData - the data to consume
+ * 
+ *   len - the number of bytes
+ * 
+ * Return:
+ * 
+ *   non-zero if the data was accepted, zero otherwise
+ */
+static int sinkFail(void *pCustom, const uint8_t *pData, size_t len) {
+  
+  STRESS_FAILSINK *pf = NULL;
+  
+  /* Check parameters */
+  if ((pCustom == NULL) || (pData == NULL)) {
+    abort();
+  }
+  pf = (STRESS_FAILSINK *) pCustom;
+  
+  /* Fail once the limit would be passed */
+  if (len > pf->limit - pf->total) {
+    return 0;
+  }
+  
+  /* Accept and hash the data */
+  pf->hash = hashBytes(pf->hash, pData, len);
+  pf->total += len;
+  
+  return 1;
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * Run a pardecode job.
+ * 
+ * A new parallel decoder is used for each job, since parallel decoders
+ * can't be reused.  The hash covers the same data as for runDecode().
+ * 
+ * Parameters:
+ * 
+ *   pw - the worker
+ * 
+ *   pj - the job
+ * 
+ *   pHash - receives the output hash
+ * 
+ * Return:
+ * 
+ *   the final status of the parallel decoder
+ */
+static int runParDecode(
+          STRESS_WORKER * pw,
+    const STRESS_JOB    * pj,
+          uint64_t      * pHash) {
+  
+  SPH_JPEG_PAR *pp = NULL;
+  uint64_t h = 0;
+  int32_t dim[3];
+  size_t stride = 0;
+  int32_t y = 0;
+  int32_t got = 0;
+  int status = 0;
+  int ok = 0;
+  
+  /* Initialize arrays */
+  memset(dim, 0, sizeof(dim));
+  
+  /* Start the parallel decoder */
+  pp = sph_jpeg_par_new(pj->pData, pj->len, STRESS_PAR_THREADS, NULL);
+  if (pp == NULL) {
+    abort();
+  }
+  
+  /* Hash the dimensions */
+  h = hashStart();
+  ok = (sph_jpeg_par_status(pp) == SPH_JPEG_ERR_OK);
+  if (ok) {
+    dim[0] = sph_jpeg_par_width(pp);
+    dim[1] = sph_jpeg_par_height(pp);
+    dim[2] = (int32_t) sph_jpeg_par_channels(pp);
+    h = hashBytes(h, dim, sizeof(dim));
+    
+    stride = ((size_t) dim[0]) * ((size_t) dim[2]);
+    pw->pBuf = (uint8_t *) growBuf(
+                  pw->pBuf, &(pw->cap), stride * DECODE_ROWS);
+  }
+  
+  /* Decode and hash all the rows */
+  for(y = 0; ok && (y < dim[1]); y += got) {
+    got = sph_jpeg_par_get_rows(pp, pw->pBuf, stride, DECODE_ROWS);
+    if (got < 1) {
+      ok = 0;
+    } else {
+      h = hashBytes(h, pw->pBuf, stride * ((size_t) got));
+    }
+  }
+  
+  status = sph_jpeg_par_status(pp);
+  sph_jpeg_par_free(pp);
+  
+  *pHash = h;
+  return status;
+}
+
+/*
+ * Run a parencode job.
+ * 
+ * A new parallel writer is used for each job, since parallel writers
+ * can't be reused.  The hash covers the encoded file.
+ * 
+ * Parameters:
+ * 
+ *   pw - the worker
+ * 
+ *   pj - the job
+ * 
+ *   pHash - receives the output hash
+ * 
+ * Return:
+ * 
+ *   the final status of the parallel writer
+ */
+static int runParEncode(
+          STRESS_WORKER * pw,
+    const STRESS_JOB    * pj,
+          uint64_t      * pHash) {
+  
+  const STRESS_IMAGE *pImg = pj->pImg;
+  SPH_JPEG_PAR_WRITER *ppw = NULL;
+  size_t stride = 0;
+  int status = 0;
+  
+  /* Start the parallel writer, overwriting the previous output */
+  pw->out.len = 0;
+  ppw = sph_jpeg_par_writer_new_sink(
+          &sinkMem, &(pw->out), pImg->width, pImg->height,
+          pImg->chcount, STRESS_Q, NULL, STRESS_PAR_THREADS);
+  if (ppw == NULL) {
+    abort();
+  }
+  
+  /* Encode the whole image */
+  stride = ((size_t) pImg->width) * ((size_t) pImg->chcount);
+  sph_jpeg_par_writer_put_rows(ppw, pImg->pPix, stride, pImg->height);
+  
+  /* Hash the output */
+  status = sph_jpeg_par_writer_status(ppw);
+  sph_jpeg_par_writer_free(ppw);
+  *pHash = hashBytes(hashStart(), pw->out.pData, pw->out.len);
+  
+  return status;
+}
+
+/*
+ * Run a pipe job.
+ * 
+ * The hash covers the encoded file.
+ * 
+ * Parameters:
+ * 
+ *   pw - the worker
+ * 
+ *   pj - the job
+ * 
+ *   pHash - receives the output hash
+ * 
+ * Return:
+ * 
+ *   the return value of jpegshrink_pipe_run()
+ */
+static int runPipe(
+          STRESS_WORKER * pw,
+    const STRESS_JOB    * pj,
+          uint64_t      * pHash) {
+  
+  FILE *pIn = NULL;
+  FILE *pOut = NULL;
+  char *pOutBuf = NULL;
+  size_t out_len = 0;
+  int retval = 0;
+  
+  /* Get or reuse the shrink context */
+  if (pw->pc == NULL) {
+    pw->pc = jpegshrink_ctx_new();
+    if (pw->pc == NULL) {
+      abort();
+    }
+  }
+  
+  /* Open the memory streams */
+  pIn = fmemopen((void *) pj->pData, pj->len, "rb");
+  if (pIn == NULL) {
+    abort();
+  }
+  pOut = open_memstream(&pOutBuf, &out_len);
+  if (pOut == NULL) {
+    abort();
+  }
+  
+  /* Shrink the image through the pipeline */
+  retval = jpegshrink_pipe_run(
+              pw->pc, pIn, pOut, STRESS_SVAL, STRESS_Q, NULL, 0);
+  
+  /* Close the streams and hash the output */
+  (void) fclose(pIn);
+  pIn = NULL;
+  if (fclose(pOut)) {
+    abort();
+  }
+  pOut = NULL;
+  
+  *pHash = hashBytes(hashStart(), pOutBuf, out_len);
+  free(pOutBuf);
+  
+  return retval;
+}
+
+/*
+ * Run a failwrite job.
+ * 
+ * The hash covers the bytes that the sink accepted.  If the writer
+ * doesn't stop with SPH_JPEG_ERR_WRIT, STRESS_ERR_CHECK is returned.
+ * 
+ * Parameters:
+ * 
+ *   pw - the worker
+ * 
+ *   pj - the job
+ * 
+ *   pHash - receives the output hash
+ * 
+ * Return:
+ * 
+ *   the final status of the writer, or STRESS_ERR_CHECK
+ */
+static int runFailWrite(
+          STRESS_WORKER * pw,
+    const STRESS_JOB    * pj,
+          uint64_t      * pHash) {
+  
+  const STRESS_IMAGE *pImg = pj->pImg;
+  size_t stride = 0;
+  int status = 0;
+  
+  /* Reset the sink state */
+  pw->fail.limit = (pImg->rst).len / 2;
+  pw->fail.total = 0;
+  pw->fail.hash = hashStart();
+  
+  /* Open or reuse the writer */
+  if (pw->pw == NULL) {
+    pw->pw = sph_jpeg_writer_new_sink(
+                &sinkFail, &(pw->fail), pImg->width, pImg->height,
+                pImg->chcount, STRESS_Q);
+    if (pw->pw == NULL) {
+      abort();
+    }
+  } else {
+    sph_jpeg_writer_reset_sink(
+      pw->pw, &sinkFail, &(pw->fail), pImg->width, pImg->height,
+      pImg->chcount, STRESS_Q);
+  }
+  
+  /* Encode the whole image */
+  stride = ((size_t) pImg->width) * ((size_t) pImg->chcount);
+  sph_jpeg_writer_put_rows(pw->pw, pImg->pPix, stride, pImg->height);
+  
+  /* Check that the sink failure was reported */
+  status = sph_jpeg_writer_status(pw->pw);
+  if (status != SPH_JPEG_ERR_WRIT) {
+    status = STRESS_ERR_CHECK;
+  }
+  
+  *pHash = pw->fail.hash;
+  return status;
+}
+
+/*
+ * Run a job.
+ * 
+ * Parameters:
+ * 
+ *   pw - the worker
+ * 
+ *   pj - the job
+ * 
+ *   pHash - receives the output hash
+ * 
+ * Return:
+ * 
+ *   the status code of the job
+ */
+static int runJob(
+          STRESS_WORKER * pw,
+    const STRESS_JOB    * pj,
+          uint64_t      * pHash) {
+  
+  int status = 0;
+  
+  /* Check parameters */
+  if ((pw == NULL) || (pj == NULL) || (pHash == NULL)) {
+    abort();
+  }
+  
+  /* Dispatch on job kind */
+  if (pj->kind == JOB_ENCODE) {
+    status = runEncode(pw, pj, pHash);
+  } else if (pj->kind == JOB_SHRINK) {
+    status = runShrink(pw, pj, pHash);
+  } else if (pj->kind == JOB_TRANSCODE) {
+    status = runTranscode(pw, pj, pHash);
+  } else if (pj->kind == JOB_PARDECODE) {
+    status = runParDecode(pw, pj, pHash);
+  } else if (pj->kind == JOB_PARENCODE) {
+    status = runParEncode(pw, pj, pHash);
+  } else if (pj->kind == JOB_PIPE) {
+    status = runPipe(pw, pj, pHash);
+  } else if (pj->kind == JOB_FAILWRITE) {
+    status = runFailWrite(pw, pj, pHash);
+  } else {
+    status = runDecode(pw, pj, pHash);
+  }
+  
+  return status;
+}
+
+/*
+ * Shrink an image of the corpus through a cache into memory.
+ * 
+ * Parameters:
+ * 
+ *   pCache - the cache
+ * 
+ *   pImg - the image
+ * 
+ *   ppOut - receives the output, which the caller must free
+ * 
+ *   pLen - receives the length of the output
+ * 
+ * Return:
+ * 
+ *   the return value of jpegshrink_cache_run()
+ */
+static int cacheShrink(
+          JPEGSHRINK_CACHE  * pCache,
+    const STRESS_IMAGE      * pImg,
+          char             ** ppOut,
+          size_t            * pLen) {
+  
+  FILE *pOut = NULL;
+  int retval = 0;
+  
+  /* Check parameters */
+  if ((pCache == NULL) || (pImg == NULL) ||
+      (ppOut == NULL) || (pLen == NULL)) {
+    abort();
+  }
+  
+  /* Shrink into a memory stream */
+  *ppOut = NULL;
+  *pLen = 0;
+  pOut = open_memstream(ppOut, pLen);
+  if (pOut == NULL) {
+    abort();
+  }
+  retval = jpegshrink_cache_run(
+              pCache, NULL, pImg->pData, pImg->len, NULL, 0, pOut,
+              STRESS_SVAL, STRESS_Q, NULL);
+  if (fclose(pOut)) {
+    abort();
+  }
+  
+  return retval;
+}
+
+/*
+ * Overwrite the length field of the entry of a cache file that holds
+ * an output of a given length.
+ * 
+ * The entry table starts STRESS_CACHE_TABLE bytes into the file.
+ * The first aligned 32-bit value in the native byte order at or after
+ * that offset which equals the output length is taken to be the length
+ * field of the entry.  This is only reliable for a cache with a single
+ * stored entry, whose other fields are hashes, ticks, and small
+ * settings.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path to the cache file, which must not be open as a
+ *   cache
+ * 
+ *   len - the length of the stored output
+ * 
+ *   bad_len - the length to write into the entry
+ * 
+ * Return:
+ * 
+ *   non-zero if the field was found and overwritten, zero otherwise
+ */
+static int cacheDamage(
+    const char    * pPath,
+          int32_t   len,
+          int32_t   bad_len) {
+  
+  FILE *fh = NULL;
+  uint8_t block[STRESS_CACHE_TABLE];
+  int32_t v = 0;
+  size_t got = 0;
+  size_t i = 0;
+  int found = 0;
+  
+  /* Initialize arrays */
+  memset(block, 0, sizeof(block));
+  
+  /* Check parameter */
+  if (pPath == NULL) {
+    abort();
+  }
+  
+  /* Read the first block of the entry table */
+  fh = fopen(pPath, "r+b");
+  if (fh == NULL) {
+    return 0;
+  }
+  if (fseek(fh, STRESS_CACHE_TABLE, SEEK_SET) == 0) {
+    got = fread(block, 1, sizeof(block), fh);
+  }
+  
+  /* Find and replace the length */
+  for(i = 0; i + 4 <= got; i += 4) {
+    memcpy(&v, block + i, 4);
+    if (v == len) {
+      memcpy(block + i, &bad_len, 4);
+      found = 1;
+      break;
+    }
+  }
+  if (found) {
+    if ((fseek(fh, (long) (STRESS_CACHE_TABLE + i), SEEK_SET) != 0)
+        || (fwrite(block + i, 1, 4, fh) != 4)) {
+      found = 0;
+    }
+  }
+  
+  if (fclose(fh)) {
+    found = 0;
+  }
+  return found;
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * Check that a damaged cache entry is treated as a miss.
+ * 
+ * An empty cache file is made in the directory given by the TMPDIR
+ * environment variable, or in /tmp.  The image is shrunk through the
+ * cache twice, which must give one miss and one hit with the same
+ * output.  The length field of the stored entry is then overwritten
+ * with CACHE_BAD_LEN, far beyond the size of an entry.  The next
+ * shrink must be a miss that gives the same output again and stores
+ * it over the damaged entry, and the shrink after that a hit.  The
+ * cache file is removed afterwards.
+ * 
+ * Parameters:
+ * 
+ *   pImg - the image to shrink
+ * 
+ *   pModule - the module name for error reports
+ * 
+ * Return:
+ * 
+ *   non-zero if the check passes, zero otherwise
+ */
+static int checkCache(const STRESS_IMAGE *pImg, const char *pModule) {
+  
+  JPEGSHRINK_CACHE *pCache = NULL;
+  JPEGSHRINK_CACHE_STATS st;
+  const char *pDir = NULL;
+  char *pPath = NULL;
+  char *pRef = NULL;
+  size_t ref_len = 0;
+  char *pOut = NULL;
+  size_t out_len = 0;
+  int32_t entry_bytes = 0;
+  int fd = -1;
+  int pass = 0;
+  int ok = 1;
+  
+  /* Initialize structures */
+  memset(&st, 0, sizeof(JPEGSHRINK_CACHE_STATS));
+  
+  /* Check parameters */
+  if ((pImg == NULL) || (pModule == NULL)) {
+    abort();
+  }
+  
+  /* Make an empty cache file */
+  pDir = getenv("TMPDIR");
+  if ((pDir == NULL) || (*pDir == 0)) {
+    pDir = "/tmp";
+  }
+  pPath = (char *) malloc(strlen(pDir) + 20);
+  if (pPath == NULL) {
+    abort();
+  }
+  sprintf(pPath, "%s/jpeg_stress.XXXXXX", pDir);
+  fd = mkstemp(pPath);
+  if (fd == -1) {
+    fprintf(stderr, "%s: Can't create cache file!\n", pModule);
+    free(pPath);
+    return 0;
+  }
+  (void) close(fd);
+  fd = -1;
+  
+  /* Size the entries so that the output of the image fits */
+  entry_bytes = JPEGSHRINK_CACHE_MAXBYTES;
+  if (pImg->len < (size_t) JPEGSHRINK_CACHE_MAXBYTES / 2) {
+    entry_bytes = (int32_t) (pImg->len * 2);
+  }
+  if (entry_bytes < JPEGSHRINK_CACHE_MINBYTES) {
+    entry_bytes = JPEGSHRINK_CACHE_MINBYTES;
+  }
+  
+  /* Run each pass, opening the cache anew for each one, and damage the
+   * entry before the third pass */
+  for(pass = 0; ok && (pass < 4); pass++) {
+    if (pass == 2) {
+      if ((ref_len < 1) || (ref_len > (size_t) INT32_MAX) ||
+          (!cacheDamage(pPath, (int32_t) ref_len, CACHE_BAD_LEN))) {
+        ok = 0;
+        break;
+      }
+    }
+    
+    pCache = jpegshrink_cache_open(
+                pPath, JPEGSHRINK_CACHE_WAYS, entry_bytes);
+    if (pCache == NULL) {
+      ok = 0;
+      break;
+    }
+    
+    if (pass == 0) {
+      if (cacheShrink(pCache, pImg, &pRef, &ref_len) !=
+            SPH_JPEG_ERR_OK) {
+        ok = 0;
+      }
+    } else {
+      if ((cacheShrink(pCache, pImg, &pOut, &out_len) !=
+            SPH_JPEG_ERR_OK) ||
+          (out_len != ref_len) ||
+          (memcmp(pOut, pRef, ref_len) != 0)) {
+        ok = 0;
+      }
+      free(pOut);
+      pOut = NULL;
+    }
+    
+    /* Check the hits and misses so far */
+    jpegshrink_cache_stats(pCache, &st);
+    if ((st.misses != ((pass < 2) ? 1 : 2)) ||
+        (st.hits != ((pass < 2) ? pass : (pass - 1))) ||
+        (st.stores != st.misses)) {
+      ok = 0;
+    }
+    
+    jpegshrink_cache_close(pCache);
+    pCache = NULL;
+  }
+  
+  if (!ok) {
+    fprintf(stderr, "%s: Cache check fails with %s!\n",
+            pModule, pImg->pName);
+  }
+  
+  (void) unlink(pPath);
+  free(pPath);
+  free(pRef);
+  return ok;
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * Thread function that runs the job list and compares the results to
+ * the references.
+ * 
+ * Parameters:
+ * 
+ *   pArg - the STRESS_THREAD state of the thread
+ * 
+ * Return:
+ * 
+ *   NULL
+ */
+static void *threadMain(void *pArg) {
+  
+  STRESS_THREAD *pt = NULL;
+  const STRESS_JOB *pj = NULL;
+  uint64_t h = 0;
+  int32_t r = 0;
+  int32_t k = 0;
+  int status = 0;
+  
+  /* Check parameter */
+  if (pArg == NULL) {
+    abort();
+  }
+  pt = (STRESS_THREAD *) pArg;
+  
+  /* Run every job reps times, starting at the first index */
+  for(r = 0; r < pt->reps; r++) {
+    for(k = 0; k < pt->job_count; k++) {
+      pj = &(pt->pJobs[(pt->first + k) % pt->job_count]);
+      
+      status = runJob(&(pt->w), pj, &h);
+      if ((status != pj->ref_status) || (h != pj->ref_hash)) {
+        (pt->bad[pj->kind])++;
+      }
+      (pt->done)++;
+    }
+  }
+  
+  return NULL;
+}
+
+/*
+ * Run the job list on a given number of threads and report the results.
+ * 
+ * Parameters:
+ * 
+ *   pJobs - the job list with the reference results
+ * 
+ *   job_count - the number of jobs
+ * 
+ *   nthreads - the number of threads
+ * 
+ *   reps - the number of times each thread runs the job list
+ * 
+ *   pBase - the single-thread throughput, which is set if it is zero
+ * 
+ *   pModule - the module name for mismatch reports
+ * 
+ * Return:
+ * 
+ *   the number of mismatches
+ */
+static int32_t runThreads(
+    const STRESS_JOB * pJobs,
+          int32_t      job_count,
+          int32_t      nthreads,
+          int32_t      reps,
+          double     * pBase,
+    const char       * pModule) {
+  
+  STRESS_THREAD *pThreads = NULL;
+  pthread_t *pTids = NULL;
+  int32_t i = 0;
+  int32_t done = 0;
+  int32_t bad = 0;
+  int32_t kind_bad[JOB_KINDS];
+  double t = 0.0;
+  double rate = 0.0;
+  int k = 0;
+  
+  /* Initialize arrays */
+  memset(kind_bad, 0, sizeof(kind_bad));
+  
+  /* Check parameters */
+  if ((pJobs == NULL) || (job_count < 1) ||
+      (nthreads < 1) || (nthreads > MAX_THREADS) ||
+      (reps < 1) || (pBase == NULL) || (pModule == NULL)) {
+    abort();
+  }
+  
+  /* Allocate the thread states, spreading the starting points */
+  pThreads = (STRESS_THREAD *) calloc(
+                (size_t) nthreads, sizeof(STRESS_THREAD));
+  pTids = (pthread_t *) calloc((size_t) nthreads, sizeof(pthread_t));
+  if ((pThreads == NULL) || (pTids == NULL)) {
+    abort();
+  }
+  for(i = 0; i < nthreads; i++) {
+    pThreads[i].pJobs = pJobs;
+    pThreads[i].job_count = job_count;
+    pThreads[i].first = (int32_t)
+      ((((int64_t) i) * ((int64_t) job_count)) / nthreads);
+    pThreads[i].reps = reps;
+    sph_jpeg_membuf_init(&(pThreads[i].w.out));
+  }
+  
+  /* Run all the threads */
+  t = nowSec();
+  for(i = 0; i < nthreads; i++) {
+    if (pthread_create(
+          &(pTids[i]), NULL, &threadMain, &(pThreads[i]))) {
+      abort();
+    }
+  }
+  for(i = 0; i < nthreads; i++) {
+    if (pthread_join(pTids[i], NULL)) {
+      abort();
+    }
+  }
+  t = nowSec() - t;
+  
+  /* Gather the results and release the threads */
+  for(i = 0; i < nthreads; i++) {
+    done += pThreads[i].done;
+    for(k = 0; k < JOB_KINDS; k++) {
+      kind_bad[k] += pThreads[i].bad[k];
+      bad += pThreads[i].bad[k];
+    }
+    workerFree(&(pThreads[i].w));
+  }
+  free(pThreads);
+  free(pTids);
+  
+  /* Report the results */
+  if (t > 0.0) {
+    rate = ((double) done) / t;
+  }
+  if (*pBase <= 0.0) {
+    *pBase = rate;
+  }
+  printf("%7ld %9ld %8ld %9.3f %9.2f %9.2f %7.2f\n",
+          (long) nthreads, (long) done, (long) bad, t, rate,
+          rate / ((double) nthreads),
+          (*pBase > 0.0) ? (rate / *pBase) : 0.0);
+  fflush(stdout);
+  
+  for(k = 0; k < JOB_KINDS; k++) {
+    if (kind_bad[k] > 0) {
+      fprintf(stderr, "%s: %ld %s mismatches with %ld threads\n",
+              pModule, (long) kind_bad[k], m_kind_names[k],
+              (long) nthreads);
+    }
+  }
+  
+  return bad;
+}
+
+/*
+ * Program entrypoint.
+ */
+int main(int argc, char *argv[]) {
+  
+  int status = 1;
+  int i = 0;
+  const char *pModule = NULL;
+  int32_t max_threads = DEFAULT_THREADS;
+  int32_t reps = DEFAULT_REPS;
+  int32_t nthreads = 0;
+  int32_t job_count = 0;
+  int32_t bad = 0;
+  int32_t j = 0;
+  double base = 0.0;
+  STRESS_CORPUS corpus;
+  STRESS_JOB *pJobs = NULL;
+  STRESS_WORKER ref;
+  
+  /* Initialize structures */
+  memset(&corpus, 0, sizeof(STRESS_CORPUS));
+  memset(&ref, 0, sizeof(STRESS_WORKER));
+  sph_jpeg_membuf_init(&(ref.out));
+  
+  /* Get the module name */
+  if (argc > 0) {
+    if (argv != NULL) {
+      if (argv[0] != NULL) {
+        pModule = argv[0];
+      }
+    }
+  }
+  if (pModule == NULL) {
+    pModule = "jpeg_stress";
+  }
+  
+  /* Check that parameters are present */
+  if (argv == NULL) {
+    abort();
+  }
+  for(i = 0; i < argc; i++) {
+    if (argv[i] == NULL) {
+      abort();
+    }
+  }
+  
+  /* Check that there are one to three extra parameters */
+  if ((argc < 2) || (argc > 4)) {
+    fprintf(stderr, "%s: Wrong number of parameters!\n", pModule);
+    status = 0;
+  }
+  
+  /* If a second parameter is there, parse it as a thread count */
+  if (status && (argc > 2)) {
+    if (!parseInt(argv[2], &max_threads)) {
+      fprintf(stderr, "%s: Can't parse thread count!\n", pModule);
+      status = 0;
+    }
+    if (status && ((max_threads < 1) || (max_threads > MAX_THREADS))) {
+      fprintf(stderr, "%s: Thread count out of range!\n", pModule);
+      status = 0;
+    }
+  }
+  
+  /* If a third parameter is there, parse it as a repetition count */
+  if (status && (argc > 3)) {
+    if (!parseInt(argv[3], &reps)) {
+      fprintf(stderr, "%s: Can't parse repetition count!\n", pModule);
+      status = 0;
+    }
+    if (status && ((reps < 1) || (reps > MAX_REPS))) {
+      fprintf(stderr, "%s: Repetition count out of range!\n", pModule);
+      status = 0;
+    }
+  }
+  
+  /* Load the corpus */
+  if (status) {
+    if (!loadCorpus(&corpus, argv[1], pModule)) {
+      fprintf(stderr, "%s: Can't read corpus directory!\n", pModule);
+      status = 0;
+    }
+  }
+  if (status && (corpus.count < 1)) {
+    fprintf(stderr, "%s: No JPEG files in corpus!\n", pModule);
+    status = 0;
+  }
+  
+  /* Build the job list and get the reference results on the main
+   * thread */
+  if (status) {
+    pJobs = buildJobs(&corpus, &job_count);
+    for(j = 0; j < job_count; j++) {
+      pJobs[j].ref_status = runJob(
+                              &ref, &(pJobs[j]), &(pJobs[j].ref_hash));
+      if (pJobs[j].ref_status == STRESS_ERR_CHECK) {
+        fprintf(stderr, "%s: %s of %s fails its check!\n",
+                pModule, m_kind_names[pJobs[j].kind],
+                pJobs[j].pImg->pName);
+        status = 0;
+      }
+    }
+    workerFree(&ref);
+  }
+  
+  /* Check the cache with the first image that shrinks successfully */
+  if (status) {
+    for(j = 0; j < job_count; j++) {
+      if ((pJobs[j].kind == JOB_SHRINK) &&
+          (pJobs[j].ref_status == SPH_JPEG_ERR_OK)) {
+        break;
+      }
+    }
+    if (j < job_count) {
+      if (!checkCache(pJobs[j].pImg, pModule)) {
+        status = 0;
+      }
+    }
+  }
+  
+  /* Report the configuration */
+  if (status) {
+    printf("%ld images, %ld jobs, %ld repetitions\n\n",
+            (long) corpus.count, (long) job_count, (long) reps);
+    printf("%7s %9s %8s %9s %9s %9s %7s\n",
+            "threads", "jobs", "mismatch", "seconds",
+            "img/s", "img/s/thr", "scaling");
+  }
+  
+  /* Run each thread count */
+  if (status) {
+    nthreads = 1;
+    for(;;) {
+      bad += runThreads(
+                pJobs, job_count, nthreads, reps, &base, pModule);
+      
+      if (nthreads >= max_threads) {
+        break;
+      } else if (nthreads * 2 > max_threads) {
+        nthreads = max_threads;
+      } else {
+        nthreads *= 2;
+      }
+    }
+    
+    if (bad > 0) {
+      fprintf(stderr, "%s: Results differ from the reference!\n",
+              pModule);
+      status = 0;
+    }
+  }
+  
+  /* Release everything */
+  free(pJobs);
+  for(i = 0; i < corpus.count; i++) {
+    free(corpus.pImages[i].pName);
+    free(corpus.pImages[i].pData);
+    free(corpus.pImages[i].pCorrupt);
+    free(corpus.pImages[i].pBadHead);
+    free(corpus.pImages[i].pPix);
+    sph_jpeg_membuf_free(&(corpus.pImages[i].rst));
+  }
+  free(corpus.pImages);
+  
+  /* Invert status and return */
+  if (status) {
+    status = 0;
+  } else {
+    status = 1;
+  }
+  return status;
+}
@@ -6,26 +6,249 @@
  * 
  * See the header for further information.
  */
+
+/* Instrumentation needs clock_gettime() from POSIX */
+#ifdef SPH_JPEG_ENABLE_STATS
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#endif
+
 #include "jpegshrink.h"
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef SPH_JPEG_ENABLE_STATS
+#include <time.h>
+#endif
+
+/*
+ * Constants
+ * =========
+ */
+
+/*
+ * The number of scanlines transferred per batch when copying without
+ * box filtering.
+ */
+#define JPEGSHRINK_COPYROWS (16)
+
+/*
+ * The largest box filter size that can use an accumulator with 16-bit
+ * samples, since 16 * 16 * 255 is 65280.  Larger box filters use an
+ * accumulator with 32-bit samples.
+ */
+#define JPEGSHRINK_MAXBOX16 (16)
+
+/*
+ * Instrumentation macros.
+ * 
+ * JPEGSHRINK_STAT_MARK() records the current time in one of the mark
+ * fields of a shrink context, and JPEGSHRINK_STAT_TIME() adds the time
+ * since a mark to one of its timers.  Without SPH_JPEG_ENABLE_STATS,
+ * these expand to nothing.
+ */
+#ifdef SPH_JPEG_ENABLE_STATS
+#define JPEGSHRINK_STAT_MARK(pc, mark) \
+  ((pc)->mark = jpegshrink_stat_now())
+#define JPEGSHRINK_STAT_TIME(pc, mark, field) \
+  ((pc)->field += jpegshrink_stat_now() - (pc)->mark)
+#else
+#define JPEGSHRINK_STAT_MARK(pc, mark)
+#define JPEGSHRINK_STAT_TIME(pc, mark, field)
+#endif
+
+/*
+ * Type declarations
+ * =================
+ */
+
+/*
+ * Box filter kernels for the accumulator with 16-bit samples, which
+ * are specialized for each box filter size and channel count.  See
+ * JPEGSHRINK_KERNELS() for their definitions.
+ */
+typedef void (*JPEGSHRINK_MIXFN)(
+    const uint8_t  * pInScan,
+          uint16_t * pAcc,
+          int32_t    out_width);
+
+typedef void (*JPEGSHRINK_BLITFN)(
+    const uint16_t * pAcc,
+          uint8_t  * pOutScan,
+          int32_t    out_samples);
+
+/*
+ * The kernels for one box filter size, with a mixing kernel for each
+ * channel count.
+ */
+typedef struct {
+  JPEGSHRINK_MIXFN fMix1;
+  JPEGSHRINK_MIXFN fMix3;
+  JPEGSHRINK_BLITFN fBlit;
+} JPEGSHRINK_KERNEL;
+
+/*
+ * The state of one target of a multi-output shrink operation.
+ */
+typedef struct {
+  
+  /*
+   * The JPEG writer object of the target, or NULL if nothing has been
+   * written to this target position yet.
+   */
+  SPH_JPEG_WRITER *pw;
+  
+  /*
+   * The accumulator buffers and the output scanline buffer, in the same
+   * way as for the context, with their capacities in bytes.
+   */
+  uint16_t *pAcc;
+  size_t acc_cap;
+  uint32_t *pWideAcc;
+  size_t wide_cap;
+  uint8_t *pOutScan;
+  size_t out_cap;
+  
+  /*
+   * The geometry of the current operation.
+   * 
+   * active is non-zero if the target is being written.  bval is the box
+   * filter size, out_samples is the number of samples per output
+   * scanline, and pad_height is the height of the padded input.  fMix
+   * and fBlit are the box filter kernels if bval is in range
+   * [2, JPEGSHRINK_MAXBOX16].
+   */
+  int active;
+  int bval;
+  JPEGSHRINK_MIXFN fMix;
+  JPEGSHRINK_BLITFN fBlit;
+  int32_t out_width;
+  int32_t out_samples;
+  int32_t pad_height;
+  
+} JPEGSHRINK_STAGE;
+
+/*
+ * JPEGSHRINK_CTX
+ * 
+ * See the header for prototype.
+ */
+struct JPEGSHRINK_CTX_TAG {
+  
+  /*
+   * The JPEG reader object, or NULL if nothing has been read yet.
+   */
+  SPH_JPEG_READER *pr;
+  
+  /*
+   * The JPEG writer object, or NULL if nothing has been written yet.
+   */
+  SPH_JPEG_WRITER *pw;
+  
+  /*
+   * The input scanline buffer and its capacity in bytes.
+   */
+  uint8_t *pInScan;
+  size_t in_cap;
+  
+  /*
+   * The accumulator buffer and its capacity in samples.
+   */
+  uint16_t *pAcc;
+  size_t acc_cap;
+  
+  /*
+   * The accumulator buffer with 32-bit samples for box filters larger
+   * than JPEGSHRINK_MAXBOX16, and its capacity in bytes.
+   */
+  uint32_t *pWideAcc;
+  size_t wide_cap;
+  
+  /*
+   * The output scanline buffer and its capacity in bytes.
+   */
+  uint8_t *pOutScan;
+  size_t out_cap;
+  
+  /*
+   * Buffers used only by the fractional resampler of jpegshrink_fit().
+   * 
+   * pHRow is a horizontally resampled scanline, pVAcc is the vertical
+   * accumulator, pXSpan holds the first input pixel and the input pixel
+   * count for each output pixel, and pXWeight holds the horizontal
+   * weights.  Capacities are in bytes.
+   */
+  uint32_t *pHRow;
+  size_t h_cap;
+  uint64_t *pVAcc;
+  size_t v_cap;
+  int32_t *pXSpan;
+  size_t span_cap;
+  uint32_t *pXWeight;
+  size_t weight_cap;
+  
+  /*
+   * Non-zero to always decode with the accurate default decoder
+   * options, zero to use the fast options for reductions.
+   */
+  int accurate;
+  
+  /*
+   * Non-zero to decode only the luma channel of color images and write
+   * grayscale output.
+   */
+  int gray;
+  
+  /*
+   * The scanline source callback and its custom parameter, or NULL to
+   * read directly from the reader.
+   */
+  JPEGSHRINK_SOURCE fSource;
+  void *pSourceCustom;
+  
+  /*
+   * The target states of multi-output shrink operations, with room for
+   * JPEGSHRINK_MAXTARGETS targets, or NULL if there has not been any
+   * such operation yet.
+   */
+  JPEGSHRINK_STAGE *pStages;
+  
+#ifdef SPH_JPEG_ENABLE_STATS
+  /*
+   * The instrumentation counters, see JPEGSHRINK_STATS, with the start
+   * times of the current operation and the current scanline request.
+   */
+  int64_t ops;
+  int64_t total_ns;
+  int64_t input_ns;
+  int64_t op_mark;
+  int64_t in_mark;
+#endif
+};
+
 /*
  * Local functions
  * ===============
  */
 
 /* Prototypes */
-static void jpegshrink_avgblit(
-    const uint16_t * pAcc,
+static void jpegshrink_kernels(
+    int                 bval,
+    int                 chcount,
+    JPEGSHRINK_MIXFN  * pfMix,
+    JPEGSHRINK_BLITFN * pfBlit);
+
+static void jpegshrink_avgblit32(
+    const uint32_t * pAcc,
           uint8_t  * pOutScan,
           int32_t    out_samples,
           int        sval);
 
-static void jpegshrink_mixscan(
+static void jpegshrink_mixscan32(
     const uint8_t  * pInScan,
-          uint16_t * pAcc,
+          uint32_t * pAcc,
           int32_t    out_width,
           int        sval,
           int        chcount);
@@ -36,25 +259,273 @@ static void jpegshrink_padscan(
     int32_t   pad_count,
     int       chcount);
 
+static int jpegshrink_dctscale(int sval);
+
+static int32_t jpegshrink_getrows(
+    JPEGSHRINK_CTX * pc,
+    uint8_t        * buf,
+    size_t           stride,
+    int32_t          max_rows);
+
+static int jpegshrink_cropin(
+          JPEGSHRINK_CTX       * pc,
+          FILE                 * pIn,
+    const JPEGSHRINK_RECT      * pCrop,
+          int                    denom,
+    const SPH_JPEG_READER_OPTS * pOpts);
+
+static int jpegshrink_run(
+          JPEGSHRINK_CTX    * pc,
+          FILE              * pIn,
+          FILE              * pOut,
+    const JPEGSHRINK_RECT   * pCrop,
+          int                 sval,
+          int                 q,
+    const JPEGSHRINK_BOUNDS * pBounds);
+
+static void *jpegshrink_reserve(void *pBuf, size_t *pCap, size_t need);
+
+static void jpegshrink_readopts(
+    const JPEGSHRINK_CTX       * pc,
+          int                    reduce,
+          SPH_JPEG_READER_OPTS * pOpts);
+
+static int jpegshrink_openout(
+    JPEGSHRINK_CTX   * pc,
+    SPH_JPEG_WRITER ** ppw,
+    FILE             * pOut,
+    int32_t            out_width,
+    int32_t            out_height,
+    int                chcount,
+    int                q);
+
+static void jpegshrink_stagerow(
+          JPEGSHRINK_STAGE * ps,
+    const uint8_t          * pInScan,
+          int32_t            y,
+          int                chcount);
+
+static int jpegshrink_inbounds(
+          int32_t             out_width,
+          int32_t             out_height,
+    const JPEGSHRINK_BOUNDS * pBounds);
+
+static int jpegshrink_fitdims(
+          int32_t             in_width,
+          int32_t             in_height,
+    const JPEGSHRINK_BOUNDS * pBounds,
+          int32_t           * pOutWidth,
+          int32_t           * pOutHeight);
+
+static void jpegshrink_fitaxis(
+    int32_t    src,
+    int32_t    dst,
+    int32_t  * pSpan,
+    uint32_t * pWeight);
+
+static void jpegshrink_hresample(
+    const uint8_t  * pInScan,
+          uint32_t * pHRow,
+          int32_t    out_width,
+          int        chcount,
+    const int32_t  * pSpan,
+    const uint32_t * pWeight);
+
+#ifdef SPH_JPEG_ENABLE_STATS
+static int64_t jpegshrink_stat_now(void);
+#endif
+static void jpegshrink_addstats(
+          SPH_JPEG_STATS * pSum,
+    const SPH_JPEG_STATS * pStats);
+
 /*
- * Transfer the accumulator into the output scanline buffer by averaging
- * each accumulator sample.
+ * Define the specialized box filter kernels for one box filter size.
  * 
- * pAcc points to the accumulator.
+ * n is the box filter size, in range [2, JPEGSHRINK_MAXBOX16], which
+ * must be a plain decimal literal since it becomes part of the function
+ * names.  Three functions are defined, each of matching type for the
+ * kernel table:
  * 
- * pOutScan points to the output scanline.
+ * jpegshrink_mix1_n() and jpegshrink_mix3_n() mix a padded input
+ * scanline with one or three channels into the accumulator.  Each run
+ * of n pixels in the input scanline is summed and added to a single
+ * output pixel in the accumulator.  pAcc must have out_width pixels,
+ * and pInScan must have (out_width * n) pixels.  Undefined behavior
+ * occurs if the accumulator overflows.
  * 
- * out_samples is the total number of *samples* (not pixels!) to
- * transfer from accumulator to output buffer.  It must be in range
- * [1, SPH_JPEG_MAXDIM * 3].
+ * jpegshrink_blit_n() transfers out_samples samples of the accumulator
+ * into the output scanline, dividing each of them by (n * n), which is
+ * the number of input pixels that map to a single output pixel, and
+ * clamping the result to range [0, 255].  The division is performed by
+ * multiplying with a rounded-up 24-bit fixed-point reciprocal of the
+ * divisor, which gives exactly the same result as integer division for
+ * all dividends below 2^16 and divisors up to 2^8, and the product of
+ * an accumulator sample (at most 255 * n * n) with the reciprocal
+ * always fits in 32 bits.
  * 
- * sval is the scaling value, in range [1, JPEGSHRINK_MAXSHRINK].
+ * Since n is a constant in each function, the compiler can fully
+ * unroll the inner sums and fold the reciprocal, and the loops have no
+ * branches in their bodies, which allows compilers to vectorize them.
+ * The parameters are not checked, since they are checked once per
+ * image when the kernels are chosen by jpegshrink_kernels().
+ */
+#define JPEGSHRINK_KERNELS(n) \
+  static void jpegshrink_mix1_##n( \
+      const uint8_t  * pInScan, \
+            uint16_t * pAcc, \
+            int32_t    out_width) { \
+    int32_t x = 0; \
+    int k = 0; \
+    uint32_t sum = 0; \
+    for(x = 0; x < out_width; x++) { \
+      sum = 0; \
+      for(k = 0; k < (n); k++) { \
+        sum += pInScan[k]; \
+      } \
+      pAcc[x] = (uint16_t) (pAcc[x] + sum); \
+      pInScan += (n); \
+    } \
+  } \
+  static void jpegshrink_mix3_##n( \
+      const uint8_t  * pInScan, \
+            uint16_t * pAcc, \
+            int32_t    out_width) { \
+    int32_t x = 0; \
+    int k = 0; \
+    uint32_t sum = 0; \
+    uint32_t sum_g = 0; \
+    uint32_t sum_b = 0; \
+    for(x = 0; x < out_width; x++) { \
+      sum = 0; \
+      sum_g = 0; \
+      sum_b = 0; \
+      for(k = 0; k < (n); k++) { \
+        sum += pInScan[(k * 3)    ]; \
+        sum_g += pInScan[(k * 3) + 1]; \
+        sum_b += pInScan[(k * 3) + 2]; \
+      } \
+      pAcc[0] = (uint16_t) (pAcc[0] + sum); \
+      pAcc[1] = (uint16_t) (pAcc[1] + sum_g); \
+      pAcc[2] = (uint16_t) (pAcc[2] + sum_b); \
+      pAcc += 3; \
+      pInScan += 3 * (n); \
+    } \
+  } \
+  static void jpegshrink_blit_##n( \
+      const uint16_t * pAcc, \
+            uint8_t  * pOutScan, \
+            int32_t    out_samples) { \
+    const uint32_t recip = \
+      ((UINT32_C(1) << 24) + ((n) * (n)) - 1) / ((n) * (n)); \
+    int32_t i = 0; \
+    uint32_t sv = 0; \
+    for(i = 0; i < out_samples; i++) { \
+      sv = (((uint32_t) pAcc[i]) * recip) >> 24; \
+      if (sv > 255) { \
+        sv = 255; \
+      } \
+      pOutScan[i] = (uint8_t) sv; \
+    } \
+  }
+
+JPEGSHRINK_KERNELS(2)
+JPEGSHRINK_KERNELS(3)
+JPEGSHRINK_KERNELS(4)
+JPEGSHRINK_KERNELS(5)
+JPEGSHRINK_KERNELS(6)
+JPEGSHRINK_KERNELS(7)
+JPEGSHRINK_KERNELS(8)
+JPEGSHRINK_KERNELS(9)
+JPEGSHRINK_KERNELS(10)
+JPEGSHRINK_KERNELS(11)
+JPEGSHRINK_KERNELS(12)
+JPEGSHRINK_KERNELS(13)
+JPEGSHRINK_KERNELS(14)
+JPEGSHRINK_KERNELS(15)
+JPEGSHRINK_KERNELS(16)
+
+/*
+ * The kernel table, with one entry for each box filter size from two
+ * up to JPEGSHRINK_MAXBOX16.
+ */
+static const JPEGSHRINK_KERNEL
+    jpegshrink_kernel_table[JPEGSHRINK_MAXBOX16 - 1] = {
+  {&jpegshrink_mix1_2,  &jpegshrink_mix3_2,  &jpegshrink_blit_2 },
+  {&jpegshrink_mix1_3,  &jpegshrink_mix3_3,  &jpegshrink_blit_3 },
+  {&jpegshrink_mix1_4,  &jpegshrink_mix3_4,  &jpegshrink_blit_4 },
+  {&jpegshrink_mix1_5,  &jpegshrink_mix3_5,  &jpegshrink_blit_5 },
+  {&jpegshrink_mix1_6,  &jpegshrink_mix3_6,  &jpegshrink_blit_6 },
+  {&jpegshrink_mix1_7,  &jpegshrink_mix3_7,  &jpegshrink_blit_7 },
+  {&jpegshrink_mix1_8,  &jpegshrink_mix3_8,  &jpegshrink_blit_8 },
+  {&jpegshrink_mix1_9,  &jpegshrink_mix3_9,  &jpegshrink_blit_9 },
+  {&jpegshrink_mix1_10, &jpegshrink_mix3_10, &jpegshrink_blit_10},
+  {&jpegshrink_mix1_11, &jpegshrink_mix3_11, &jpegshrink_blit_11},
+  {&jpegshrink_mix1_12, &jpegshrink_mix3_12, &jpegshrink_blit_12},
+  {&jpegshrink_mix1_13, &jpegshrink_mix3_13, &jpegshrink_blit_13},
+  {&jpegshrink_mix1_14, &jpegshrink_mix3_14, &jpegshrink_blit_14},
+  {&jpegshrink_mix1_15, &jpegshrink_mix3_15, &jpegshrink_blit_15},
+  {&jpegshrink_mix1_16, &jpegshrink_mix3_16, &jpegshrink_blit_16}
+};
+
+/*
+ * Choose the box filter kernels for an image.
+ * 
+ * bval is the box filter size, in range [2, JPEGSHRINK_MAXBOX16], and
+ * chcount is the number of channels per pixel, one or three.  The
+ * parameters are checked here once, so that the kernels don't need to
+ * check them for every scanline.
+ * 
+ * Parameters:
+ * 
+ *   bval - the box filter size
+ * 
+ *   chcount - the number of color channels
+ * 
+ *   pfMix - receives the kernel that mixes scanlines
+ * 
+ *   pfBlit - receives the kernel that transfers the accumulator
+ */
+static void jpegshrink_kernels(
+    int                 bval,
+    int                 chcount,
+    JPEGSHRINK_MIXFN  * pfMix,
+    JPEGSHRINK_BLITFN * pfBlit) {
+  
+  const JPEGSHRINK_KERNEL *pk = NULL;
+  
+  /* Check parameters */
+  if ((pfMix == NULL) || (pfBlit == NULL)) {
+    abort();
+  }
+  if ((bval < 2) || (bval > JPEGSHRINK_MAXBOX16)) {
+    abort();
+  }
+  if ((chcount != 1) && (chcount != 3)) {
+    abort();
+  }
+  
+  /* Look up the kernels */
+  pk = &(jpegshrink_kernel_table[bval - 2]);
+  if (chcount == 3) {
+    *pfMix = pk->fMix3;
+  } else {
+    *pfMix = pk->fMix1;
+  }
+  *pfBlit = pk->fBlit;
+}
+
+/*
+ * Transfer an accumulator with 32-bit samples into the output scanline
+ * buffer by averaging each accumulator sample.
  * 
- * Each sample in the accumulator is divided by (sval * sval) and then
- * clamped to range [0, 255] before being written to the output scaline.
- * The divisor of (sval * sval) is the number of pixels in the svalxsval
- * input pixel that maps to a single output pixel, so as to compute an
- * average value.
+ * This is the same as the jpegshrink_blit_n() kernels defined by
+ * JPEGSHRINK_KERNELS(), except that it is for the accumulator used by
+ * box filters larger than JPEGSHRINK_MAXBOX16, and sval may be in range
+ * [1, JPEGSHRINK_MAXSHRINK].
+ * 
+ * The division is an ordinary integer division.  Only one output
+ * scanline is transferred for every sval input scanlines, and sval is
+ * large here, so the division is not worth avoiding.
  * 
  * Parameters:
  * 
@@ -67,15 +538,15 @@ static void jpegshrink_padscan(
  * 
  *   sval - the scaling value
  */
-static void jpegshrink_avgblit(
-    const uint16_t * pAcc,
+static void jpegshrink_avgblit32(
+    const uint32_t * pAcc,
           uint8_t  * pOutScan,
           int32_t    out_samples,
           int        sval) {
   
-  int32_t div_val = 0;
+  uint32_t div_val = 0;
   int32_t i = 0;
-  int32_t sv = 0;
+  uint32_t sv = 0;
   
   /* Check parameters */
   if ((pAcc == NULL) || (pOutScan == NULL)) {
@@ -89,18 +560,16 @@ static void jpegshrink_avgblit(
   }
   
   /* Compute the divisor value */
-  div_val = ((int32_t) sval) * ((int32_t) sval);
+  div_val = ((uint32_t) sval) * ((uint32_t) sval);
   
   /* Perform the transfer */
   for(i = 0; i < out_samples; i++) {
-  
+    
     /* Compute averaged sample value */
-    sv = ((int32_t) pAcc[i]) / div_val;
+    sv = pAcc[i] / div_val;
     
     /* Clamp value */
-    if (sv < 0) {
-      sv = 0;
-    } else if (sv > 255) {
+    if (sv > 255) {
       sv = 255;
     }
     
@@ -110,26 +579,15 @@ static void jpegshrink_avgblit(
 }
 
 /*
- * Mix a (padded) input scanline into the accumulator.
- * 
- * pInScan points to the (padded) input scanline.
- * 
- * pAcc points to the accumulator.
- * 
- * out_width is the width in pixels of the accumulator.  pAcc must have
- * (out_width) pixels, and pInScan must have (out_width * sval) pixels.
- * out_width must be in range [1, SPH_JPEG_MAXDIM].
- * 
- * sval is the scaling value to use.  It must be in the range
- * [1, JPEGSHRINK_MAXSHRINK].
- * 
- * chcount is the number of channels per pixel.  It must be either one
- * or three.
+ * Mix a (padded) input scanline into an accumulator with 32-bit
+ * samples.
  * 
- * Each run of (sval) pixels in the input scanline is mixed into a
- * single output pixel in the accumulator.  Mixing is done by adding
- * input sample values to the values already in the accumulator.
- * Undefined behavior occurs if the accumulator overflows.
+ * This is the same as the jpegshrink_mix1_n() and jpegshrink_mix3_n()
+ * kernels defined by JPEGSHRINK_KERNELS(), except that it is for the
+ * accumulator used by box filters larger than JPEGSHRINK_MAXBOX16, and
+ * sval may be in range [1, JPEGSHRINK_MAXSHRINK].  With 32-bit samples,
+ * the accumulator can't overflow for any such scaling value.  Only the
+ * general loops are provided, since these box filter sizes are rare.
  * 
  * Parameters:
  * 
@@ -143,15 +601,18 @@ static void jpegshrink_avgblit(
  * 
  *   chcount - the number of color channels
  */
-static void jpegshrink_mixscan(
+static void jpegshrink_mixscan32(
     const uint8_t  * pInScan,
-          uint16_t * pAcc,
+          uint32_t * pAcc,
           int32_t    out_width,
           int        sval,
           int        chcount) {
   
   int32_t x = 0;
-  int32_t pad_width = 0;
+  int k = 0;
+  uint32_t sum = 0;
+  uint32_t sum_g = 0;
+  uint32_t sum_b = 0;
   
   /* Check parameters */
   if ((pInScan == NULL) || (pAcc == NULL)) {
@@ -167,40 +628,37 @@ static void jpegshrink_mixscan(
     abort();
   }
   
-  /* Iterate over all padded input pixels */
-  pad_width = out_width * ((int32_t) sval);
-  for(x = 0; x < pad_width; x++) {
-    
-    /* Add current input pixel into accumulator */
-    if (chcount == 3) {
-      /* RGB accumulation */
-      pAcc[0] = pAcc[0] + ((uint16_t) pInScan[0]);
-      pAcc[1] = pAcc[1] + ((uint16_t) pInScan[1]);
-      pAcc[2] = pAcc[2] + ((uint16_t) pInScan[2]);
-      
-    } else if (chcount == 1) {
-      /* Grayscale accumulation */
-      *pAcc = *pAcc + ((uint16_t) *pInScan);
-      
-    } else {
-      /* shouldn't happen */
-      abort();
+  /* Sum each run of input pixels into the accumulator */
+  if (chcount == 1) {
+    for(x = 0; x < out_width; x++) {
+      sum = 0;
+      for(k = 0; k < sval; k++) {
+        sum += pInScan[k];
+      }
+      pAcc[x] += sum;
+      pInScan += sval;
     }
     
-    /* Update pointers if not at last pixel */
-    if (x < pad_width - 1) {
-      /* Advance the input pointer */
-      pInScan += chcount;
-      
-      /* If sval is less than two, advance the accumulator pointer;
-       * otherwise, advance accumulator pointer if (x % sval) is
-       * (sval - 1) */
-      if (sval < 2) {
-        pAcc += chcount;
-      } else if ((x % sval) >= sval - 1) {
-        pAcc += chcount;
+  } else if (chcount == 3) {
+    for(x = 0; x < out_width; x++) {
+      sum = 0;
+      sum_g = 0;
+      sum_b = 0;
+      for(k = 0; k < sval; k++) {
+        sum += pInScan[0];
+        sum_g += pInScan[1];
+        sum_b += pInScan[2];
+        pInScan += 3;
       }
+      pAcc[0] += sum;
+      pAcc[1] += sum_g;
+      pAcc[2] += sum_b;
+      pAcc += 3;
     }
+    
+  } else {
+    /* shouldn't happen */
+    abort();
   }
 }
 
@@ -258,113 +716,454 @@ static void jpegshrink_padscan(
     /* Get a pointer to the last input pixel in scanline */
     plast = pInScan + ((in_width - 1) * ((int32_t) chcount));
     
-    /* Duplicate last pixel pad_count times */
-    for(i = 1; i <= pad_count; i++) {
-      if (chcount == 3) {
-        /* RGB duplication */
+    /* Duplicate last pixel pad_count times, with a separate loop for
+     * each channel count */
+    if (chcount == 3) {
+      /* RGB duplication */
+      for(i = 1; i <= pad_count; i++) {
         plast[(i * 3)    ] = plast[0];
         plast[(i * 3) + 1] = plast[1];
         plast[(i * 3) + 2] = plast[2];
-        
-      } else if (chcount == 1) {
-        /* Grayscale duplication */
-        plast[i] = plast[0];
-        
-      } else {
-        /* shouldn't happen */
-        abort();
       }
+      
+    } else if (chcount == 1) {
+      /* Grayscale duplication */
+      memset(plast + 1, plast[0], (size_t) pad_count);
+      
+    } else {
+      /* shouldn't happen */
+      abort();
     }
   }
 }
 
 /*
- * Public function implementations
- * ===============================
+ * Determine the DCT scaling denominator to use for a scaling value.
  * 
- * See the header for specifications.
+ * sval is the scaling value, in range [1, JPEGSHRINK_MAXSHRINK].
+ * 
+ * The return value is the largest of 8, 4, 2, and 1 that evenly
+ * divides sval.  The decoder is asked to scale by this factor in the
+ * DCT domain, and the box filter only needs to reduce by the remaining
+ * factor of (sval / denom).
+ * 
+ * Since the decoder rounds scaled dimensions up, and the box filter
+ * also rounds up by padding, the output dimensions are the same as if
+ * the whole reduction were performed by the box filter.
+ * 
+ * Parameters:
+ * 
+ *   sval - the scaling value
+ * 
+ * Return:
+ * 
+ *   the DCT scaling denominator
  */
+static int jpegshrink_dctscale(int sval) {
+  
+  int denom = 0;
+  
+  /* Check parameter */
+  if ((sval < 1) || (sval > JPEGSHRINK_MAXSHRINK)) {
+    abort();
+  }
+  
+  /* Find largest supported denominator dividing the scaling value */
+  if ((sval % 8) == 0) {
+    denom = 8;
+  } else if ((sval % 4) == 0) {
+    denom = 4;
+  } else if ((sval % 2) == 0) {
+    denom = 2;
+  } else {
+    denom = 1;
+  }
+  
+  return denom;
+}
 
+#ifdef SPH_JPEG_ENABLE_STATS
 /*
- * jpegshrink function.
+ * Read the monotonic clock.
+ * 
+ * Return:
+ * 
+ *   the current time in nanoseconds
  */
-int jpegshrink(
-          FILE              * pIn,
-          FILE              * pOut,
-          int                 sval,
-          int                 q,
-    const JPEGSHRINK_BOUNDS * pBounds) {
+static int64_t jpegshrink_stat_now(void) {
   
-  int status = 1;
-  int retval = SPH_JPEG_ERR_OK;
+  struct timespec ts;
   
-  int32_t in_width = 0;
-  int32_t in_height = 0;
-  int chcount = 0;
-  int32_t out_width = 0;
-  int32_t out_height = 0;
-  int32_t out_samples = 0;
-  int32_t pad_height = 0;
-  int32_t pad_count = 0;
+  memset(&ts, 0, sizeof(struct timespec));
+  if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+    abort();
+  }
   
-  int32_t long_dim = 0;
-  int32_t short_dim = 0;
-  int64_t pix_count = 0;
+  return (((int64_t) ts.tv_sec) * INT64_C(1000000000)) +
+            ((int64_t) ts.tv_nsec);
+}
+#endif
+
+/*
+ * Add the counters of a reader or writer to a sum.
+ * 
+ * Every field is added, including the pool fields, so the pool fields
+ * of a sum over several writers are an upper bound.
+ * 
+ * Parameters:
+ * 
+ *   pSum - the sum to add to
+ * 
+ *   pStats - the counters to add
+ */
+static void jpegshrink_addstats(
+          SPH_JPEG_STATS * pSum,
+    const SPH_JPEG_STATS * pStats) {
   
-  int32_t y = 0;
-  int32_t i = 0;
+  /* Check parameters */
+  if ((pSum == NULL) || (pStats == NULL)) {
+    abort();
+  }
   
-  SPH_JPEG_READER *pr = NULL;
-  SPH_JPEG_WRITER *pw = NULL;
+  /* Add the fields */
+  pSum->images += pStats->images;
+  pSum->setup_ns += pStats->setup_ns;
+  pSum->scan_ns += pStats->scan_ns;
+  pSum->finish_ns += pStats->finish_ns;
+  pSum->bytes += pStats->bytes;
+  pSum->rows += pStats->rows;
+  pSum->pool_bytes += pStats->pool_bytes;
+  pSum->pool_peak += pStats->pool_peak;
+}
+
+/*
+ * Read decoded scanlines for a shrink operation.
+ * 
+ * This has the same interface as sph_jpeg_reader_get_rows() on the
+ * reader of the context.  If the context has a source callback, the
+ * rows are read through the callback.
+ * 
+ * Parameters:
+ * 
+ *   pc - the shrink context
+ * 
+ *   buf - the buffer to receive the rows
+ * 
+ *   stride - the distance in bytes between rows in buf
+ * 
+ *   max_rows - the maximum number of rows to read
+ * 
+ * Return:
+ * 
+ *   the number of rows read, or zero if there was an error
+ */
+static int32_t jpegshrink_getrows(
+    JPEGSHRINK_CTX * pc,
+    uint8_t        * buf,
+    size_t           stride,
+    int32_t          max_rows) {
   
-  uint8_t *pInScan = NULL;
-  uint16_t *pAcc = NULL;
-  uint8_t *pOutScan = NULL;
+  int32_t result = 0;
   
   /* Check parameters */
-  if ((pIn == NULL) || (pOut == NULL)) {
+  if ((pc == NULL) || (buf == NULL) || (max_rows < 1)) {
     abort();
   }
-  if ((sval < 1) || (sval > JPEGSHRINK_MAXSHRINK)) {
+  if (pc->pr == NULL) {
     abort();
   }
+  
+  /* Read through the source callback, or else from the reader */
+  JPEGSHRINK_STAT_MARK(pc, in_mark);
+  if (pc->fSource != NULL) {
+    result = (*(pc->fSource))(
+                pc->pSourceCustom, pc->pr, buf, stride, max_rows);
+  } else if (max_rows <= 1) {
+    if (sph_jpeg_reader_get(pc->pr, buf)) {
+      result = 1;
+    }
+  } else {
+    result = sph_jpeg_reader_get_rows(pc->pr, buf, stride, max_rows);
+  }
+  JPEGSHRINK_STAT_TIME(pc, in_mark, input_ns);
+  
+  return result;
+}
 
-  /* Open the input file */
-  pr = sph_jpeg_reader_new(pIn);
-  if (sph_jpeg_reader_status(pr) != SPH_JPEG_ERR_OK) {
-    status = 0;
+/*
+ * Make sure that a buffer in a shrink context has at least a given
+ * capacity.
+ * 
+ * pBuf is the current buffer, or NULL if it has not been allocated
+ * yet.  pCap points to its current capacity in bytes.  If the capacity
+ * is less than need, the buffer is reallocated to exactly that size and
+ * the capacity is updated.  The contents of the buffer are undefined
+ * afterwards.
+ * 
+ * If the buffer can't be allocated, the old buffer is released, the
+ * capacity is set to zero, and NULL is returned.
+ * 
+ * Parameters:
+ * 
+ *   pBuf - the current buffer, or NULL
+ * 
+ *   pCap - pointer to the current capacity
+ * 
+ *   need - the required capacity in bytes
+ * 
+ * Return:
+ * 
+ *   the buffer with at least the required capacity, or NULL if it
+ *   could not be allocated
+ */
+static void *jpegshrink_reserve(void *pBuf, size_t *pCap, size_t need) {
+  
+  /* Check parameters */
+  if (pCap == NULL) {
+    abort();
+  }
+  if (need < 1) {
+    need = 1;
   }
   
-  /* Get the width, height, and channel count */
-  if (status) {
-    in_width = sph_jpeg_reader_width(pr);
-    in_height = sph_jpeg_reader_height(pr);
-    chcount = sph_jpeg_reader_channels(pr);
+  /* Only reallocate if the buffer is too small */
+  if ((pBuf == NULL) || (*pCap < need)) {
+    free(pBuf);
+    pBuf = malloc(need);
+    if (pBuf != NULL) {
+      *pCap = need;
+    } else {
+      *pCap = 0;
+    }
   }
   
-  /* Determine output width and height */
-  if (status && (sval <= 1)) {
-    /* No scaling, so output dimensions equal to input */
-    out_width = in_width;
-    out_height = in_height;
-    
-  } else if (status) {
-    /* Scaling, so first divide by scaling value */
-    out_width = in_width / ((int32_t) sval);
-    out_height = in_height / ((int32_t) sval);
-    
-    /* Next, if input padding required, increment corresponding
-     * dimensions */
-    if ((in_width % sval) != 0) {
-      out_width++;
+  return pBuf;
+}
+
+/*
+ * Choose the decoder options for a shrink operation.
+ * 
+ * pc is the shrink context.  reduce is non-zero if the output is at
+ * most half the size of the full input image in each dimension.  The
+ * fast decoder options are written to pOpts if reduce is non-zero and
+ * the context does not ask for accurate decoding.  Otherwise, the
+ * accurate defaults are written.  In both cases, color images are
+ * requested in YCbCr, or as grayscale if the context asks for it.
+ * 
+ * Parameters:
+ * 
+ *   pc - the shrink context
+ * 
+ *   reduce - non-zero if the image is reduced by at least two
+ * 
+ *   pOpts - the decoder options to fill in
+ */
+static void jpegshrink_readopts(
+    const JPEGSHRINK_CTX       * pc,
+          int                    reduce,
+          SPH_JPEG_READER_OPTS * pOpts) {
+  
+  /* Check parameters */
+  if ((pc == NULL) || (pOpts == NULL)) {
+    abort();
+  }
+  
+  /* Start with the accurate defaults, but keep color images in YCbCr
+   * since the filters work on each channel separately, or only decode
+   * luma if the context asks for grayscale output */
+  sph_jpeg_reader_opts_init(pOpts);
+  if (pc->gray) {
+    pOpts->color = SPH_JPEG_COLOR_GRAY;
+  } else {
+    pOpts->color = SPH_JPEG_COLOR_YCC;
+  }
+  
+  /* Switch to the fast options if the reduction hides the loss */
+  if (reduce && (!(pc->accurate))) {
+    pOpts->dct = SPH_JPEG_DCT_IFAST;
+    pOpts->fancy_upsampling = 0;
+    pOpts->block_smoothing = 0;
+  }
+}
+
+/*
+ * Start writing the output image of a shrink operation.
+ * 
+ * ppw points to the writer variable of the context pc, which is either
+ * the main writer of the context or the writer of a target of a
+ * multi-output operation.  The writer is reused if there is one, or
+ * else it is allocated and stored in the variable.  The writer takes
+ * its scanlines in the same color space as the reader of the context
+ * delivers them, so color images that are stored as YCbCr are shrunk
+ * without any color conversion.  The other parameters are as for
+ * sph_jpeg_writer_new().
+ * 
+ * Parameters:
+ * 
+ *   pc - the shrink context
+ * 
+ *   ppw - the writer variable
+ * 
+ *   pOut - the output JPEG file
+ * 
+ *   out_width - the output width in pixels
+ * 
+ *   out_height - the output height in pixels
+ * 
+ *   chcount - the number of color channels
+ * 
+ *   q - the compression quality
+ * 
+ * Return:
+ * 
+ *   SPH_JPEG_ERR_OK (0) if successful, SPH_JPEG_ERR_MEM if the writer
+ *   could not be allocated, or else the error status of the writer
+ */
+static int jpegshrink_openout(
+    JPEGSHRINK_CTX   * pc,
+    SPH_JPEG_WRITER ** ppw,
+    FILE             * pOut,
+    int32_t            out_width,
+    int32_t            out_height,
+    int                chcount,
+    int                q) {
+  
+  int retval = SPH_JPEG_ERR_OK;
+  SPH_JPEG_WRITER_OPTS wopts;
+  
+  /* Initialize structures */
+  memset(&wopts, 0, sizeof(SPH_JPEG_WRITER_OPTS));
+  
+  /* Check parameters */
+  if ((pc == NULL) || (pc->pr == NULL) || (ppw == NULL) ||
+      (pOut == NULL)) {
+    abort();
+  }
+  
+  /* Match the color space of the reader */
+  sph_jpeg_writer_opts_init(&wopts);
+  wopts.color = sph_jpeg_reader_color(pc->pr);
+  
+  /* Reuse the writer if there is one */
+  if (*ppw != NULL) {
+    sph_jpeg_writer_set_opts(*ppw, &wopts);
+    sph_jpeg_writer_reset(
+      *ppw, pOut, out_width, out_height, chcount, q);
+  } else {
+    *ppw = sph_jpeg_writer_new_ex(
+            pOut, out_width, out_height, chcount, q, &wopts);
+  }
+  
+  /* Report the status of the writer */
+  if (*ppw != NULL) {
+    retval = sph_jpeg_writer_status(*ppw);
+  } else {
+    retval = SPH_JPEG_ERR_MEM;
+  }
+  
+  return retval;
+}
+
+/*
+ * Process one scanline of the padded input of a box-filtered target of
+ * a multi-output shrink operation.
+ * 
+ * pInScan is the padded input scanline, which has at least
+ * (out_width * bval) pixels, and y is its row in the padded input of
+ * the target.  The scanline is mixed into the accumulator of the
+ * target, which is cleared first at the start of each block of bval
+ * rows, and an output scanline is written at the end of each block, in
+ * the same way as for a single-output shrink.
+ * 
+ * Parameters:
+ * 
+ *   ps - the target state
+ * 
+ *   pInScan - the padded input scanline
+ * 
+ *   y - the row in the padded input
+ * 
+ *   chcount - the number of color channels
+ */
+static void jpegshrink_stagerow(
+          JPEGSHRINK_STAGE * ps,
+    const uint8_t          * pInScan,
+          int32_t            y,
+          int                chcount) {
+  
+  int32_t i = 0;
+  
+  /* Check parameters */
+  if ((ps == NULL) || (pInScan == NULL)) {
+    abort();
+  }
+  if ((!(ps->active)) || (ps->bval < 2) || (y < 0) ||
+      (y >= ps->pad_height)) {
+    abort();
+  }
+  
+  /* At the start of a block, zero out the accumulator */
+  if ((y % ps->bval) == 0) {
+    if (ps->bval <= JPEGSHRINK_MAXBOX16) {
+      for(i = 0; i < ps->out_samples; i++) {
+        (ps->pAcc)[i] = (uint16_t) 0;
+      }
+    } else {
+      for(i = 0; i < ps->out_samples; i++) {
+        (ps->pWideAcc)[i] = 0;
+      }
     }
-    if ((in_height % sval) != 0) {
-      out_height++;
+  }
+  
+  /* Mix the scanline into the accumulator */
+  if (ps->bval <= JPEGSHRINK_MAXBOX16) {
+    (*(ps->fMix))(pInScan, ps->pAcc, ps->out_width);
+  } else {
+    jpegshrink_mixscan32(
+      pInScan, ps->pWideAcc, ps->out_width, ps->bval, chcount);
+  }
+  
+  /* At the end of a block, write an output scanline */
+  if ((y % ps->bval) >= (ps->bval - 1)) {
+    if (ps->bval <= JPEGSHRINK_MAXBOX16) {
+      (*(ps->fBlit))(ps->pAcc, ps->pOutScan, ps->out_samples);
+    } else {
+      jpegshrink_avgblit32(
+        ps->pWideAcc, ps->pOutScan, ps->out_samples, ps->bval);
     }
+    sph_jpeg_writer_put(ps->pw, ps->pOutScan);
   }
+}
+
+/*
+ * Check whether output dimensions satisfy a constraints structure.
+ * 
+ * pBounds may be NULL, in which case there are no constraints.
+ * 
+ * Parameters:
+ * 
+ *   out_width - the output width in pixels
+ * 
+ *   out_height - the output height in pixels
+ * 
+ *   pBounds - the output image constraints, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if all constraints are satisfied, zero otherwise
+ */
+static int jpegshrink_inbounds(
+          int32_t             out_width,
+          int32_t             out_height,
+    const JPEGSHRINK_BOUNDS * pBounds) {
+  
+  int status = 1;
+  int32_t long_dim = 0;
+  int32_t short_dim = 0;
+  int64_t pix_count = 0;
   
-  /* If there are constraints, check them */
-  if (status && (pBounds != NULL)) {
+  /* Only check if there are constraints */
+  if (pBounds != NULL) {
     
     /* Figure out long dimension and short dimension */
     if (out_height > out_width) {
@@ -404,157 +1203,1647 @@ int jpegshrink(
         status = 0;
       }
     }
-    
-    /* If failure, set retval to -1 */
-    if (!status) {
-      retval = -1;
-    }
   }
   
-  /* Open the output file */
-  if (status) {
-    pw = sph_jpeg_writer_new(pOut, out_width, out_height, chcount, q);
+  return status;
+}
+
+/*
+ * Compute the largest output dimensions that fit within constraints
+ * while keeping the aspect ratio of the input image.
+ * 
+ * The output is never larger than the input.  The longer dimension of
+ * the output is found by binary search, and the shorter dimension is
+ * derived from it by scaling with rounding, but never less than one.
+ * 
+ * Parameters:
+ * 
+ *   in_width - the input width in pixels
+ * 
+ *   in_height - the input height in pixels
+ * 
+ *   pBounds - the output image constraints, or NULL
+ * 
+ *   pOutWidth - receives the output width
+ * 
+ *   pOutHeight - receives the output height
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if not even a one by one pixel image
+ *   satisfies the constraints
+ */
+static int jpegshrink_fitdims(
+          int32_t             in_width,
+          int32_t             in_height,
+    const JPEGSHRINK_BOUNDS * pBounds,
+          int32_t           * pOutWidth,
+          int32_t           * pOutHeight) {
+  
+  int32_t long_dim = 0;
+  int32_t short_dim = 0;
+  int32_t lo = 0;
+  int32_t hi = 0;
+  int32_t mid = 0;
+  int32_t s = 0;
+  int found = 0;
+  int32_t best_long = 0;
+  int32_t best_short = 0;
+  
+  /* Check parameters */
+  if ((in_width < 1) || (in_width > SPH_JPEG_MAXDIM) ||
+      (in_height < 1) || (in_height > SPH_JPEG_MAXDIM)) {
+    abort();
+  }
+  if ((pOutWidth == NULL) || (pOutHeight == NULL)) {
+    abort();
   }
   
-  /* Allocate input scanline buffer with necessary padding */
-  if (status) {
-    pInScan = (uint8_t *) calloc(
-                            (size_t) (out_width * ((int32_t) sval)),
-                            (size_t) chcount);
-    if (pInScan == NULL) {
-      abort();
-    }
+  /* Figure out long dimension and short dimension */
+  if (in_height > in_width) {
+    long_dim = in_height;
+    short_dim = in_width;
+  } else {
+    long_dim = in_width;
+    short_dim = in_height;
   }
   
-  /* Transfer scanlines with appropriate scaling */
-  if (status && (sval <= 1)) {
-    /* No scaling required, so just copy from input to output */
-    for(y = 0; y < in_height; y++) {
-      
-      /* Read a scanline */
-      if (!sph_jpeg_reader_get(pr, pInScan)) {
-        status = 0;
-      }
-      
-      /* Write a scanline */
-      if (status) {
-        sph_jpeg_writer_put(pw, pInScan);
-      }
-      
-      /* Leave loop if error */
-      if (!status) {
-        break;
-      }
-    }
+  /* Find the largest long dimension that fits; the constraints are
+   * monotonic in the long dimension, so binary search works */
+  lo = 1;
+  hi = long_dim;
+  while (lo <= hi) {
+    mid = lo + ((hi - lo) / 2);
     
-  } else if (status) {
-    /* Scaling required -- allocate an accumulator with 16-bit channels
-     * and an output scanline buffer */
-    pAcc = (uint16_t *) calloc(
-                            (size_t) out_width,
-                            ((size_t) chcount) * sizeof(uint16_t));
-    if (pAcc == NULL) {
-      abort();
+    /* Derive the short dimension, rounding to nearest */
+    s = (int32_t) ((((int64_t) short_dim) * ((int64_t) mid) +
+                      (((int64_t) long_dim) / 2)) /
+                    ((int64_t) long_dim));
+    if (s < 1) {
+      s = 1;
     }
     
-    pOutScan = (uint8_t *) calloc(
-                            (size_t) out_width,
-                            (size_t) chcount);
-    if (pOutScan == NULL) {
-      abort();
+    /* Check constraints with the dimensions in proper orientation */
+    if (in_height > in_width) {
+      found = jpegshrink_inbounds(s, mid, pBounds);
+    } else {
+      found = jpegshrink_inbounds(mid, s, pBounds);
     }
     
-    /* Padded height is the input height plus any necessary padding;
-     * compute this by multiplying the output height by the scaling
-     * factor */
-    pad_height = out_height * ((int32_t) sval);
+    if (found) {
+      best_long = mid;
+      best_short = s;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  
+  /* Fail if nothing fits */
+  if (best_long < 1) {
+    return 0;
+  }
+  
+  /* Return the dimensions in proper orientation */
+  if (in_height > in_width) {
+    *pOutWidth = best_short;
+    *pOutHeight = best_long;
+  } else {
+    *pOutWidth = best_long;
+    *pOutHeight = best_short;
+  }
+  
+  return 1;
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * Compute the horizontal weight tables for area resampling.
+ * 
+ * src is the number of input pixels and dst is the number of output
+ * pixels on the axis, where dst is in range [1, src].
+ * 
+ * In a coordinate space where each input pixel has width dst and each
+ * output pixel has width src, each output pixel covers a span of input
+ * pixels.  The weight of each input pixel in the span is the integer
+ * length of its overlap with the output pixel, so the weights of each
+ * output pixel always sum to src.
+ * 
+ * pSpan must have room for (2 * dst) values.  It receives the index of
+ * the first input pixel and the number of input pixels for each output
+ * pixel.  pWeight must have room for (src + dst) values.  It receives
+ * all the weights, one output pixel after another.
+ * 
+ * Parameters:
+ * 
+ *   src - the input pixel count
+ * 
+ *   dst - the output pixel count
+ * 
+ *   pSpan - receives the span of each output pixel
+ * 
+ *   pWeight - receives the weights
+ */
+static void jpegshrink_fitaxis(
+    int32_t    src,
+    int32_t    dst,
+    int32_t  * pSpan,
+    uint32_t * pWeight) {
+  
+  int32_t x = 0;
+  int32_t i = 0;
+  int64_t lo = 0;
+  int64_t hi = 0;
+  int64_t a = 0;
+  int64_t b = 0;
+  
+  /* Check parameters */
+  if ((src < 1) || (src > SPH_JPEG_MAXDIM) ||
+      (dst < 1) || (dst > src)) {
+    abort();
+  }
+  if ((pSpan == NULL) || (pWeight == NULL)) {
+    abort();
+  }
+  
+  /* Compute the span and weights of each output pixel */
+  for(x = 0; x < dst; x++) {
     
-    /* The amount of padding per scanline is the difference between the
-     * padded input width and the actual input width; compute the padded
-     * input width by multiplying the output width by the scaling
-     * factor */
-    pad_count = (out_width * ((int32_t) sval)) - in_width;
+    /* Output pixel boundaries */
+    lo = ((int64_t) x) * ((int64_t) src);
+    hi = lo + ((int64_t) src);
     
-    /* The amount of samples per output scanline is the output width
-     * multiplied by the channel count */
-    out_samples = out_width * ((int32_t) chcount);
+    /* First input pixel overlapping the output pixel */
+    i = (int32_t) (lo / ((int64_t) dst));
+    pSpan[2 * x] = i;
+    pSpan[2 * x + 1] = 0;
     
-    /* Go through all scanlines in the padded input Y space */
-    for(y = 0; y < pad_height; y++) {
-      
-      /* If we have not exceeded the input dimensions yet, read another
-       * scanline from input to the input scanline buffer and end-pad
-       * scanline by duplication as necessary; otherwise, leave input
-       * scanline buffer as-is so as to duplicate the last scanline in
-       * the image */
-      if (y < in_height) {
-        /* There is an actual input line -- read into input buffer */
-        if (!sph_jpeg_reader_get(pr, pInScan)) {
-          status = 0;
-        }
-        
-        /* Pad scanline as necessary */
-        if (status) {
-          jpegshrink_padscan(pInScan, in_width, pad_count, chcount);
-        }
-      }
-      
-      /* If (y % divisor) is zero, zero out the accumulator */
-      if (status && ((y % sval) == 0)) {
-        for(i = 0; i < out_samples; i++) {
-          pAcc[i] = (uint16_t) 0;
-        }
-      }
-      
-      /* Mix padded input scanline into accumulator */
-      if (status) {
-        jpegshrink_mixscan(pInScan, pAcc, out_width, sval, chcount);
+    /* Add weights for every overlapping input pixel */
+    for( ; i < src; i++) {
+      a = ((int64_t) i) * ((int64_t) dst);
+      if (a >= hi) {
+        break;
       }
-      
-      /* If (y % divisor) is (divisor - 1), copy accumulator to output
-       * buffer (averaging components) and output scanline */
-      if (status && ((y % sval) >= (sval - 1))) {
-        jpegshrink_avgblit(pAcc, pOutScan, out_samples, sval);
-        sph_jpeg_writer_put(pw, pOutScan);
+      b = a + ((int64_t) dst);
+      if (a < lo) {
+        a = lo;
       }
-      
-      /* Leave loop if error */
-      if (!status) {
-        break;
+      if (b > hi) {
+        b = hi;
       }
+      *pWeight = (uint32_t) (b - a);
+      pWeight++;
+      (pSpan[2 * x + 1])++;
     }
   }
+}
+
+/*
+ * Resample an input scanline horizontally with precomputed area
+ * weights.
+ * 
+ * pInScan is the input scanline and pHRow receives (out_width *
+ * chcount) samples.  pSpan and pWeight are the tables computed by
+ * jpegshrink_fitaxis().  Each output sample is the weighted sum of the
+ * input samples in its span, without normalization, so it is at most
+ * 255 times the input width.
+ * 
+ * Parameters:
+ * 
+ *   pInScan - the input scanline
+ * 
+ *   pHRow - receives the resampled scanline
+ * 
+ *   out_width - the output width in pixels
+ * 
+ *   chcount - the number of color channels
+ * 
+ *   pSpan - the span table
+ * 
+ *   pWeight - the weight table
+ */
+static void jpegshrink_hresample(
+    const uint8_t  * pInScan,
+          uint32_t * pHRow,
+          int32_t    out_width,
+          int        chcount,
+    const int32_t  * pSpan,
+    const uint32_t * pWeight) {
   
-  /* If there is an error, get the return value as the error status from
-   * the reader, unless the retval is set to -1; otherwise, leave the
-   * return value set to OK or -1 */
-  if (!status) {
-    if (retval != -1) {
-      retval = sph_jpeg_reader_status(pr);
-    }
-  }
-  
-  /* Free reader and writer if allocated */
-  sph_jpeg_reader_free(pr);
-  sph_jpeg_writer_free(pw);
-  
-  pr = NULL;
-  pw = NULL;
+  int32_t x = 0;
+  int32_t k = 0;
+  int32_t n = 0;
+  const uint8_t *ps = NULL;
+  uint32_t sum = 0;
+  uint32_t sum_g = 0;
+  uint32_t sum_b = 0;
   
-  /* Free buffers if allocated */
-  if (pInScan != NULL) {
-    free(pInScan);
-    pInScan = NULL;
+  /* Check parameters */
+  if ((pInScan == NULL) || (pHRow == NULL) ||
+      (pSpan == NULL) || (pWeight == NULL)) {
+    abort();
   }
-  if (pAcc != NULL) {
-    free(pAcc);
-    pAcc = NULL;
+  if ((out_width < 1) || (out_width > SPH_JPEG_MAXDIM)) {
+    abort();
   }
-  if (pOutScan != NULL) {
-    free(pOutScan);
-    pOutScan = NULL;
+  
+  if (chcount == 1) {
+    /* Grayscale resampling */
+    for(x = 0; x < out_width; x++) {
+      ps = pInScan + pSpan[2 * x];
+      n = pSpan[2 * x + 1];
+      sum = 0;
+      for(k = 0; k < n; k++) {
+        sum += ((uint32_t) ps[k]) * pWeight[k];
+      }
+      pWeight += n;
+      pHRow[x] = sum;
+    }
+    
+  } else if (chcount == 3) {
+    /* RGB resampling */
+    for(x = 0; x < out_width; x++) {
+      ps = pInScan + (((int32_t) 3) * pSpan[2 * x]);
+      n = pSpan[2 * x + 1];
+      sum = 0;
+      sum_g = 0;
+      sum_b = 0;
+      for(k = 0; k < n; k++) {
+        sum += ((uint32_t) ps[0]) * pWeight[k];
+        sum_g += ((uint32_t) ps[1]) * pWeight[k];
+        sum_b += ((uint32_t) ps[2]) * pWeight[k];
+        ps += 3;
+      }
+      pWeight += n;
+      pHRow[0] = sum;
+      pHRow[1] = sum_g;
+      pHRow[2] = sum_b;
+      pHRow += 3;
+    }
+    
+  } else {
+    /* Invalid channel count */
+    abort();
+  }
+}
+
+/*
+ * Open the input file of a crop operation.
+ * 
+ * The header of the input file is read with the reader of the context,
+ * which is allocated if there is none yet.  The crop rectangle is then
+ * clipped to the image, decompression is started with the DCT scaling
+ * denominator denom and the decoder options pOpts, and the clipped
+ * rectangle is cropped out of the scaled image.
+ * 
+ * The scaled rectangle starts at the scaled pixel containing the top
+ * left of the rectangle, and has the dimensions of the rectangle
+ * divided by denom, rounding up.  Since libjpeg rounds scaled image
+ * dimensions up, this always fits within the scaled image.
+ * 
+ * If the reader is in an error state afterwards, or the reader could
+ * not be allocated so that the reader of the context is NULL, the
+ * function still succeeds, and the caller must check the reader.
+ * 
+ * Parameters:
+ * 
+ *   pc - the shrink context
+ * 
+ *   pIn - the input JPEG file
+ * 
+ *   pCrop - the crop rectangle
+ * 
+ *   denom - the DCT scaling denominator
+ * 
+ *   pOpts - the decoder options
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the rectangle does not overlap the
+ *   image
+ */
+static int jpegshrink_cropin(
+          JPEGSHRINK_CTX       * pc,
+          FILE                 * pIn,
+    const JPEGSHRINK_RECT      * pCrop,
+          int                    denom,
+    const SPH_JPEG_READER_OPTS * pOpts) {
+  
+  int status = 1;
+  int32_t full_w = 0;
+  int32_t full_h = 0;
+  int32_t cw = 0;
+  int32_t ch = 0;
+  SPH_JPEG_READER *pr = NULL;
+  
+  /* Check parameters */
+  if ((pc == NULL) || (pIn == NULL) || (pCrop == NULL) ||
+      (pOpts == NULL)) {
+    abort();
+  }
+  if ((denom != 1) && (denom != 2) && (denom != 4) && (denom != 8)) {
+    abort();
+  }
+  
+  /* Read the header, reusing the reader of the context if there is
+   * one */
+  if (pc->pr != NULL) {
+    sph_jpeg_reader_reset_header(pc->pr, pIn);
+  } else {
+    pc->pr = sph_jpeg_reader_new_header(pIn);
+  }
+  pr = pc->pr;
+  
+  /* Clip the rectangle to the full-size image */
+  if ((pr != NULL) && (sph_jpeg_reader_status(pr) == SPH_JPEG_ERR_OK)) {
+    full_w = sph_jpeg_reader_width(pr);
+    full_h = sph_jpeg_reader_height(pr);
+    if ((pCrop->x >= full_w) || (pCrop->y >= full_h)) {
+      status = 0;
+    }
+    if (status) {
+      cw = full_w - pCrop->x;
+      if (cw > pCrop->width) {
+        cw = pCrop->width;
+      }
+      ch = full_h - pCrop->y;
+      if (ch > pCrop->height) {
+        ch = pCrop->height;
+      }
+    }
+  }
+  
+  /* Start decompression, and crop the scaled rectangle unless there is
+   * an error */
+  if (status && (pr != NULL)) {
+    sph_jpeg_reader_set_opts(pr, pOpts);
+    sph_jpeg_reader_scale(pr, denom);
+    if (sph_jpeg_reader_status(pr) == SPH_JPEG_ERR_OK) {
+      sph_jpeg_reader_set_crop(pr,
+        pCrop->x / ((int32_t) denom),
+        pCrop->y / ((int32_t) denom),
+        (cw + ((int32_t) denom) - 1) / ((int32_t) denom),
+        (ch + ((int32_t) denom) - 1) / ((int32_t) denom));
+    }
+  }
+  
+  return status;
+}
+
+/*
+ * Perform a shrink operation, optionally on a crop of the input.
+ * 
+ * This implements jpegshrink_ctx_run() and jpegshrink_ctx_crop().
+ * pCrop is the crop rectangle, or NULL if the whole image is shrunk.
+ * The other parameters are the same as for those functions.
+ * 
+ * Parameters:
+ * 
+ *   pc - the shrink context
+ * 
+ *   pIn - the input JPEG file
+ * 
+ *   pOut - the output JPEG file
+ * 
+ *   pCrop - the crop rectangle, or NULL
+ * 
+ *   sval - the scaling value
+ * 
+ *   q - the compression quality
+ * 
+ *   pBounds - the output image constraints, or NULL
+ * 
+ * Return:
+ * 
+ *   SPH_JPEG_ERR_OK (0) if successful, otherwise a sophistry_jpeg error
+ *   code, or -1 if the crop is outside the image or the output
+ *   constraints are not satisfied
+ */
+static int jpegshrink_run(
+          JPEGSHRINK_CTX    * pc,
+          FILE              * pIn,
+          FILE              * pOut,
+    const JPEGSHRINK_RECT   * pCrop,
+          int                 sval,
+          int                 q,
+    const JPEGSHRINK_BOUNDS * pBounds) {
+  
+  int status = 1;
+  int retval = SPH_JPEG_ERR_OK;
+  int denom = 0;
+  int bval = 0;
+  
+  int32_t in_width = 0;
+  int32_t in_height = 0;
+  int chcount = 0;
+  int32_t out_width = 0;
+  int32_t out_height = 0;
+  int32_t out_samples = 0;
+  int32_t pad_height = 0;
+  int32_t pad_count = 0;
+  
+  int32_t y = 0;
+  int32_t i = 0;
+  
+  SPH_JPEG_READER *pr = NULL;
+  SPH_JPEG_WRITER *pw = NULL;
+  SPH_JPEG_READER_OPTS ropts;
+  
+  uint8_t *pInScan = NULL;
+  uint16_t *pAcc = NULL;
+  uint32_t *pWideAcc = NULL;
+  uint8_t *pOutScan = NULL;
+  JPEGSHRINK_MIXFN fMix = NULL;
+  JPEGSHRINK_BLITFN fBlit = NULL;
+  
+  /* Initialize structures */
+  memset(&ropts, 0, sizeof(SPH_JPEG_READER_OPTS));
+  
+  /* Check parameters */
+  if ((pc == NULL) || (pIn == NULL) || (pOut == NULL)) {
+    abort();
+  }
+  if ((sval < 1) || (sval > JPEGSHRINK_MAXSHRINK)) {
+    abort();
+  }
+  if (pCrop != NULL) {
+    if ((pCrop->x < 0) || (pCrop->y < 0) ||
+        (pCrop->width < 1) || (pCrop->height < 1)) {
+      abort();
+    }
+  }
+
+  /* Time the whole operation */
+  JPEGSHRINK_STAT_MARK(pc, op_mark);
+  
+  /* Split the scaling value into a DCT scaling part performed by the
+   * decoder and a remaining box filter part */
+  denom = jpegshrink_dctscale(sval);
+  bval = sval / denom;
+
+  /* Open the input file, scaling during decompression, and reusing
+   * the reader of the context if there is one; if there is a crop
+   * rectangle, it is cropped out of the scaled image */
+  jpegshrink_readopts(pc, (sval >= 2), &ropts);
+  if (pCrop != NULL) {
+    if (!jpegshrink_cropin(pc, pIn, pCrop, denom, &ropts)) {
+      status = 0;
+      retval = -1;
+    }
+  } else if (pc->pr != NULL) {
+    sph_jpeg_reader_set_opts(pc->pr, &ropts);
+    sph_jpeg_reader_reset_scaled(pc->pr, pIn, denom);
+  } else {
+    pc->pr = sph_jpeg_reader_new_ex(pIn, denom, &ropts);
+  }
+  pr = pc->pr;
+  if (status && (pr == NULL)) {
+    status = 0;
+    retval = SPH_JPEG_ERR_MEM;
+  }
+  if (status && (sph_jpeg_reader_status(pr) != SPH_JPEG_ERR_OK)) {
+    status = 0;
+  }
+  
+  /* Get the width, height, and channel count */
+  if (status) {
+    in_width = sph_jpeg_reader_width(pr);
+    in_height = sph_jpeg_reader_height(pr);
+    chcount = sph_jpeg_reader_channels(pr);
+  }
+  
+  /* Determine output width and height */
+  if (status && (bval <= 1)) {
+    /* No box filtering, so output dimensions equal to (scaled) input */
+    out_width = in_width;
+    out_height = in_height;
+    
+  } else if (status) {
+    /* Box filtering, so first divide by box filter value */
+    out_width = in_width / ((int32_t) bval);
+    out_height = in_height / ((int32_t) bval);
+    
+    /* Next, if input padding required, increment corresponding
+     * dimensions */
+    if ((in_width % bval) != 0) {
+      out_width++;
+    }
+    if ((in_height % bval) != 0) {
+      out_height++;
+    }
+  }
+  
+  /* If there are constraints, check them, and set retval to -1 if
+   * they are not satisfied */
+  if (status) {
+    if (!jpegshrink_inbounds(out_width, out_height, pBounds)) {
+      status = 0;
+      retval = -1;
+    }
+  }
+  
+  /* Open the output file */
+  if (status) {
+    retval = jpegshrink_openout(
+              pc, &(pc->pw), pOut, out_width, out_height, chcount, q);
+    if (retval != SPH_JPEG_ERR_OK) {
+      status = 0;
+    }
+  }
+  pw = pc->pw;
+  
+  /* Reserve input scanline buffer with necessary padding; when there
+   * is no box filtering, the buffer instead holds a batch of rows */
+  if (status && (bval <= 1)) {
+    pc->pInScan = (uint8_t *) jpegshrink_reserve(
+                    pc->pInScan, &(pc->in_cap),
+                    ((size_t) (out_width * JPEGSHRINK_COPYROWS)) *
+                      ((size_t) chcount));
+    pInScan = pc->pInScan;
+    
+  } else if (status) {
+    pc->pInScan = (uint8_t *) jpegshrink_reserve(
+                    pc->pInScan, &(pc->in_cap),
+                    ((size_t) (out_width * ((int32_t) bval))) *
+                      ((size_t) chcount));
+    pInScan = pc->pInScan;
+  }
+  if (status && (pInScan == NULL)) {
+    status = 0;
+    retval = SPH_JPEG_ERR_MEM;
+  }
+  
+  /* Transfer scanlines with appropriate scaling */
+  if (status && (bval <= 1)) {
+    /* No box filtering required, so just copy from the (possibly
+     * DCT-scaled) input to output in batches of rows */
+    out_samples = out_width * ((int32_t) chcount);
+    for(y = 0; y < in_height; y += i) {
+      
+      /* Read a batch of scanlines */
+      i = jpegshrink_getrows(
+            pc, pInScan, (size_t) out_samples, JPEGSHRINK_COPYROWS);
+      if (i < 1) {
+        status = 0;
+      }
+      
+      /* Write the batch of scanlines */
+      if (status) {
+        sph_jpeg_writer_put_rows(pw, pInScan, (size_t) out_samples, i);
+        if (sph_jpeg_writer_status(pw) != SPH_JPEG_ERR_OK) {
+          status = 0;
+        }
+      }
+      
+      /* Leave loop if error */
+      if (!status) {
+        break;
+      }
+    }
+    
+  } else if (status) {
+    /* Scaling required -- reserve an accumulator with 16-bit channels,
+     * or 32-bit channels for large box filters, and an output scanline
+     * buffer */
+    if (bval <= JPEGSHRINK_MAXBOX16) {
+      pc->pAcc = (uint16_t *) jpegshrink_reserve(
+                    pc->pAcc, &(pc->acc_cap),
+                    ((size_t) out_width) * ((size_t) chcount) *
+                      sizeof(uint16_t));
+      pAcc = pc->pAcc;
+      jpegshrink_kernels(bval, chcount, &fMix, &fBlit);
+    } else {
+      pc->pWideAcc = (uint32_t *) jpegshrink_reserve(
+                        pc->pWideAcc, &(pc->wide_cap),
+                        ((size_t) out_width) * ((size_t) chcount) *
+                          sizeof(uint32_t));
+      pWideAcc = pc->pWideAcc;
+    }
+    
+    pc->pOutScan = (uint8_t *) jpegshrink_reserve(
+                      pc->pOutScan, &(pc->out_cap),
+                      ((size_t) out_width) * ((size_t) chcount));
+    pOutScan = pc->pOutScan;
+    
+    if (((pAcc == NULL) && (pWideAcc == NULL)) || (pOutScan == NULL)) {
+      status = 0;
+      retval = SPH_JPEG_ERR_MEM;
+    }
+    
+    /* Padded height is the input height plus any necessary padding;
+     * compute this by multiplying the output height by the scaling
+     * factor */
+    pad_height = out_height * ((int32_t) bval);
+    
+    /* The amount of padding per scanline is the difference between the
+     * padded input width and the actual input width; compute the padded
+     * input width by multiplying the output width by the scaling
+     * factor */
+    pad_count = (out_width * ((int32_t) bval)) - in_width;
+    
+    /* The amount of samples per output scanline is the output width
+     * multiplied by the channel count */
+    out_samples = out_width * ((int32_t) chcount);
+    
+    /* Go through all scanlines in the padded input Y space */
+    for(y = 0; status && (y < pad_height); y++) {
+      
+      /* If we have not exceeded the input dimensions yet, read another
+       * scanline from input to the input scanline buffer and end-pad
+       * scanline by duplication as necessary; otherwise, leave input
+       * scanline buffer as-is so as to duplicate the last scanline in
+       * the image */
+      if (y < in_height) {
+        /* There is an actual input line -- read into input buffer */
+        if (jpegshrink_getrows(pc, pInScan,
+              ((size_t) in_width) * ((size_t) chcount), 1) < 1) {
+          status = 0;
+        }
+        
+        /* Pad scanline as necessary */
+        if (status) {
+          jpegshrink_padscan(pInScan, in_width, pad_count, chcount);
+        }
+      }
+      
+      /* If (y % divisor) is zero, zero out the accumulator */
+      if (status && ((y % bval) == 0)) {
+        if (pAcc != NULL) {
+          for(i = 0; i < out_samples; i++) {
+            pAcc[i] = (uint16_t) 0;
+          }
+        } else {
+          for(i = 0; i < out_samples; i++) {
+            pWideAcc[i] = 0;
+          }
+        }
+      }
+      
+      /* Mix padded input scanline into accumulator */
+      if (status && (pAcc != NULL)) {
+        (*fMix)(pInScan, pAcc, out_width);
+      } else if (status) {
+        jpegshrink_mixscan32(
+          pInScan, pWideAcc, out_width, bval, chcount);
+      }
+      
+      /* If (y % divisor) is (divisor - 1), copy accumulator to output
+       * buffer (averaging components) and output scanline */
+      if (status && ((y % bval) >= (bval - 1))) {
+        if (pAcc != NULL) {
+          (*fBlit)(pAcc, pOutScan, out_samples);
+        } else {
+          jpegshrink_avgblit32(pWideAcc, pOutScan, out_samples, bval);
+        }
+        sph_jpeg_writer_put(pw, pOutScan);
+        if (sph_jpeg_writer_status(pw) != SPH_JPEG_ERR_OK) {
+          status = 0;
+        }
+      }
+      
+      /* Leave loop if error */
+      if (!status) {
+        break;
+      }
+    }
+  }
+  
+  /* If there is an error, get the return value as the error status from
+   * the reader, or else the writer, unless the retval is already set;
+   * otherwise, leave the return value set to OK or -1 */
+  if (!status) {
+    if (retval == SPH_JPEG_ERR_OK) {
+      retval = sph_jpeg_reader_status(pr);
+    }
+    if ((retval == SPH_JPEG_ERR_OK) && (pw != NULL)) {
+      retval = sph_jpeg_writer_status(pw);
+    }
+  }
+  
+  /* The reader, writer, and buffers stay in the context for reuse */
+  pr = NULL;
+  pw = NULL;
+  pInScan = NULL;
+  pAcc = NULL;
+  pWideAcc = NULL;
+  pOutScan = NULL;
+  
+  /* Finish timing the operation */
+  JPEGSHRINK_STAT_TIME(pc, op_mark, total_ns);
+#ifdef SPH_JPEG_ENABLE_STATS
+  (pc->ops)++;
+#endif
+  
+  /* Return retval */
+  return retval;
+}
+
+/*
+ * Public function implementations
+ * ===============================
+ * 
+ * See the header for specifications.
+ */
+
+/*
+ * jpegshrink_ctx_new function.
+ */
+JPEGSHRINK_CTX *jpegshrink_ctx_new(void) {
+  
+  JPEGSHRINK_CTX *pc = NULL;
+  
+  /* Allocate the context with everything unallocated */
+  pc = (JPEGSHRINK_CTX *) calloc(1, sizeof(JPEGSHRINK_CTX));
+  if (pc == NULL) {
+    return NULL;
+  }
+  pc->pr = NULL;
+  pc->pw = NULL;
+  pc->pInScan = NULL;
+  pc->in_cap = 0;
+  pc->pAcc = NULL;
+  pc->acc_cap = 0;
+  pc->pWideAcc = NULL;
+  pc->wide_cap = 0;
+  pc->pOutScan = NULL;
+  pc->out_cap = 0;
+  pc->pHRow = NULL;
+  pc->h_cap = 0;
+  pc->pVAcc = NULL;
+  pc->v_cap = 0;
+  pc->pXSpan = NULL;
+  pc->span_cap = 0;
+  pc->pXWeight = NULL;
+  pc->weight_cap = 0;
+  pc->accurate = 0;
+  pc->gray = 0;
+  pc->fSource = NULL;
+  pc->pSourceCustom = NULL;
+  pc->pStages = NULL;
+#ifdef SPH_JPEG_ENABLE_STATS
+  pc->ops = 0;
+  pc->total_ns = 0;
+  pc->input_ns = 0;
+  pc->op_mark = 0;
+  pc->in_mark = 0;
+#endif
+  
+  return pc;
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * jpegshrink_ctx_free function.
+ */
+void jpegshrink_ctx_free(JPEGSHRINK_CTX *pc) {
+  
+  int i = 0;
+  
+  /* Only proceed if non-NULL passed */
+  if (pc != NULL) {
+    
+    /* Free reader and writer if allocated */
+    sph_jpeg_reader_free(pc->pr);
+    sph_jpeg_writer_free(pc->pw);
+    pc->pr = NULL;
+    pc->pw = NULL;
+    
+    /* Free buffers if allocated */
+    free(pc->pInScan);
+    free(pc->pAcc);
+    free(pc->pWideAcc);
+    free(pc->pOutScan);
+    free(pc->pHRow);
+    free(pc->pVAcc);
+    free(pc->pXSpan);
+    free(pc->pXWeight);
+    pc->pInScan = NULL;
+    pc->pAcc = NULL;
+    pc->pWideAcc = NULL;
+    pc->pOutScan = NULL;
+    pc->pHRow = NULL;
+    pc->pVAcc = NULL;
+    pc->pXSpan = NULL;
+    pc->pXWeight = NULL;
+    
+    /* Free the target states if allocated */
+    if (pc->pStages != NULL) {
+      for(i = 0; i < JPEGSHRINK_MAXTARGETS; i++) {
+        sph_jpeg_writer_free((pc->pStages)[i].pw);
+        free((pc->pStages)[i].pAcc);
+        free((pc->pStages)[i].pWideAcc);
+        free((pc->pStages)[i].pOutScan);
+      }
+      free(pc->pStages);
+      pc->pStages = NULL;
+    }
+    
+    /* Free the structure */
+    free(pc);
+  }
+}
+
+/*
+ * jpegshrink_ctx_accurate function.
+ */
+void jpegshrink_ctx_accurate(JPEGSHRINK_CTX *pc, int accurate) {
+  
+  /* Check parameter */
+  if (pc == NULL) {
+    abort();
+  }
+  
+  /* Store the setting */
+  if (accurate) {
+    pc->accurate = 1;
+  } else {
+    pc->accurate = 0;
+  }
+}
+
+/*
+ * jpegshrink_ctx_gray function.
+ */
+void jpegshrink_ctx_gray(JPEGSHRINK_CTX *pc, int gray) {
+  
+  /* Check parameter */
+  if (pc == NULL) {
+    abort();
+  }
+  
+  /* Store the setting */
+  if (gray) {
+    pc->gray = 1;
+  } else {
+    pc->gray = 0;
+  }
+}
+
+/*
+ * jpegshrink_ctx_source function.
+ */
+void jpegshrink_ctx_source(
+    JPEGSHRINK_CTX    * pc,
+    JPEGSHRINK_SOURCE   fSource,
+    void              * pCustom) {
+  
+  /* Check parameter */
+  if (pc == NULL) {
+    abort();
+  }
+  
+  /* Store the callback */
+  pc->fSource = fSource;
+  if (fSource != NULL) {
+    pc->pSourceCustom = pCustom;
+  } else {
+    pc->pSourceCustom = NULL;
+  }
+}
+
+/*
+ * jpegshrink_ctx_stats function.
+ */
+int jpegshrink_ctx_stats(JPEGSHRINK_CTX *pc, JPEGSHRINK_STATS *pStats) {
+  
+  int result = 0;
+  int i = 0;
+  SPH_JPEG_STATS st;
+  
+  /* Initialize structures */
+  memset(&st, 0, sizeof(SPH_JPEG_STATS));
+  
+  /* Check parameters */
+  if ((pc == NULL) || (pStats == NULL)) {
+    abort();
+  }
+  memset(pStats, 0, sizeof(JPEGSHRINK_STATS));
+  
+  /* Get the counters of the reader and the sum over all the writers */
+  if (pc->pr != NULL) {
+    result = sph_jpeg_reader_stats(pc->pr, &(pStats->read));
+  }
+  if (pc->pw != NULL) {
+    result = sph_jpeg_writer_stats(pc->pw, &st);
+    jpegshrink_addstats(&(pStats->write), &st);
+  }
+  if (pc->pStages != NULL) {
+    for(i = 0; i < JPEGSHRINK_MAXTARGETS; i++) {
+      if ((pc->pStages)[i].pw != NULL) {
+        result = sph_jpeg_writer_stats((pc->pStages)[i].pw, &st);
+        jpegshrink_addstats(&(pStats->write), &st);
+      }
+    }
+  }
+  
+  /* Add the counters of the context, with the filter time being
+   * whatever is left of the operations after getting scanlines,
+   * setting up the reader, and writing */
+#ifdef SPH_JPEG_ENABLE_STATS
+  pStats->ops = pc->ops;
+  pStats->total_ns = pc->total_ns;
+  pStats->input_ns = pc->input_ns;
+  pStats->filter_ns = pc->total_ns - pc->input_ns -
+                        (pStats->read).setup_ns -
+                        (pStats->write).setup_ns -
+                        (pStats->write).scan_ns -
+                        (pStats->write).finish_ns;
+  if (pStats->filter_ns < 0) {
+    pStats->filter_ns = 0;
+  }
+  result = 1;
+#endif
+  
+  return result;
+}
+
+/*
+ * jpegshrink function.
+ */
+int jpegshrink(
+          FILE              * pIn,
+          FILE              * pOut,
+          int                 sval,
+          int                 q,
+    const JPEGSHRINK_BOUNDS * pBounds) {
+  
+  int retval = SPH_JPEG_ERR_OK;
+  JPEGSHRINK_CTX *pc = NULL;
+  
+  /* Perform the operation with a temporary context */
+  pc = jpegshrink_ctx_new();
+  if (pc != NULL) {
+    retval = jpegshrink_ctx_run(pc, pIn, pOut, sval, q, pBounds);
+  } else {
+    retval = SPH_JPEG_ERR_MEM;
+  }
+  jpegshrink_ctx_free(pc);
+  pc = NULL;
+  
+  return retval;
+}
+
+/*
+ * jpegshrink_ctx_run function.
+ */
+int jpegshrink_ctx_run(
+          JPEGSHRINK_CTX    * pc,
+          FILE              * pIn,
+          FILE              * pOut,
+          int                 sval,
+          int                 q,
+    const JPEGSHRINK_BOUNDS * pBounds) {
+  return jpegshrink_run(pc, pIn, pOut, NULL, sval, q, pBounds);
+}
+
+/*
+ * jpegshrink_crop function.
+ */
+int jpegshrink_crop(
+          FILE              * pIn,
+          FILE              * pOut,
+    const JPEGSHRINK_RECT   * pCrop,
+          int                 sval,
+          int                 q,
+    const JPEGSHRINK_BOUNDS * pBounds) {
+  
+  int retval = SPH_JPEG_ERR_OK;
+  JPEGSHRINK_CTX *pc = NULL;
+  
+  /* Perform the operation with a temporary context */
+  pc = jpegshrink_ctx_new();
+  if (pc != NULL) {
+    retval = jpegshrink_ctx_crop(
+              pc, pIn, pOut, pCrop, sval, q, pBounds);
+  } else {
+    retval = SPH_JPEG_ERR_MEM;
+  }
+  jpegshrink_ctx_free(pc);
+  pc = NULL;
+  
+  return retval;
+}
+
+/*
+ * jpegshrink_ctx_crop function.
+ */
+int jpegshrink_ctx_crop(
+          JPEGSHRINK_CTX    * pc,
+          FILE              * pIn,
+          FILE              * pOut,
+    const JPEGSHRINK_RECT   * pCrop,
+          int                 sval,
+          int                 q,
+    const JPEGSHRINK_BOUNDS * pBounds) {
+  
+  /* Check parameters */
+  if (pCrop == NULL) {
+    abort();
+  }
+  
+  return jpegshrink_run(pc, pIn, pOut, pCrop, sval, q, pBounds);
+}
+
+/*
+ * jpegshrink_fit function.
+ */
+int jpegshrink_fit(
+          FILE              * pIn,
+          FILE              * pOut,
+          int                 q,
+    const JPEGSHRINK_BOUNDS * pBounds) {
+  
+  int retval = SPH_JPEG_ERR_OK;
+  JPEGSHRINK_CTX *pc = NULL;
+  
+  /* Perform the operation with a temporary context */
+  pc = jpegshrink_ctx_new();
+  if (pc != NULL) {
+    retval = jpegshrink_ctx_fit(pc, pIn, pOut, q, pBounds);
+  } else {
+    retval = SPH_JPEG_ERR_MEM;
+  }
+  jpegshrink_ctx_free(pc);
+  pc = NULL;
+  
+  return retval;
+}
+
+/*
+ * jpegshrink_ctx_fit function.
+ */
+int jpegshrink_ctx_fit(
+          JPEGSHRINK_CTX    * pc,
+          FILE              * pIn,
+          FILE              * pOut,
+          int                 q,
+    const JPEGSHRINK_BOUNDS * pBounds) {
+  
+  int status = 1;
+  int retval = SPH_JPEG_ERR_OK;
+  int denom = 0;
+  
+  int32_t in_width = 0;
+  int32_t in_height = 0;
+  int chcount = 0;
+  int32_t out_width = 0;
+  int32_t out_height = 0;
+  int32_t out_samples = 0;
+  int32_t in_samples = 0;
+  
+  int32_t y = 0;
+  int32_t oy = 0;
+  int32_t i = 0;
+  int64_t lo = 0;
+  int64_t hi = 0;
+  int64_t seg = 0;
+  uint32_t wgt = 0;
+  uint64_t norm = 0;
+  
+  SPH_JPEG_READER *pr = NULL;
+  SPH_JPEG_WRITER *pw = NULL;
+  SPH_JPEG_READER_OPTS ropts;
+  
+  /* Initialize structures */
+  memset(&ropts, 0, sizeof(SPH_JPEG_READER_OPTS));
+  
+  /* Check parameters */
+  if ((pc == NULL) || (pIn == NULL) || (pOut == NULL)) {
+    abort();
+  }
+  
+  /* Time the whole operation */
+  JPEGSHRINK_STAT_MARK(pc, op_mark);
+  
+  /* Read just the header, reusing the reader of the context if there
+   * is one */
+  if (pc->pr != NULL) {
+    sph_jpeg_reader_reset_header(pc->pr, pIn);
+  } else {
+    pc->pr = sph_jpeg_reader_new_header(pIn);
+  }
+  pr = pc->pr;
+  if (pr == NULL) {
+    status = 0;
+    retval = SPH_JPEG_ERR_MEM;
+  }
+  if (status && (sph_jpeg_reader_status(pr) != SPH_JPEG_ERR_OK)) {
+    status = 0;
+  }
+  
+  /* Compute the output dimensions from the full image dimensions */
+  if (status) {
+    if (!jpegshrink_fitdims(
+          sph_jpeg_reader_width(pr), sph_jpeg_reader_height(pr),
+          pBounds, &out_width, &out_height)) {
+      status = 0;
+      retval = -1;
+    }
+  }
+  
+  /* Choose the largest DCT scaling denominator that keeps the scaled
+   * image at least as large as the output; libjpeg rounds scaled
+   * dimensions up */
+  if (status) {
+    in_width = sph_jpeg_reader_width(pr);
+    in_height = sph_jpeg_reader_height(pr);
+    for(denom = 8; denom > 1; denom /= 2) {
+      if (((in_width + denom - 1) / denom >= out_width) &&
+          ((in_height + denom - 1) / denom >= out_height)) {
+        break;
+      }
+    }
+  }
+  
+  /* Start decompression, with the fast decoder options if the image
+   * is reduced by at least two */
+  if (status) {
+    jpegshrink_readopts(
+      pc,
+      ((in_width >= 2 * out_width) && (in_height >= 2 * out_height)),
+      &ropts);
+    sph_jpeg_reader_set_opts(pr, &ropts);
+    sph_jpeg_reader_scale(pr, denom);
+    if (sph_jpeg_reader_status(pr) != SPH_JPEG_ERR_OK) {
+      status = 0;
+    }
+  }
+  
+  /* Get the scaled input dimensions */
+  if (status) {
+    in_width = sph_jpeg_reader_width(pr);
+    in_height = sph_jpeg_reader_height(pr);
+    chcount = sph_jpeg_reader_channels(pr);
+    
+    /* The DCT scaling choice guarantees this, but check anyway */
+    if ((in_width < out_width) || (in_height < out_height)) {
+      abort();
+    }
+  }
+  
+  /* Open the output file */
+  if (status) {
+    retval = jpegshrink_openout(
+              pc, &(pc->pw), pOut, out_width, out_height, chcount, q);
+    if (retval != SPH_JPEG_ERR_OK) {
+      status = 0;
+    }
+  }
+  pw = pc->pw;
+  
+  /* Reserve buffers and compute the horizontal weight tables */
+  if (status) {
+    in_samples = in_width * ((int32_t) chcount);
+    out_samples = out_width * ((int32_t) chcount);
+    
+    pc->pInScan = (uint8_t *) jpegshrink_reserve(
+                    pc->pInScan, &(pc->in_cap), (size_t) in_samples);
+    pc->pOutScan = (uint8_t *) jpegshrink_reserve(
+                    pc->pOutScan, &(pc->out_cap), (size_t) out_samples);
+    pc->pHRow = (uint32_t *) jpegshrink_reserve(
+                  pc->pHRow, &(pc->h_cap),
+                  ((size_t) out_samples) * sizeof(uint32_t));
+    pc->pVAcc = (uint64_t *) jpegshrink_reserve(
+                  pc->pVAcc, &(pc->v_cap),
+                  ((size_t) out_samples) * sizeof(uint64_t));
+    pc->pXSpan = (int32_t *) jpegshrink_reserve(
+                  pc->pXSpan, &(pc->span_cap),
+                  ((size_t) out_width) * 2 * sizeof(int32_t));
+    pc->pXWeight = (uint32_t *) jpegshrink_reserve(
+                    pc->pXWeight, &(pc->weight_cap),
+                    ((size_t) (in_width + out_width)) *
+                      sizeof(uint32_t));
+    
+    if ((pc->pInScan == NULL) || (pc->pOutScan == NULL) ||
+        (pc->pHRow == NULL) || (pc->pVAcc == NULL) ||
+        (pc->pXSpan == NULL) || (pc->pXWeight == NULL)) {
+      status = 0;
+      retval = SPH_JPEG_ERR_MEM;
+    }
+  }
+  
+  /* Compute the horizontal weight tables */
+  if (status) {
+    jpegshrink_fitaxis(in_width, out_width, pc->pXSpan, pc->pXWeight);
+    memset(pc->pVAcc, 0, ((size_t) out_samples) * sizeof(uint64_t));
+  }
+  
+  /* Each output sample is normalized by the total weight of its area,
+   * which is the input width times the input height */
+  norm = ((uint64_t) in_width) * ((uint64_t) in_height);
+  
+  /* Stream through the input scanlines; in a vertical coordinate space
+   * where each input row has height out_height and each output row has
+   * height in_height, each input row overlaps either one output row or
+   * the end of one and the start of the next */
+  for(y = 0; status && (y < in_height); y++) {
+    
+    /* Read the scanline and resample it horizontally */
+    if (jpegshrink_getrows(
+          pc, pc->pInScan, (size_t) in_samples, 1) < 1) {
+      status = 0;
+      break;
+    }
+    jpegshrink_hresample(
+      pc->pInScan, pc->pHRow, out_width, chcount,
+      pc->pXSpan, pc->pXWeight);
+    
+    /* Add the row to each output row it overlaps */
+    lo = ((int64_t) y) * ((int64_t) out_height);
+    hi = lo + ((int64_t) out_height);
+    while (lo < hi) {
+      
+      /* The part of this input row within the current output row */
+      seg = ((int64_t) (oy + 1)) * ((int64_t) in_height);
+      if (seg > hi) {
+        seg = hi;
+      }
+      wgt = (uint32_t) (seg - lo);
+      lo = seg;
+      
+      /* Accumulate */
+      for(i = 0; i < out_samples; i++) {
+        pc->pVAcc[i] += ((uint64_t) pc->pHRow[i]) * ((uint64_t) wgt);
+      }
+      
+      /* If the output row is complete, normalize and write it */
+      if (seg >= ((int64_t) (oy + 1)) * ((int64_t) in_height)) {
+        for(i = 0; i < out_samples; i++) {
+          pc->pOutScan[i] = (uint8_t)
+                              ((pc->pVAcc[i] + (norm / 2)) / norm);
+          pc->pVAcc[i] = 0;
+        }
+        sph_jpeg_writer_put(pw, pc->pOutScan);
+        oy++;
+      }
+    }
+    
+    /* Stop if the output can't be written */
+    if (sph_jpeg_writer_status(pw) != SPH_JPEG_ERR_OK) {
+      status = 0;
+    }
+  }
+  
+  /* If there is an error, get the return value as the error status from
+   * the reader, or else the writer, unless the retval is already set */
+  if (!status) {
+    if (retval == SPH_JPEG_ERR_OK) {
+      retval = sph_jpeg_reader_status(pr);
+    }
+    if ((retval == SPH_JPEG_ERR_OK) && (pw != NULL)) {
+      retval = sph_jpeg_writer_status(pw);
+    }
+  }
+  
+  /* The reader, writer, and buffers stay in the context for reuse */
+  pr = NULL;
+  pw = NULL;
+  
+  /* Finish timing the operation */
+  JPEGSHRINK_STAT_TIME(pc, op_mark, total_ns);
+#ifdef SPH_JPEG_ENABLE_STATS
+  (pc->ops)++;
+#endif
+  
+  /* Return retval */
+  return retval;
+}
+
+/*
+ * jpegshrink_multi function.
+ */
+int jpegshrink_multi(
+    FILE              * pIn,
+    JPEGSHRINK_TARGET * pTargets,
+    int                 count) {
+  
+  int retval = SPH_JPEG_ERR_OK;
+  int t = 0;
+  JPEGSHRINK_CTX *pc = NULL;
+  
+  /* Check parameters */
+  if ((pTargets == NULL) ||
+      (count < 1) || (count > JPEGSHRINK_MAXTARGETS)) {
+    abort();
+  }
+  
+  /* Perform the operation with a temporary context, or else report
+   * the allocation failure in every target */
+  pc = jpegshrink_ctx_new();
+  if (pc != NULL) {
+    retval = jpegshrink_ctx_multi(pc, pIn, pTargets, count);
+  } else {
+    retval = SPH_JPEG_ERR_MEM;
+    for(t = 0; t < count; t++) {
+      pTargets[t].result = retval;
+    }
+  }
+  jpegshrink_ctx_free(pc);
+  pc = NULL;
+  
+  return retval;
+}
+
+/*
+ * jpegshrink_ctx_multi function.
+ */
+int jpegshrink_ctx_multi(
+    JPEGSHRINK_CTX    * pc,
+    FILE              * pIn,
+    JPEGSHRINK_TARGET * pTargets,
+    int                 count) {
+  
+  int status = 1;
+  int retval = SPH_JPEG_ERR_OK;
+  int skipped = 0;
+  int reduce = 1;
+  int denom = 8;
+  int d = 0;
+  int t = 0;
+  
+  int32_t in_width = 0;
+  int32_t in_height = 0;
+  int chcount = 0;
+  int32_t out_height = 0;
+  int32_t pad_count = 0;
+  int32_t max_pad = 0;
+  int32_t max_height = 0;
+  size_t stride = 0;
+  
+  int32_t y = 0;
+  int32_t n = 0;
+  int32_t i = 0;
+  
+  SPH_JPEG_READER *pr = NULL;
+  SPH_JPEG_READER_OPTS ropts;
+  JPEGSHRINK_STAGE *ps = NULL;
+  JPEGSHRINK_TARGET *pt = NULL;
+  
+  uint8_t *pInScan = NULL;
+  const uint8_t *pLast = NULL;
+  
+  /* Initialize structures */
+  memset(&ropts, 0, sizeof(SPH_JPEG_READER_OPTS));
+  
+  /* Check parameters */
+  if ((pc == NULL) || (pIn == NULL) || (pTargets == NULL)) {
+    abort();
+  }
+  if ((count < 1) || (count > JPEGSHRINK_MAXTARGETS)) {
+    abort();
+  }
+  for(t = 0; t < count; t++) {
+    pt = &(pTargets[t]);
+    if (pt->pOut == NULL) {
+      abort();
+    }
+    if ((pt->sval < 1) || (pt->sval > JPEGSHRINK_MAXSHRINK)) {
+      abort();
+    }
+    pt->result = SPH_JPEG_ERR_OK;
+  }
+  
+  /* Time the whole operation */
+  JPEGSHRINK_STAT_MARK(pc, op_mark);
+  
+  /* Allocate the target states the first time */
+  if (pc->pStages == NULL) {
+    pc->pStages = (JPEGSHRINK_STAGE *) calloc(
+                    (size_t) JPEGSHRINK_MAXTARGETS,
+                    sizeof(JPEGSHRINK_STAGE));
+    if (pc->pStages != NULL) {
+      for(t = 0; t < JPEGSHRINK_MAXTARGETS; t++) {
+        ps = &((pc->pStages)[t]);
+        ps->pw = NULL;
+        ps->pAcc = NULL;
+        ps->acc_cap = 0;
+        ps->pWideAcc = NULL;
+        ps->wide_cap = 0;
+        ps->pOutScan = NULL;
+        ps->out_cap = 0;
+      }
+    } else {
+      status = 0;
+      retval = SPH_JPEG_ERR_MEM;
+    }
+  }
+  
+  /* Decode with the largest DCT scaling denominator that all the
+   * scaling values share, and only use the fast decoder options if
+   * every target is a reduction */
+  for(t = 0; t < count; t++) {
+    d = jpegshrink_dctscale(pTargets[t].sval);
+    if (d < denom) {
+      denom = d;
+    }
+    if (pTargets[t].sval < 2) {
+      reduce = 0;
+    }
+  }
+  
+  /* Open the input file, reusing the reader of the context if there is
+   * one */
+  jpegshrink_readopts(pc, reduce, &ropts);
+  if (status && (pc->pr != NULL)) {
+    sph_jpeg_reader_set_opts(pc->pr, &ropts);
+    sph_jpeg_reader_reset_scaled(pc->pr, pIn, denom);
+  } else if (status) {
+    pc->pr = sph_jpeg_reader_new_ex(pIn, denom, &ropts);
+  }
+  pr = pc->pr;
+  if (status && (pr == NULL)) {
+    status = 0;
+    retval = SPH_JPEG_ERR_MEM;
+  }
+  if (status && (sph_jpeg_reader_status(pr) != SPH_JPEG_ERR_OK)) {
+    status = 0;
+  }
+  
+  /* Get the width, height, and channel count */
+  if (status) {
+    in_width = sph_jpeg_reader_width(pr);
+    in_height = sph_jpeg_reader_height(pr);
+    chcount = sph_jpeg_reader_channels(pr);
+  }
+  
+  /* Set up each target, in the same way as a single-output shrink
+   * operation, skipping targets whose constraints are not satisfied */
+  for(t = 0; status && (t < count); t++) {
+    pt = &(pTargets[t]);
+    ps = &((pc->pStages)[t]);
+    
+    /* Determine the box filter size and the output dimensions */
+    ps->bval = pt->sval / denom;
+    ps->out_width = in_width / ((int32_t) ps->bval);
+    out_height = in_height / ((int32_t) ps->bval);
+    if ((in_width % ps->bval) != 0) {
+      (ps->out_width)++;
+    }
+    if ((in_height % ps->bval) != 0) {
+      out_height++;
+    }
+    ps->out_samples = ps->out_width * ((int32_t) chcount);
+    ps->pad_height = out_height * ((int32_t) ps->bval);
+    
+    /* Check the constraints */
+    if (!jpegshrink_inbounds(ps->out_width, out_height, pt->pBounds)) {
+      ps->active = 0;
+      pt->result = -1;
+      skipped = 1;
+      continue;
+    }
+    ps->active = 1;
+    
+    /* Open the output file, skipping the target if that fails */
+    pt->result = jpegshrink_openout(
+                  pc, &(ps->pw), pt->pOut, ps->out_width, out_height,
+                  chcount, pt->q);
+    if (pt->result != SPH_JPEG_ERR_OK) {
+      ps->active = 0;
+      continue;
+    }
+    
+    /* Reserve the accumulator and the output scanline buffer for box
+     * filtering */
+    if (ps->bval > JPEGSHRINK_MAXBOX16) {
+      ps->pWideAcc = (uint32_t *) jpegshrink_reserve(
+                        ps->pWideAcc, &(ps->wide_cap),
+                        ((size_t) ps->out_samples) * sizeof(uint32_t));
+    } else if (ps->bval > 1) {
+      ps->pAcc = (uint16_t *) jpegshrink_reserve(
+                    ps->pAcc, &(ps->acc_cap),
+                    ((size_t) ps->out_samples) * sizeof(uint16_t));
+      jpegshrink_kernels(
+        ps->bval, chcount, &(ps->fMix), &(ps->fBlit));
+    }
+    if (ps->bval > 1) {
+      ps->pOutScan = (uint8_t *) jpegshrink_reserve(
+                        ps->pOutScan, &(ps->out_cap),
+                        (size_t) ps->out_samples);
+      if ((ps->pOutScan == NULL) ||
+          ((ps->pAcc == NULL) && (ps->pWideAcc == NULL))) {
+        ps->active = 0;
+        pt->result = SPH_JPEG_ERR_MEM;
+        continue;
+      }
+    }
+    
+    /* Track the largest padding of the active targets */
+    pad_count = (ps->out_width * ((int32_t) ps->bval)) - in_width;
+    if (pad_count > max_pad) {
+      max_pad = pad_count;
+    }
+    if (ps->pad_height > max_height) {
+      max_height = ps->pad_height;
+    }
+  }
+  
+  /* Reserve the input buffer for a batch of scanlines, each with room
+   * for the largest padding; padding by duplicating the last pixel
+   * serves every target */
+  if (status && (max_height > 0)) {
+    stride = ((size_t) (in_width + max_pad)) * ((size_t) chcount);
+    pc->pInScan = (uint8_t *) jpegshrink_reserve(
+                    pc->pInScan, &(pc->in_cap),
+                    stride * JPEGSHRINK_COPYROWS);
+    pInScan = pc->pInScan;
+    if (pInScan == NULL) {
+      status = 0;
+      retval = SPH_JPEG_ERR_MEM;
+    }
+  }
+  
+  /* Decode the input once, passing each batch of scanlines to every
+   * active target */
+  for(y = 0; status && (max_height > 0) && (y < in_height); y += n) {
+    
+    /* Read and pad a batch of scanlines */
+    n = jpegshrink_getrows(pc, pInScan, stride, JPEGSHRINK_COPYROWS);
+    if (n < 1) {
+      status = 0;
+      break;
+    }
+    for(i = 0; i < n; i++) {
+      jpegshrink_padscan(
+        pInScan + (((size_t) i) * stride), in_width, max_pad, chcount);
+    }
+    pLast = pInScan + (((size_t) (n - 1)) * stride);
+    
+    /* Copy the batch or mix it into each target */
+    for(t = 0; t < count; t++) {
+      ps = &((pc->pStages)[t]);
+      if (!(ps->active)) {
+        continue;
+      }
+      if (ps->bval <= 1) {
+        sph_jpeg_writer_put_rows(ps->pw, pInScan, stride, n);
+      } else {
+        for(i = 0; i < n; i++) {
+          jpegshrink_stagerow(
+            ps, pInScan + (((size_t) i) * stride), y + i, chcount);
+        }
+      }
+      
+      /* Stop feeding the target if its output can't be written */
+      if (sph_jpeg_writer_status(ps->pw) != SPH_JPEG_ERR_OK) {
+        ps->active = 0;
+        pTargets[t].result = sph_jpeg_writer_status(ps->pw);
+      }
+    }
+  }
+  
+  /* Duplicate the last scanline into the padding below the image for
+   * each box-filtered target */
+  for(t = 0; status && (max_height > 0) && (t < count); t++) {
+    ps = &((pc->pStages)[t]);
+    if ((ps->active) && (ps->bval > 1)) {
+      for(y = in_height; y < ps->pad_height; y++) {
+        jpegshrink_stagerow(ps, pLast, y, chcount);
+      }
+      if (sph_jpeg_writer_status(ps->pw) != SPH_JPEG_ERR_OK) {
+        ps->active = 0;
+        pTargets[t].result = sph_jpeg_writer_status(ps->pw);
+      }
+    }
+  }
+  
+  /* Determine the return value and the results of the targets; if the
+   * input failed, every target that has no result of its own yet gets
+   * the error, and otherwise the first failed target decides */
+  if (!status) {
+    if (retval == SPH_JPEG_ERR_OK) {
+      retval = sph_jpeg_reader_status(pr);
+    }
+    for(t = 0; t < count; t++) {
+      if (pTargets[t].result == SPH_JPEG_ERR_OK) {
+        pTargets[t].result = retval;
+      }
+    }
+  } else {
+    for(t = 0; t < count; t++) {
+      if (pTargets[t].result > 0) {
+        retval = pTargets[t].result;
+        break;
+      }
+    }
+    if ((retval == SPH_JPEG_ERR_OK) && skipped) {
+      retval = -1;
+    }
   }
   
+  /* The reader, writers, and buffers stay in the context for reuse */
+  pr = NULL;
+  ps = NULL;
+  pt = NULL;
+  pInScan = NULL;
+  pLast = NULL;
+  
+  /* Finish timing the operation */
+  JPEGSHRINK_STAT_TIME(pc, op_mark, total_ns);
+#ifdef SPH_JPEG_ENABLE_STATS
+  (pc->ops)++;
+#endif
+  
   /* Return retval */
   return retval;
 }
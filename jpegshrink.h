@@ -21,16 +21,17 @@
 /*
  * The maximum shrink value.
  * 
- * The maximum value of sixteen means that the width and height of the
- * input image are both divided by sixteen, with duplication padding
- * used to round the input image up to 16-pixel boundaries.
+ * The maximum value of 256 means that the width and height of the input
+ * image are both divided by 256, with duplication padding used to round
+ * the input image up to 256-pixel boundaries.
  * 
- * JPEGSHRINK_MAXSHRINK must be chosen such that the function
- * jpegshrink_mixscan() in the implementation never encounters an
- * overflow during accumulation.  The value of 16 is the maximum
- * possible using unsigned 16-bit accumulator samples.
+ * JPEGSHRINK_MAXSHRINK must be chosen such that the box filter in the
+ * implementation never encounters an overflow during accumulation.  Box
+ * filters of up to 16 by 16 pixels use unsigned 16-bit accumulator
+ * samples, and larger box filters use unsigned 32-bit accumulator
+ * samples, which could hold more than 256 by 256 pixels.
  */
-#define JPEGSHRINK_MAXSHRINK (16)
+#define JPEGSHRINK_MAXSHRINK (256)
 
 /*
  * Structure for declaring output dimension constraints.
@@ -73,6 +74,158 @@ typedef struct {
   
 } JPEGSHRINK_BOUNDS;
 
+/*
+ * Structure for declaring a crop rectangle within the input image.
+ * 
+ * All values are in pixels of the full-size input image.
+ */
+typedef struct {
+  
+  /*
+   * The left and top of the rectangle, each zero or greater.
+   */
+  int32_t x;
+  int32_t y;
+  
+  /*
+   * The width and height of the rectangle, each one or greater.
+   */
+  int32_t width;
+  int32_t height;
+  
+} JPEGSHRINK_RECT;
+
+/*
+ * The maximum number of targets of a multi-output shrink operation.
+ */
+#define JPEGSHRINK_MAXTARGETS (16)
+
+/*
+ * Structure for declaring one output of a multi-output shrink
+ * operation.
+ * 
+ * See jpegshrink_multi().
+ */
+typedef struct {
+  
+  /*
+   * The output JPEG file.
+   */
+  FILE *pOut;
+  
+  /*
+   * The scaling value and the compression quality, with the same
+   * meaning as for jpegshrink().
+   */
+  int sval;
+  int q;
+  
+  /*
+   * The output image constraints, or NULL if there are none.
+   */
+  const JPEGSHRINK_BOUNDS *pBounds;
+  
+  /*
+   * The result for this output, which is filled in by the operation.
+   * 
+   * This is SPH_JPEG_ERR_OK (0) if the output was written, -1 if the
+   * output constraints were not satisfied, so that nothing was written
+   * to this output, or else a sophistry_jpeg error code.
+   */
+  int result;
+  
+} JPEGSHRINK_TARGET;
+
+/*
+ * Structure that receives the instrumentation counters of a shrink
+ * context.
+ * 
+ * The counters accumulate over every operation on the context.  They
+ * are only collected if sophistry_jpeg and jpegshrink are both compiled
+ * with SPH_JPEG_ENABLE_STATS (see sophistry_jpeg.h).
+ * 
+ * See jpegshrink_ctx_stats().
+ */
+typedef struct {
+  
+  /*
+   * The number of shrink operations performed.
+   */
+  int64_t ops;
+  
+  /*
+   * The total time spent in shrink operations, in nanoseconds.
+   */
+  int64_t total_ns;
+  
+  /*
+   * The time spent getting decoded scanlines, in nanoseconds.
+   * 
+   * This is the scanline decoding time of the reader, or with a source
+   * callback, the time spent waiting for the callback.
+   */
+  int64_t input_ns;
+  
+  /*
+   * The time spent in the operations outside of the reader and the
+   * writers, in nanoseconds.
+   * 
+   * This is mostly spent in the box filter or the resampler.
+   */
+  int64_t filter_ns;
+  
+  /*
+   * The counters of the JPEG reader of the context.
+   */
+  SPH_JPEG_STATS read;
+  
+  /*
+   * The sum of the counters of all the JPEG writers of the context.
+   */
+  SPH_JPEG_STATS write;
+  
+} JPEGSHRINK_STATS;
+
+/*
+ * JPEGSHRINK_CTX structure prototype.
+ * 
+ * See the implementation file for definition.
+ * 
+ * A shrink context holds a JPEG reader, a JPEG writer, and scanline
+ * buffers that are kept between shrink operations, so that shrinking
+ * many images in a row does not need to allocate and release them for
+ * each image.
+ */
+struct JPEGSHRINK_CTX_TAG;
+typedef struct JPEGSHRINK_CTX_TAG JPEGSHRINK_CTX;
+
+/*
+ * Callback that supplies decoded scanlines to a shrink context.
+ * 
+ * Shrink contexts normally read scanlines straight from their JPEG
+ * reader.  A source callback installed with jpegshrink_ctx_source() is
+ * called instead, for example to decode on another thread.
+ * 
+ * pCustom is the custom parameter given to jpegshrink_ctx_source().
+ * pr is the JPEG reader of the context, which has been opened on the
+ * input image and checked for errors.  The callback should read up to
+ * max_rows scanlines of pr into buf, where stride is the distance in
+ * bytes between rows, in the same way as sph_jpeg_reader_get_rows(),
+ * and return the number of rows read.  It may return fewer rows than
+ * requested, but must read at least one unless there is an error.
+ * 
+ * If there is an error, the callback returns zero.  The shrink
+ * operation then stops and reports the status of pr, so the callback
+ * must make sure that pr is in an error state and that no other thread
+ * is still using it before returning zero.
+ */
+typedef int32_t (*JPEGSHRINK_SOURCE)(
+    void            * pCustom,
+    SPH_JPEG_READER * pr,
+    uint8_t         * buf,
+    size_t            stride,
+    int32_t           max_rows);
+
 /*
  * Perform a shrink operation.
  * 
@@ -92,6 +245,10 @@ typedef struct {
  * 
  * If the input file is grayscale, the output file will be grayscale.
  * If the input file is RGB, the output file will be RGB.
+ * Color images stored as YCbCr are decoded, filtered, and encoded in
+ * YCbCr, so no color conversion is performed in either direction.
+ * Shrink contexts can instead make grayscale output from color input
+ * with jpegshrink_ctx_gray().
  * 
  * sval is the scaling value.  The minimum value of one means that no
  * scaling is performed.  Otherwise, the width and height of the input
@@ -101,8 +258,26 @@ typedef struct {
  * the scaling value.  The maximum scaling value is
  * JPEGSHRINK_MAXSHRINK.
  * 
+ * The power-of-two part of sval (up to a factor of eight) is performed
+ * by libjpeg in the DCT domain during decompression, using
+ * sph_jpeg_reader_new_scaled().  Only the remaining factor is performed
+ * by box filtering decoded pixels.  Box filters larger than 16 by 16
+ * pixels accumulate in 32 bits instead of 16 bits, so even very large
+ * reductions such as a scaling value of 128 happen in a single
+ * streaming pass.  The output dimensions are the same
+ * as if the whole reduction were performed by box filtering, but pixel
+ * values may differ very slightly.
+ * 
+ * When sval is two or more, the input is decoded with the fast decoder
+ * options (the fast integer IDCT, simple chroma upsampling, and no
+ * progressive block smoothing), since the reduction hides their small
+ * loss of accuracy.  See sph_jpeg_reader_new_ex().  Use
+ * jpegshrink_ctx_accurate() on a shrink context to always decode with
+ * the accurate defaults instead.
+ * 
  * There is special code to perform an efficient copy in the special
- * case that sval is one.
+ * case that no box filtering is required, which is when sval is one,
+ * two, four, or eight.
  * 
  * q is the quality value of the output compressed JPEG file.  It is
  * passed through to sophistry_jpeg.  See sph_jpeg_writer_new() for the
@@ -121,7 +296,10 @@ typedef struct {
  * It is zero (or SPH_JPEG_ERR_OK) if the operation was successful, else
  * it is a sophistry_jpeg error code or -1.  sph_jpeg_errstr() can be
  * used to convert the error code (except for -1) into a message for the
- * user.  If pBounds is NULL, -1 will never be returned.
+ * user.  If pBounds is NULL, -1 will never be returned.  Errors while
+ * reading the input are reported with the status of the reader, errors
+ * while writing the output with the status of the writer (such as
+ * SPH_JPEG_ERR_WRIT), and allocation failures with SPH_JPEG_ERR_MEM.
  * 
  * Parameters:
  * 
@@ -147,4 +325,406 @@ int jpegshrink(
           int                 q,
     const JPEGSHRINK_BOUNDS * pBounds);
 
+/*
+ * Allocate a new shrink context.
+ * 
+ * The context starts out empty, and its reader, writer, and buffers are
+ * allocated by the first call to jpegshrink_ctx_run().  Release the
+ * context with jpegshrink_ctx_free().
+ * 
+ * A context may only be used by one thread at a time.
+ * 
+ * Return:
+ * 
+ *   a new shrink context, or NULL if it could not be allocated
+ */
+JPEGSHRINK_CTX *jpegshrink_ctx_new(void);
+
+/*
+ * Release a shrink context.
+ * 
+ * The call is ignored if pc is NULL.  This does NOT close any of the
+ * file handles that were passed to jpegshrink_ctx_run().
+ * 
+ * Parameters:
+ * 
+ *   pc - the shrink context to release, or NULL
+ */
+void jpegshrink_ctx_free(JPEGSHRINK_CTX *pc);
+
+/*
+ * Choose whether a shrink context always decodes accurately.
+ * 
+ * By default, shrink operations that reduce the image by at least a
+ * factor of two decode with the fast decoder options, as described for
+ * jpegshrink().  If accurate is non-zero, operations on this context
+ * decode with the accurate default options instead.  If accurate is
+ * zero, the default behavior is restored.
+ * 
+ * Parameters:
+ * 
+ *   pc - the shrink context
+ * 
+ *   accurate - non-zero to always decode accurately
+ */
+void jpegshrink_ctx_accurate(JPEGSHRINK_CTX *pc, int accurate);
+
+/*
+ * Choose whether a shrink context makes grayscale output.
+ * 
+ * If gray is non-zero, operations on this context decode only the luma
+ * channel of color images that are stored as YCbCr, and write a
+ * grayscale output image.  The chroma channels are never decoded,
+ * which roughly halves the decoding work.  Grayscale input images and
+ * color images that are not stored as YCbCr are not affected.  If gray
+ * is zero, the default of keeping color images in color is restored.
+ * 
+ * Parameters:
+ * 
+ *   pc - the shrink context
+ * 
+ *   gray - non-zero to make grayscale output
+ */
+void jpegshrink_ctx_gray(JPEGSHRINK_CTX *pc, int gray);
+
+/*
+ * Install a scanline source callback on a shrink context.
+ * 
+ * All later operations on this context read their decoded scanlines
+ * through fSource, with pCustom passed through to it.  See
+ * JPEGSHRINK_SOURCE for the requirements of the callback.  If fSource
+ * is NULL, the context goes back to reading directly from its reader,
+ * which is the default.
+ * 
+ * The callback is only called between the start and the end of an
+ * operation, and only on the thread that runs the operation.
+ * 
+ * Parameters:
+ * 
+ *   pc - the shrink context
+ * 
+ *   fSource - the source callback, or NULL
+ * 
+ *   pCustom - the custom parameter passed to the callback
+ */
+void jpegshrink_ctx_source(
+    JPEGSHRINK_CTX    * pc,
+    JPEGSHRINK_SOURCE   fSource,
+    void              * pCustom);
+
+/*
+ * Get the instrumentation counters of a shrink context.
+ * 
+ * pStats receives the counters accumulated by all the operations on
+ * the context so far.  Clients measure a single operation by taking the
+ * difference between counters queried before and after it.  Without
+ * SPH_JPEG_ENABLE_STATS, every counter is zero and the return value is
+ * zero.
+ * 
+ * With a source callback that decodes on another thread, the decoding
+ * time appears in the scan_ns counter of the reader, but not in the
+ * total time of the operations.
+ * 
+ * Parameters:
+ * 
+ *   pc - the shrink context
+ * 
+ *   pStats - receives the counters
+ * 
+ * Return:
+ * 
+ *   non-zero if instrumentation is compiled in, zero if not
+ */
+int jpegshrink_ctx_stats(JPEGSHRINK_CTX *pc, JPEGSHRINK_STATS *pStats);
+
+/*
+ * Perform a shrink operation using a shrink context.
+ * 
+ * This is the same as jpegshrink(), except that the JPEG reader and
+ * writer objects and the scanline buffers are taken from the context pc
+ * and left there for the next operation, rather than being allocated
+ * and released each time.  Scanline buffers only grow, so after the
+ * context has processed the largest image in a run, no further buffer
+ * allocations are made.
+ * 
+ * jpegshrink() is equivalent to calling this function with a context
+ * that is allocated just beforehand and released right afterwards.
+ * 
+ * The context may be reused after any return value, including errors.
+ * 
+ * Parameters:
+ * 
+ *   pc - the shrink context
+ * 
+ *   pIn - the input JPEG file
+ * 
+ *   pOut - the output JPEG file
+ * 
+ *   sval - the scaling value
+ * 
+ *   q - the compression quality
+ * 
+ *   pBounds - the output image constraints, or NULL
+ * 
+ * Return:
+ * 
+ *   SPH_JPEG_ERR_OK (0) if successful, otherwise a sophistry_jpeg error
+ *   code, or -1 if the output constraints are not satisfied
+ */
+int jpegshrink_ctx_run(
+          JPEGSHRINK_CTX    * pc,
+          FILE              * pIn,
+          FILE              * pOut,
+          int                 sval,
+          int                 q,
+    const JPEGSHRINK_BOUNDS * pBounds);
+
+/*
+ * Crop an image and then perform a shrink operation on the crop.
+ * 
+ * This is the same as jpegshrink(), except that only the rectangle
+ * pCrop of the input image is shrunk.  The rectangle is given in the
+ * coordinates of the full-size input image.  Parts of the rectangle
+ * that extend past the right or bottom of the image are clipped off.
+ * If the rectangle does not overlap the image at all, the function
+ * fails with an error code of -1.  If any field of pCrop is out of
+ * range, a fault occurs.
+ * 
+ * The output image is the clipped rectangle with its width and height
+ * divided by sval, rounding up.  The output dimensions are checked
+ * against pBounds in the same way as for jpegshrink().
+ * 
+ * The DCT-scaled part of the reduction is performed first, and the
+ * rectangle is then cropped out of the scaled image during decoding
+ * with sph_jpeg_reader_set_crop().  Rows above the rectangle are
+ * skipped, and decoding stops after the last row of the rectangle, so
+ * a small crop of a large image decodes much less than the whole
+ * image.  Because the rectangle is aligned to the DCT-scaled pixel grid
+ * of the decoder, its edges may shift by less than one output pixel.
+ * 
+ * Since decoding may stop before the end of the input image, the file
+ * pointer of pIn is undefined afterwards, even if the operation was
+ * successful.
+ * 
+ * Parameters:
+ * 
+ *   pIn - the input JPEG file
+ * 
+ *   pOut - the output JPEG file
+ * 
+ *   pCrop - the crop rectangle
+ * 
+ *   sval - the scaling value
+ * 
+ *   q - the compression quality
+ * 
+ *   pBounds - the output image constraints, or NULL
+ * 
+ * Return:
+ * 
+ *   SPH_JPEG_ERR_OK (0) if successful, otherwise a sophistry_jpeg error
+ *   code, or -1 if the crop is outside the image or the output
+ *   constraints are not satisfied
+ */
+int jpegshrink_crop(
+          FILE              * pIn,
+          FILE              * pOut,
+    const JPEGSHRINK_RECT   * pCrop,
+          int                 sval,
+          int                 q,
+    const JPEGSHRINK_BOUNDS * pBounds);
+
+/*
+ * Perform a crop and shrink operation using a shrink context.
+ * 
+ * This is the same as jpegshrink_crop(), except that the objects and
+ * buffers are kept in the context pc between calls, in the same way as
+ * for jpegshrink_ctx_run().
+ * 
+ * Parameters:
+ * 
+ *   pc - the shrink context
+ * 
+ *   pIn - the input JPEG file
+ * 
+ *   pOut - the output JPEG file
+ * 
+ *   pCrop - the crop rectangle
+ * 
+ *   sval - the scaling value
+ * 
+ *   q - the compression quality
+ * 
+ *   pBounds - the output image constraints, or NULL
+ * 
+ * Return:
+ * 
+ *   SPH_JPEG_ERR_OK (0) if successful, otherwise a sophistry_jpeg error
+ *   code, or -1 if the crop is outside the image or the output
+ *   constraints are not satisfied
+ */
+int jpegshrink_ctx_crop(
+          JPEGSHRINK_CTX    * pc,
+          FILE              * pIn,
+          FILE              * pOut,
+    const JPEGSHRINK_RECT   * pCrop,
+          int                 sval,
+          int                 q,
+    const JPEGSHRINK_BOUNDS * pBounds);
+
+/*
+ * Shrink an image so that it fits exactly within output constraints.
+ * 
+ * Unlike jpegshrink(), which divides the image by a given integer
+ * scaling value and fails if the result does not satisfy the
+ * constraints, this function computes the largest output dimensions
+ * that satisfy all the constraints in pBounds while keeping the aspect
+ * ratio of the input image, and then resizes the image to exactly those
+ * dimensions.  The image is never enlarged, so if it already satisfies
+ * the constraints, it is only re-encoded.  If pBounds is NULL, there
+ * are no constraints and the image is only re-encoded.
+ * 
+ * The JPEG header is read first, and libjpeg is then asked to scale by
+ * the largest DCT scaling denominator that still leaves the decoded
+ * image at least as large as the output.  If the output is at most half
+ * the input size in each dimension, the fast decoder options are used
+ * in the same way as for jpegshrink().  The remaining reduction is
+ * performed with a separable area (box) resampler that supports any
+ * fractional ratio, in a single streaming pass over the decoded
+ * scanlines.  The input is therefore only decoded once.
+ * 
+ * pIn, pOut, and q have the same meaning as for jpegshrink().
+ * 
+ * The return value is SPH_JPEG_ERR_OK (zero) if successful, -1 if not
+ * even a one by one pixel image satisfies the constraints, or else a
+ * sophistry_jpeg error code.
+ * 
+ * Parameters:
+ * 
+ *   pIn - the input JPEG file
+ * 
+ *   pOut - the output JPEG file
+ * 
+ *   q - the compression quality
+ * 
+ *   pBounds - the output image constraints, or NULL
+ * 
+ * Return:
+ * 
+ *   SPH_JPEG_ERR_OK (0) if successful, otherwise a sophistry_jpeg error
+ *   code, or -1 if the output constraints can't be satisfied
+ */
+int jpegshrink_fit(
+          FILE              * pIn,
+          FILE              * pOut,
+          int                 q,
+    const JPEGSHRINK_BOUNDS * pBounds);
+
+/*
+ * Perform a fit operation using a shrink context.
+ * 
+ * This is the same as jpegshrink_fit(), except that the objects and
+ * buffers are kept in the context pc between calls, in the same way as
+ * for jpegshrink_ctx_run().
+ * 
+ * Parameters:
+ * 
+ *   pc - the shrink context
+ * 
+ *   pIn - the input JPEG file
+ * 
+ *   pOut - the output JPEG file
+ * 
+ *   q - the compression quality
+ * 
+ *   pBounds - the output image constraints, or NULL
+ * 
+ * Return:
+ * 
+ *   SPH_JPEG_ERR_OK (0) if successful, otherwise a sophistry_jpeg error
+ *   code, or -1 if the output constraints can't be satisfied
+ */
+int jpegshrink_ctx_fit(
+          JPEGSHRINK_CTX    * pc,
+          FILE              * pIn,
+          FILE              * pOut,
+          int                 q,
+    const JPEGSHRINK_BOUNDS * pBounds);
+
+/*
+ * Shrink an image to several outputs while decoding it only once.
+ * 
+ * pIn is the input JPEG file.  pTargets is an array of count output
+ * targets, where count is in range [1, JPEGSHRINK_MAXTARGETS].  Each
+ * target is written as if by jpegshrink() with the output file, scaling
+ * value, quality, and constraints of the target.
+ * 
+ * The input is decoded once, with DCT scaling by the largest factor
+ * that all the scaling values share (see jpegshrink() for how DCT
+ * scaling is chosen).  Each target then box filters the shared decoded
+ * scanlines by the rest of its own scaling value, and all the output
+ * files are written at the same time, each by its own writer.  The
+ * output dimensions are the same as for jpegshrink(), but since a
+ * target may be decoded at a larger DCT scale than it would be on its
+ * own, pixel values may differ very slightly.  The fast decoder options
+ * are only used if all scaling values are two or more.
+ * 
+ * The result field of each target is filled in.  Targets whose output
+ * constraints are not satisfied are skipped without writing anything,
+ * and the other targets are still written.  If the input can't be read,
+ * the result of every target that was not skipped is the error code,
+ * and targets that were already started will be incomplete.  If the
+ * output of a target can't be written or its buffers can't be
+ * allocated, only that target stops, with the error code as its
+ * result, and the other targets are still written.
+ * 
+ * Parameters:
+ * 
+ *   pIn - the input JPEG file
+ * 
+ *   pTargets - the output targets
+ * 
+ *   count - the number of targets
+ * 
+ * Return:
+ * 
+ *   SPH_JPEG_ERR_OK (0) if all targets were written, -1 if the input
+ *   was read but the output constraints of at least one target were not
+ *   satisfied, otherwise a sophistry_jpeg error code
+ */
+int jpegshrink_multi(
+    FILE              * pIn,
+    JPEGSHRINK_TARGET * pTargets,
+    int                 count);
+
+/*
+ * Perform a multi-output shrink operation using a shrink context.
+ * 
+ * This is the same as jpegshrink_multi(), except that the objects and
+ * buffers are kept in the context pc between calls, in the same way as
+ * for jpegshrink_ctx_run().  The context keeps one writer for each
+ * target position.
+ * 
+ * Parameters:
+ * 
+ *   pc - the shrink context
+ * 
+ *   pIn - the input JPEG file
+ * 
+ *   pTargets - the output targets
+ * 
+ *   count - the number of targets
+ * 
+ * Return:
+ * 
+ *   SPH_JPEG_ERR_OK (0) if all targets were written, -1 if the input
+ *   was read but the output constraints of at least one target were not
+ *   satisfied, otherwise a sophistry_jpeg error code
+ */
+int jpegshrink_ctx_multi(
+    JPEGSHRINK_CTX    * pc,
+    FILE              * pIn,
+    JPEGSHRINK_TARGET * pTargets,
+    int                 count);
+
 #endif
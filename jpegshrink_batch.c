@@ -0,0 +1,358 @@
+/*
+ * jpegshrink_batch.c
+ * ==================
+ * 
+ * Implementation of jpegshrink_batch.h
+ * 
+ * See the header for further information.
+ */
+#include "jpegshrink_batch.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Type declarations
+ * =================
+ */
+
+/*
+ * The shared state of a batch, used by all worker threads.
+ */
+typedef struct {
+  
+  /*
+   * Lock protecting the callbacks and the counters below.
+   */
+  pthread_mutex_t lock;
+  
+  /*
+   * The client callbacks and their custom parameter.
+   */
+  JPEGSHRINK_NEXT fNext;
+  JPEGSHRINK_DONE fDone;
+  void *pCustom;
+  
+  /*
+   * The shrink parameters for every job.
+   */
+  int sval;
+  int q;
+  const JPEGSHRINK_BOUNDS *pBounds;
+  
+  /*
+   * Non-zero once the fNext callback has reported there are no more
+   * jobs.
+   */
+  int finished;
+  
+  /*
+   * The number of jobs that have failed.
+   */
+  int32_t fail_count;
+  
+} JPEGSHRINK_BATCH;
+
+/*
+ * Local functions
+ * ===============
+ */
+
+/* Prototypes */
+static int jpegshrink_batch_one(
+          JPEGSHRINK_BATCH * pb,
+          JPEGSHRINK_CTX   * pc,
+    const JPEGSHRINK_JOB   * pJob);
+
+static void *jpegshrink_batch_worker(void *pParam);
+
+/*
+ * Run a single job.
+ * 
+ * pb is the batch state.  The lock is NOT held while this function
+ * runs.  pc is the shrink context of the calling worker.  pJob is the
+ * job to run.
+ * 
+ * If the job fails after the output file has been created, the output
+ * file is removed.
+ * 
+ * Parameters:
+ * 
+ *   pb - the batch state
+ * 
+ *   pc - the shrink context of the worker
+ * 
+ *   pJob - the job to run
+ * 
+ * Return:
+ * 
+ *   the job status code
+ */
+static int jpegshrink_batch_one(
+          JPEGSHRINK_BATCH * pb,
+          JPEGSHRINK_CTX   * pc,
+    const JPEGSHRINK_JOB   * pJob) {
+  
+  int retval = SPH_JPEG_ERR_OK;
+  FILE *pIn = NULL;
+  FILE *pOut = NULL;
+  
+  /* Check parameters */
+  if ((pb == NULL) || (pc == NULL) || (pJob == NULL)) {
+    abort();
+  }
+  if ((pJob->pInPath == NULL) || (pJob->pOutPath == NULL)) {
+    abort();
+  }
+  
+  /* Open the input file */
+  pIn = fopen(pJob->pInPath, "rb");
+  if (pIn == NULL) {
+    retval = JPEGSHRINK_ERR_INPUT;
+  }
+  
+  /* Create the output file */
+  if (retval == SPH_JPEG_ERR_OK) {
+    pOut = fopen(pJob->pOutPath, "wb");
+    if (pOut == NULL) {
+      retval = JPEGSHRINK_ERR_OUTPUT;
+    }
+  }
+  
+  /* Perform the shrink operation */
+  if (retval == SPH_JPEG_ERR_OK) {
+    retval = jpegshrink_ctx_run(
+              pc, pIn, pOut, pb->sval, pb->q, pb->pBounds);
+  }
+  
+  /* Close the files, checking that the output was fully written */
+  if (pIn != NULL) {
+    (void) fclose(pIn);
+    pIn = NULL;
+  }
+  if (pOut != NULL) {
+    if (fclose(pOut)) {
+      if (retval == SPH_JPEG_ERR_OK) {
+        retval = JPEGSHRINK_ERR_OUTPUT;
+      }
+    }
+    pOut = NULL;
+    
+    /* Remove the output file if the job failed */
+    if (retval != SPH_JPEG_ERR_OK) {
+      (void) remove(pJob->pOutPath);
+    }
+  }
+  
+  /* Return status */
+  return retval;
+}
+
+/*
+ * Worker thread procedure.
+ * 
+ * pParam points to the JPEGSHRINK_BATCH state.  The worker keeps
+ * fetching and running jobs until there are no more, reusing a single
+ * shrink context for all of them.
+ * 
+ * The shrink context is allocated before the first job is run.  If it
+ * can't be allocated, the job fails with SPH_JPEG_ERR_MEM, and the
+ * allocation is tried again for the next job, so that a worker never
+ * stops the batch because of a temporary shortage of memory.
+ * 
+ * Parameters:
+ * 
+ *   pParam - the batch state
+ * 
+ * Return:
+ * 
+ *   always NULL
+ */
+static void *jpegshrink_batch_worker(void *pParam) {
+  
+  JPEGSHRINK_BATCH *pb = NULL;
+  JPEGSHRINK_CTX *pc = NULL;
+  JPEGSHRINK_JOB job;
+  int got = 0;
+  int retval = 0;
+  
+  /* Initialize structures */
+  memset(&job, 0, sizeof(JPEGSHRINK_JOB));
+  
+  /* Get the batch state */
+  if (pParam == NULL) {
+    abort();
+  }
+  pb = (JPEGSHRINK_BATCH *) pParam;
+  
+  /* Run jobs until there are no more */
+  for( ; ; ) {
+    
+    /* Fetch the next job */
+    if (pthread_mutex_lock(&(pb->lock))) {
+      abort();
+    }
+    got = 0;
+    if (!(pb->finished)) {
+      memset(&job, 0, sizeof(JPEGSHRINK_JOB));
+      got = (*(pb->fNext))(pb->pCustom, &job);
+      if (!got) {
+        pb->finished = 1;
+      }
+    }
+    if (pthread_mutex_unlock(&(pb->lock))) {
+      abort();
+    }
+    
+    /* Leave loop if no more jobs */
+    if (!got) {
+      break;
+    }
+    
+    /* Allocate the shrink context of this worker if necessary, and run
+     * the job without holding the lock */
+    if (pc == NULL) {
+      pc = jpegshrink_ctx_new();
+    }
+    if (pc != NULL) {
+      retval = jpegshrink_batch_one(pb, pc, &job);
+    } else {
+      retval = SPH_JPEG_ERR_MEM;
+    }
+    
+    /* Report the result */
+    if (pthread_mutex_lock(&(pb->lock))) {
+      abort();
+    }
+    if (retval != SPH_JPEG_ERR_OK) {
+      (pb->fail_count)++;
+    }
+    (*(pb->fDone))(pb->pCustom, &job, retval);
+    if (pthread_mutex_unlock(&(pb->lock))) {
+      abort();
+    }
+  }
+  
+  /* Release the shrink context */
+  jpegshrink_ctx_free(pc);
+  pc = NULL;
+  
+  return NULL;
+}
+
+/*
+ * Public function implementations
+ * ===============================
+ * 
+ * See the header for specifications.
+ */
+
+/*
+ * jpegshrink_batch_errstr function.
+ */
+const char *jpegshrink_batch_errstr(int status) {
+  
+  const char *pResult = NULL;
+  
+  switch (status) {
+    case -1:
+      pResult = "Output constraints not satisfied";
+      break;
+    
+    case JPEGSHRINK_ERR_INPUT:
+      pResult = "Can't open input file";
+      break;
+    
+    case JPEGSHRINK_ERR_OUTPUT:
+      pResult = "Can't write output file";
+      break;
+    
+    default:
+      pResult = sph_jpeg_errstr(status);
+  }
+  
+  return pResult;
+}
+
+/*
+ * jpegshrink_batch function.
+ */
+int32_t jpegshrink_batch(
+          JPEGSHRINK_NEXT     fNext,
+          JPEGSHRINK_DONE     fDone,
+          void              * pCustom,
+          int                 jobs,
+          int                 sval,
+          int                 q,
+    const JPEGSHRINK_BOUNDS * pBounds) {
+  
+  JPEGSHRINK_BATCH batch;
+  pthread_t *pThreads = NULL;
+  int i = 0;
+  
+  /* Initialize structures */
+  memset(&batch, 0, sizeof(JPEGSHRINK_BATCH));
+  
+  /* Check parameters */
+  if ((fNext == NULL) || (fDone == NULL)) {
+    abort();
+  }
+  if ((jobs < 1) || (jobs > JPEGSHRINK_MAXJOBS)) {
+    abort();
+  }
+  if ((sval < 1) || (sval > JPEGSHRINK_MAXSHRINK)) {
+    abort();
+  }
+  
+  /* Initialize the shared state */
+  if (pthread_mutex_init(&(batch.lock), NULL)) {
+    abort();
+  }
+  batch.fNext = fNext;
+  batch.fDone = fDone;
+  batch.pCustom = pCustom;
+  batch.sval = sval;
+  batch.q = q;
+  batch.pBounds = pBounds;
+  batch.finished = 0;
+  batch.fail_count = 0;
+  
+  /* Allocate the thread handles if there is more than one worker */
+  if (jobs > 1) {
+    pThreads = (pthread_t *) calloc((size_t) jobs, sizeof(pthread_t));
+  }
+  
+  if (pThreads == NULL) {
+    /* Single worker, or no memory for the thread handles, so run on the
+     * calling thread */
+    (void) jpegshrink_batch_worker(&batch);
+    
+  } else {
+    /* Start the worker threads */
+    for(i = 0; i < jobs; i++) {
+      if (pthread_create(
+            &(pThreads[i]), NULL, &jpegshrink_batch_worker, &batch)) {
+        abort();
+      }
+    }
+    
+    /* Wait for all the workers to run out of jobs */
+    for(i = 0; i < jobs; i++) {
+      if (pthread_join(pThreads[i], NULL)) {
+        abort();
+      }
+    }
+    
+    free(pThreads);
+    pThreads = NULL;
+  }
+  
+  /* Release the shared state */
+  if (pthread_mutex_destroy(&(batch.lock))) {
+    abort();
+  }
+  
+  /* Return the failure count */
+  return batch.fail_count;
+}
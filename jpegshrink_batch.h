@@ -0,0 +1,159 @@
+#ifndef JPEGSHRINK_BATCH_H_INCLUDED
+#define JPEGSHRINK_BATCH_H_INCLUDED
+
+/*
+ * jpegshrink_batch.h
+ * ==================
+ * 
+ * Optional module that runs jpegshrink over many files on a pool of
+ * worker threads.
+ * 
+ * Each worker thread shrinks one file at a time with its own shrink
+ * context, so the JPEG reader and writer objects and the scanline
+ * buffers of each worker are reused from one file to the next.
+ * sophistry_jpeg reader and writer objects are independent of each
+ * other (see the thread safety notes in sophistry_jpeg.h), so the
+ * workers do not need to be synchronized except when fetching the next
+ * job and reporting results.
+ * 
+ * Compilation
+ * -----------
+ * 
+ * Compile with sophistry_jpeg and jpegshrink.  Requires POSIX threads,
+ * so use -pthread (or -lpthread) when compiling and linking.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "jpegshrink.h"
+
+/*
+ * The maximum number of worker threads.
+ */
+#define JPEGSHRINK_MAXJOBS (256)
+
+/*
+ * Additional status codes reported for jobs, besides the status codes
+ * that are returned by jpegshrink().
+ */
+#define JPEGSHRINK_ERR_INPUT  (-2)  /* Can't open input file */
+#define JPEGSHRINK_ERR_OUTPUT (-3)  /* Can't write output file */
+
+/*
+ * Structure describing a single shrink job.
+ * 
+ * The path strings are owned by the client.  They must remain valid
+ * from the time the job is returned by the JPEGSHRINK_NEXT callback
+ * until the time it is passed to the JPEGSHRINK_DONE callback.
+ */
+typedef struct {
+  
+  /*
+   * The path to the input JPEG file.
+   */
+  char *pInPath;
+  
+  /*
+   * The path to the output JPEG file, which is created or overwritten.
+   */
+  char *pOutPath;
+  
+} JPEGSHRINK_JOB;
+
+/*
+ * Callback that supplies the next job.
+ * 
+ * pCustom is the custom parameter passed to jpegshrink_batch().  If
+ * there is another job, the callback fills in pJob and returns
+ * non-zero.  If there are no more jobs, the callback returns zero.
+ * Once the callback has returned zero, it is not called again.
+ */
+typedef int (*JPEGSHRINK_NEXT)(void *pCustom, JPEGSHRINK_JOB *pJob);
+
+/*
+ * Callback that receives the result of a job.
+ * 
+ * pCustom is the custom parameter passed to jpegshrink_batch().  pJob
+ * is a copy of the job that was supplied by the JPEGSHRINK_NEXT
+ * callback.  status is SPH_JPEG_ERR_OK (zero) if the job succeeded, or
+ * else a status code that can be converted to a message with the
+ * jpegshrink_batch_errstr() function.
+ * 
+ * If a job fails, its output file is removed.
+ */
+typedef void (*JPEGSHRINK_DONE)(
+          void           * pCustom,
+    const JPEGSHRINK_JOB * pJob,
+          int              status);
+
+/*
+ * Return an error message for a job status code.
+ * 
+ * This handles the -1 code returned by jpegshrink() when the output
+ * constraints are not satisfied, and the JPEGSHRINK_ERR codes defined
+ * in this header.  All other codes are passed through to
+ * sph_jpeg_errstr().
+ * 
+ * Parameters:
+ * 
+ *   status - the status code
+ * 
+ * Return:
+ * 
+ *   an error message
+ */
+const char *jpegshrink_batch_errstr(int status);
+
+/*
+ * Shrink a batch of JPEG files on a pool of worker threads.
+ * 
+ * Jobs are fetched one at a time with the fNext callback and the result
+ * of each job is reported with the fDone callback.  Both callbacks are
+ * made while holding an internal lock, so calls to them never overlap
+ * and they do not need to do their own locking.  Jobs may complete in a
+ * different order than they were supplied.
+ * 
+ * jobs is the number of worker threads, in range
+ * [1, JPEGSHRINK_MAXJOBS].  If it is one, all jobs run on the calling
+ * thread.
+ * 
+ * sval, q, and pBounds are passed to jpegshrink() for each file.  See
+ * that function for their meaning.  pBounds may be NULL.
+ * 
+ * The function returns once all jobs have been completed.  Failure to
+ * create a thread causes a fault.  Running out of memory does not: if
+ * the thread handles can't be allocated, all jobs run on the calling
+ * thread, and if a worker can't allocate its shrink context, each job
+ * it fetches until the allocation succeeds fails with
+ * SPH_JPEG_ERR_MEM and is counted as a failure.
+ * 
+ * Parameters:
+ * 
+ *   fNext - the callback that supplies jobs
+ * 
+ *   fDone - the callback that receives results
+ * 
+ *   pCustom - the custom parameter passed to the callbacks
+ * 
+ *   jobs - the number of worker threads
+ * 
+ *   sval - the scaling value
+ * 
+ *   q - the compression quality
+ * 
+ *   pBounds - the output image constraints, or NULL
+ * 
+ * Return:
+ * 
+ *   the number of jobs that failed
+ */
+int32_t jpegshrink_batch(
+          JPEGSHRINK_NEXT     fNext,
+          JPEGSHRINK_DONE     fDone,
+          void              * pCustom,
+          int                 jobs,
+          int                 sval,
+          int                 q,
+    const JPEGSHRINK_BOUNDS * pBounds);
+
+#endif
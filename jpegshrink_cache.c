@@ -0,0 +1,1105 @@
+/*
+ * jpegshrink_cache.c
+ * ==================
+ * 
+ * Implementation of jpegshrink_cache.h
+ * 
+ * See the header for further information.
+ */
+
+/* mmap(), fmemopen(), and open_memstream() need POSIX.1-2008 */
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "jpegshrink_cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/*
+ * Constants
+ * =========
+ */
+
+/*
+ * The magic bytes at the start of a cache file.
+ */
+#define JPEGSHRINK_CACHE_MAGIC "SPHJPGC\x01"
+
+/*
+ * The version of the cache file layout.
+ */
+#define JPEGSHRINK_CACHE_VERSION (1)
+
+/*
+ * The alignment in bytes of the entry table and of the entry data in
+ * the cache file.  The header is padded to this size.
+ */
+#define JPEGSHRINK_CACHE_ALIGN (4096)
+
+/*
+ * The number of output constraints that are part of a key, which are
+ * the fields of JPEGSHRINK_BOUNDS.
+ */
+#define JPEGSHRINK_CACHE_NBOUNDS (5)
+
+/*
+ * Type declarations
+ * =================
+ */
+
+/*
+ * The header at the start of a cache file.
+ */
+typedef struct {
+  
+  /*
+   * JPEGSHRINK_CACHE_MAGIC, written last when the file is created.
+   */
+  char magic[8];
+  
+  /*
+   * JPEGSHRINK_CACHE_VERSION, and the sizes of the header and entry
+   * structures, which change with the layout of the structures on
+   * different platforms.
+   */
+  uint32_t version;
+  uint32_t head_size;
+  uint32_t slot_size;
+  
+  /*
+   * The number of entries, which is a multiple of
+   * JPEGSHRINK_CACHE_WAYS, and the number of bytes of data each entry
+   * can hold.
+   */
+  int32_t entries;
+  int32_t entry_bytes;
+  
+  /*
+   * The access clock.  It is advanced on every hit and store, and the
+   * new value is recorded in the entry, so the entry with the lowest
+   * value in a set is the least recently used.
+   */
+  uint64_t clock;
+  
+  /*
+   * The counters of the cache.
+   */
+  JPEGSHRINK_CACHE_STATS stats;
+  
+} JPEGSHRINK_CACHE_HEAD;
+
+/*
+ * An entry in the entry table of a cache file.
+ */
+typedef struct {
+  
+  /*
+   * The hash of the key.
+   */
+  uint64_t hash[2];
+  
+  /*
+   * The access clock value of the last hit or store, or zero if the
+   * entry is free.
+   */
+  uint64_t tick;
+  
+  /*
+   * The shrink parameters of the output.  Missing bounds are -1.
+   */
+  int32_t sval;
+  int32_t q;
+  int32_t bounds[JPEGSHRINK_CACHE_NBOUNDS];
+  
+  /*
+   * The length of the encoded output in bytes.
+   */
+  int32_t len;
+  
+} JPEGSHRINK_CACHE_SLOT;
+
+/*
+ * The lookup key of a shrink operation.
+ */
+typedef struct {
+  
+  /*
+   * The hash of the client key or of the input file.
+   */
+  uint64_t hash[2];
+  
+  /*
+   * The shrink parameters.
+   */
+  int32_t sval;
+  int32_t q;
+  int32_t bounds[JPEGSHRINK_CACHE_NBOUNDS];
+  
+} JPEGSHRINK_CACHE_KEY;
+
+/*
+ * JPEGSHRINK_CACHE structure.
+ * 
+ * Prototype given in header.
+ */
+struct JPEGSHRINK_CACHE_TAG {
+  
+  /*
+   * Lock serializing the threads of this process.  The record lock on
+   * the file is only taken while holding this.
+   */
+  pthread_mutex_t lock;
+  
+  /*
+   * The open cache file.
+   */
+  int fd;
+  
+  /*
+   * The mapping of the whole file, which is map_len bytes.
+   */
+  uint8_t *pMap;
+  size_t map_len;
+  
+  /*
+   * Pointers into the mapping for the header, the entry table, and the
+   * data of the first entry.
+   */
+  JPEGSHRINK_CACHE_HEAD *pHead;
+  JPEGSHRINK_CACHE_SLOT *pSlots;
+  uint8_t *pData;
+  
+  /*
+   * Copies of the geometry of the cache from the header.
+   */
+  int32_t entries;
+  int32_t entry_bytes;
+  
+};
+
+/*
+ * Local functions
+ * ===============
+ */
+
+/* Prototypes */
+static uint64_t jpegshrink_cache_rotl(uint64_t v, int r);
+static uint64_t jpegshrink_cache_fmix(uint64_t v);
+static void jpegshrink_cache_hash(
+    const uint8_t  * p,
+          size_t     len,
+          uint64_t * pHash);
+
+static int64_t jpegshrink_cache_layout(
+    int32_t   entries,
+    int32_t   entry_bytes,
+    size_t  * pDataOffset);
+
+static int jpegshrink_cache_filelock(int fd, int type);
+static void jpegshrink_cache_lock(JPEGSHRINK_CACHE *pCache);
+static void jpegshrink_cache_unlock(JPEGSHRINK_CACHE *pCache);
+
+static int jpegshrink_cache_valid(
+    const JPEGSHRINK_CACHE      * pCache,
+    const JPEGSHRINK_CACHE_SLOT * ps);
+static int jpegshrink_cache_match(
+    const JPEGSHRINK_CACHE_SLOT * ps,
+    const JPEGSHRINK_CACHE_KEY  * pk);
+static JPEGSHRINK_CACHE_SLOT *jpegshrink_cache_set(
+          JPEGSHRINK_CACHE     * pCache,
+    const JPEGSHRINK_CACHE_KEY * pk);
+static uint8_t *jpegshrink_cache_lookup(
+          JPEGSHRINK_CACHE     * pCache,
+    const JPEGSHRINK_CACHE_KEY * pk,
+          size_t               * pLen,
+          int                  * pStatus);
+static void jpegshrink_cache_store(
+          JPEGSHRINK_CACHE     * pCache,
+    const JPEGSHRINK_CACHE_KEY * pk,
+    const uint8_t              * pOut,
+          size_t                 len);
+
+/*
+ * Rotate a 64-bit value left.
+ * 
+ * Parameters:
+ * 
+ *   v - the value
+ * 
+ *   r - the number of bits, in range 1 to 63
+ * 
+ * Return:
+ * 
+ *   the rotated value
+ */
+static uint64_t jpegshrink_cache_rotl(uint64_t v, int r) {
+  return ((v << r) | (v >> (64 - r)));
+}
+
+/*
+ * Mix the bits of a 64-bit value, using the finalizer of MurmurHash3.
+ * 
+ * Parameters:
+ * 
+ *   v - the value
+ * 
+ * Return:
+ * 
+ *   the mixed value
+ */
+static uint64_t jpegshrink_cache_fmix(uint64_t v) {
+  v ^= (v >> 33);
+  v *= UINT64_C(0xff51afd7ed558ccd);
+  v ^= (v >> 33);
+  v *= UINT64_C(0xc4ceb9fe1a85ec53);
+  v ^= (v >> 33);
+  return v;
+}
+
+/*
+ * Compute the 128-bit hash of a byte string.
+ * 
+ * The string is consumed eight bytes at a time in two lanes that are
+ * mixed together at the end.  This runs at several gigabytes per
+ * second, so hashing an input file costs far less than decoding it.
+ * The hash is not cryptographic.
+ * 
+ * Parameters:
+ * 
+ *   p - the string, which may be NULL if len is zero
+ * 
+ *   len - the length of the string in bytes
+ * 
+ *   pHash - receives the two halves of the hash
+ */
+static void jpegshrink_cache_hash(
+    const uint8_t  * p,
+          size_t     len,
+          uint64_t * pHash) {
+  
+  uint64_t h1 = UINT64_C(0x9e3779b97f4a7c15);
+  uint64_t h2 = UINT64_C(0x6a09e667f3bcc909);
+  uint64_t w = 0;
+  size_t i = 0;
+  
+  /* Check parameters */
+  if ((pHash == NULL) || ((p == NULL) && (len > 0))) {
+    abort();
+  }
+  
+  /* Hash the whole words */
+  for(i = 0; i + 8 <= len; i += 8) {
+    memcpy(&w, p + i, 8);
+    h1 = jpegshrink_cache_rotl(h1 ^ (w * UINT64_C(0x87c37b91114253d5)),
+                                31) * UINT64_C(0x4cf5ad432745937f);
+    h2 = (jpegshrink_cache_rotl(h2 + w, 27) + h1) *
+            UINT64_C(0x52dce729) + UINT64_C(0x38495ab5);
+  }
+  
+  /* Hash the remaining bytes as a partial word */
+  if (i < len) {
+    w = 0;
+    memcpy(&w, p + i, len - i);
+    h1 = jpegshrink_cache_rotl(h1 ^ (w * UINT64_C(0x87c37b91114253d5)),
+                                31) * UINT64_C(0x4cf5ad432745937f);
+    h2 = (jpegshrink_cache_rotl(h2 + w, 27) + h1) *
+            UINT64_C(0x52dce729) + UINT64_C(0x38495ab5);
+  }
+  
+  /* Fold in the length and mix the lanes */
+  h1 ^= (uint64_t) len;
+  h2 ^= (uint64_t) len;
+  h1 += h2;
+  h2 += h1;
+  h1 = jpegshrink_cache_fmix(h1);
+  h2 = jpegshrink_cache_fmix(h2);
+  h1 += h2;
+  h2 += h1;
+  
+  pHash[0] = h1;
+  pHash[1] = h2;
+}
+
+/*
+ * Compute the layout of a cache file.
+ * 
+ * The header is followed by the entry table, and then by the data of
+ * all entries, each entry_bytes long.  The table and the data both
+ * start at multiples of JPEGSHRINK_CACHE_ALIGN.
+ * 
+ * Parameters:
+ * 
+ *   entries - the number of entries
+ * 
+ *   entry_bytes - the size of the data of each entry
+ * 
+ *   pDataOffset - receives the offset of the data of the first entry
+ * 
+ * Return:
+ * 
+ *   the size of the file in bytes
+ */
+static int64_t jpegshrink_cache_layout(
+    int32_t   entries,
+    int32_t   entry_bytes,
+    size_t  * pDataOffset) {
+  
+  int64_t data_offset = 0;
+  
+  /* Check parameters */
+  if ((entries < 1) || (entry_bytes < 1) || (pDataOffset == NULL)) {
+    abort();
+  }
+  
+  /* Place the data after the table, rounded up to the alignment */
+  data_offset = ((int64_t) JPEGSHRINK_CACHE_ALIGN) +
+                  (((int64_t) entries) *
+                    ((int64_t) sizeof(JPEGSHRINK_CACHE_SLOT)));
+  data_offset = ((data_offset + (JPEGSHRINK_CACHE_ALIGN - 1)) /
+                  JPEGSHRINK_CACHE_ALIGN) * JPEGSHRINK_CACHE_ALIGN;
+  
+  *pDataOffset = (size_t) data_offset;
+  return (data_offset +
+            (((int64_t) entries) * ((int64_t) entry_bytes)));
+}
+
+/*
+ * Change the record lock on a whole cache file.
+ * 
+ * The call waits for the lock, and it is retried if it is interrupted
+ * by a signal.
+ * 
+ * Parameters:
+ * 
+ *   fd - the open cache file
+ * 
+ *   type - F_WRLCK to lock or F_UNLCK to unlock
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the lock failed
+ */
+static int jpegshrink_cache_filelock(int fd, int type) {
+  
+  struct flock fl;
+  int retval = 0;
+  
+  /* Describe the whole file */
+  memset(&fl, 0, sizeof(struct flock));
+  fl.l_type = (short) type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 0;
+  fl.l_len = 0;
+  
+  /* Set the lock */
+  do {
+    retval = fcntl(fd, F_SETLKW, &fl);
+  } while ((retval == -1) && (errno == EINTR));
+  
+  return (retval != -1);
+}
+
+/*
+ * Take exclusive access to a cache, first from the other threads of
+ * this process and then from other processes.
+ * 
+ * Locking failures cause faults.
+ * 
+ * Parameters:
+ * 
+ *   pCache - the cache object
+ */
+static void jpegshrink_cache_lock(JPEGSHRINK_CACHE *pCache) {
+  
+  /* Check parameter */
+  if (pCache == NULL) {
+    abort();
+  }
+  
+  /* Lock the mutex and then the file */
+  if (pthread_mutex_lock(&(pCache->lock))) {
+    abort();
+  }
+  if (!jpegshrink_cache_filelock(pCache->fd, F_WRLCK)) {
+    abort();
+  }
+}
+
+/*
+ * Release exclusive access to a cache taken with
+ * jpegshrink_cache_lock().
+ * 
+ * Parameters:
+ * 
+ *   pCache - the cache object
+ */
+static void jpegshrink_cache_unlock(JPEGSHRINK_CACHE *pCache) {
+  
+  /* Check parameter */
+  if (pCache == NULL) {
+    abort();
+  }
+  
+  /* Unlock the file and then the mutex */
+  if (!jpegshrink_cache_filelock(pCache->fd, F_UNLCK)) {
+    abort();
+  }
+  if (pthread_mutex_unlock(&(pCache->lock))) {
+    abort();
+  }
+}
+
+/*
+ * Check whether the fields of an entry are in range.
+ * 
+ * The entry table is in the shared mapping, where any process that can
+ * write to the cache file may have changed it, so the fields of an
+ * entry are checked before they are used to copy its output.  The
+ * length must be in range 1 to the entry size of the cache, the
+ * scaling value in range 1 to JPEGSHRINK_MAXSHRINK, and the quality in
+ * range 0 to 100.
+ * 
+ * Parameters:
+ * 
+ *   pCache - the cache object
+ * 
+ *   ps - the entry
+ * 
+ * Return:
+ * 
+ *   non-zero if the entry is usable, zero otherwise
+ */
+static int jpegshrink_cache_valid(
+    const JPEGSHRINK_CACHE      * pCache,
+    const JPEGSHRINK_CACHE_SLOT * ps) {
+  
+  int result = 1;
+  
+  /* Check parameters */
+  if ((pCache == NULL) || (ps == NULL)) {
+    abort();
+  }
+  
+  /* Check the fields */
+  if ((ps->len < 1) || (ps->len > pCache->entry_bytes) ||
+      (ps->sval < 1) || (ps->sval > JPEGSHRINK_MAXSHRINK) ||
+      (ps->q < 0) || (ps->q > 100)) {
+    result = 0;
+  }
+  
+  return result;
+}
+
+/*
+ * Check whether an entry holds the output for a key.
+ * 
+ * Parameters:
+ * 
+ *   ps - the entry
+ * 
+ *   pk - the key
+ * 
+ * Return:
+ * 
+ *   non-zero if the entry is valid and matches the key, zero otherwise
+ */
+static int jpegshrink_cache_match(
+    const JPEGSHRINK_CACHE_SLOT * ps,
+    const JPEGSHRINK_CACHE_KEY  * pk) {
+  
+  int i = 0;
+  int result = 1;
+  
+  /* Check parameters */
+  if ((ps == NULL) || (pk == NULL)) {
+    abort();
+  }
+  
+  /* Compare the fields */
+  if ((ps->tick == 0) ||
+      (ps->hash[0] != pk->hash[0]) || (ps->hash[1] != pk->hash[1]) ||
+      (ps->sval != pk->sval) || (ps->q != pk->q)) {
+    result = 0;
+  }
+  for(i = 0; result && (i < JPEGSHRINK_CACHE_NBOUNDS); i++) {
+    if (ps->bounds[i] != pk->bounds[i]) {
+      result = 0;
+    }
+  }
+  
+  return result;
+}
+
+/*
+ * Find the set of entries that a key is stored in.
+ * 
+ * The shrink parameters are mixed into the hash, so that outputs of the
+ * same input at different settings spread over different sets.
+ * 
+ * Parameters:
+ * 
+ *   pCache - the cache object
+ * 
+ *   pk - the key
+ * 
+ * Return:
+ * 
+ *   the first of the JPEGSHRINK_CACHE_WAYS entries of the set
+ */
+static JPEGSHRINK_CACHE_SLOT *jpegshrink_cache_set(
+          JPEGSHRINK_CACHE     * pCache,
+    const JPEGSHRINK_CACHE_KEY * pk) {
+  
+  uint64_t h = 0;
+  int i = 0;
+  
+  /* Check parameters */
+  if ((pCache == NULL) || (pk == NULL)) {
+    abort();
+  }
+  
+  /* Mix the parameters into the hash */
+  h = pk->hash[0];
+  h = jpegshrink_cache_fmix(h ^ (uint64_t) (uint32_t) pk->sval);
+  h = jpegshrink_cache_fmix(h ^ (uint64_t) (uint32_t) pk->q);
+  for(i = 0; i < JPEGSHRINK_CACHE_NBOUNDS; i++) {
+    h = jpegshrink_cache_fmix(h ^ (uint64_t) (uint32_t) pk->bounds[i]);
+  }
+  
+  /* Select the set */
+  h %= (uint64_t) (pCache->entries / JPEGSHRINK_CACHE_WAYS);
+  return (pCache->pSlots + (((size_t) h) * JPEGSHRINK_CACHE_WAYS));
+}
+
+/*
+ * Look up a key in the cache and copy out its output.
+ * 
+ * On a hit, the entry is marked as the most recently used, and its
+ * output is copied into a new buffer allocated with malloc(), so that
+ * it can be written out without holding the lock.  If the buffer can't
+ * be allocated, the hit is still counted, NULL is returned, and
+ * pStatus receives SPH_JPEG_ERR_MEM.
+ * 
+ * An entry that matches the key but fails jpegshrink_cache_valid() is
+ * freed and counted as a miss, so that the output is shrunk again and
+ * stored over it.
+ * 
+ * Parameters:
+ * 
+ *   pCache - the cache object
+ * 
+ *   pk - the key
+ * 
+ *   pLen - receives the length of the output on a hit
+ * 
+ *   pStatus - receives SPH_JPEG_ERR_MEM if a hit couldn't be copied
+ * 
+ * Return:
+ * 
+ *   the copy of the output, or NULL on a miss or allocation failure
+ */
+static uint8_t *jpegshrink_cache_lookup(
+          JPEGSHRINK_CACHE     * pCache,
+    const JPEGSHRINK_CACHE_KEY * pk,
+          size_t               * pLen,
+          int                  * pStatus) {
+  
+  JPEGSHRINK_CACHE_SLOT *ps = NULL;
+  JPEGSHRINK_CACHE_SLOT slot;
+  uint8_t *pCopy = NULL;
+  int hit = 0;
+  int i = 0;
+  
+  /* Initialize structures */
+  memset(&slot, 0, sizeof(JPEGSHRINK_CACHE_SLOT));
+  
+  /* Check parameters */
+  if ((pCache == NULL) || (pk == NULL) ||
+      (pLen == NULL) || (pStatus == NULL)) {
+    abort();
+  }
+  
+  /* Search the set of the key, checking a copy of each entry so that
+   * the fields that are checked are the ones that are used */
+  ps = jpegshrink_cache_set(pCache, pk);
+  jpegshrink_cache_lock(pCache);
+  for(i = 0; i < JPEGSHRINK_CACHE_WAYS; i++) {
+    memcpy(&slot, &(ps[i]), sizeof(JPEGSHRINK_CACHE_SLOT));
+    if (jpegshrink_cache_match(&slot, pk)) {
+      if (jpegshrink_cache_valid(pCache, &slot)) {
+        hit = 1;
+      } else {
+        ps[i].tick = 0;
+      }
+      break;
+    }
+  }
+  
+  /* On a hit, refresh the entry and copy out the output */
+  if (hit) {
+    (pCache->pHead->clock)++;
+    ps[i].tick = pCache->pHead->clock;
+    (pCache->pHead->stats).hits++;
+    
+    pCopy = (uint8_t *) malloc((size_t) slot.len);
+    if (pCopy != NULL) {
+      memcpy(
+        pCopy,
+        pCache->pData + (((size_t) (ps + i - pCache->pSlots)) *
+                          ((size_t) pCache->entry_bytes)),
+        (size_t) slot.len);
+      *pLen = (size_t) slot.len;
+    } else {
+      *pStatus = SPH_JPEG_ERR_MEM;
+    }
+    
+  } else {
+    (pCache->pHead->stats).misses++;
+  }
+  jpegshrink_cache_unlock(pCache);
+  
+  return pCopy;
+}
+
+/*
+ * Store the output for a key in the cache.
+ * 
+ * If another process has stored the same key in the meantime, its entry
+ * is overwritten.  Otherwise, a free entry of the set is used, or else
+ * the least recently used entry of the set is replaced.  The entry is
+ * marked free while its data is copied, and only marked valid again
+ * once everything has been stored.
+ * 
+ * Parameters:
+ * 
+ *   pCache - the cache object
+ * 
+ *   pk - the key
+ * 
+ *   pOut - the encoded output
+ * 
+ *   len - the length of the output, at most the entry size
+ */
+static void jpegshrink_cache_store(
+          JPEGSHRINK_CACHE     * pCache,
+    const JPEGSHRINK_CACHE_KEY * pk,
+    const uint8_t              * pOut,
+          size_t                 len) {
+  
+  JPEGSHRINK_CACHE_SLOT *ps = NULL;
+  JPEGSHRINK_CACHE_SLOT *pv = NULL;
+  int i = 0;
+  
+  /* Check parameters */
+  if ((pCache == NULL) || (pk == NULL) || (pOut == NULL)) {
+    abort();
+  }
+  if ((len < 1) || (len > (size_t) pCache->entry_bytes)) {
+    abort();
+  }
+  
+  /* Choose the entry to store into */
+  ps = jpegshrink_cache_set(pCache, pk);
+  jpegshrink_cache_lock(pCache);
+  for(i = 0; i < JPEGSHRINK_CACHE_WAYS; i++) {
+    if (jpegshrink_cache_match(&(ps[i]), pk)) {
+      pv = &(ps[i]);
+      break;
+    }
+    if ((pv == NULL) || (ps[i].tick < pv->tick)) {
+      pv = &(ps[i]);
+    }
+  }
+  if ((pv->tick != 0) && (!jpegshrink_cache_match(pv, pk))) {
+    (pCache->pHead->stats).evictions++;
+  }
+  
+  /* Free the entry, copy the output, and then fill in the entry */
+  pv->tick = 0;
+  memcpy(
+    pCache->pData + (((size_t) (pv - pCache->pSlots)) *
+                      ((size_t) pCache->entry_bytes)),
+    pOut,
+    len);
+  pv->hash[0] = pk->hash[0];
+  pv->hash[1] = pk->hash[1];
+  pv->sval = pk->sval;
+  pv->q = pk->q;
+  memcpy(&(pv->bounds[0]), &(pk->bounds[0]),
+          sizeof(int32_t) * JPEGSHRINK_CACHE_NBOUNDS);
+  pv->len = (int32_t) len;
+  
+  /* Mark the entry valid and most recently used */
+  (pCache->pHead->clock)++;
+  pv->tick = pCache->pHead->clock;
+  (pCache->pHead->stats).stores++;
+  jpegshrink_cache_unlock(pCache);
+}
+
+/*
+ * Public function implementations
+ * ===============================
+ * 
+ * See the header for specifications.
+ */
+
+/*
+ * jpegshrink_cache_open function.
+ */
+JPEGSHRINK_CACHE *jpegshrink_cache_open(
+    const char    * pPath,
+          int32_t   entries,
+          int32_t   entry_bytes) {
+  
+  static const char zero_magic[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  JPEGSHRINK_CACHE *pCache = NULL;
+  JPEGSHRINK_CACHE_HEAD head;
+  struct stat st;
+  ssize_t got = 0;
+  int64_t file_len = 0;
+  size_t data_offset = 0;
+  int locked = 0;
+  int created = 0;
+  int status = 1;
+  int err = 0;
+  
+  /* Initialize structures */
+  memset(&head, 0, sizeof(JPEGSHRINK_CACHE_HEAD));
+  memset(&st, 0, sizeof(struct stat));
+  
+  /* Check parameters */
+  if (pPath == NULL) {
+    abort();
+  }
+  if ((entries < 1) || (entries > JPEGSHRINK_CACHE_MAXENTRIES)) {
+    abort();
+  }
+  if ((entry_bytes < JPEGSHRINK_CACHE_MINBYTES) ||
+      (entry_bytes > JPEGSHRINK_CACHE_MAXBYTES)) {
+    abort();
+  }
+  
+  /* Round the entries up to whole sets and check the file size */
+  entries = ((entries + (JPEGSHRINK_CACHE_WAYS - 1)) /
+              JPEGSHRINK_CACHE_WAYS) * JPEGSHRINK_CACHE_WAYS;
+  if (jpegshrink_cache_layout(entries, entry_bytes, &data_offset) >
+        JPEGSHRINK_CACHE_MAXFILE) {
+    abort();
+  }
+  
+  /* Allocate the object */
+  pCache = (JPEGSHRINK_CACHE *) calloc(1, sizeof(JPEGSHRINK_CACHE));
+  if (pCache == NULL) {
+    return NULL;
+  }
+  if (pthread_mutex_init(&(pCache->lock), NULL)) {
+    abort();
+  }
+  pCache->fd = -1;
+  pCache->pMap = NULL;
+  
+  /* Open the file and lock it while it is checked or created */
+  pCache->fd = open(pPath, O_RDWR | O_CREAT, 0600);
+  if (pCache->fd == -1) {
+    status = 0;
+  }
+  if (status) {
+    if (jpegshrink_cache_filelock(pCache->fd, F_WRLCK)) {
+      locked = 1;
+    } else {
+      status = 0;
+    }
+  }
+  
+  /* Read the header, which is missing if the file is new */
+  if (status) {
+    do {
+      got = pread(pCache->fd, &head, sizeof(JPEGSHRINK_CACHE_HEAD), 0);
+    } while ((got == -1) && (errno == EINTR));
+    if (got == -1) {
+      status = 0;
+    } else if (got == 0) {
+      /* New file */
+      created = 1;
+    } else if (got < (ssize_t) sizeof(JPEGSHRINK_CACHE_HEAD)) {
+      errno = EINVAL;
+      status = 0;
+    } else if ((memcmp(&(head.magic[0]), &(zero_magic[0]), 8) == 0) &&
+                ((head.version == 0) ||
+                  (head.version == JPEGSHRINK_CACHE_VERSION))) {
+      /* Sized by a creator that died before writing the magic bytes */
+      created = 1;
+    }
+  }
+  
+  /* Size a new file, or check the header of an existing one */
+  if (status && created) {
+    memset(&head, 0, sizeof(JPEGSHRINK_CACHE_HEAD));
+    head.version = JPEGSHRINK_CACHE_VERSION;
+    head.head_size = (uint32_t) sizeof(JPEGSHRINK_CACHE_HEAD);
+    head.slot_size = (uint32_t) sizeof(JPEGSHRINK_CACHE_SLOT);
+    head.entries = entries;
+    head.entry_bytes = entry_bytes;
+    file_len = jpegshrink_cache_layout(
+                  entries, entry_bytes, &data_offset);
+    if (ftruncate(pCache->fd, 0) || ftruncate(pCache->fd, file_len)) {
+      status = 0;
+    }
+    
+  } else if (status) {
+    if ((memcmp(&(head.magic[0]), JPEGSHRINK_CACHE_MAGIC, 8) != 0) ||
+        (head.version != JPEGSHRINK_CACHE_VERSION) ||
+        (head.head_size != (uint32_t) sizeof(JPEGSHRINK_CACHE_HEAD)) ||
+        (head.slot_size != (uint32_t) sizeof(JPEGSHRINK_CACHE_SLOT)) ||
+        (head.entries < JPEGSHRINK_CACHE_WAYS) ||
+        (head.entries > JPEGSHRINK_CACHE_MAXENTRIES) ||
+        ((head.entries % JPEGSHRINK_CACHE_WAYS) != 0) ||
+        (head.entry_bytes < JPEGSHRINK_CACHE_MINBYTES) ||
+        (head.entry_bytes > JPEGSHRINK_CACHE_MAXBYTES)) {
+      errno = EINVAL;
+      status = 0;
+    }
+    if (status) {
+      file_len = jpegshrink_cache_layout(
+                    head.entries, head.entry_bytes, &data_offset);
+      if (fstat(pCache->fd, &st)) {
+        status = 0;
+      } else if (((int64_t) st.st_size) < file_len) {
+        errno = EINVAL;
+        status = 0;
+      }
+    }
+  }
+  
+  /* Map the file */
+  if (status) {
+    pCache->map_len = (size_t) file_len;
+    pCache->pMap = (uint8_t *) mmap(
+                      NULL, pCache->map_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, pCache->fd, 0);
+    if (pCache->pMap == (uint8_t *) MAP_FAILED) {
+      pCache->pMap = NULL;
+      status = 0;
+    }
+  }
+  if (status) {
+    pCache->pHead = (JPEGSHRINK_CACHE_HEAD *) pCache->pMap;
+    pCache->pSlots = (JPEGSHRINK_CACHE_SLOT *) (
+                        pCache->pMap + JPEGSHRINK_CACHE_ALIGN);
+    pCache->pData = pCache->pMap + data_offset;
+    pCache->entries = head.entries;
+    pCache->entry_bytes = head.entry_bytes;
+  }
+  
+  /* A new file gets its header, with the magic bytes written last */
+  if (status && created) {
+    memcpy(pCache->pHead, &head, sizeof(JPEGSHRINK_CACHE_HEAD));
+    memcpy(&((pCache->pHead)->magic[0]), JPEGSHRINK_CACHE_MAGIC, 8);
+  }
+  
+  /* Release the file lock */
+  if (locked) {
+    if (!jpegshrink_cache_filelock(pCache->fd, F_UNLCK)) {
+      abort();
+    }
+    locked = 0;
+  }
+  
+  /* Clean up on failure, keeping errno */
+  if (!status) {
+    err = errno;
+    jpegshrink_cache_close(pCache);
+    pCache = NULL;
+    errno = err;
+  }
+  
+  return pCache;
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * jpegshrink_cache_close function.
+ */
+void jpegshrink_cache_close(JPEGSHRINK_CACHE *pCache) {
+  
+  if (pCache != NULL) {
+    if (pCache->pMap != NULL) {
+      (void) munmap(pCache->pMap, pCache->map_len);
+      pCache->pMap = NULL;
+    }
+    if (pCache->fd != -1) {
+      (void) close(pCache->fd);
+      pCache->fd = -1;
+    }
+    (void) pthread_mutex_destroy(&(pCache->lock));
+    free(pCache);
+  }
+}
+
+/*
+ * jpegshrink_cache_run function.
+ */
+int jpegshrink_cache_run(
+          JPEGSHRINK_CACHE  * pCache,
+          JPEGSHRINK_CTX    * pc,
+    const void              * pData,
+          size_t              len,
+    const void              * pKey,
+          size_t              key_len,
+          FILE              * pOut,
+          int                 sval,
+          int                 q,
+    const JPEGSHRINK_BOUNDS * pBounds) {
+  
+  JPEGSHRINK_CACHE_KEY key;
+  int retval = SPH_JPEG_ERR_OK;
+  uint8_t *pCopy = NULL;
+  size_t copy_len = 0;
+  FILE *pIn = NULL;
+  FILE *pMem = NULL;
+  char *pEnc = NULL;
+  size_t enc_len = 0;
+  
+  /* Initialize structures */
+  memset(&key, 0, sizeof(JPEGSHRINK_CACHE_KEY));
+  
+  /* Check parameters */
+  if ((pCache == NULL) || (pData == NULL) || (len < 1) ||
+      (pOut == NULL)) {
+    abort();
+  }
+  if ((pKey == NULL) && (key_len > 0)) {
+    abort();
+  }
+  if ((sval < 1) || (sval > JPEGSHRINK_MAXSHRINK) ||
+      (q < 0) || (q > 100)) {
+    abort();
+  }
+  
+  /* Build the key */
+  if (pKey != NULL) {
+    jpegshrink_cache_hash(
+      (const uint8_t *) pKey, key_len, &(key.hash[0]));
+  } else {
+    jpegshrink_cache_hash((const uint8_t *) pData, len, &(key.hash[0]));
+  }
+  key.sval = (int32_t) sval;
+  key.q = (int32_t) q;
+  if (pBounds != NULL) {
+    key.bounds[0] = pBounds->max_long;
+    key.bounds[1] = pBounds->max_short;
+    key.bounds[2] = pBounds->max_width;
+    key.bounds[3] = pBounds->max_height;
+    key.bounds[4] = pBounds->max_pixels;
+  } else {
+    key.bounds[0] = -1;
+    key.bounds[1] = -1;
+    key.bounds[2] = -1;
+    key.bounds[3] = -1;
+    key.bounds[4] = -1;
+  }
+  
+  /* On a hit, write the cached output */
+  pCopy = jpegshrink_cache_lookup(pCache, &key, &copy_len, &retval);
+  if (pCopy != NULL) {
+    if (fwrite(pCopy, 1, copy_len, pOut) != copy_len) {
+      retval = SPH_JPEG_ERR_WRIT;
+    }
+    free(pCopy);
+    pCopy = NULL;
+    return retval;
+  } else if (retval != SPH_JPEG_ERR_OK) {
+    return retval;
+  }
+  
+  /* On a miss, shrink from memory into memory */
+  pIn = fmemopen((void *) pData, len, "rb");
+  pMem = open_memstream(&pEnc, &enc_len);
+  if ((pIn == NULL) || (pMem == NULL)) {
+    retval = SPH_JPEG_ERR_MEM;
+  }
+  if (retval == SPH_JPEG_ERR_OK) {
+    if (pc != NULL) {
+      retval = jpegshrink_ctx_run(pc, pIn, pMem, sval, q, pBounds);
+    } else {
+      retval = jpegshrink(pIn, pMem, sval, q, pBounds);
+    }
+  }
+  if (pIn != NULL) {
+    (void) fclose(pIn);
+    pIn = NULL;
+  }
+  if (pMem != NULL) {
+    if (fclose(pMem) && (retval == SPH_JPEG_ERR_OK)) {
+      retval = SPH_JPEG_ERR_MEM;
+    }
+    pMem = NULL;
+  }
+  
+  /* Store a successful output if it fits, and then write it */
+  if ((retval == SPH_JPEG_ERR_OK) && (enc_len > 0)) {
+    if (enc_len <= (size_t) pCache->entry_bytes) {
+      jpegshrink_cache_store(
+        pCache, &key, (const uint8_t *) pEnc, enc_len);
+    } else {
+      jpegshrink_cache_lock(pCache);
+      (pCache->pHead->stats).oversize++;
+      jpegshrink_cache_unlock(pCache);
+    }
+    if (fwrite(pEnc, 1, enc_len, pOut) != enc_len) {
+      retval = SPH_JPEG_ERR_WRIT;
+    }
+  }
+  free(pEnc);
+  pEnc = NULL;
+  
+  return retval;
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * jpegshrink_cache_stats function.
+ */
+void jpegshrink_cache_stats(
+    JPEGSHRINK_CACHE       * pCache,
+    JPEGSHRINK_CACHE_STATS * pStats) {
+  
+  /* Check parameters */
+  if ((pCache == NULL) || (pStats == NULL)) {
+    abort();
+  }
+  
+  /* Copy the counters */
+  jpegshrink_cache_lock(pCache);
+  memcpy(pStats, &((pCache->pHead)->stats),
+          sizeof(JPEGSHRINK_CACHE_STATS));
+  jpegshrink_cache_unlock(pCache);
+}
+
+/*
+ * jpegshrink_cache_clear function.
+ */
+void jpegshrink_cache_clear(JPEGSHRINK_CACHE *pCache) {
+  
+  int32_t i = 0;
+  
+  /* Check parameter */
+  if (pCache == NULL) {
+    abort();
+  }
+  
+  /* Free every entry */
+  jpegshrink_cache_lock(pCache);
+  for(i = 0; i < pCache->entries; i++) {
+    (pCache->pSlots)[i].tick = 0;
+  }
+  jpegshrink_cache_unlock(pCache);
+}
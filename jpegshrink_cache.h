@@ -0,0 +1,290 @@
+#ifndef JPEGSHRINK_CACHE_H_INCLUDED
+#define JPEGSHRINK_CACHE_H_INCLUDED
+
+/*
+ * jpegshrink_cache.h
+ * ==================
+ * 
+ * Optional module that caches the encoded output of jpegshrink, so that
+ * repeated requests for the same image at the same settings are served
+ * without decoding or encoding anything.
+ * 
+ * Entries are keyed by a 128-bit hash of the input file, or of a key
+ * chosen by the client, together with the scaling value, the quality,
+ * and the output constraints.  The hash is fast but not cryptographic,
+ * so clients that shrink files from untrusted sources should supply
+ * their own keys, such as a content digest that is already known.
+ * 
+ * The cache lives in a file that is memory-mapped with MAP_SHARED, so
+ * every process on a node that opens the same file shares one cache.
+ * The file holds a fixed number of entries, each with room for an
+ * encoded file of up to a fixed size, so its size is bounded when it is
+ * created and never changes.  Outputs larger than an entry are not
+ * cached.  Entries are grouped into sets of JPEGSHRINK_CACHE_WAYS, and
+ * each key can only be stored in one set, where the least recently used
+ * entry is replaced.  This keeps every lookup to a few entries, however
+ * large the cache is.
+ * 
+ * Access is serialized with a POSIX record lock on the file between
+ * processes, and with a mutex between threads of a process.  The lock
+ * is only held while entries are looked up and copied, never while an
+ * image is shrunk.  The lock is released by the system if a process
+ * dies, and an entry is only marked valid after all of its data has
+ * been stored, so a process that dies while storing an entry leaves a
+ * free entry behind rather than a damaged one.
+ * 
+ * The cache file depends on the layout of structures in memory, so it
+ * may only be shared between processes built for the same platform.
+ * 
+ * Compilation
+ * -----------
+ * 
+ * Compile with sophistry_jpeg and jpegshrink.  Requires a POSIX.1-2008
+ * platform for mmap(), fmemopen(), and open_memstream(), and POSIX
+ * threads, so use -pthread (or -lpthread) when compiling and linking.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "jpegshrink.h"
+
+/*
+ * The number of entries in each set of the cache.
+ * 
+ * The entry count of a cache is always a multiple of this.
+ */
+#define JPEGSHRINK_CACHE_WAYS (8)
+
+/*
+ * The maximum number of entries in a cache.
+ */
+#define JPEGSHRINK_CACHE_MAXENTRIES (1048576)
+
+/*
+ * The range of the largest encoded file that an entry can hold, in
+ * bytes.
+ */
+#define JPEGSHRINK_CACHE_MINBYTES (1024)
+#define JPEGSHRINK_CACHE_MAXBYTES (16777216)
+
+/*
+ * The maximum size of a cache file in bytes, which is 64 GiB.
+ */
+#define JPEGSHRINK_CACHE_MAXFILE (((int64_t) 1) << 36)
+
+/*
+ * JPEGSHRINK_CACHE structure prototype.
+ * 
+ * See the implementation file for definition.
+ * 
+ * A cache object is one process's handle to a cache file.  It may be
+ * used by several threads at the same time.  Record locks belong to
+ * the process rather than to the handle, so a process must not open
+ * the same cache file more than once at a time.
+ */
+struct JPEGSHRINK_CACHE_TAG;
+typedef struct JPEGSHRINK_CACHE_TAG JPEGSHRINK_CACHE;
+
+/*
+ * Structure that receives the counters of a cache.
+ * 
+ * The counters are kept in the cache file, so they cover every process
+ * that has used the file since it was created.
+ * 
+ * See jpegshrink_cache_stats().
+ */
+typedef struct {
+  
+  /*
+   * The number of shrink operations served from the cache.
+   */
+  int64_t hits;
+  
+  /*
+   * The number of shrink operations that were not found in the cache
+   * and had to be performed.
+   */
+  int64_t misses;
+  
+  /*
+   * The number of outputs stored in the cache.
+   */
+  int64_t stores;
+  
+  /*
+   * The number of valid entries that were replaced to make room for a
+   * new output.
+   */
+  int64_t evictions;
+  
+  /*
+   * The number of successful outputs that were too large to be cached.
+   */
+  int64_t oversize;
+  
+} JPEGSHRINK_CACHE_STATS;
+
+/*
+ * Open a cache file, creating it if it does not exist.
+ * 
+ * pPath is the path to the cache file.  If the file does not exist or
+ * is empty, it is created with room for entries encoded files of up to
+ * entry_bytes bytes each.  entries is rounded up to a multiple of
+ * JPEGSHRINK_CACHE_WAYS, and must be in range 1 to
+ * JPEGSHRINK_CACHE_MAXENTRIES.  entry_bytes must be in range
+ * JPEGSHRINK_CACHE_MINBYTES to JPEGSHRINK_CACHE_MAXBYTES.  The total
+ * size of the file may not exceed JPEGSHRINK_CACHE_MAXFILE.  Invalid
+ * parameters cause a fault.
+ * 
+ * The file is sized with ftruncate(), so on most file systems, disk
+ * space is only used by entries that have been stored.  Placing the
+ * file on a memory file system such as /dev/shm keeps the cache in
+ * memory only.
+ * 
+ * If the file already holds a cache, its own entry count and entry
+ * size are used, and the entries and entry_bytes parameters are only
+ * checked.  Several processes may open the same file at the same time,
+ * and exactly one of them creates it.
+ * 
+ * A file that does not exist is created with mode 0600, so only its
+ * owner can open it.  To share a cache between processes running as
+ * different users, create an empty file beforehand with the owner,
+ * group, and mode they need, such as mode 0660 with a group that all
+ * of them belong to.  The first process to open the empty file makes
+ * it into a cache.  Every process that can write to the file can change
+ * what the others read from it, so write access must be limited to
+ * trusted processes.  Entries whose fields are out of range are
+ * treated as misses, but a process with write access can still make
+ * the cache serve wrong outputs.
+ * 
+ * NULL is returned if the file can't be opened, created, or mapped, if
+ * it holds something other than a cache made by this module on the
+ * same platform, or if allocation fails.  errno is then set by the
+ * system call that failed, or to EINVAL if the file is not a valid
+ * cache.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path to the cache file
+ * 
+ *   entries - the number of entries for a new cache
+ * 
+ *   entry_bytes - the size of each entry for a new cache
+ * 
+ * Return:
+ * 
+ *   a new cache object, or NULL if the cache could not be opened
+ */
+JPEGSHRINK_CACHE *jpegshrink_cache_open(
+    const char    * pPath,
+          int32_t   entries,
+          int32_t   entry_bytes);
+
+/*
+ * Close a cache object.
+ * 
+ * The mapping and the file are released.  The cache file itself stays
+ * in place for other processes and later runs.  No other thread may be
+ * using the object.  If NULL is passed, the call is ignored.
+ * 
+ * Parameters:
+ * 
+ *   pCache - the cache object to close, or NULL
+ */
+void jpegshrink_cache_close(JPEGSHRINK_CACHE *pCache);
+
+/*
+ * Perform a shrink operation through the cache.
+ * 
+ * pData points to the complete input JPEG file, which is len bytes,
+ * where len must be at least one.  The encoded output is written to
+ * pOut, in the same way as for jpegshrink().
+ * 
+ * pKey points to a key of key_len bytes that identifies the input, or
+ * is NULL to use the input file itself as the key.  Keys can be any
+ * bytes, such as a path with a modification time or a digest of the
+ * file, as long as different inputs never share a key.  Hashing a key
+ * is cheaper than hashing the file.  A key_len of zero is allowed.
+ * 
+ * The key, sval, q, and the output constraints in pBounds are looked
+ * up in the cache.  If they are found, the cached output is written to
+ * pOut and libjpeg is never called.  Otherwise, the shrink operation
+ * is performed with jpegshrink_ctx_run() on pc, or with jpegshrink()
+ * if pc is NULL, the output is stored in the cache if it fits in an
+ * entry, and it is then written to pOut.  Failed shrink operations are
+ * not cached, and nothing is written to pOut for them.
+ * 
+ * The grayscale and accurate settings of pc (see jpegshrink_ctx_gray()
+ * and jpegshrink_ctx_accurate()) are not part of the key, so clients
+ * that use different settings must use different caches or keys for
+ * them.
+ * 
+ * sval, q, and pBounds are as for jpegshrink().  pBounds may be NULL,
+ * which is the same as all bounds set to -1.
+ * 
+ * Parameters:
+ * 
+ *   pCache - the cache object
+ * 
+ *   pc - the shrink context to use on a miss, or NULL
+ * 
+ *   pData - the input JPEG file
+ * 
+ *   len - the length of the input JPEG file in bytes
+ * 
+ *   pKey - the key of the input, or NULL
+ * 
+ *   key_len - the length of the key in bytes
+ * 
+ *   pOut - the output JPEG file
+ * 
+ *   sval - the scaling value
+ * 
+ *   q - the compression quality
+ * 
+ *   pBounds - the output image constraints, or NULL
+ * 
+ * Return:
+ * 
+ *   SPH_JPEG_ERR_OK (0) if successful, otherwise a sophistry_jpeg error
+ *   code, or -1 if the output constraints are not satisfied
+ */
+int jpegshrink_cache_run(
+          JPEGSHRINK_CACHE  * pCache,
+          JPEGSHRINK_CTX    * pc,
+    const void              * pData,
+          size_t              len,
+    const void              * pKey,
+          size_t              key_len,
+          FILE              * pOut,
+          int                 sval,
+          int                 q,
+    const JPEGSHRINK_BOUNDS * pBounds);
+
+/*
+ * Get the counters of a cache.
+ * 
+ * Parameters:
+ * 
+ *   pCache - the cache object
+ * 
+ *   pStats - receives the counters
+ */
+void jpegshrink_cache_stats(
+    JPEGSHRINK_CACHE       * pCache,
+    JPEGSHRINK_CACHE_STATS * pStats);
+
+/*
+ * Remove every entry from a cache.
+ * 
+ * The entries are marked free in the cache file, so the cache is
+ * emptied for every process that shares it.  The counters are kept.
+ * 
+ * Parameters:
+ * 
+ *   pCache - the cache object
+ */
+void jpegshrink_cache_clear(JPEGSHRINK_CACHE *pCache);
+
+#endif
@@ -0,0 +1,554 @@
+/*
+ * jpegshrink_pipe.c
+ * =================
+ * 
+ * Implementation of jpegshrink_pipe.h
+ * 
+ * See the header for further information.
+ */
+#include "jpegshrink_pipe.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Type declarations
+ * =================
+ */
+
+/*
+ * The state of a pipelined operation, shared by the decode thread and
+ * the calling thread.
+ * 
+ * The ring is an array of slot_count batches, each with room for
+ * slot_rows scanlines of row_size bytes.  Batches are filled by the
+ * decode thread at index tail and emptied by the calling thread at
+ * index head.  filled is the number of batches between them.  Each
+ * thread only touches the contents of a batch while it owns it, so the
+ * lock only needs to be held when moving head, tail, and filled.
+ */
+typedef struct {
+  
+  /*
+   * Lock protecting the ring indices and the flags below, with a
+   * condition that is signalled whenever any of them changes.
+   */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  
+  /*
+   * The maximum ring size in bytes requested by the client.
+   */
+  size_t ring_max;
+  
+  /*
+   * The JPEG reader used by the decode thread, or NULL before the
+   * decode thread has been started.
+   */
+  SPH_JPEG_READER *pr;
+  
+  /*
+   * The decode thread, which is valid if started is non-zero and
+   * joined is zero.
+   */
+  pthread_t thread;
+  int started;
+  int joined;
+  
+  /*
+   * The ring of batches, and the number of scanlines actually in each
+   * filled batch.
+   */
+  uint8_t *pRing;
+  int32_t *pSlotCount;
+  size_t row_size;
+  int32_t slot_rows;
+  int32_t slot_count;
+  
+  /*
+   * The ring indices, and the number of rows of the head batch that
+   * the calling thread has already taken.
+   */
+  int32_t head;
+  int32_t tail;
+  int32_t filled;
+  int32_t head_used;
+  
+  /*
+   * The number of scanlines in the image, and the number that the
+   * decode thread has decoded and the calling thread has taken.
+   */
+  int32_t height;
+  int32_t decoded;
+  int32_t taken;
+  
+  /*
+   * failed is set by the decode thread if the reader reports an error.
+   * cancel is set by the calling thread to make the decode thread stop
+   * early.  done is set by the decode thread when it stops.
+   */
+  int failed;
+  int cancel;
+  int done;
+  
+} JPEGSHRINK_PIPE;
+
+/*
+ * Local functions
+ * ===============
+ */
+
+/* Prototypes */
+static void jpegshrink_pipe_lock(JPEGSHRINK_PIPE *pp);
+static void jpegshrink_pipe_unlock(JPEGSHRINK_PIPE *pp);
+static void *jpegshrink_pipe_worker(void *pParam);
+static void jpegshrink_pipe_start(
+    JPEGSHRINK_PIPE * pp,
+    SPH_JPEG_READER * pr);
+static void jpegshrink_pipe_stop(JPEGSHRINK_PIPE *pp);
+
+static int32_t jpegshrink_pipe_source(
+    void            * pCustom,
+    SPH_JPEG_READER * pr,
+    uint8_t         * buf,
+    size_t            stride,
+    int32_t           max_rows);
+
+static void jpegshrink_pipe_init(JPEGSHRINK_PIPE *pp, size_t ring_max);
+static void jpegshrink_pipe_release(JPEGSHRINK_PIPE *pp);
+
+/*
+ * Acquire the lock of a pipeline, faulting on failure.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pipeline state
+ */
+static void jpegshrink_pipe_lock(JPEGSHRINK_PIPE *pp) {
+  if (pthread_mutex_lock(&(pp->lock))) {
+    abort();
+  }
+}
+
+/*
+ * Release the lock of a pipeline and wake any waiting thread, faulting
+ * on failure.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pipeline state
+ */
+static void jpegshrink_pipe_unlock(JPEGSHRINK_PIPE *pp) {
+  if (pthread_cond_broadcast(&(pp->cond))) {
+    abort();
+  }
+  if (pthread_mutex_unlock(&(pp->lock))) {
+    abort();
+  }
+}
+
+/*
+ * Decode thread procedure.
+ * 
+ * pParam points to the JPEGSHRINK_PIPE state.  The thread decodes the
+ * whole image into the ring one batch at a time, waiting whenever the
+ * ring is full, until all rows are decoded, the reader reports an
+ * error, or the calling thread cancels the operation.
+ * 
+ * Parameters:
+ * 
+ *   pParam - the pipeline state
+ * 
+ * Return:
+ * 
+ *   always NULL
+ */
+static void *jpegshrink_pipe_worker(void *pParam) {
+  
+  JPEGSHRINK_PIPE *pp = NULL;
+  int32_t slot = 0;
+  int32_t want = 0;
+  int32_t got = 0;
+  
+  /* Get the pipeline state */
+  if (pParam == NULL) {
+    abort();
+  }
+  pp = (JPEGSHRINK_PIPE *) pParam;
+  
+  jpegshrink_pipe_lock(pp);
+  while ((pp->decoded < pp->height) && (!(pp->cancel))) {
+    
+    /* Wait for a free batch */
+    while ((pp->filled >= pp->slot_count) && (!(pp->cancel))) {
+      if (pthread_cond_wait(&(pp->cond), &(pp->lock))) {
+        abort();
+      }
+    }
+    if (pp->cancel) {
+      break;
+    }
+    
+    /* Take the batch at the tail and decide how many rows to decode */
+    slot = pp->tail;
+    want = pp->height - pp->decoded;
+    if (want > pp->slot_rows) {
+      want = pp->slot_rows;
+    }
+    
+    /* Decode into the batch without holding the lock */
+    jpegshrink_pipe_unlock(pp);
+    got = sph_jpeg_reader_get_rows(
+            pp->pr,
+            pp->pRing +
+              (((size_t) slot) * ((size_t) pp->slot_rows) *
+                pp->row_size),
+            pp->row_size,
+            want);
+    jpegshrink_pipe_lock(pp);
+    
+    /* Stop on error, else hand the batch to the calling thread */
+    if (got < 1) {
+      pp->failed = 1;
+      break;
+    }
+    (pp->pSlotCount)[slot] = got;
+    pp->tail = (slot + 1) % pp->slot_count;
+    (pp->filled)++;
+    pp->decoded += got;
+  }
+  pp->done = 1;
+  jpegshrink_pipe_unlock(pp);
+  
+  return NULL;
+}
+
+/*
+ * Allocate the ring and start the decode thread.
+ * 
+ * This is called on the calling thread the first time the shrink
+ * operation asks for scanlines.  pr is the reader, which has been
+ * opened on the input image and is not used by the calling thread
+ * again until the decode thread has stopped.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pipeline state
+ * 
+ *   pr - the JPEG reader
+ */
+static void jpegshrink_pipe_start(
+    JPEGSHRINK_PIPE * pp,
+    SPH_JPEG_READER * pr) {
+  
+  size_t rows = 0;
+  size_t slots = 0;
+  
+  /* Check parameters and state */
+  if ((pp == NULL) || (pr == NULL)) {
+    abort();
+  }
+  if (pp->started) {
+    abort();
+  }
+  
+  /* Get the image geometry */
+  pp->pr = pr;
+  pp->height = sph_jpeg_reader_height(pr);
+  pp->row_size = ((size_t) sph_jpeg_reader_width(pr)) *
+                  ((size_t) sph_jpeg_reader_channels(pr));
+  
+  /* Split the ring size into at least two batches, making the batches
+   * as large as possible up to the maximum rows */
+  rows = pp->ring_max / (pp->row_size * 2);
+  if (rows < 1) {
+    rows = 1;
+  } else if (rows > JPEGSHRINK_PIPE_MAXROWS) {
+    rows = JPEGSHRINK_PIPE_MAXROWS;
+  }
+  pp->slot_rows = (int32_t) rows;
+  
+  slots = pp->ring_max / (pp->row_size * rows);
+  if (slots < 2) {
+    slots = 2;
+  } else if (slots > JPEGSHRINK_PIPE_MAXSLOTS) {
+    slots = JPEGSHRINK_PIPE_MAXSLOTS;
+  }
+  pp->slot_count = (int32_t) slots;
+  
+  /* Allocate the ring */
+  pp->pRing = (uint8_t *) malloc(
+                ((size_t) pp->slot_count) * ((size_t) pp->slot_rows) *
+                  pp->row_size);
+  pp->pSlotCount = (int32_t *) calloc(
+                      (size_t) pp->slot_count, sizeof(int32_t));
+  if ((pp->pRing == NULL) || (pp->pSlotCount == NULL)) {
+    abort();
+  }
+  
+  /* Start the decode thread */
+  if (pthread_create(
+        &(pp->thread), NULL, &jpegshrink_pipe_worker, pp)) {
+    abort();
+  }
+  pp->started = 1;
+}
+
+/*
+ * Stop the decode thread if it is running and wait for it.
+ * 
+ * If the decode thread has not finished decoding, it is cancelled,
+ * leaving the reader part way through the image.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pipeline state
+ */
+static void jpegshrink_pipe_stop(JPEGSHRINK_PIPE *pp) {
+  
+  /* Check parameter */
+  if (pp == NULL) {
+    abort();
+  }
+  
+  /* Only proceed if there is a thread to join */
+  if (pp->started && (!(pp->joined))) {
+    jpegshrink_pipe_lock(pp);
+    pp->cancel = 1;
+    jpegshrink_pipe_unlock(pp);
+    
+    if (pthread_join(pp->thread, NULL)) {
+      abort();
+    }
+    pp->joined = 1;
+  }
+}
+
+/*
+ * JPEGSHRINK_SOURCE callback that takes scanlines out of the ring.
+ * 
+ * pCustom points to the JPEGSHRINK_PIPE state.  The decode thread is
+ * started on the first call.  Rows are copied out of the ring until
+ * max_rows rows have been copied or the ring is empty after at least
+ * one row.  Once the last row has been taken, or the decode thread has
+ * failed, the decode thread is joined before returning.
+ */
+static int32_t jpegshrink_pipe_source(
+    void            * pCustom,
+    SPH_JPEG_READER * pr,
+    uint8_t         * buf,
+    size_t            stride,
+    int32_t           max_rows) {
+  
+  JPEGSHRINK_PIPE *pp = NULL;
+  int32_t count = 0;
+  int32_t avail = 0;
+  int32_t n = 0;
+  int32_t i = 0;
+  const uint8_t *pBatch = NULL;
+  
+  /* Check parameters */
+  if ((pCustom == NULL) || (pr == NULL) || (buf == NULL) ||
+      (max_rows < 1)) {
+    abort();
+  }
+  pp = (JPEGSHRINK_PIPE *) pCustom;
+  
+  /* Start the decode thread on the first call */
+  if (!(pp->started)) {
+    jpegshrink_pipe_start(pp, pr);
+  }
+  if ((pp->pr != pr) || (stride < pp->row_size) ||
+      (pp->taken >= pp->height)) {
+    abort();
+  }
+  
+  while ((count < max_rows) && (pp->taken < pp->height)) {
+    
+    /* Wait for a filled batch, unless some rows were already copied
+     * and the ring is empty */
+    jpegshrink_pipe_lock(pp);
+    if (count < 1) {
+      while ((pp->filled < 1) && (!(pp->done))) {
+        if (pthread_cond_wait(&(pp->cond), &(pp->lock))) {
+          abort();
+        }
+      }
+    }
+    avail = pp->filled;
+    jpegshrink_pipe_unlock(pp);
+    
+    /* Leave loop if nothing is available */
+    if (avail < 1) {
+      break;
+    }
+    
+    /* Copy rows out of the head batch, which this thread owns */
+    pBatch = pp->pRing +
+              (((size_t) pp->head) * ((size_t) pp->slot_rows) *
+                pp->row_size);
+    n = (pp->pSlotCount)[pp->head] - pp->head_used;
+    if (n > max_rows - count) {
+      n = max_rows - count;
+    }
+    for(i = 0; i < n; i++) {
+      memcpy(
+        buf + (((size_t) (count + i)) * stride),
+        pBatch + (((size_t) (pp->head_used + i)) * pp->row_size),
+        pp->row_size);
+    }
+    count += n;
+    pp->taken += n;
+    pp->head_used += n;
+    
+    /* Give the batch back to the decode thread once it is empty */
+    if (pp->head_used >= (pp->pSlotCount)[pp->head]) {
+      jpegshrink_pipe_lock(pp);
+      pp->head = (pp->head + 1) % pp->slot_count;
+      (pp->filled)--;
+      pp->head_used = 0;
+      jpegshrink_pipe_unlock(pp);
+    }
+  }
+  
+  /* Join the decode thread once it can't supply any more rows, so that
+   * the reader status may be read by the shrink operation */
+  if ((pp->taken >= pp->height) || (count < 1)) {
+    jpegshrink_pipe_stop(pp);
+  }
+  
+  return count;
+}
+
+/*
+ * Initialize the state of a pipelined operation.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pipeline state
+ * 
+ *   ring_max - the maximum ring size in bytes, or zero for the default
+ */
+static void jpegshrink_pipe_init(JPEGSHRINK_PIPE *pp, size_t ring_max) {
+  
+  /* Check parameter */
+  if (pp == NULL) {
+    abort();
+  }
+  
+  /* Initialize the state */
+  memset(pp, 0, sizeof(JPEGSHRINK_PIPE));
+  if (pthread_mutex_init(&(pp->lock), NULL)) {
+    abort();
+  }
+  if (pthread_cond_init(&(pp->cond), NULL)) {
+    abort();
+  }
+  if (ring_max > 0) {
+    pp->ring_max = ring_max;
+  } else {
+    pp->ring_max = JPEGSHRINK_PIPE_DEFRING;
+  }
+  pp->pr = NULL;
+  pp->started = 0;
+  pp->joined = 0;
+  pp->pRing = NULL;
+  pp->pSlotCount = NULL;
+}
+
+/*
+ * Stop the decode thread if necessary and release the state of a
+ * pipelined operation.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pipeline state
+ */
+static void jpegshrink_pipe_release(JPEGSHRINK_PIPE *pp) {
+  
+  /* Check parameter */
+  if (pp == NULL) {
+    abort();
+  }
+  
+  /* Stop the decode thread and release the ring */
+  jpegshrink_pipe_stop(pp);
+  free(pp->pRing);
+  pp->pRing = NULL;
+  free(pp->pSlotCount);
+  pp->pSlotCount = NULL;
+  
+  /* Release the synchronization objects */
+  if (pthread_cond_destroy(&(pp->cond))) {
+    abort();
+  }
+  if (pthread_mutex_destroy(&(pp->lock))) {
+    abort();
+  }
+}
+
+/*
+ * Public function implementations
+ * ===============================
+ * 
+ * See the header for specifications.
+ */
+
+/*
+ * jpegshrink_pipe_run function.
+ */
+int jpegshrink_pipe_run(
+          JPEGSHRINK_CTX    * pc,
+          FILE              * pIn,
+          FILE              * pOut,
+          int                 sval,
+          int                 q,
+    const JPEGSHRINK_BOUNDS * pBounds,
+          size_t              ring_max) {
+  
+  int retval = SPH_JPEG_ERR_OK;
+  JPEGSHRINK_PIPE state;
+  
+  /* Check parameters */
+  if (pc == NULL) {
+    abort();
+  }
+  
+  /* Run the operation with the pipeline as the scanline source */
+  jpegshrink_pipe_init(&state, ring_max);
+  jpegshrink_ctx_source(pc, &jpegshrink_pipe_source, &state);
+  retval = jpegshrink_ctx_run(pc, pIn, pOut, sval, q, pBounds);
+  jpegshrink_ctx_source(pc, NULL, NULL);
+  jpegshrink_pipe_release(&state);
+  
+  return retval;
+}
+
+/*
+ * jpegshrink_pipe_fit function.
+ */
+int jpegshrink_pipe_fit(
+          JPEGSHRINK_CTX    * pc,
+          FILE              * pIn,
+          FILE              * pOut,
+          int                 q,
+    const JPEGSHRINK_BOUNDS * pBounds,
+          size_t              ring_max) {
+  
+  int retval = SPH_JPEG_ERR_OK;
+  JPEGSHRINK_PIPE state;
+  
+  /* Check parameters */
+  if (pc == NULL) {
+    abort();
+  }
+  
+  /* Run the operation with the pipeline as the scanline source */
+  jpegshrink_pipe_init(&state, ring_max);
+  jpegshrink_ctx_source(pc, &jpegshrink_pipe_source, &state);
+  retval = jpegshrink_ctx_fit(pc, pIn, pOut, q, pBounds);
+  jpegshrink_ctx_source(pc, NULL, NULL);
+  jpegshrink_pipe_release(&state);
+  
+  return retval;
+}
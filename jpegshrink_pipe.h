@@ -0,0 +1,142 @@
+#ifndef JPEGSHRINK_PIPE_H_INCLUDED
+#define JPEGSHRINK_PIPE_H_INCLUDED
+
+/*
+ * jpegshrink_pipe.h
+ * =================
+ * 
+ * Optional module that runs a single jpegshrink operation as a two
+ * stage pipeline.
+ * 
+ * Normally, jpegshrink decodes, filters, and encodes each scanline in
+ * lockstep on one thread, so while the thread is waiting for input or
+ * output, nothing else gets done.  In pipelined mode, a decode thread
+ * reads the input and fills a ring of scanline batches, while the
+ * calling thread takes batches out of the ring, filters them, and
+ * encodes and writes the output.  Slow input and output streams then
+ * overlap with decoding and encoding, and the two stages can run on
+ * separate cores.
+ * 
+ * The memory used by the ring is capped by a limit that the client
+ * chooses.  When the ring is full, the decode thread waits for the
+ * calling thread to catch up, and when it is empty, the calling thread
+ * waits for the decode thread.
+ * 
+ * The pipeline is built on the scanline source callback of shrink
+ * contexts (see jpegshrink_ctx_source()), so it produces exactly the
+ * same output as the unpipelined operations.
+ * 
+ * Compilation
+ * -----------
+ * 
+ * Compile with sophistry_jpeg and jpegshrink.  Requires POSIX threads,
+ * so use -pthread (or -lpthread) when compiling and linking.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "jpegshrink.h"
+
+/*
+ * The default ring size in bytes, used when zero is passed as the ring
+ * size.
+ */
+#define JPEGSHRINK_PIPE_DEFRING (4194304)
+
+/*
+ * The maximum number of scanlines in each batch of the ring.
+ */
+#define JPEGSHRINK_PIPE_MAXROWS (16)
+
+/*
+ * The maximum number of batches in the ring.
+ */
+#define JPEGSHRINK_PIPE_MAXSLOTS (64)
+
+/*
+ * Perform a pipelined shrink operation using a shrink context.
+ * 
+ * This is the same as jpegshrink_ctx_run(), except that decoding runs
+ * on a separate thread that feeds the calling thread through a ring of
+ * scanline batches.  The parameters and the return value are the same
+ * as for jpegshrink_ctx_run().
+ * 
+ * ring_max is the maximum size of the ring in bytes, or zero to use
+ * JPEGSHRINK_PIPE_DEFRING.  The ring is divided into at least two
+ * batches of at most JPEGSHRINK_PIPE_MAXROWS decoded scanlines each,
+ * and has at most JPEGSHRINK_PIPE_MAXSLOTS batches.  If ring_max is not
+ * large enough to hold two decoded scanlines, the ring holds two
+ * batches of one scanline each, which exceeds ring_max.  The ring is
+ * allocated for the operation and released afterwards.
+ * 
+ * A source callback installed on pc is replaced for the duration of
+ * the operation, and removed afterwards.  The decode thread is only
+ * started once the output has been opened, so it is never started if
+ * the input can't be read or the output constraints are not satisfied.
+ * Failure to create the thread or allocate the ring causes a fault.
+ * 
+ * Parameters:
+ * 
+ *   pc - the shrink context
+ * 
+ *   pIn - the input JPEG file
+ * 
+ *   pOut - the output JPEG file
+ * 
+ *   sval - the scaling value
+ * 
+ *   q - the compression quality
+ * 
+ *   pBounds - the output image constraints, or NULL
+ * 
+ *   ring_max - the maximum ring size in bytes, or zero for the default
+ * 
+ * Return:
+ * 
+ *   SPH_JPEG_ERR_OK (0) if successful, otherwise a sophistry_jpeg error
+ *   code, or -1 if the output constraints are not satisfied
+ */
+int jpegshrink_pipe_run(
+          JPEGSHRINK_CTX    * pc,
+          FILE              * pIn,
+          FILE              * pOut,
+          int                 sval,
+          int                 q,
+    const JPEGSHRINK_BOUNDS * pBounds,
+          size_t              ring_max);
+
+/*
+ * Perform a pipelined fit operation using a shrink context.
+ * 
+ * This is the same as jpegshrink_ctx_fit(), except that decoding is
+ * pipelined in the same way as for jpegshrink_pipe_run().
+ * 
+ * Parameters:
+ * 
+ *   pc - the shrink context
+ * 
+ *   pIn - the input JPEG file
+ * 
+ *   pOut - the output JPEG file
+ * 
+ *   q - the compression quality
+ * 
+ *   pBounds - the output image constraints, or NULL
+ * 
+ *   ring_max - the maximum ring size in bytes, or zero for the default
+ * 
+ * Return:
+ * 
+ *   SPH_JPEG_ERR_OK (0) if successful, otherwise a sophistry_jpeg error
+ *   code, or -1 if the output constraints can't be satisfied
+ */
+int jpegshrink_pipe_fit(
+          JPEGSHRINK_CTX    * pc,
+          FILE              * pIn,
+          FILE              * pOut,
+          int                 q,
+    const JPEGSHRINK_BOUNDS * pBounds,
+          size_t              ring_max);
+
+#endif
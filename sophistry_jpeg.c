@@ -7,11 +7,107 @@
  * See the header for further information.
  */
 
+/* Instrumentation needs clock_gettime() from POSIX */
+#ifdef SPH_JPEG_ENABLE_STATS
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#endif
+
 #include "sophistry_jpeg.h"
+#include <limits.h>
 #include <setjmp.h>
 #include <stdlib.h>
 #include <string.h>
 #include "jpeglib.h"
+#include "jerror.h"
+
+#ifdef SPH_JPEG_ENABLE_STATS
+#include <time.h>
+#endif
+
+/*
+ * Constants
+ * =========
+ */
+
+/*
+ * The maximum number of row pointers passed to libjpeg in a single call
+ * by the multi-scanline batch functions.
+ * 
+ * libjpeg itself only processes rec_outbuf_height rows (at most
+ * max_v_samp_factor, which is four or less) per row group, so this only
+ * needs to be large enough to hold a few complete row groups.
+ */
+#define SPH_JPEG_ROWSET (16)
+
+/*
+ * The size in bytes of the staging buffer used by writers that deliver
+ * their output to a sink callback.
+ */
+#define SPH_JPEG_SINKBUF (4096)
+
+/*
+ * The minimum capacity in bytes that a memory buffer is grown to when
+ * a writer first needs space in it.
+ */
+#define SPH_JPEG_MEMINIT (16384)
+
+/*
+ * The minimum capacity in bytes that the buffer of a feed reader is
+ * grown to when data is first fed to it.
+ */
+#define SPH_JPEG_FEEDINIT (16384)
+
+/*
+ * The size in bytes of the read buffer used when probing a file.
+ */
+#define SPH_JPEG_PROBEBUF (4096)
+
+/*
+ * The alignment in bytes of the memory that the custom memory manager
+ * returns, and the multiple in bytes that it rounds sample rows up to.
+ * 
+ * These match the libjpeg-turbo memory manager, whose SIMD routines
+ * work best on sample rows that are aligned and padded like this.
+ */
+#define SPH_JPEG_MEMALIGN (32)
+#define SPH_JPEG_MEMROW (64)
+
+/*
+ * SPH_JPEG_HAVE_SKIP is defined if libjpeg provides the
+ * jpeg_skip_scanlines() and jpeg_crop_scanline() extensions, which were
+ * added in libjpeg-turbo 1.5.  Only libjpeg-turbo versions that define
+ * LIBJPEG_TURBO_VERSION_NUMBER are detected.  Define SPH_JPEG_NO_SKIP
+ * when compiling to use the portable fallback instead.
+ */
+#ifndef SPH_JPEG_NO_SKIP
+#ifdef LIBJPEG_TURBO_VERSION_NUMBER
+#if LIBJPEG_TURBO_VERSION_NUMBER >= 1005000
+#define SPH_JPEG_HAVE_SKIP
+#endif
+#endif
+#endif
+
+/*
+ * Instrumentation macros.
+ * 
+ * SPH_JPEG_STAT_MARK() starts timing an operation on the stats field
+ * of a reader or writer, and SPH_JPEG_STAT_TIME() adds the time since
+ * then to one of its timers.  SPH_JPEG_STAT_COUNT() adds to one of its
+ * counters.  Without SPH_JPEG_ENABLE_STATS, these expand to nothing.
+ */
+#ifdef SPH_JPEG_ENABLE_STATS
+#define SPH_JPEG_STAT_MARK(st) ((st).mark = sph_jpeg_stat_now())
+#define SPH_JPEG_STAT_TIME(st, field) \
+  ((st).pub.field += sph_jpeg_stat_now() - (st).mark)
+#define SPH_JPEG_STAT_COUNT(st, field, n) \
+  ((st).pub.field += (int64_t) (n))
+#else
+#define SPH_JPEG_STAT_MARK(st)
+#define SPH_JPEG_STAT_TIME(st, field)
+#define SPH_JPEG_STAT_COUNT(st, field, n)
+#endif
 
 /*
  * Type declarations
@@ -19,45 +115,304 @@
  */
 
 /*
- * SPH_JPEG_WRITER
+ * The memory source manager object.
  * 
- * See the header for prototype.
+ * Used by readers that decode from a buffer in memory.
  */
-struct SPH_JPEG_WRITER_TAG {
+typedef struct {
   
   /*
-   * The compressor object.
+   * The common source manager fields.
+   * 
+   * This must be the first member of the structure.
    */
-  struct jpeg_compress_struct cinfo;
+  struct jpeg_source_mgr pub;
   
   /*
-   * The error object.
+   * The start of the buffer to decode.
    */
-  struct jpeg_error_mgr jerr;
+  const JOCTET *pData;
   
   /*
-   * The width of the output image in pixels.
+   * The length in bytes of the buffer to decode.
    */
-  int32_t width;
+  size_t len;
+  
+} SPH_JPEG_MEMSRC;
+
+/*
+ * The feed source manager object.
+ * 
+ * Used by readers that are fed with sph_jpeg_reader_feed().  The data
+ * fed so far that libjpeg hasn't consumed yet is kept in a buffer owned
+ * by the reader.  Until the end of the data is signalled, running out
+ * of data makes libjpeg suspend, so decoding can be resumed once more
+ * data has been fed.
+ */
+typedef struct {
   
   /*
-   * The height of the output image in pixels.
-   */ 
-  int32_t height;
+   * The common source manager fields.
+   * 
+   * This must be the first member of the structure.
+   */
+  struct jpeg_source_mgr pub;
   
   /*
-   * The number of scanlines written to output.
+   * The buffer of data that has been fed, which has a capacity of cap
+   * bytes.
+   * 
+   * The buffer is kept when the reader is reset.
    */
-  int32_t written;
+  JOCTET *pBuf;
+  size_t cap;
   
   /*
-   * The number of channels.
+   * The number of bytes that libjpeg has asked to skip beyond the data
+   * fed so far, which are skipped in data that is fed later.
+   */
+  size_t skip;
+  
+  /*
+   * Non-zero once the end of the data has been signalled.
+   */
+  int ended;
+  
+} SPH_JPEG_FEEDSRC;
+
+/*
+ * The probe source manager object.
+ * 
+ * Used when only reading the header of a JPEG file.  Unlike the other
+ * source managers, this one suspends at the end of data instead of
+ * inserting a fake EOI marker, so that a header can be probed from a
+ * prefix of the file.
+ */
+typedef struct {
+  
+  /*
+   * The common source manager fields.
    * 
-   * One for grayscale, three for RGB.
+   * This must be the first member of the structure.
    */
-  int chcount;
+  struct jpeg_source_mgr pub;
+  
+  /*
+   * The file to read from, or NULL if probing a memory buffer.
+   */
+  FILE *pIn;
+  
+  /*
+   * The read buffer used with files.
+   */
+  JOCTET buf[SPH_JPEG_PROBEBUF];
+  
+} SPH_JPEG_PROBESRC;
+
+/*
+ * The memory destination manager object.
+ * 
+ * Used by writers that encode into a memory buffer or a sink callback.
+ * Exactly one of pBuf and fSink is non-NULL.
+ */
+typedef struct {
+  
+  /*
+   * The common destination manager fields.
+   * 
+   * This must be the first member of the structure.
+   */
+  struct jpeg_destination_mgr pub;
+  
+  /*
+   * The growable memory buffer to append to, or NULL if writing to a
+   * sink callback.
+   */
+  SPH_JPEG_MEMBUF *pBuf;
+  
+  /*
+   * The sink callback, or NULL if writing to a memory buffer.
+   */
+  SPH_JPEG_SINK fSink;
+  
+  /*
+   * The custom parameter passed through to the sink callback.
+   */
+  void *pCustom;
+  
+  /*
+   * The staging buffer used with sink callbacks.
+   */
+  JOCTET staging[SPH_JPEG_SINKBUF];
+  
+} SPH_JPEG_MEMDEST;
+
+#ifdef SPH_JPEG_ENABLE_STATS
+/*
+ * The instrumentation state of a reader or writer object.
+ * 
+ * The client_data field of the libjpeg object points to this structure,
+ * so that the wrappers installed around the libjpeg memory manager and
+ * the source or destination manager can find it.
+ */
+typedef struct {
+  
+  /*
+   * The counters reported to the client.
+   * 
+   * For readers, the bytes counter does not yet include the bytes
+   * consumed from the current source manager.
+   */
+  SPH_JPEG_STATS pub;
+  
+  /*
+   * The start time of the operation being timed.
+   */
+  int64_t mark;
+  
+  /*
+   * The number of bytes requested from each libjpeg pool.
+   */
+  int64_t pool[JPOOL_NUMPOOLS];
+  
+  /*
+   * A copy of the original libjpeg memory manager methods, which the
+   * wrappers call through.
+   */
+  struct jpeg_memory_mgr mem;
+  
+  /*
+   * Readers only: the original fill method of the stdio source manager,
+   * or NULL if reading from memory, and the number of bytes the current
+   * source manager has delivered to libjpeg.
+   */
+  boolean (*fill_input_buffer)(j_decompress_ptr cinfo);
+  int64_t delivered;
+  
+  /*
+   * Writers only: the original destination manager methods, and the
+   * free space of the destination buffer when its bytes were last
+   * counted.
+   */
+  void (*init_destination)(j_compress_ptr cinfo);
+  boolean (*empty_output_buffer)(j_compress_ptr cinfo);
+  void (*term_destination)(j_compress_ptr cinfo);
+  size_t mark_free;
+  
+} SPH_JPEG_STATCTX;
+#endif
+
+/*
+ * Structure prototype for a block allocated by the custom memory
+ * manager.
+ */
+struct SPH_JPEG_MEMBLOCK_TAG;
+typedef struct SPH_JPEG_MEMBLOCK_TAG SPH_JPEG_MEMBLOCK;
+
+/*
+ * The header at the start of each block allocated by the custom memory
+ * manager.
+ * 
+ * The memory returned to libjpeg follows the header, aligned to
+ * SPH_JPEG_MEMALIGN bytes.
+ */
+struct SPH_JPEG_MEMBLOCK_TAG {
+  
+  /*
+   * The next block in the same pool, or NULL if this is the last one.
+   */
+  SPH_JPEG_MEMBLOCK *pNext;
+  
+  /*
+   * The total allocated size of the block in bytes, including the
+   * header and the alignment padding.
+   */
+  size_t size;
+  
+  /*
+   * The allocator that the block must be released through, or NULL if
+   * it was allocated with malloc().
+   */
+  const SPH_JPEG_ALLOCATOR *pAlloc;
 };
 
+/*
+ * Virtual array control structures, which are opaque in the libjpeg
+ * headers and defined by each memory manager.
+ * 
+ * The custom memory manager always keeps virtual arrays entirely in
+ * memory, so each one is just an ordinary array that is allocated when
+ * libjpeg realizes the virtual arrays.  rows and width are the
+ * dimensions of the array, maxaccess is the most rows libjpeg may
+ * access at once, and pre_zero requests the array to be zeroed.
+ */
+struct jvirt_sarray_control {
+  JSAMPARRAY mem_buffer;
+  JDIMENSION rows;
+  JDIMENSION width;
+  JDIMENSION maxaccess;
+  boolean pre_zero;
+  jvirt_sarray_ptr next;
+};
+
+struct jvirt_barray_control {
+  JBLOCKARRAY mem_buffer;
+  JDIMENSION rows;
+  JDIMENSION width;
+  JDIMENSION maxaccess;
+  boolean pre_zero;
+  jvirt_barray_ptr next;
+};
+
+/*
+ * The state of the custom memory manager of a reader or writer object.
+ * 
+ * The custom memory manager replaces the allocation methods of the
+ * libjpeg memory manager once a memory limit or a custom allocator is
+ * first requested for the object.  Allocations made before then stay
+ * with libjpeg, and the original free_pool and self_destruct methods
+ * are still called to release them.  All virtual arrays of an image
+ * belong to the same manager, because the custom manager is installed
+ * between images.
+ */
+typedef struct {
+  
+  /*
+   * Non-zero once the custom memory manager has been installed.
+   */
+  int installed;
+  
+  /*
+   * The blocks allocated in each libjpeg pool.
+   */
+  SPH_JPEG_MEMBLOCK *pPool[JPOOL_NUMPOOLS];
+  
+  /*
+   * The virtual arrays requested for the current image.
+   */
+  jvirt_sarray_ptr pVirtS;
+  jvirt_barray_ptr pVirtB;
+  
+  /*
+   * The total size in bytes of all the allocated blocks, and the limit
+   * that it may not exceed, or zero if there is no limit.
+   */
+  size_t in_use;
+  size_t limit;
+  
+  /*
+   * The allocator for new blocks, or NULL to use malloc().
+   */
+  const SPH_JPEG_ALLOCATOR *pAlloc;
+  
+  /*
+   * The original libjpeg methods that release memory.
+   */
+  void (*free_pool)(j_common_ptr cinfo, int pool_id);
+  void (*self_destruct)(j_common_ptr cinfo);
+  
+} SPH_JPEG_MEMMGR;
+
 /*
  * The custom error manager object.
  */
@@ -80,16 +435,16 @@ typedef struct {
 } SPH_JPEG_ERRMAN;
 
 /*
- * SPH_JPEG_READER
+ * SPH_JPEG_WRITER
  * 
  * See the header for prototype.
  */
-struct SPH_JPEG_READER_TAG {
+struct SPH_JPEG_WRITER_TAG {
   
   /*
-   * The decompressor object.
+   * The compressor object.
    */
-  struct jpeg_decompress_struct cinfo;
+  struct jpeg_compress_struct cinfo;
   
   /*
    * The custom error manager object.
@@ -97,19 +452,68 @@ struct SPH_JPEG_READER_TAG {
   SPH_JPEG_ERRMAN errman;
   
   /*
-   * The width of the input image in pixels.
+   * The memory destination manager, used only when not writing to a
+   * file.
+   */
+  SPH_JPEG_MEMDEST memdest;
+  
+  /*
+   * The libjpeg stdio destination manager, or NULL if the writer has
+   * not written to a file yet.
+   * 
+   * libjpeg only reuses a destination manager that it allocated
+   * itself, so this is kept when the writer is reset to a memory
+   * destination and restored when it is reset to a file again.
+   */
+  struct jpeg_destination_mgr *pFileDest;
+  
+  /*
+   * Push output state, used only by push writers.
+   * 
+   * pushing is non-zero if the current image is encoded into pushbuf,
+   * which is written through the memory destination manager in the
+   * same way as a client memory buffer.  The first push_taken bytes of
+   * pushbuf have already been consumed by the client.  pushbuf is kept
+   * when the writer is reset.
+   */
+  int pushing;
+  SPH_JPEG_MEMBUF pushbuf;
+  size_t push_taken;
+  
+  /*
+   * Staging buffer used by sph_jpeg_writer_encode_from() to pack rows
+   * of the padded layouts before they are encoded.
+   * 
+   * pRowBuf has a capacity of row_cap bytes, and it is kept when the
+   * writer is reset.
+   */
+  uint8_t *pRowBuf;
+  size_t row_cap;
+  
+  /*
+   * The encoder options applied each time compression is started.
+   */
+  SPH_JPEG_WRITER_OPTS opts;
+  
+  /*
+   * Non-zero once the compressor object has been created.
+   */
+  int created;
+  
+  /*
+   * The width of the output image in pixels.
    */
   int32_t width;
   
   /*
-   * The height of the input image in pixels.
+   * The height of the output image in pixels.
    */ 
   int32_t height;
   
   /*
-   * The number of scanlines read from input.
+   * The number of scanlines written to output.
    */
-  int32_t readcount;
+  int32_t written;
   
   /*
    * The number of channels.
@@ -122,282 +526,4449 @@ struct SPH_JPEG_READER_TAG {
    * The error status.
    */
   int status;
-};
-
-/*
- * Local functions
- * ===============
- */
-
-/* Prototypes */
-METHODDEF(void) sph_jpeg_error_exit(j_common_ptr cinfo);
-
-/*
- * The custom error handler for libjpeg.
- */
-METHODDEF(void) sph_jpeg_error_exit(j_common_ptr cinfo) {
-
-  /* Get pointer to our custom fields */
-  SPH_JPEG_ERRMAN *per = (SPH_JPEG_ERRMAN *) (cinfo->err);
   
-  /* Jump back to error handler callback */
-  longjmp(per->setjmp_buffer, 1);
-}
+  /*
+   * The custom memory manager state.
+   */
+  SPH_JPEG_MEMMGR memmgr;
+  
+#ifdef SPH_JPEG_ENABLE_STATS
+  /*
+   * The instrumentation state.
+   */
+  SPH_JPEG_STATCTX stats;
+#endif
+};
 
 /*
- * Public function implementations
- * ===============================
+ * SPH_JPEG_READER
  * 
- * See the header for specifications.
- */
-
-/*
- * sph_jpeg_errstr function.
+ * See the header for prototype.
  */
-const char *sph_jpeg_errstr(int status) {
+struct SPH_JPEG_READER_TAG {
   
-  const char *pResult = NULL;
+  /*
+   * The decompressor object.
+   */
+  struct jpeg_decompress_struct cinfo;
   
-  switch (status) {
-    case SPH_JPEG_ERR_OK:
+  /*
+   * The custom error manager object.
+   */
+  SPH_JPEG_ERRMAN errman;
+  
+  /*
+   * The memory source manager, used only when reading from a buffer.
+   */
+  SPH_JPEG_MEMSRC memsrc;
+  
+  /*
+   * The libjpeg stdio source manager, or NULL if the reader has not
+   * read from a file yet.
+   * 
+   * Kept for the same reason as pFileDest in the writer.
+   */
+  struct jpeg_source_mgr *pFileSrc;
+  
+  /*
+   * The feed source manager, used only by feed readers.
+   */
+  SPH_JPEG_FEEDSRC feedsrc;
+  
+  /*
+   * Feed state, used only by feed readers.
+   * 
+   * feeding is non-zero if the current image is being fed with
+   * sph_jpeg_reader_feed().  feed_stage is zero while the header is
+   * being read, one while decompression is being started, two while
+   * the scans of a preview are being read, and three once scanlines
+   * can be read.  feed_denom is the scaling denominator that is applied
+   * once the header has been read.
+   */
+  int feeding;
+  int feed_stage;
+  int feed_denom;
+  
+  /*
+   * Non-zero if only the first scans of a progressive file are decoded
+   * in buffered-image mode, because of the max_scans decoder option.
+   */
+  int preview;
+  
+  /*
+   * Non-zero once the decompressor object has been created.
+   */
+  int created;
+  
+  /*
+   * Non-zero if the header has been read but decompression has not
+   * been started yet, because the reader was constructed or reset with
+   * one of the header functions.
+   */
+  int pending;
+  
+  /*
+   * The decoder options applied each time decompression is started.
+   */
+  SPH_JPEG_READER_OPTS opts;
+  
+  /*
+   * Cropping state, set up by sph_jpeg_reader_set_crop().
+   * 
+   * cropped is non-zero once a crop has been set for the current image.
+   * If staged is non-zero, decoded rows do not exactly match the crop,
+   * so they are decoded into pCropBuf and the crop is copied out of
+   * them starting at byte crop_offset.  crop_skip is the number of
+   * decoded rows that still have to be discarded above the crop, which
+   * is only used when libjpeg can't skip rows itself.
+   * 
+   * pCropBuf has a capacity of crop_cap bytes, and it is kept when the
+   * reader is reset.
+   */
+  int cropped;
+  int staged;
+  int32_t crop_skip;
+  size_t crop_offset;
+  uint8_t *pCropBuf;
+  size_t crop_cap;
+  
+  /*
+   * The width of the input image in pixels.
+   */
+  int32_t width;
+  
+  /*
+   * The height of the input image in pixels.
+   */ 
+  int32_t height;
+  
+  /*
+   * The number of scanlines read from input.
+   */
+  int32_t readcount;
+  
+  /*
+   * The number of channels.
+   * 
+   * One for grayscale, three for RGB.
+   */
+  int chcount;
+  
+  /*
+   * The error status.
+   */
+  int status;
+  
+  /*
+   * The custom memory manager state.
+   */
+  SPH_JPEG_MEMMGR memmgr;
+  
+#ifdef SPH_JPEG_ENABLE_STATS
+  /*
+   * The instrumentation state.
+   */
+  SPH_JPEG_STATCTX stats;
+#endif
+};
+
+/*
+ * Local functions
+ * ===============
+ */
+
+/* Prototypes */
+METHODDEF(void) sph_jpeg_error_exit(j_common_ptr cinfo);
+static int sph_jpeg_errcode(const SPH_JPEG_ERRMAN *per, int status);
+
+METHODDEF(void) sph_jpeg_memsrc_init(j_decompress_ptr cinfo);
+METHODDEF(boolean) sph_jpeg_memsrc_fill(j_decompress_ptr cinfo);
+METHODDEF(void) sph_jpeg_memsrc_skip(
+    j_decompress_ptr cinfo,
+    long             num_bytes);
+METHODDEF(void) sph_jpeg_memsrc_term(j_decompress_ptr cinfo);
+
+METHODDEF(boolean) sph_jpeg_feedsrc_fill(j_decompress_ptr cinfo);
+METHODDEF(void) sph_jpeg_feedsrc_skip(
+    j_decompress_ptr cinfo,
+    long             num_bytes);
+static int sph_jpeg_feedsrc_append(
+          SPH_JPEG_FEEDSRC * pf,
+    const void             * pData,
+          size_t             len);
+
+METHODDEF(void) sph_jpeg_membuf_dinit(j_compress_ptr cinfo);
+METHODDEF(boolean) sph_jpeg_membuf_empty(j_compress_ptr cinfo);
+METHODDEF(void) sph_jpeg_membuf_term(j_compress_ptr cinfo);
+
+METHODDEF(void) sph_jpeg_sink_dinit(j_compress_ptr cinfo);
+METHODDEF(boolean) sph_jpeg_sink_empty(j_compress_ptr cinfo);
+METHODDEF(void) sph_jpeg_sink_term(j_compress_ptr cinfo);
+
+METHODDEF(boolean) sph_jpeg_probesrc_fill(j_decompress_ptr cinfo);
+METHODDEF(void) sph_jpeg_probesrc_skip(
+    j_decompress_ptr cinfo,
+    long             num_bytes);
+
+static int sph_jpeg_membuf_grow(SPH_JPEG_MEMBUF *pBuf);
+
+static int sph_jpeg_est_quality(j_decompress_ptr cinfo);
+static int sph_jpeg_probe_run(
+          FILE           * pIn,
+    const void           * pData,
+          size_t           len,
+          SPH_JPEG_PROBE * pInfo);
+
+static void sph_jpeg_writer_start(
+    SPH_JPEG_WRITER * pw,
+    FILE            * pOut,
+    SPH_JPEG_MEMBUF * pBuf,
+    SPH_JPEG_SINK     fSink,
+    void            * pCustom,
+    int32_t           width,
+    int32_t           height,
+    int               chcount,
+    int               quality);
+
+static void sph_jpeg_writer_setopts(
+          SPH_JPEG_WRITER      * pw,
+    const SPH_JPEG_WRITER_OPTS * pOpts);
+
+static SPH_JPEG_WRITER *sph_jpeg_writer_alloc(void);
+
+static void sph_jpeg_reader_start(
+          SPH_JPEG_READER * pr,
+          FILE            * pIn,
+    const void            * pData,
+          size_t            len,
+          int               denom);
+
+static void sph_jpeg_reader_setopts(
+          SPH_JPEG_READER      * pr,
+    const SPH_JPEG_READER_OPTS * pOpts);
+
+static void sph_jpeg_reader_apply(SPH_JPEG_READER *pr);
+
+static void sph_jpeg_reader_croprow(
+    SPH_JPEG_READER * pr,
+    uint8_t         * pscan);
+
+static SPH_JPEG_READER *sph_jpeg_reader_alloc(void);
+
+static void sph_jpeg_reader_dims(SPH_JPEG_READER *pr);
+static int sph_jpeg_reader_preview(SPH_JPEG_READER *pr);
+static void sph_jpeg_reader_advance(SPH_JPEG_READER *pr);
+static int sph_jpeg_reader_feedstate(SPH_JPEG_READER *pr);
+
+static SPH_JPEG_MEMMGR *sph_jpeg_mem_state(j_common_ptr cinfo);
+static void *sph_jpeg_mem_block(
+    j_common_ptr cinfo,
+    int          pool_id,
+    size_t       size);
+
+METHODDEF(void *) sph_jpeg_mem_small(
+    j_common_ptr cinfo,
+    int          pool_id,
+    size_t       sizeofobject);
+METHODDEF(JSAMPARRAY) sph_jpeg_mem_sarray(
+    j_common_ptr cinfo,
+    int          pool_id,
+    JDIMENSION   samplesperrow,
+    JDIMENSION   numrows);
+METHODDEF(JBLOCKARRAY) sph_jpeg_mem_barray(
+    j_common_ptr cinfo,
+    int          pool_id,
+    JDIMENSION   blocksperrow,
+    JDIMENSION   numrows);
+METHODDEF(jvirt_sarray_ptr) sph_jpeg_mem_vsarray(
+    j_common_ptr cinfo,
+    int          pool_id,
+    boolean      pre_zero,
+    JDIMENSION   samplesperrow,
+    JDIMENSION   numrows,
+    JDIMENSION   maxaccess);
+METHODDEF(jvirt_barray_ptr) sph_jpeg_mem_vbarray(
+    j_common_ptr cinfo,
+    int          pool_id,
+    boolean      pre_zero,
+    JDIMENSION   blocksperrow,
+    JDIMENSION   numrows,
+    JDIMENSION   maxaccess);
+METHODDEF(void) sph_jpeg_mem_realize(j_common_ptr cinfo);
+METHODDEF(JSAMPARRAY) sph_jpeg_mem_access_s(
+    j_common_ptr     cinfo,
+    jvirt_sarray_ptr ptr,
+    JDIMENSION       start_row,
+    JDIMENSION       num_rows,
+    boolean          writable);
+METHODDEF(JBLOCKARRAY) sph_jpeg_mem_access_b(
+    j_common_ptr     cinfo,
+    jvirt_barray_ptr ptr,
+    JDIMENSION       start_row,
+    JDIMENSION       num_rows,
+    boolean          writable);
+METHODDEF(void) sph_jpeg_mem_free(j_common_ptr cinfo, int pool_id);
+METHODDEF(void) sph_jpeg_mem_destruct(j_common_ptr cinfo);
+
+static void sph_jpeg_mem_release(SPH_JPEG_MEMMGR *pm, int pool_id);
+static void sph_jpeg_mem_apply(
+          j_common_ptr         cinfo,
+          size_t               max_memory,
+    const SPH_JPEG_ALLOCATOR * pAlloc);
+
+static size_t sph_jpeg_layout_rowsize(
+    int32_t width,
+    int     chcount,
+    int     layout);
+static void sph_jpeg_layout_expand(
+    uint8_t * pRow,
+    int32_t   width,
+    int       chcount,
+    int       layout);
+static void sph_jpeg_layout_pack(
+          uint8_t * pDest,
+    const uint8_t * pSrc,
+          int32_t   width,
+          int       chcount,
+          int       layout);
+
+#ifdef SPH_JPEG_ENABLE_STATS
+static int64_t sph_jpeg_stat_now(void);
+static void sph_jpeg_stat_pool(
+    j_common_ptr cinfo,
+    int          pool_id,
+    int64_t      size);
+
+METHODDEF(void *) sph_jpeg_stat_small(
+    j_common_ptr cinfo,
+    int          pool_id,
+    size_t       sizeofobject);
+METHODDEF(void *) sph_jpeg_stat_large(
+    j_common_ptr cinfo,
+    int          pool_id,
+    size_t       sizeofobject);
+METHODDEF(JSAMPARRAY) sph_jpeg_stat_sarray(
+    j_common_ptr cinfo,
+    int          pool_id,
+    JDIMENSION   samplesperrow,
+    JDIMENSION   numrows);
+METHODDEF(JBLOCKARRAY) sph_jpeg_stat_barray(
+    j_common_ptr cinfo,
+    int          pool_id,
+    JDIMENSION   blocksperrow,
+    JDIMENSION   numrows);
+METHODDEF(jvirt_sarray_ptr) sph_jpeg_stat_vsarray(
+    j_common_ptr cinfo,
+    int          pool_id,
+    boolean      pre_zero,
+    JDIMENSION   samplesperrow,
+    JDIMENSION   numrows,
+    JDIMENSION   maxaccess);
+METHODDEF(jvirt_barray_ptr) sph_jpeg_stat_vbarray(
+    j_common_ptr cinfo,
+    int          pool_id,
+    boolean      pre_zero,
+    JDIMENSION   blocksperrow,
+    JDIMENSION   numrows,
+    JDIMENSION   maxaccess);
+METHODDEF(void) sph_jpeg_stat_free(j_common_ptr cinfo, int pool_id);
+
+METHODDEF(boolean) sph_jpeg_stat_fill(j_decompress_ptr cinfo);
+METHODDEF(void) sph_jpeg_stat_dinit(j_compress_ptr cinfo);
+METHODDEF(boolean) sph_jpeg_stat_empty(j_compress_ptr cinfo);
+METHODDEF(void) sph_jpeg_stat_term(j_compress_ptr cinfo);
+
+static void sph_jpeg_stat_attach(
+    j_common_ptr       cinfo,
+    SPH_JPEG_STATCTX * ps);
+static void sph_jpeg_stat_settle(SPH_JPEG_READER *pr);
+#endif
+
+/*
+ * The custom error handler for libjpeg.
+ */
+METHODDEF(void) sph_jpeg_error_exit(j_common_ptr cinfo) {
+
+  /* Get pointer to our custom fields */
+  SPH_JPEG_ERRMAN *per = (SPH_JPEG_ERRMAN *) (cinfo->err);
+  
+  /* Jump back to error handler callback */
+  longjmp(per->setjmp_buffer, 1);
+}
+
+/*
+ * Determine the status code of a libjpeg error that was caught by the
+ * custom error handler.
+ * 
+ * Memory exhaustion, including a memory limit that was exceeded, is
+ * reported as SPH_JPEG_ERR_MEM.  Every other libjpeg error is reported
+ * with the status code given for the operation.
+ * 
+ * Parameters:
+ * 
+ *   per - the custom error manager that caught the error
+ * 
+ *   status - the status code for other libjpeg errors
+ * 
+ * Return:
+ * 
+ *   the status code to record
+ */
+static int sph_jpeg_errcode(const SPH_JPEG_ERRMAN *per, int status) {
+  
+  /* Check parameter */
+  if (per == NULL) {
+    abort();
+  }
+  
+  /* Check for memory exhaustion */
+  if ((per->pub).msg_code == JERR_OUT_OF_MEMORY) {
+    status = SPH_JPEG_ERR_MEM;
+  }
+  
+  return status;
+}
+
+/*
+ * Memory source manager initialization.
+ * 
+ * The buffer pointers are already set when the source manager is
+ * installed, so there is nothing to do here.
+ */
+METHODDEF(void) sph_jpeg_memsrc_init(j_decompress_ptr cinfo) {
+  (void) cinfo;
+}
+
+/*
+ * Memory source manager buffer refill.
+ * 
+ * This is only called once the whole buffer has been consumed.  In the
+ * same way as the libjpeg stdio source manager handles end of file, a
+ * warning is issued and a fake EOI marker is inserted, so that
+ * truncated data decodes as far as possible.
+ */
+METHODDEF(boolean) sph_jpeg_memsrc_fill(j_decompress_ptr cinfo) {
+  
+  static const JOCTET fake_eoi[2] = {(JOCTET) 0xFF, (JOCTET) JPEG_EOI};
+  
+  /* Warn about premature end of data */
+  WARNMS(cinfo, JWRN_JPEG_EOF);
+  
+  /* Insert a fake EOI marker */
+  (cinfo->src)->next_input_byte = &(fake_eoi[0]);
+  (cinfo->src)->bytes_in_buffer = 2;
+  
+  return TRUE;
+}
+
+/*
+ * Memory source manager data skipping.
+ * 
+ * Skips are done directly within the buffer.  Skipping beyond the end
+ * of the buffer behaves like reaching the end of data.
+ */
+METHODDEF(void) sph_jpeg_memsrc_skip(
+    j_decompress_ptr cinfo,
+    long             num_bytes) {
+  
+  struct jpeg_source_mgr *src = cinfo->src;
+  
+  /* Ignore non-positive skips */
+  if (num_bytes > 0) {
+    if ((size_t) num_bytes <= src->bytes_in_buffer) {
+      /* Skip within the buffer */
+      src->next_input_byte += (size_t) num_bytes;
+      src->bytes_in_buffer -= (size_t) num_bytes;
+      
+    } else {
+      /* Skipping past the end of the data */
+      src->next_input_byte += src->bytes_in_buffer;
+      src->bytes_in_buffer = 0;
+      (void) sph_jpeg_memsrc_fill(cinfo);
+    }
+  }
+}
+
+/*
+ * Memory source manager termination.
+ * 
+ * The buffer is owned by the client, so there is nothing to do here.
+ */
+METHODDEF(void) sph_jpeg_memsrc_term(j_decompress_ptr cinfo) {
+  (void) cinfo;
+}
+
+/*
+ * Feed source manager buffer refill.
+ * 
+ * This is called once all the data fed so far has been consumed.
+ * Until the end of the data has been signalled, return FALSE so that
+ * libjpeg suspends.  libjpeg backs up to the start of the unit it was
+ * working on, so the data it has not consumed yet is left in the buffer
+ * for the next attempt.  At the end of the data, a fake EOI marker is
+ * inserted in the same way as for the memory source manager.
+ * 
+ * The feed source manager shares the initialization and termination
+ * methods of the memory source manager, which do nothing.
+ */
+METHODDEF(boolean) sph_jpeg_feedsrc_fill(j_decompress_ptr cinfo) {
+  
+  SPH_JPEG_FEEDSRC *pf = (SPH_JPEG_FEEDSRC *) (cinfo->src);
+  
+  /* Suspend until more data is fed */
+  if (!(pf->ended)) {
+    return FALSE;
+  }
+  
+  return sph_jpeg_memsrc_fill(cinfo);
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * Feed source manager data skipping.
+ * 
+ * Skips within the data fed so far are done directly within the buffer.
+ * Any part of a skip beyond the data fed so far is remembered and
+ * applied to data that is fed later, or behaves like reaching the end
+ * of data if the end has been signalled.
+ */
+METHODDEF(void) sph_jpeg_feedsrc_skip(
+    j_decompress_ptr cinfo,
+    long             num_bytes) {
+  
+  SPH_JPEG_FEEDSRC *pf = (SPH_JPEG_FEEDSRC *) (cinfo->src);
+  
+  /* Ignore non-positive skips */
+  if (num_bytes > 0) {
+    if ((size_t) num_bytes <= (pf->pub).bytes_in_buffer) {
+      /* Skip within the buffer */
+      (pf->pub).next_input_byte += (size_t) num_bytes;
+      (pf->pub).bytes_in_buffer -= (size_t) num_bytes;
+      
+    } else {
+      /* Skip everything in the buffer and remember the rest */
+      pf->skip += ((size_t) num_bytes) - (pf->pub).bytes_in_buffer;
+      (pf->pub).next_input_byte += (pf->pub).bytes_in_buffer;
+      (pf->pub).bytes_in_buffer = 0;
+      if (pf->ended) {
+        pf->skip = 0;
+        (void) sph_jpeg_memsrc_fill(cinfo);
+      }
+    }
+  }
+}
+
+/*
+ * Append data to the buffer of a feed source manager.
+ * 
+ * Any skip that libjpeg left pending is applied to the new data first.
+ * The data libjpeg has not consumed yet is moved to the start of the
+ * buffer, and the buffer is grown if necessary by doubling its
+ * capacity, starting at SPH_JPEG_FEEDINIT.  If the buffer can't be
+ * grown, the new data is not appended, but the source manager remains
+ * consistent.
+ * 
+ * Parameters:
+ * 
+ *   pf - the feed source manager
+ * 
+ *   pData - the data to append, which may be NULL if len is zero
+ * 
+ *   len - the number of bytes to append
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the allocation failed
+ */
+static int sph_jpeg_feedsrc_append(
+          SPH_JPEG_FEEDSRC * pf,
+    const void             * pData,
+          size_t             len) {
+  
+  const JOCTET *pSrc = (const JOCTET *) pData;
+  size_t keep = 0;
+  size_t new_cap = 0;
+  JOCTET *pNew = NULL;
+  
+  /* Check parameters */
+  if ((pf == NULL) || ((pData == NULL) && (len > 0))) {
+    abort();
+  }
+  
+  /* Apply any pending skip */
+  if (pf->skip >= len) {
+    pf->skip -= len;
+    len = 0;
+  } else {
+    pSrc += pf->skip;
+    len -= pf->skip;
+    pf->skip = 0;
+  }
+  
+  /* Move the unconsumed data to the start of the buffer */
+  keep = (pf->pub).bytes_in_buffer;
+  if ((keep > 0) && ((pf->pub).next_input_byte != pf->pBuf)) {
+    memmove(pf->pBuf, (pf->pub).next_input_byte, keep);
+  }
+  (pf->pub).next_input_byte = pf->pBuf;
+  
+  /* Grow the buffer if necessary */
+  if (len > pf->cap - keep) {
+    if (len > ((size_t) -1) - keep) {
+      return 0;
+    }
+    new_cap = pf->cap;
+    if (new_cap < SPH_JPEG_FEEDINIT) {
+      new_cap = SPH_JPEG_FEEDINIT;
+    }
+    while (new_cap < keep + len) {
+      if (new_cap > ((size_t) -1) / 2) {
+        new_cap = keep + len;
+      } else {
+        new_cap *= 2;
+      }
+    }
+    
+    pNew = (JOCTET *) realloc(pf->pBuf, new_cap);
+    if (pNew == NULL) {
+      return 0;
+    }
+    pf->pBuf = pNew;
+    pf->cap = new_cap;
+    (pf->pub).next_input_byte = pf->pBuf;
+  }
+  
+  /* Append the new data */
+  if (len > 0) {
+    memcpy(pf->pBuf + keep, pSrc, len);
+  }
+  (pf->pub).bytes_in_buffer = keep + len;
+  
+  return 1;
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * Probe source manager buffer refill.
+ * 
+ * When probing a file, read the next block.  At the end of the file, or
+ * always when probing memory, return FALSE so that libjpeg suspends.
+ * The probe never resumes after a suspension, so unconsumed data does
+ * not need to be preserved.
+ */
+METHODDEF(boolean) sph_jpeg_probesrc_fill(j_decompress_ptr cinfo) {
+  
+  SPH_JPEG_PROBESRC *ps = (SPH_JPEG_PROBESRC *) (cinfo->src);
+  size_t count = 0;
+  
+  /* Read another block if probing a file */
+  if (ps->pIn != NULL) {
+    count = fread(&((ps->buf)[0]), 1, SPH_JPEG_PROBEBUF, ps->pIn);
+  }
+  
+  /* Suspend if no more data */
+  if (count < 1) {
+    return FALSE;
+  }
+  
+  (ps->pub).next_input_byte = &((ps->buf)[0]);
+  (ps->pub).bytes_in_buffer = count;
+  
+  return TRUE;
+}
+
+/*
+ * Probe source manager data skipping.
+ */
+METHODDEF(void) sph_jpeg_probesrc_skip(
+    j_decompress_ptr cinfo,
+    long             num_bytes) {
+  
+  struct jpeg_source_mgr *src = cinfo->src;
+  
+  /* Skip through as many blocks as necessary */
+  while (num_bytes > 0) {
+    if ((size_t) num_bytes <= src->bytes_in_buffer) {
+      src->next_input_byte += (size_t) num_bytes;
+      src->bytes_in_buffer -= (size_t) num_bytes;
+      num_bytes = 0;
+      
+    } else {
+      num_bytes -= (long) src->bytes_in_buffer;
+      src->next_input_byte += src->bytes_in_buffer;
+      src->bytes_in_buffer = 0;
+      if (!sph_jpeg_probesrc_fill(cinfo)) {
+        break;
+      }
+    }
+  }
+}
+
+/*
+ * Grow a memory buffer so that it has free space after its current
+ * length.
+ * 
+ * The capacity is doubled, starting at SPH_JPEG_MEMINIT.  If the
+ * buffer can't be grown, it is left as it was.
+ * 
+ * Parameters:
+ * 
+ *   pBuf - the memory buffer to grow
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the allocation failed
+ */
+static int sph_jpeg_membuf_grow(SPH_JPEG_MEMBUF *pBuf) {
+  
+  size_t new_cap = 0;
+  uint8_t *pNew = NULL;
+  
+  /* Check parameter */
+  if (pBuf == NULL) {
+    abort();
+  }
+  
+  /* Compute new capacity */
+  if (pBuf->cap < SPH_JPEG_MEMINIT) {
+    new_cap = SPH_JPEG_MEMINIT;
+  } else {
+    if (pBuf->cap > ((size_t) -1) / 2) {
+      return 0;
+    }
+    new_cap = pBuf->cap * 2;
+  }
+  
+  /* Reallocate the buffer */
+  pNew = (uint8_t *) realloc(pBuf->pData, new_cap);
+  if (pNew == NULL) {
+    return 0;
+  }
+  pBuf->pData = pNew;
+  pBuf->cap = new_cap;
+  
+  return 1;
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * Memory buffer destination initialization.
+ * 
+ * Output is appended after the current length of the buffer.
+ */
+METHODDEF(void) sph_jpeg_membuf_dinit(j_compress_ptr cinfo) {
+  
+  SPH_JPEG_MEMDEST *pd = (SPH_JPEG_MEMDEST *) (cinfo->dest);
+  SPH_JPEG_MEMBUF *pBuf = pd->pBuf;
+  
+  /* Make sure there is some free space */
+  if (pBuf->len >= pBuf->cap) {
+    if (!sph_jpeg_membuf_grow(pBuf)) {
+      ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
+    }
+  }
+  
+  /* Point libjpeg at the free space */
+  (pd->pub).next_output_byte = (JOCTET *) (pBuf->pData + pBuf->len);
+  (pd->pub).free_in_buffer = pBuf->cap - pBuf->len;
+}
+
+/*
+ * Memory buffer destination flush.
+ * 
+ * This is called when the free space is full, so the whole capacity is
+ * now in use.  Grow the buffer and continue writing directly into it.
+ * If the buffer can't be grown, the writer stops with a libjpeg memory
+ * error, and the buffer keeps the output so far.
+ */
+METHODDEF(boolean) sph_jpeg_membuf_empty(j_compress_ptr cinfo) {
+  
+  SPH_JPEG_MEMDEST *pd = (SPH_JPEG_MEMDEST *) (cinfo->dest);
+  SPH_JPEG_MEMBUF *pBuf = pd->pBuf;
+  
+  /* The whole buffer is now filled */
+  pBuf->len = pBuf->cap;
+  
+  /* Grow the buffer */
+  if (!sph_jpeg_membuf_grow(pBuf)) {
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
+  }
+  
+  /* Point libjpeg at the new free space */
+  (pd->pub).next_output_byte = (JOCTET *) (pBuf->pData + pBuf->len);
+  (pd->pub).free_in_buffer = pBuf->cap - pBuf->len;
+  
+  return TRUE;
+}
+
+/*
+ * Memory buffer destination termination.
+ * 
+ * Update the buffer length to include everything written.
+ */
+METHODDEF(void) sph_jpeg_membuf_term(j_compress_ptr cinfo) {
+  
+  SPH_JPEG_MEMDEST *pd = (SPH_JPEG_MEMDEST *) (cinfo->dest);
+  SPH_JPEG_MEMBUF *pBuf = pd->pBuf;
+  
+  pBuf->len = (size_t) (((uint8_t *) (pd->pub).next_output_byte) -
+                          pBuf->pData);
+}
+
+/*
+ * Sink callback destination initialization.
+ * 
+ * Output is collected in the staging buffer.
+ */
+METHODDEF(void) sph_jpeg_sink_dinit(j_compress_ptr cinfo) {
+  
+  SPH_JPEG_MEMDEST *pd = (SPH_JPEG_MEMDEST *) (cinfo->dest);
+  
+  (pd->pub).next_output_byte = &((pd->staging)[0]);
+  (pd->pub).free_in_buffer = SPH_JPEG_SINKBUF;
+}
+
+/*
+ * Sink callback destination flush.
+ * 
+ * The staging buffer is full, so pass it to the sink and start over.
+ * Sink failures are reported as libjpeg write errors.
+ */
+METHODDEF(boolean) sph_jpeg_sink_empty(j_compress_ptr cinfo) {
+  
+  SPH_JPEG_MEMDEST *pd = (SPH_JPEG_MEMDEST *) (cinfo->dest);
+  
+  if (!((*(pd->fSink))(
+          pd->pCustom,
+          (const uint8_t *) &((pd->staging)[0]),
+          (size_t) SPH_JPEG_SINKBUF))) {
+    ERREXIT(cinfo, JERR_FILE_WRITE);
+  }
+  
+  (pd->pub).next_output_byte = &((pd->staging)[0]);
+  (pd->pub).free_in_buffer = SPH_JPEG_SINKBUF;
+  
+  return TRUE;
+}
+
+/*
+ * Sink callback destination termination.
+ * 
+ * Pass whatever remains in the staging buffer to the sink.  Sink
+ * failures are reported as libjpeg write errors.
+ */
+METHODDEF(void) sph_jpeg_sink_term(j_compress_ptr cinfo) {
+  
+  SPH_JPEG_MEMDEST *pd = (SPH_JPEG_MEMDEST *) (cinfo->dest);
+  size_t count = 0;
+  
+  count = SPH_JPEG_SINKBUF - (pd->pub).free_in_buffer;
+  if (count > 0) {
+    if (!((*(pd->fSink))(
+            pd->pCustom,
+            (const uint8_t *) &((pd->staging)[0]),
+            count))) {
+      ERREXIT(cinfo, JERR_FILE_WRITE);
+    }
+  }
+}
+
+/*
+ * Estimate the quality value that a JPEG file was compressed with.
+ * 
+ * cinfo is a decompressor that has read at least the quantization
+ * tables.  Each libjpeg quality value from 1 to 100 is tried, scaling
+ * the standard luminance table in the same way as jpeg_set_quality()
+ * with baseline limiting, and the one that most closely matches the
+ * first quantization table is returned.
+ * 
+ * Parameters:
+ * 
+ *   cinfo - the decompressor
+ * 
+ * Return:
+ * 
+ *   the estimated quality, or -1 if there is no quantization table
+ */
+static int sph_jpeg_est_quality(j_decompress_ptr cinfo) {
+  
+  /* The standard luminance table from the JPEG standard, in natural
+   * order, which is also the order libjpeg stores tables in */
+  static const int32_t std_lum[DCTSIZE2] = {
+    16,  11,  10,  16,  24,  40,  51,  61,
+    12,  12,  14,  19,  26,  58,  60,  55,
+    14,  13,  16,  24,  40,  57,  69,  56,
+    14,  17,  22,  29,  51,  87,  80,  62,
+    18,  22,  37,  56,  68, 109, 103,  77,
+    24,  35,  55,  64,  81, 104, 113,  92,
+    49,  64,  78,  87, 103, 121, 120, 101,
+    72,  92,  95,  98, 112, 100, 103,  99
+  };
+  
+  JQUANT_TBL *pq = NULL;
+  int result = -1;
+  int q = 0;
+  int i = 0;
+  int32_t scale = 0;
+  int32_t tv = 0;
+  int32_t diff = 0;
+  int32_t best = 0;
+  
+  /* Get the first quantization table */
+  pq = cinfo->quant_tbl_ptrs[0];
+  
+  /* Try each quality value if there is a table */
+  if (pq != NULL) {
+    for(q = 1; q <= 100; q++) {
+      
+      /* Compute scaling factor like jpeg_quality_scaling() */
+      if (q < 50) {
+        scale = 5000 / ((int32_t) q);
+      } else {
+        scale = 200 - (((int32_t) q) * 2);
+      }
+      
+      /* Compute the total difference from the scaled table */
+      diff = 0;
+      for(i = 0; i < DCTSIZE2; i++) {
+        tv = ((std_lum[i] * scale) + 50) / 100;
+        if (tv < 1) {
+          tv = 1;
+        } else if (tv > 255) {
+          tv = 255;
+        }
+        tv = tv - ((int32_t) (pq->quantval)[i]);
+        if (tv < 0) {
+          tv = -tv;
+        }
+        diff += tv;
+      }
+      
+      /* Keep the closest match */
+      if ((result < 0) || (diff < best)) {
+        result = q;
+        best = diff;
+      }
+    }
+  }
+  
+  return result;
+}
+
+/*
+ * Probe the header of a JPEG file from a file or memory.
+ * 
+ * Exactly one of pIn and pData must be non-NULL.  len is only used with
+ * pData.  This is the shared implementation of sph_jpeg_probe() and
+ * sph_jpeg_probe_mem().
+ * 
+ * Parameters:
+ * 
+ *   pIn - the file to read from, or NULL
+ * 
+ *   pData - the memory buffer to read from, or NULL
+ * 
+ *   len - the length of the memory buffer
+ * 
+ *   pInfo - the structure to receive the results
+ * 
+ * Return:
+ * 
+ *   SPH_JPEG_ERR_OK if successful, otherwise an error status code
+ */
+static int sph_jpeg_probe_run(
+          FILE           * pIn,
+    const void           * pData,
+          size_t           len,
+          SPH_JPEG_PROBE * pInfo) {
+  
+  /* status is volatile because it is changed after setjmp() */
+  volatile int status = SPH_JPEG_ERR_OK;
+  int hstat = 0;
+  struct jpeg_decompress_struct cinfo;
+  SPH_JPEG_ERRMAN errman;
+  SPH_JPEG_PROBESRC src;
+  
+  /* Initialize structures */
+  memset(&cinfo, 0, sizeof(struct jpeg_decompress_struct));
+  memset(&errman, 0, sizeof(SPH_JPEG_ERRMAN));
+  memset(&src, 0, sizeof(SPH_JPEG_PROBESRC));
+  
+  /* Check parameters */
+  if (((pIn == NULL) && (pData == NULL)) || (pInfo == NULL)) {
+    abort();
+  }
+  
+  /* Clear the results */
+  memset(pInfo, 0, sizeof(SPH_JPEG_PROBE));
+  pInfo->quality = -1;
+  
+  /* Set up the error handler */
+  cinfo.err = jpeg_std_error(&(errman.pub));
+  (errman.pub).error_exit = &sph_jpeg_error_exit;
+  
+  /* Establish the callback error handler */
+  if (setjmp(errman.setjmp_buffer)) {
+    /* This is run if libjpeg indicates an error */
+    jpeg_destroy_decompress(&cinfo);
+    memset(pInfo, 0, sizeof(SPH_JPEG_PROBE));
+    pInfo->quality = -1;
+    return SPH_JPEG_ERR_LIBJ;
+  }
+  
+  /* Create the decompressor object */
+  jpeg_create_decompress(&cinfo);
+  
+  /* Install the probe source manager */
+  src.pIn = pIn;
+  src.pub.init_source = &sph_jpeg_memsrc_init;
+  src.pub.fill_input_buffer = &sph_jpeg_probesrc_fill;
+  src.pub.skip_input_data = &sph_jpeg_probesrc_skip;
+  src.pub.resync_to_restart = &jpeg_resync_to_restart;
+  src.pub.term_source = &sph_jpeg_memsrc_term;
+  if (pIn == NULL) {
+    src.pub.next_input_byte = (const JOCTET *) pData;
+    src.pub.bytes_in_buffer = len;
+  } else {
+    src.pub.next_input_byte = NULL;
+    src.pub.bytes_in_buffer = 0;
+  }
+  cinfo.src = &(src.pub);
+  
+  /* Read markers up to the first scan; a suspension is acceptable if
+   * the frame header has already been read */
+  hstat = jpeg_read_header(&cinfo, TRUE);
+  if (hstat == JPEG_SUSPENDED) {
+    if ((cinfo.image_width < 1) || (cinfo.image_height < 1) ||
+        (cinfo.num_components < 1)) {
+      status = SPH_JPEG_ERR_MORE;
+    }
+  }
+  
+  /* Range-check information */
+  if (status == SPH_JPEG_ERR_OK) {
+    if ((cinfo.image_width < 1) ||
+        (cinfo.image_width > (JDIMENSION) SPH_JPEG_MAXDIM) ||
+        (cinfo.image_height < 1) ||
+        (cinfo.image_height > (JDIMENSION) SPH_JPEG_MAXDIM)) {
+      status = SPH_JPEG_ERR_IDIM;
+    }
+  }
+  if (status == SPH_JPEG_ERR_OK) {
+    if ((cinfo.num_components != 1) && (cinfo.num_components != 3)) {
+      status = SPH_JPEG_ERR_CCNT;
+    }
+  }
+  
+  /* Return the results if successful */
+  if (status == SPH_JPEG_ERR_OK) {
+    pInfo->width = (int32_t) cinfo.image_width;
+    pInfo->height = (int32_t) cinfo.image_height;
+    pInfo->chcount = (int) cinfo.num_components;
+    if (cinfo.progressive_mode) {
+      pInfo->progressive = 1;
+    } else {
+      pInfo->progressive = 0;
+    }
+    pInfo->quality = sph_jpeg_est_quality(&cinfo);
+  }
+  
+  /* Release the decompressor object */
+  jpeg_destroy_decompress(&cinfo);
+  
+  /* Return status */
+  return status;
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * Start compression of a new image on a JPEG writer object.
+ * 
+ * pw is the writer object.  If its compressor object has already been
+ * created, any compression in progress is abandoned with
+ * jpeg_abort_compress(), which keeps the libjpeg memory pools and
+ * tables allocated for reuse.  Otherwise, the compressor object is
+ * created.
+ * 
+ * Exactly one of pOut, pBuf, and fSink must be non-NULL, selecting
+ * whether output goes to a file, a memory buffer, or a sink callback.
+ * pCustom is only used with fSink.  If pBuf is the push buffer of the
+ * writer, the writer becomes a push writer, and the caller must already
+ * have emptied the push buffer.  The remaining parameters are as for
+ * sph_jpeg_writer_new(), and must already have been checked.
+ * 
+ * Errors are recorded in the status of the writer object.
+ * 
+ * This is the shared implementation of all the writer constructors and
+ * reset functions.
+ * 
+ * Parameters:
+ * 
+ *   pw - the JPEG writer object
+ * 
+ *   pOut - the file handle to write to, or NULL
+ * 
+ *   pBuf - the memory buffer to append to, or NULL
+ * 
+ *   fSink - the sink callback, or NULL
+ * 
+ *   pCustom - the custom sink parameter
+ * 
+ *   width - the width of the JPEG file in pixels
+ * 
+ *   height - the height of the JPEG file in pixels
+ * 
+ *   chcount - the number of color channels
+ * 
+ *   quality - the compression quality
+ */
+static void sph_jpeg_writer_start(
+    SPH_JPEG_WRITER * pw,
+    FILE            * pOut,
+    SPH_JPEG_MEMBUF * pBuf,
+    SPH_JPEG_SINK     fSink,
+    void            * pCustom,
+    int32_t           width,
+    int32_t           height,
+    int               chcount,
+    int               quality) {
+  
+  /* Check parameters */
+  if (pw == NULL) {
+    abort();
+  }
+  if ((width < 1) || (width > SPH_JPEG_MAXDIM) ||
+      (height < 1) || (height > SPH_JPEG_MAXDIM)) {
+    abort();
+  }
+  if ((chcount != 1) && (chcount != 3)) {
+    abort();
+  }
+  
+  /* Clamp quality value */
+  if (quality < SPH_JPEG_MINQ) {
+    quality = SPH_JPEG_MINQ;
+  }
+  if (quality > SPH_JPEG_MAXQ) {
+    quality = SPH_JPEG_MAXQ;
+  }
+  
+  /* Initialize simple fields */
+  pw->width = width;
+  pw->height = height;
+  pw->written = 0;
+  pw->chcount = chcount;
+  pw->status = SPH_JPEG_ERR_OK;
+  pw->pushing = (pBuf == &(pw->pushbuf));
+  
+  /* Establish the callback error handler */
+  if (setjmp(((pw->errman).setjmp_buffer))) {
+    /* This is run if libjpeg indicates an error; a compressor object
+     * that failed while being created is destroyed, so that it is
+     * created again for the next image */
+    if (!(pw->created)) {
+      jpeg_destroy_compress(&(pw->cinfo));
+    }
+    pw->status = sph_jpeg_errcode(&(pw->errman), SPH_JPEG_ERR_WRIT);
+    return;
+  }
+  
+  /* Abandon any previous image, or else create the JPEG compressor */
+  if (pw->created) {
+    jpeg_abort_compress(&(pw->cinfo));
+  } else {
+    jpeg_create_compress(&(pw->cinfo));
+    pw->created = 1;
+#ifdef SPH_JPEG_ENABLE_STATS
+    sph_jpeg_stat_attach((j_common_ptr) &(pw->cinfo), &(pw->stats));
+#endif
+  }
+  sph_jpeg_mem_apply(
+    (j_common_ptr) &(pw->cinfo),
+    (pw->opts).max_memory, (pw->opts).pAlloc);
+  SPH_JPEG_STAT_COUNT(pw->stats, images, 1);
+  
+  /* Set output destination */
+  if (pOut != NULL) {
+    /* Writing to a file, reusing the stdio destination manager if
+     * there already is one */
+#ifdef SPH_JPEG_ENABLE_STATS
+    if ((pw->pFileDest != NULL) &&
+        ((pw->pFileDest)->init_destination == &sph_jpeg_stat_dinit)) {
+      /* An error stopped the previous image before the wrapper could
+       * put the original method back */
+      (pw->pFileDest)->init_destination = (pw->stats).init_destination;
+    }
+#endif
+    (pw->cinfo).dest = pw->pFileDest;
+    jpeg_stdio_dest(&(pw->cinfo), pOut);
+    pw->pFileDest = (pw->cinfo).dest;
+    
+  } else if (pBuf != NULL) {
+    /* Writing to a memory buffer */
+    memset(&(pw->memdest), 0, sizeof(SPH_JPEG_MEMDEST));
+    (pw->memdest).pBuf = pBuf;
+    (pw->memdest).pub.init_destination = &sph_jpeg_membuf_dinit;
+    (pw->memdest).pub.empty_output_buffer = &sph_jpeg_membuf_empty;
+    (pw->memdest).pub.term_destination = &sph_jpeg_membuf_term;
+    (pw->cinfo).dest = &((pw->memdest).pub);
+    
+  } else if (fSink != NULL) {
+    /* Writing to a sink callback */
+    memset(&(pw->memdest), 0, sizeof(SPH_JPEG_MEMDEST));
+    (pw->memdest).fSink = fSink;
+    (pw->memdest).pCustom = pCustom;
+    (pw->memdest).pub.init_destination = &sph_jpeg_sink_dinit;
+    (pw->memdest).pub.empty_output_buffer = &sph_jpeg_sink_empty;
+    (pw->memdest).pub.term_destination = &sph_jpeg_sink_term;
+    (pw->cinfo).dest = &((pw->memdest).pub);
+    
+  } else {
+    /* Shouldn't happen */
+    abort();
+  }
+  
+#ifdef SPH_JPEG_ENABLE_STATS
+  /* Count the output through the destination manager wrappers */
+  (pw->stats).init_destination = ((pw->cinfo).dest)->init_destination;
+  (pw->stats).empty_output_buffer =
+    ((pw->cinfo).dest)->empty_output_buffer;
+  (pw->stats).term_destination = ((pw->cinfo).dest)->term_destination;
+  ((pw->cinfo).dest)->init_destination = &sph_jpeg_stat_dinit;
+  ((pw->cinfo).dest)->empty_output_buffer = &sph_jpeg_stat_empty;
+  ((pw->cinfo).dest)->term_destination = &sph_jpeg_stat_term;
+#endif
+  
+  /* Initialize JPEG information */
+  (pw->cinfo).image_width = (int) width;
+  (pw->cinfo).image_height = (int) height;
+  
+  if (chcount == 3) {
+    (pw->cinfo).input_components = 3;
+    if ((pw->opts).color == SPH_JPEG_COLOR_YCC) {
+      (pw->cinfo).in_color_space = JCS_YCbCr;
+    } else {
+      (pw->cinfo).in_color_space = JCS_RGB;
+    }
+  
+  } else if (chcount == 1) {
+    (pw->cinfo).input_components = 1;
+    (pw->cinfo).in_color_space = JCS_GRAYSCALE;
+  
+  } else {
+    /* Shouldn't happen */
+    abort();
+  }
+    
+  jpeg_set_defaults(&(pw->cinfo));
+    
+  /* Set quality on scale 0-100, avoid < 25 */
+  jpeg_set_quality(&(pw->cinfo), quality, TRUE);
+  
+  /* Apply the encoder options */
+  if (chcount == 3) {
+    if ((pw->opts).sampling == SPH_JPEG_SAMP_420) {
+      (pw->cinfo).comp_info[0].h_samp_factor = 2;
+      (pw->cinfo).comp_info[0].v_samp_factor = 2;
+      
+    } else if ((pw->opts).sampling == SPH_JPEG_SAMP_422) {
+      (pw->cinfo).comp_info[0].h_samp_factor = 2;
+      (pw->cinfo).comp_info[0].v_samp_factor = 1;
+      
+    } else if ((pw->opts).sampling == SPH_JPEG_SAMP_444) {
+      (pw->cinfo).comp_info[0].h_samp_factor = 1;
+      (pw->cinfo).comp_info[0].v_samp_factor = 1;
+      
+    } else {
+      /* Shouldn't happen */
+      abort();
+    }
+  }
+  
+  if ((pw->opts).dct == SPH_JPEG_DCT_ISLOW) {
+    (pw->cinfo).dct_method = JDCT_ISLOW;
+  } else if ((pw->opts).dct == SPH_JPEG_DCT_IFAST) {
+    (pw->cinfo).dct_method = JDCT_IFAST;
+  } else if ((pw->opts).dct == SPH_JPEG_DCT_FLOAT) {
+    (pw->cinfo).dct_method = JDCT_FLOAT;
+  } else {
+    /* Shouldn't happen */
+    abort();
+  }
+  
+  (pw->cinfo).optimize_coding = (pw->opts).optimize ? TRUE : FALSE;
+  (pw->cinfo).restart_in_rows = (pw->opts).restart_rows;
+  if ((pw->opts).progressive) {
+    jpeg_simple_progression(&(pw->cinfo));
+  }
+  
+  /* Start compression */
+  SPH_JPEG_STAT_MARK(pw->stats);
+  jpeg_start_compress(&(pw->cinfo), TRUE);
+  SPH_JPEG_STAT_TIME(pw->stats, setup_ns);
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * Check and store encoder options in a JPEG writer object.
+ * 
+ * pOpts is copied into the writer, or the defaults are stored if it is
+ * NULL.  Options that are out of range cause a fault.
+ * 
+ * Parameters:
+ * 
+ *   pw - the JPEG writer object
+ * 
+ *   pOpts - the encoder options, or NULL
+ */
+static void sph_jpeg_writer_setopts(
+          SPH_JPEG_WRITER      * pw,
+    const SPH_JPEG_WRITER_OPTS * pOpts) {
+  
+  /* Check parameters */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Use defaults if no options given */
+  if (pOpts == NULL) {
+    sph_jpeg_writer_opts_init(&(pw->opts));
+    return;
+  }
+  
+  /* Check the options */
+  if ((pOpts->sampling != SPH_JPEG_SAMP_420) &&
+      (pOpts->sampling != SPH_JPEG_SAMP_422) &&
+      (pOpts->sampling != SPH_JPEG_SAMP_444)) {
+    abort();
+  }
+  if ((pOpts->dct != SPH_JPEG_DCT_ISLOW) &&
+      (pOpts->dct != SPH_JPEG_DCT_IFAST) &&
+      (pOpts->dct != SPH_JPEG_DCT_FLOAT)) {
+    abort();
+  }
+  if ((pOpts->restart_rows < 0) ||
+      (pOpts->restart_rows > SPH_JPEG_MAXRESTART)) {
+    abort();
+  }
+  if ((pOpts->color != SPH_JPEG_COLOR_RGB) &&
+      (pOpts->color != SPH_JPEG_COLOR_YCC)) {
+    abort();
+  }
+  if ((pOpts->pAlloc != NULL) &&
+      (((pOpts->pAlloc)->fAlloc == NULL) ||
+        ((pOpts->pAlloc)->fFree == NULL))) {
+    abort();
+  }
+  
+  /* Store the options */
+  memcpy(&(pw->opts), pOpts, sizeof(SPH_JPEG_WRITER_OPTS));
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * Allocate a new JPEG writer object.
+ * 
+ * The compressor object is not created until the first call to
+ * sph_jpeg_writer_start().
+ * 
+ * Return:
+ * 
+ *   a new JPEG writer object, or NULL if it could not be allocated
+ */
+static SPH_JPEG_WRITER *sph_jpeg_writer_alloc(void) {
+  
+  SPH_JPEG_WRITER *pw = NULL;
+  
+  /* Allocate new object */
+  pw = (SPH_JPEG_WRITER *) malloc(sizeof(SPH_JPEG_WRITER));
+  if (pw == NULL) {
+    return NULL;
+  }
+  memset(pw, 0, sizeof(SPH_JPEG_WRITER));
+  
+  /* Initialize fields */
+  pw->pFileDest = NULL;
+  pw->created = 0;
+  pw->status = SPH_JPEG_ERR_OK;
+  pw->pushing = 0;
+  sph_jpeg_membuf_init(&(pw->pushbuf));
+  pw->push_taken = 0;
+  pw->pRowBuf = NULL;
+  pw->row_cap = 0;
+  sph_jpeg_writer_opts_init(&(pw->opts));
+  
+  /* Set up the error handler */
+  (pw->cinfo).err = jpeg_std_error(&((pw->errman).pub));
+  ((pw->errman).pub).error_exit = &sph_jpeg_error_exit;
+  
+  /* Return writer object */
+  return pw;
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * Start decompression of a new image on a JPEG reader object with the
+ * given DCT scaling denominator.
+ * 
+ * pr is the reader object.  If its decompressor object has already been
+ * created, any decompression in progress is abandoned with
+ * jpeg_abort_decompress(), which keeps the libjpeg memory pools
+ * allocated for reuse.  Otherwise, the decompressor object is created.
+ * 
+ * If pIn is not NULL, the image is read from that file.  Otherwise, if
+ * pData is not NULL, it is read from the len bytes at pData.  If both
+ * are NULL, the reader becomes a feed reader, and the header is read
+ * as far as possible once data is fed with sph_jpeg_reader_feed().
+ * 
+ * denom is the scaling denominator, which must already have been
+ * checked to be one of 1, 2, 4, or 8.  Except for feed readers, it may
+ * also be zero, in which case only the header is read and the reader is
+ * left pending until sph_jpeg_reader_scale() is called.
+ * 
+ * Errors are recorded in the status of the reader object.
+ * 
+ * This is the shared implementation of all the reader constructors and
+ * reset functions.
+ * 
+ * Parameters:
+ * 
+ *   pr - the JPEG reader object
+ * 
+ *   pIn - the file handle to read the JPEG file from, or NULL
+ * 
+ *   pData - the JPEG file in memory if pIn is NULL, or NULL
+ * 
+ *   len - the length of the data at pData
+ * 
+ *   denom - the scaling denominator
+ */
+static void sph_jpeg_reader_start(
+          SPH_JPEG_READER * pr,
+          FILE            * pIn,
+    const void            * pData,
+          size_t            len,
+          int               denom) {
+  
+  /* Check parameters */
+  if (pr == NULL) {
+    abort();
+  }
+  if ((denom != 0) && (denom != 1) && (denom != 2) &&
+      (denom != 4) && (denom != 8)) {
+    abort();
+  }
+  if ((pIn == NULL) && (pData == NULL) && (denom == 0)) {
+    abort();
+  }
+  
+  /* Initialize the simple fields with default values */
+  pr->width = 1;
+  pr->height = 1;
+  pr->readcount = 0;
+  pr->chcount = 1;
+  pr->pending = 0;
+  pr->feeding = ((pIn == NULL) && (pData == NULL));
+  pr->feed_stage = 0;
+  pr->feed_denom = denom;
+  pr->preview = 0;
+  pr->status = SPH_JPEG_ERR_OK;
+  pr->cropped = 0;
+  pr->staged = 0;
+  pr->crop_skip = 0;
+  pr->crop_offset = 0;
+  
+  /* Establish the callback error handler */
+  if (setjmp(((pr->errman).setjmp_buffer))) {
+    /* This is run if libjpeg indicates an error; a decompressor object
+     * that failed while being created is destroyed, so that it is
+     * created again for the next image */
+    if (!(pr->created)) {
+      jpeg_destroy_decompress(&(pr->cinfo));
+    }
+    pr->width = 1;
+    pr->height = 1;
+    pr->chcount = 1;
+    pr->status = sph_jpeg_errcode(&(pr->errman), SPH_JPEG_ERR_LIBJ);
+    return;
+  }
+  
+  /* Abandon any previous image, or else create the decompressor
+   * object */
+  if (pr->created) {
+    jpeg_abort_decompress(&(pr->cinfo));
+  } else {
+    jpeg_create_decompress(&(pr->cinfo));
+    pr->created = 1;
+#ifdef SPH_JPEG_ENABLE_STATS
+    sph_jpeg_stat_attach((j_common_ptr) &(pr->cinfo), &(pr->stats));
+#endif
+  }
+  sph_jpeg_mem_apply(
+    (j_common_ptr) &(pr->cinfo),
+    (pr->opts).max_memory, (pr->opts).pAlloc);
+  SPH_JPEG_STAT_COUNT(pr->stats, images, 1);
+#ifdef SPH_JPEG_ENABLE_STATS
+  sph_jpeg_stat_settle(pr);
+#endif
+  
+  /* Specify file handle or memory buffer to read from */
+  if (pIn != NULL) {
+    (pr->cinfo).src = pr->pFileSrc;
+    jpeg_stdio_src(&(pr->cinfo), pIn);
+    pr->pFileSrc = (pr->cinfo).src;
+#ifdef SPH_JPEG_ENABLE_STATS
+    (pr->stats).fill_input_buffer =
+      ((pr->cinfo).src)->fill_input_buffer;
+    ((pr->cinfo).src)->fill_input_buffer = &sph_jpeg_stat_fill;
+#endif
+    
+  } else if (pData != NULL) {
+    memset(&(pr->memsrc), 0, sizeof(SPH_JPEG_MEMSRC));
+    (pr->memsrc).pData = (const JOCTET *) pData;
+    (pr->memsrc).len = len;
+    (pr->memsrc).pub.init_source = &sph_jpeg_memsrc_init;
+    (pr->memsrc).pub.fill_input_buffer = &sph_jpeg_memsrc_fill;
+    (pr->memsrc).pub.skip_input_data = &sph_jpeg_memsrc_skip;
+    (pr->memsrc).pub.resync_to_restart = &jpeg_resync_to_restart;
+    (pr->memsrc).pub.term_source = &sph_jpeg_memsrc_term;
+    (pr->memsrc).pub.next_input_byte = (pr->memsrc).pData;
+    (pr->memsrc).pub.bytes_in_buffer = len;
+    (pr->cinfo).src = &((pr->memsrc).pub);
+#ifdef SPH_JPEG_ENABLE_STATS
+    (pr->stats).delivered = (int64_t) len;
+#endif
+    
+  } else {
+    /* Data is fed later, into the buffer kept from any earlier feed */
+    (pr->feedsrc).skip = 0;
+    (pr->feedsrc).ended = 0;
+    (pr->feedsrc).pub.init_source = &sph_jpeg_memsrc_init;
+    (pr->feedsrc).pub.fill_input_buffer = &sph_jpeg_feedsrc_fill;
+    (pr->feedsrc).pub.skip_input_data = &sph_jpeg_feedsrc_skip;
+    (pr->feedsrc).pub.resync_to_restart = &jpeg_resync_to_restart;
+    (pr->feedsrc).pub.term_source = &sph_jpeg_memsrc_term;
+    (pr->feedsrc).pub.next_input_byte = (pr->feedsrc).pBuf;
+    (pr->feedsrc).pub.bytes_in_buffer = 0;
+    (pr->cinfo).src = &((pr->feedsrc).pub);
+  }
+  
+  /* A feed reader gets as far as it can without any data, which is
+   * usually nowhere */
+  if (pr->feeding) {
+    sph_jpeg_reader_advance(pr);
+    return;
+  }
+  
+  /* Read file parameters */
+  SPH_JPEG_STAT_MARK(pr->stats);
+  (void) jpeg_read_header(&(pr->cinfo), TRUE);
+  
+  if (denom > 0) {
+    /* Request DCT-domain scaling; libjpeg rounds scaled dimensions up,
+     * so the output is ceil(width / denom) by ceil(height / denom) */
+    (pr->cinfo).scale_num = 1;
+    (pr->cinfo).scale_denom = (unsigned int) denom;
+    
+    /* Apply the decoder options and start decompression */
+    sph_jpeg_reader_apply(pr);
+    (void) jpeg_start_decompress(&(pr->cinfo));
+    if (pr->preview) {
+      (void) sph_jpeg_reader_preview(pr);
+    }
+    
+  } else {
+    /* Header only, so compute the unscaled output dimensions without
+     * starting decompression */
+    (pr->cinfo).scale_num = 1;
+    (pr->cinfo).scale_denom = 1;
+    sph_jpeg_reader_apply(pr);
+    jpeg_calc_output_dimensions(&(pr->cinfo));
+    pr->pending = 1;
+  }
+  SPH_JPEG_STAT_TIME(pr->stats, setup_ns);
+  
+  /* Read and check the image information */
+  sph_jpeg_reader_dims(pr);
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * Check and store decoder options in a JPEG reader object.
+ * 
+ * pOpts is copied into the reader, or the defaults are stored if it is
+ * NULL.  Options that are out of range cause a fault.
+ * 
+ * Parameters:
+ * 
+ *   pr - the JPEG reader object
+ * 
+ *   pOpts - the decoder options, or NULL
+ */
+static void sph_jpeg_reader_setopts(
+          SPH_JPEG_READER      * pr,
+    const SPH_JPEG_READER_OPTS * pOpts) {
+  
+  /* Check parameters */
+  if (pr == NULL) {
+    abort();
+  }
+  
+  /* Use defaults if no options given */
+  if (pOpts == NULL) {
+    sph_jpeg_reader_opts_init(&(pr->opts));
+    return;
+  }
+  
+  /* Check the options */
+  if ((pOpts->dct != SPH_JPEG_DCT_ISLOW) &&
+      (pOpts->dct != SPH_JPEG_DCT_IFAST) &&
+      (pOpts->dct != SPH_JPEG_DCT_FLOAT)) {
+    abort();
+  }
+  if ((pOpts->color != SPH_JPEG_COLOR_RGB) &&
+      (pOpts->color != SPH_JPEG_COLOR_YCC) &&
+      (pOpts->color != SPH_JPEG_COLOR_GRAY)) {
+    abort();
+  }
+  if (pOpts->max_scans < 0) {
+    abort();
+  }
+  if ((pOpts->pAlloc != NULL) &&
+      (((pOpts->pAlloc)->fAlloc == NULL) ||
+        ((pOpts->pAlloc)->fFree == NULL))) {
+    abort();
+  }
+  
+  /* Store the options */
+  memcpy(&(pr->opts), pOpts, sizeof(SPH_JPEG_READER_OPTS));
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * Apply the decoder options of a JPEG reader object to its
+ * decompressor object.
+ * 
+ * This must be called after the header has been read, since
+ * jpeg_read_header() resets the decompression parameters, and before
+ * decompression is started.
+ * 
+ * Parameters:
+ * 
+ *   pr - the JPEG reader object
+ */
+static void sph_jpeg_reader_apply(SPH_JPEG_READER *pr) {
+  
+  /* Check parameter */
+  if (pr == NULL) {
+    abort();
+  }
+  
+  /* Set the inverse DCT method */
+  if ((pr->opts).dct == SPH_JPEG_DCT_ISLOW) {
+    (pr->cinfo).dct_method = JDCT_ISLOW;
+  } else if ((pr->opts).dct == SPH_JPEG_DCT_IFAST) {
+    (pr->cinfo).dct_method = JDCT_IFAST;
+  } else if ((pr->opts).dct == SPH_JPEG_DCT_FLOAT) {
+    (pr->cinfo).dct_method = JDCT_FLOAT;
+  } else {
+    /* Shouldn't happen */
+    abort();
+  }
+  
+  /* Set upsampling and block smoothing */
+  (pr->cinfo).do_fancy_upsampling =
+    (pr->opts).fancy_upsampling ? TRUE : FALSE;
+  (pr->cinfo).do_block_smoothing =
+    (pr->opts).block_smoothing ? TRUE : FALSE;
+  
+  /* Set the output color space of color images, which libjpeg
+   * converts to RGB by default; YCbCr and grayscale output are only
+   * requested if the file is stored as YCbCr, in which case grayscale
+   * output is just the Y channel and libjpeg skips the chroma channels
+   * entirely */
+  if ((pr->cinfo).num_components == 3) {
+    if (((pr->opts).color == SPH_JPEG_COLOR_YCC) &&
+        ((pr->cinfo).jpeg_color_space == JCS_YCbCr)) {
+      (pr->cinfo).out_color_space = JCS_YCbCr;
+    } else if (((pr->opts).color == SPH_JPEG_COLOR_GRAY) &&
+        ((pr->cinfo).jpeg_color_space == JCS_YCbCr)) {
+      (pr->cinfo).out_color_space = JCS_GRAYSCALE;
+    } else {
+      (pr->cinfo).out_color_space = JCS_RGB;
+    }
+  }
+  
+  /* Decode only the first scans of progressive files, which needs
+   * buffered-image mode so that an output pass can be run before the
+   * rest of the file has been read */
+  pr->preview = (((pr->opts).max_scans > 0) &&
+                  jpeg_has_multiple_scans(&(pr->cinfo)));
+  (pr->cinfo).buffered_image = pr->preview ? TRUE : FALSE;
+}
+
+/*
+ * Read one scanline of a cropped image through the crop buffer.
+ * 
+ * This is only used when the staged flag of the reader is set.  Any
+ * decoded rows above the crop that still need to be discarded are read
+ * first.  Then the next decoded row is read into the crop buffer and
+ * the cropped part of it is copied to pscan.
+ * 
+ * The caller must have established the error handler.
+ * 
+ * Parameters:
+ * 
+ *   pr - the JPEG reader object
+ * 
+ *   pscan - the scanline buffer to receive the cropped row
+ */
+static void sph_jpeg_reader_croprow(
+    SPH_JPEG_READER * pr,
+    uint8_t         * pscan) {
+  
+  JSAMPROW row_pointer[1];
+  
+  /* Check parameters */
+  if ((pr == NULL) || (pscan == NULL)) {
+    abort();
+  }
+  if ((!(pr->staged)) || (pr->pCropBuf == NULL)) {
+    abort();
+  }
+  
+  /* Decode into the crop buffer */
+  row_pointer[0] = (JSAMPROW) pr->pCropBuf;
+  
+  /* Discard any rows above the crop */
+  for( ; pr->crop_skip > 0; (pr->crop_skip)--) {
+    (void) jpeg_read_scanlines(&(pr->cinfo), row_pointer, 1);
+  }
+  
+  /* Decode the row and copy out the crop */
+  (void) jpeg_read_scanlines(&(pr->cinfo), row_pointer, 1);
+  memcpy(
+    pscan,
+    pr->pCropBuf + pr->crop_offset,
+    (size_t) (pr->width * ((int32_t) pr->chcount)));
+}
+
+/*
+ * Allocate a new JPEG reader object.
+ * 
+ * The error handler is installed, but the decompressor object is not
+ * created until the first call to sph_jpeg_reader_start().
+ * 
+ * Return:
+ * 
+ *   a new JPEG reader object
+ */
+static SPH_JPEG_READER *sph_jpeg_reader_alloc(void) {
+  
+  SPH_JPEG_READER *pr = NULL;
+  
+  /* Allocate a new reader object */
+  pr = (SPH_JPEG_READER *) malloc(sizeof(SPH_JPEG_READER));
+  if (pr == NULL) {
+    return NULL;
+  }
+  memset(pr, 0, sizeof(SPH_JPEG_READER));
+  
+  /* Initialize fields */
+  pr->pFileSrc = NULL;
+  pr->created = 0;
+  pr->pending = 0;
+  pr->width = 1;
+  pr->height = 1;
+  pr->readcount = 0;
+  pr->chcount = 1;
+  pr->status = SPH_JPEG_ERR_OK;
+  sph_jpeg_reader_opts_init(&(pr->opts));
+  pr->cropped = 0;
+  pr->staged = 0;
+  pr->crop_skip = 0;
+  pr->crop_offset = 0;
+  pr->pCropBuf = NULL;
+  pr->crop_cap = 0;
+  pr->feeding = 0;
+  pr->feed_stage = 0;
+  pr->feed_denom = 1;
+  pr->preview = 0;
+  (pr->feedsrc).pBuf = NULL;
+  (pr->feedsrc).cap = 0;
+  
+  /* Set up the error handler */
+  (pr->cinfo).err = jpeg_std_error(&((pr->errman).pub));
+  ((pr->errman).pub).error_exit = &sph_jpeg_error_exit;
+  
+  /* Return the new reader object */
+  return pr;
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * Read the output dimensions and channel count of a JPEG reader object
+ * from its decompressor object.
+ * 
+ * The output dimensions must have been computed, either by starting
+ * decompression or by jpeg_calc_output_dimensions().  If they are out
+ * of range, the error status of the reader is set and the fields are
+ * reset to default values.
+ * 
+ * Parameters:
+ * 
+ *   pr - the JPEG reader object
+ */
+static void sph_jpeg_reader_dims(SPH_JPEG_READER *pr) {
+  
+  int status = 1;
+  
+  /* Check parameter */
+  if (pr == NULL) {
+    abort();
+  }
+  
+  /* Read the image information */
+  pr->width = (int32_t) (pr->cinfo).output_width;
+  pr->height = (int32_t) (pr->cinfo).output_height;
+  pr->chcount = (int) (pr->cinfo).output_components;
+  
+  /* Range-check information */
+  if ((pr->width < 1) || (pr->width > SPH_JPEG_MAXDIM) ||
+      (pr->height < 1) || (pr->height > SPH_JPEG_MAXDIM)) {
+    status = 0;
+    pr->status = SPH_JPEG_ERR_IDIM;
+  }
+  
+  if (status && (pr->chcount != 1) && (pr->chcount != 3)) {
+    status = 0;
+    pr->status = SPH_JPEG_ERR_CCNT;
+  }
+  
+  /* If there was an error, reset the fields */
+  if (!status) {
+    pr->width = 1;
+    pr->height = 1;
+    pr->chcount = 1;
+  }
+}
+
+/*
+ * Read the scans of a progressive file that a preview is made from,
+ * and start the output pass for them.
+ * 
+ * This is only used when the preview flag of the reader is set, once
+ * decompression has been started in buffered-image mode.  Input is
+ * consumed until max_scans scans have been read completely or the end
+ * of the image has been reached, and then the output pass is started
+ * for the last scan read.  With a feed reader, this is called again
+ * after each suspension, and continues where it left off.
+ * 
+ * The caller must have established the error handler.
+ * 
+ * Parameters:
+ * 
+ *   pr - the JPEG reader object
+ * 
+ * Return:
+ * 
+ *   non-zero if the output pass has started, zero if libjpeg suspended
+ *   for lack of data
+ */
+static int sph_jpeg_reader_preview(SPH_JPEG_READER *pr) {
+  
+  int retcode = 0;
+  int done = 0;
+  int result = 1;
+  
+  /* Check parameter */
+  if (pr == NULL) {
+    abort();
+  }
+  if (!(pr->preview)) {
+    abort();
+  }
+  
+  /* Consume input until enough scans are complete */
+  while (!done) {
+    retcode = jpeg_consume_input(&(pr->cinfo));
+    if (retcode == JPEG_SUSPENDED) {
+      result = 0;
+      done = 1;
+    } else if (retcode == JPEG_REACHED_EOI) {
+      done = 1;
+    } else if ((retcode == JPEG_SCAN_COMPLETED) &&
+        ((pr->cinfo).input_scan_number >= (pr->opts).max_scans)) {
+      done = 1;
+    }
+  }
+  
+  /* Start output of the scans read */
+  if (result) {
+    (void) jpeg_start_output(
+      &(pr->cinfo), (pr->cinfo).input_scan_number);
+  }
+  
+  return result;
+}
+
+/*
+ * Advance a feed reader through reading the header and starting
+ * decompression, as far as the data fed so far allows.
+ * 
+ * Each step is retried from where libjpeg suspended, so this is called
+ * again whenever more data has been fed, until decompression has
+ * started.  The image information is then read and checked.  Errors
+ * are recorded in the status of the reader object.
+ * 
+ * Parameters:
+ * 
+ *   pr - the JPEG reader object
+ */
+static void sph_jpeg_reader_advance(SPH_JPEG_READER *pr) {
+  
+  /* Check parameter */
+  if (pr == NULL) {
+    abort();
+  }
+  if ((!(pr->feeding)) || (pr->feed_stage >= 3)) {
+    abort();
+  }
+  
+  /* Establish the callback error handler */
+  if (setjmp(((pr->errman).setjmp_buffer))) {
+    /* This is run if libjpeg indicates an error */
+    pr->width = 1;
+    pr->height = 1;
+    pr->chcount = 1;
+    pr->status = sph_jpeg_errcode(&(pr->errman), SPH_JPEG_ERR_LIBJ);
+    return;
+  }
+  
+  SPH_JPEG_STAT_MARK(pr->stats);
+  
+  /* Read the header, and then request DCT-domain scaling in the same
+   * way as sph_jpeg_reader_start() and apply the decoder options */
+  if (pr->feed_stage == 0) {
+    if (jpeg_read_header(&(pr->cinfo), TRUE) != JPEG_SUSPENDED) {
+      (pr->cinfo).scale_num = 1;
+      (pr->cinfo).scale_denom = (unsigned int) pr->feed_denom;
+      sph_jpeg_reader_apply(pr);
+      pr->feed_stage = 1;
+    }
+  }
+  
+  /* Start decompression, which for progressive files reads the whole
+   * file unless only a preview is decoded */
+  if (pr->feed_stage == 1) {
+    if (jpeg_start_decompress(&(pr->cinfo))) {
+      pr->feed_stage = 2;
+    }
+  }
+  
+  /* Read the scans of a preview */
+  if (pr->feed_stage == 2) {
+    if ((!(pr->preview)) || sph_jpeg_reader_preview(pr)) {
+      pr->feed_stage = 3;
+    }
+  }
+  
+  SPH_JPEG_STAT_TIME(pr->stats, setup_ns);
+  
+  /* Read and check the image information once started */
+  if (pr->feed_stage >= 3) {
+    sph_jpeg_reader_dims(pr);
+  }
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * Determine the value that the feed functions return for a feed
+ * reader.
+ * 
+ * Parameters:
+ * 
+ *   pr - the JPEG reader object
+ * 
+ * Return:
+ * 
+ *   the error status if there is an error, else SPH_JPEG_ERR_MORE if
+ *   decompression has not started yet, else SPH_JPEG_ERR_OK
+ */
+static int sph_jpeg_reader_feedstate(SPH_JPEG_READER *pr) {
+  
+  int result = SPH_JPEG_ERR_OK;
+  
+  /* Check parameter */
+  if (pr == NULL) {
+    abort();
+  }
+  
+  /* Determine the result */
+  if (pr->status != SPH_JPEG_ERR_OK) {
+    result = pr->status;
+  } else if (pr->feed_stage < 3) {
+    result = SPH_JPEG_ERR_MORE;
+  }
+  
+  return result;
+}
+
+/*
+ * Find the custom memory manager state of a libjpeg object.
+ * 
+ * The libjpeg object is the first member of both the reader and the
+ * writer structures, so the object can be cast to the structure that
+ * contains it.  Only reader and writer objects may install the custom
+ * memory manager.
+ * 
+ * Parameters:
+ * 
+ *   cinfo - the libjpeg object
+ * 
+ * Return:
+ * 
+ *   the custom memory manager state of the object
+ */
+static SPH_JPEG_MEMMGR *sph_jpeg_mem_state(j_common_ptr cinfo) {
+  
+  /* Check parameter */
+  if (cinfo == NULL) {
+    abort();
+  }
+  
+  /* Cast to the containing object */
+  if (cinfo->is_decompressor) {
+    return &(((SPH_JPEG_READER *) cinfo)->memmgr);
+  } else {
+    return &(((SPH_JPEG_WRITER *) cinfo)->memmgr);
+  }
+}
+
+/*
+ * Allocate a block with the custom memory manager.
+ * 
+ * The block is added to the given pool and charged against the memory
+ * limit, along with its header and alignment padding.  If the pool ID
+ * is invalid, the memory limit would be exceeded, or the allocator
+ * fails, a libjpeg error is raised, so this function only returns if
+ * it succeeds.
+ * 
+ * Parameters:
+ * 
+ *   cinfo - the libjpeg object
+ * 
+ *   pool_id - the pool to allocate from
+ * 
+ *   size - the number of bytes to allocate
+ * 
+ * Return:
+ * 
+ *   the allocated memory, aligned to SPH_JPEG_MEMALIGN bytes
+ */
+static void *sph_jpeg_mem_block(
+    j_common_ptr cinfo,
+    int          pool_id,
+    size_t       size) {
+  
+  SPH_JPEG_MEMMGR *pm = NULL;
+  SPH_JPEG_MEMBLOCK *pb = NULL;
+  uint8_t *pData = NULL;
+  size_t total = 0;
+  size_t pad = 0;
+  
+  /* Get the state */
+  pm = sph_jpeg_mem_state(cinfo);
+  
+  /* Check the pool ID */
+  if ((pool_id < 0) || (pool_id >= JPOOL_NUMPOOLS)) {
+    ERREXIT1(cinfo, JERR_BAD_POOL_ID, pool_id);
+  }
+  
+  /* Add room for the header and the alignment padding */
+  if (size > SIZE_MAX - sizeof(SPH_JPEG_MEMBLOCK) - SPH_JPEG_MEMALIGN) {
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 1);
+  }
+  total = size + sizeof(SPH_JPEG_MEMBLOCK) + SPH_JPEG_MEMALIGN;
+  
+  /* Enforce the memory limit */
+  if ((pm->limit > 0) &&
+      ((total > pm->limit) || (pm->in_use > pm->limit - total))) {
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 2);
+  }
+  
+  /* Allocate the block */
+  if (pm->pAlloc != NULL) {
+    pb = (SPH_JPEG_MEMBLOCK *) (*((pm->pAlloc)->fAlloc))(
+                                  (pm->pAlloc)->pCustom, total);
+  } else {
+    pb = (SPH_JPEG_MEMBLOCK *) malloc(total);
+  }
+  if (pb == NULL) {
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 3);
+  }
+  
+  /* Add the block to the pool */
+  pb->pNext = (pm->pPool)[pool_id];
+  pb->size = total;
+  pb->pAlloc = pm->pAlloc;
+  (pm->pPool)[pool_id] = pb;
+  pm->in_use += total;
+  
+  /* Align the memory following the header */
+  pData = ((uint8_t *) pb) + sizeof(SPH_JPEG_MEMBLOCK);
+  pad = (size_t) (((uintptr_t) pData) % SPH_JPEG_MEMALIGN);
+  if (pad > 0) {
+    pData += (SPH_JPEG_MEMALIGN - pad);
+  }
+  
+  return (void *) pData;
+}
+
+/*
+ * Custom memory manager methods.
+ * 
+ * Each allocation is a separate block, and small and large objects are
+ * allocated in the same way.  Arrays are allocated as one block of
+ * storage and one block of row pointers.  Sample rows are padded to a
+ * multiple of SPH_JPEG_MEMROW bytes.  Virtual arrays can only be
+ * requested from the image pool, and they are allocated entirely in
+ * memory when they are realized, so accessing them just returns the
+ * requested rows.
+ */
+METHODDEF(void *) sph_jpeg_mem_small(
+    j_common_ptr cinfo,
+    int          pool_id,
+    size_t       sizeofobject) {
+  
+  return sph_jpeg_mem_block(cinfo, pool_id, sizeofobject);
+}
+
+METHODDEF(JSAMPARRAY) sph_jpeg_mem_sarray(
+    j_common_ptr cinfo,
+    int          pool_id,
+    JDIMENSION   samplesperrow,
+    JDIMENSION   numrows) {
+  
+  JSAMPARRAY result = NULL;
+  JSAMPLE *pData = NULL;
+  size_t rowsize = 0;
+  JDIMENSION i = 0;
+  
+  /* Compute the padded row size */
+  rowsize = ((size_t) samplesperrow) * sizeof(JSAMPLE);
+  rowsize = ((rowsize + SPH_JPEG_MEMROW - 1) / SPH_JPEG_MEMROW) *
+              SPH_JPEG_MEMROW;
+  if ((rowsize < 1) || (numrows < 1) ||
+      (((size_t) numrows) > SIZE_MAX / rowsize)) {
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 4);
+  }
+  
+  /* Allocate the row pointers and the storage */
+  result = (JSAMPARRAY) sph_jpeg_mem_block(
+              cinfo, pool_id, ((size_t) numrows) * sizeof(JSAMPROW));
+  pData = (JSAMPLE *) sph_jpeg_mem_block(
+              cinfo, pool_id, ((size_t) numrows) * rowsize);
+  
+  /* Point the rows into the storage */
+  for(i = 0; i < numrows; i++) {
+    result[i] = pData;
+    pData += (rowsize / sizeof(JSAMPLE));
+  }
+  
+  return result;
+}
+
+METHODDEF(JBLOCKARRAY) sph_jpeg_mem_barray(
+    j_common_ptr cinfo,
+    int          pool_id,
+    JDIMENSION   blocksperrow,
+    JDIMENSION   numrows) {
+  
+  JBLOCKARRAY result = NULL;
+  JBLOCKROW pData = NULL;
+  JDIMENSION i = 0;
+  
+  /* Check the array size */
+  if ((blocksperrow < 1) || (numrows < 1) ||
+      (((size_t) numrows) >
+        SIZE_MAX / (((size_t) blocksperrow) * sizeof(JBLOCK)))) {
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 5);
+  }
+  
+  /* Allocate the row pointers and the storage */
+  result = (JBLOCKARRAY) sph_jpeg_mem_block(
+              cinfo, pool_id, ((size_t) numrows) * sizeof(JBLOCKROW));
+  pData = (JBLOCKROW) sph_jpeg_mem_block(
+              cinfo, pool_id,
+              ((size_t) numrows) * ((size_t) blocksperrow) *
+                sizeof(JBLOCK));
+  
+  /* Point the rows into the storage */
+  for(i = 0; i < numrows; i++) {
+    result[i] = pData;
+    pData += blocksperrow;
+  }
+  
+  return result;
+}
+
+METHODDEF(jvirt_sarray_ptr) sph_jpeg_mem_vsarray(
+    j_common_ptr cinfo,
+    int          pool_id,
+    boolean      pre_zero,
+    JDIMENSION   samplesperrow,
+    JDIMENSION   numrows,
+    JDIMENSION   maxaccess) {
+  
+  SPH_JPEG_MEMMGR *pm = NULL;
+  jvirt_sarray_ptr result = NULL;
+  
+  /* Get the state */
+  pm = sph_jpeg_mem_state(cinfo);
+  
+  /* Only the image pool may hold virtual arrays */
+  if (pool_id != JPOOL_IMAGE) {
+    ERREXIT1(cinfo, JERR_BAD_POOL_ID, pool_id);
+  }
+  
+  /* Record the request until the arrays are realized */
+  result = (jvirt_sarray_ptr) sph_jpeg_mem_block(
+              cinfo, pool_id, sizeof(struct jvirt_sarray_control));
+  result->mem_buffer = NULL;
+  result->rows = numrows;
+  result->width = samplesperrow;
+  result->maxaccess = maxaccess;
+  result->pre_zero = pre_zero;
+  result->next = pm->pVirtS;
+  pm->pVirtS = result;
+  
+  return result;
+}
+
+METHODDEF(jvirt_barray_ptr) sph_jpeg_mem_vbarray(
+    j_common_ptr cinfo,
+    int          pool_id,
+    boolean      pre_zero,
+    JDIMENSION   blocksperrow,
+    JDIMENSION   numrows,
+    JDIMENSION   maxaccess) {
+  
+  SPH_JPEG_MEMMGR *pm = NULL;
+  jvirt_barray_ptr result = NULL;
+  
+  /* Get the state */
+  pm = sph_jpeg_mem_state(cinfo);
+  
+  /* Only the image pool may hold virtual arrays */
+  if (pool_id != JPOOL_IMAGE) {
+    ERREXIT1(cinfo, JERR_BAD_POOL_ID, pool_id);
+  }
+  
+  /* Record the request until the arrays are realized */
+  result = (jvirt_barray_ptr) sph_jpeg_mem_block(
+              cinfo, pool_id, sizeof(struct jvirt_barray_control));
+  result->mem_buffer = NULL;
+  result->rows = numrows;
+  result->width = blocksperrow;
+  result->maxaccess = maxaccess;
+  result->pre_zero = pre_zero;
+  result->next = pm->pVirtB;
+  pm->pVirtB = result;
+  
+  return result;
+}
+
+METHODDEF(void) sph_jpeg_mem_realize(j_common_ptr cinfo) {
+  
+  SPH_JPEG_MEMMGR *pm = NULL;
+  jvirt_sarray_ptr ps = NULL;
+  jvirt_barray_ptr pb = NULL;
+  JDIMENSION i = 0;
+  
+  /* Get the state */
+  pm = sph_jpeg_mem_state(cinfo);
+  
+  /* Allocate each array that hasn't been realized yet */
+  for(ps = pm->pVirtS; ps != NULL; ps = ps->next) {
+    if (ps->mem_buffer == NULL) {
+      ps->mem_buffer = sph_jpeg_mem_sarray(
+                          cinfo, JPOOL_IMAGE, ps->width, ps->rows);
+      if (ps->pre_zero) {
+        for(i = 0; i < ps->rows; i++) {
+          memset(
+            (ps->mem_buffer)[i], 0,
+            ((size_t) ps->width) * sizeof(JSAMPLE));
+        }
+      }
+    }
+  }
+  
+  for(pb = pm->pVirtB; pb != NULL; pb = pb->next) {
+    if (pb->mem_buffer == NULL) {
+      pb->mem_buffer = sph_jpeg_mem_barray(
+                          cinfo, JPOOL_IMAGE, pb->width, pb->rows);
+      if (pb->pre_zero) {
+        for(i = 0; i < pb->rows; i++) {
+          memset(
+            (pb->mem_buffer)[i], 0,
+            ((size_t) pb->width) * sizeof(JBLOCK));
+        }
+      }
+    }
+  }
+}
+
+METHODDEF(JSAMPARRAY) sph_jpeg_mem_access_s(
+    j_common_ptr     cinfo,
+    jvirt_sarray_ptr ptr,
+    JDIMENSION       start_row,
+    JDIMENSION       num_rows,
+    boolean          writable) {
+  
+  /* The whole array is always in memory */
+  (void) writable;
+  if ((ptr == NULL) || (ptr->mem_buffer == NULL) ||
+      (num_rows > ptr->maxaccess) || (start_row > ptr->rows) ||
+      (num_rows > ptr->rows - start_row)) {
+    ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+  }
+  
+  return ptr->mem_buffer + start_row;
+}
+
+METHODDEF(JBLOCKARRAY) sph_jpeg_mem_access_b(
+    j_common_ptr     cinfo,
+    jvirt_barray_ptr ptr,
+    JDIMENSION       start_row,
+    JDIMENSION       num_rows,
+    boolean          writable) {
+  
+  /* The whole array is always in memory */
+  (void) writable;
+  if ((ptr == NULL) || (ptr->mem_buffer == NULL) ||
+      (num_rows > ptr->maxaccess) || (start_row > ptr->rows) ||
+      (num_rows > ptr->rows - start_row)) {
+    ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+  }
+  
+  return ptr->mem_buffer + start_row;
+}
+
+METHODDEF(void) sph_jpeg_mem_free(j_common_ptr cinfo, int pool_id) {
+  
+  SPH_JPEG_MEMMGR *pm = NULL;
+  
+  /* Get the state */
+  pm = sph_jpeg_mem_state(cinfo);
+  
+  /* Check the pool ID */
+  if ((pool_id < 0) || (pool_id >= JPOOL_NUMPOOLS)) {
+    ERREXIT1(cinfo, JERR_BAD_POOL_ID, pool_id);
+  }
+  
+  /* The virtual arrays are stored in the image pool */
+  if (pool_id == JPOOL_IMAGE) {
+    pm->pVirtS = NULL;
+    pm->pVirtB = NULL;
+  }
+  
+  /* Release our blocks and whatever libjpeg allocated itself */
+  sph_jpeg_mem_release(pm, pool_id);
+  (*(pm->free_pool))(cinfo, pool_id);
+}
+
+METHODDEF(void) sph_jpeg_mem_destruct(j_common_ptr cinfo) {
+  
+  SPH_JPEG_MEMMGR *pm = NULL;
+  int i = 0;
+  
+  /* Get the state */
+  pm = sph_jpeg_mem_state(cinfo);
+  
+  /* Release all our blocks, then let libjpeg release the rest along
+   * with the memory manager itself */
+  pm->pVirtS = NULL;
+  pm->pVirtB = NULL;
+  for(i = JPOOL_NUMPOOLS - 1; i >= 0; i--) {
+    sph_jpeg_mem_release(pm, i);
+  }
+  pm->installed = 0;
+  (*(pm->self_destruct))(cinfo);
+}
+
+/*
+ * Release all the blocks in one pool of the custom memory manager.
+ * 
+ * Each block is released through the allocator that it was allocated
+ * with.
+ * 
+ * Parameters:
+ * 
+ *   pm - the custom memory manager state
+ * 
+ *   pool_id - the pool to release
+ */
+static void sph_jpeg_mem_release(SPH_JPEG_MEMMGR *pm, int pool_id) {
+  
+  SPH_JPEG_MEMBLOCK *pb = NULL;
+  SPH_JPEG_MEMBLOCK *pNext = NULL;
+  
+  /* Check parameters */
+  if (pm == NULL) {
+    abort();
+  }
+  if ((pool_id < 0) || (pool_id >= JPOOL_NUMPOOLS)) {
+    abort();
+  }
+  
+  /* Release each block */
+  for(pb = (pm->pPool)[pool_id]; pb != NULL; pb = pNext) {
+    pNext = pb->pNext;
+    pm->in_use -= pb->size;
+    if (pb->pAlloc != NULL) {
+      (*((pb->pAlloc)->fFree))((pb->pAlloc)->pCustom, (void *) pb);
+    } else {
+      free(pb);
+    }
+  }
+  (pm->pPool)[pool_id] = NULL;
+}
+
+/*
+ * Apply the memory options of a reader or writer object to its libjpeg
+ * object before an image is started.
+ * 
+ * The first time a memory limit or a custom allocator is requested,
+ * the custom memory manager is installed in place of the allocation
+ * methods of libjpeg.  If instrumentation is compiled in, the custom
+ * methods are installed beneath the instrumentation wrappers, so that
+ * the wrappers still see every request.  Once installed, the custom
+ * memory manager stays in place, and it uses malloc() without a limit
+ * if the options no longer ask for anything else.
+ * 
+ * This must be called between images, when the image pool is empty.
+ * 
+ * Parameters:
+ * 
+ *   cinfo - the libjpeg object
+ * 
+ *   max_memory - the memory limit in bytes, or zero for no limit
+ * 
+ *   pAlloc - the custom allocator, or NULL for malloc()
+ */
+static void sph_jpeg_mem_apply(
+          j_common_ptr         cinfo,
+          size_t               max_memory,
+    const SPH_JPEG_ALLOCATOR * pAlloc) {
+  
+  SPH_JPEG_MEMMGR *pm = NULL;
+  struct jpeg_memory_mgr *pTarget = NULL;
+  
+  /* Check parameter */
+  if (cinfo == NULL) {
+    abort();
+  }
+  pm = sph_jpeg_mem_state(cinfo);
+  
+  /* Install the custom memory manager if needed */
+  if ((!(pm->installed)) && ((max_memory > 0) || (pAlloc != NULL))) {
+    
+    /* The wrapped methods go beneath the instrumentation wrappers */
+#ifdef SPH_JPEG_ENABLE_STATS
+    pTarget = &(((SPH_JPEG_STATCTX *) (cinfo->client_data))->mem);
+#else
+    pTarget = cinfo->mem;
+#endif
+    
+    pm->free_pool = pTarget->free_pool;
+    pTarget->alloc_small = &sph_jpeg_mem_small;
+    pTarget->alloc_large = &sph_jpeg_mem_small;
+    pTarget->alloc_sarray = &sph_jpeg_mem_sarray;
+    pTarget->alloc_barray = &sph_jpeg_mem_barray;
+    pTarget->request_virt_sarray = &sph_jpeg_mem_vsarray;
+    pTarget->request_virt_barray = &sph_jpeg_mem_vbarray;
+    pTarget->free_pool = &sph_jpeg_mem_free;
+    
+    pm->self_destruct = (cinfo->mem)->self_destruct;
+    (cinfo->mem)->realize_virt_arrays = &sph_jpeg_mem_realize;
+    (cinfo->mem)->access_virt_sarray = &sph_jpeg_mem_access_s;
+    (cinfo->mem)->access_virt_barray = &sph_jpeg_mem_access_b;
+    (cinfo->mem)->self_destruct = &sph_jpeg_mem_destruct;
+    
+    pm->installed = 1;
+  }
+  
+  /* Set the limit and the allocator for new blocks */
+  pm->limit = max_memory;
+  pm->pAlloc = pAlloc;
+  if (max_memory > (size_t) LONG_MAX) {
+    (cinfo->mem)->max_memory_to_use = LONG_MAX;
+  } else {
+    (cinfo->mem)->max_memory_to_use = (long) max_memory;
+  }
+}
+
+#ifdef SPH_JPEG_ENABLE_STATS
+/*
+ * Read the monotonic clock.
+ * 
+ * Return:
+ * 
+ *   the current time in nanoseconds
+ */
+static int64_t sph_jpeg_stat_now(void) {
+  
+  struct timespec ts;
+  
+  memset(&ts, 0, sizeof(struct timespec));
+  if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+    abort();
+  }
+  
+  return (((int64_t) ts.tv_sec) * INT64_C(1000000000)) +
+            ((int64_t) ts.tv_nsec);
+}
+
+/*
+ * Record a request made to one of the libjpeg memory pools.
+ * 
+ * Parameters:
+ * 
+ *   cinfo - the libjpeg object
+ * 
+ *   pool_id - the pool the request was made to
+ * 
+ *   size - the number of bytes requested
+ */
+static void sph_jpeg_stat_pool(
+    j_common_ptr cinfo,
+    int          pool_id,
+    int64_t      size) {
+  
+  SPH_JPEG_STATCTX *ps = (SPH_JPEG_STATCTX *) (cinfo->client_data);
+  
+  /* libjpeg has already rejected invalid pool IDs */
+  if ((pool_id < 0) || (pool_id >= JPOOL_NUMPOOLS)) {
+    abort();
+  }
+  
+  (ps->pool)[pool_id] += size;
+  (ps->pub).pool_bytes += size;
+  if ((ps->pub).pool_bytes > (ps->pub).pool_peak) {
+    (ps->pub).pool_peak = (ps->pub).pool_bytes;
+  }
+}
+
+/*
+ * Memory manager wrappers.
+ * 
+ * Each of these calls the original method and records the size of the
+ * request.  Arrays are counted at the size of their sample or block
+ * storage, and virtual arrays are counted when they are requested,
+ * because libjpeg realizes them entirely in memory.
+ */
+METHODDEF(void *) sph_jpeg_stat_small(
+    j_common_ptr cinfo,
+    int          pool_id,
+    size_t       sizeofobject) {
+  
+  SPH_JPEG_STATCTX *ps = (SPH_JPEG_STATCTX *) (cinfo->client_data);
+  void *pResult = NULL;
+  
+  pResult = (*((ps->mem).alloc_small))(cinfo, pool_id, sizeofobject);
+  sph_jpeg_stat_pool(cinfo, pool_id, (int64_t) sizeofobject);
+  
+  return pResult;
+}
+
+METHODDEF(void *) sph_jpeg_stat_large(
+    j_common_ptr cinfo,
+    int          pool_id,
+    size_t       sizeofobject) {
+  
+  SPH_JPEG_STATCTX *ps = (SPH_JPEG_STATCTX *) (cinfo->client_data);
+  void *pResult = NULL;
+  
+  pResult = (*((ps->mem).alloc_large))(cinfo, pool_id, sizeofobject);
+  sph_jpeg_stat_pool(cinfo, pool_id, (int64_t) sizeofobject);
+  
+  return pResult;
+}
+
+METHODDEF(JSAMPARRAY) sph_jpeg_stat_sarray(
+    j_common_ptr cinfo,
+    int          pool_id,
+    JDIMENSION   samplesperrow,
+    JDIMENSION   numrows) {
+  
+  SPH_JPEG_STATCTX *ps = (SPH_JPEG_STATCTX *) (cinfo->client_data);
+  JSAMPARRAY result = NULL;
+  
+  result = (*((ps->mem).alloc_sarray))(
+              cinfo, pool_id, samplesperrow, numrows);
+  sph_jpeg_stat_pool(
+    cinfo, pool_id,
+    ((int64_t) samplesperrow) * ((int64_t) numrows) *
+      ((int64_t) sizeof(JSAMPLE)));
+  
+  return result;
+}
+
+METHODDEF(JBLOCKARRAY) sph_jpeg_stat_barray(
+    j_common_ptr cinfo,
+    int          pool_id,
+    JDIMENSION   blocksperrow,
+    JDIMENSION   numrows) {
+  
+  SPH_JPEG_STATCTX *ps = (SPH_JPEG_STATCTX *) (cinfo->client_data);
+  JBLOCKARRAY result = NULL;
+  
+  result = (*((ps->mem).alloc_barray))(
+              cinfo, pool_id, blocksperrow, numrows);
+  sph_jpeg_stat_pool(
+    cinfo, pool_id,
+    ((int64_t) blocksperrow) * ((int64_t) numrows) *
+      ((int64_t) sizeof(JBLOCK)));
+  
+  return result;
+}
+
+METHODDEF(jvirt_sarray_ptr) sph_jpeg_stat_vsarray(
+    j_common_ptr cinfo,
+    int          pool_id,
+    boolean      pre_zero,
+    JDIMENSION   samplesperrow,
+    JDIMENSION   numrows,
+    JDIMENSION   maxaccess) {
+  
+  SPH_JPEG_STATCTX *ps = (SPH_JPEG_STATCTX *) (cinfo->client_data);
+  jvirt_sarray_ptr result = NULL;
+  
+  result = (*((ps->mem).request_virt_sarray))(
+              cinfo, pool_id, pre_zero, samplesperrow, numrows,
+              maxaccess);
+  sph_jpeg_stat_pool(
+    cinfo, pool_id,
+    ((int64_t) samplesperrow) * ((int64_t) numrows) *
+      ((int64_t) sizeof(JSAMPLE)));
+  
+  return result;
+}
+
+METHODDEF(jvirt_barray_ptr) sph_jpeg_stat_vbarray(
+    j_common_ptr cinfo,
+    int          pool_id,
+    boolean      pre_zero,
+    JDIMENSION   blocksperrow,
+    JDIMENSION   numrows,
+    JDIMENSION   maxaccess) {
+  
+  SPH_JPEG_STATCTX *ps = (SPH_JPEG_STATCTX *) (cinfo->client_data);
+  jvirt_barray_ptr result = NULL;
+  
+  result = (*((ps->mem).request_virt_barray))(
+              cinfo, pool_id, pre_zero, blocksperrow, numrows,
+              maxaccess);
+  sph_jpeg_stat_pool(
+    cinfo, pool_id,
+    ((int64_t) blocksperrow) * ((int64_t) numrows) *
+      ((int64_t) sizeof(JBLOCK)));
+  
+  return result;
+}
+
+METHODDEF(void) sph_jpeg_stat_free(j_common_ptr cinfo, int pool_id) {
+  
+  SPH_JPEG_STATCTX *ps = (SPH_JPEG_STATCTX *) (cinfo->client_data);
+  
+  (*((ps->mem).free_pool))(cinfo, pool_id);
+  if ((pool_id >= 0) && (pool_id < JPOOL_NUMPOOLS)) {
+    (ps->pub).pool_bytes -= (ps->pool)[pool_id];
+    (ps->pool)[pool_id] = 0;
+  }
+}
+
+/*
+ * Source manager fill wrapper for readers of files, which counts the
+ * bytes delivered to libjpeg.
+ */
+METHODDEF(boolean) sph_jpeg_stat_fill(j_decompress_ptr cinfo) {
+  
+  SPH_JPEG_STATCTX *ps = (SPH_JPEG_STATCTX *) (cinfo->client_data);
+  boolean result = FALSE;
+  
+  result = (*(ps->fill_input_buffer))(cinfo);
+  ps->delivered += (int64_t) (cinfo->src)->bytes_in_buffer;
+  
+  return result;
+}
+
+/*
+ * Destination manager wrappers for writers, which count the bytes that
+ * libjpeg produces between the calls.
+ * 
+ * The bytes are counted from the free space of the buffer.  When the
+ * buffer is emptied, it is always full, but the libjpeg entropy coders
+ * keep their own copy of the output position and may not have stored
+ * it back yet, so all the free space since the last count is counted
+ * at that point.  The initialization wrapper puts the original
+ * initialization method back once it has run, because the libjpeg
+ * stdio destination manager refuses to be reused if that method has
+ * changed.
+ */
+METHODDEF(void) sph_jpeg_stat_dinit(j_compress_ptr cinfo) {
+  
+  SPH_JPEG_STATCTX *ps = (SPH_JPEG_STATCTX *) (cinfo->client_data);
+  
+  (*(ps->init_destination))(cinfo);
+  (cinfo->dest)->init_destination = ps->init_destination;
+  ps->mark_free = (cinfo->dest)->free_in_buffer;
+}
+
+METHODDEF(boolean) sph_jpeg_stat_empty(j_compress_ptr cinfo) {
+  
+  SPH_JPEG_STATCTX *ps = (SPH_JPEG_STATCTX *) (cinfo->client_data);
+  boolean result = FALSE;
+  
+  (ps->pub).bytes += (int64_t) ps->mark_free;
+  result = (*(ps->empty_output_buffer))(cinfo);
+  ps->mark_free = (cinfo->dest)->free_in_buffer;
+  
+  return result;
+}
+
+METHODDEF(void) sph_jpeg_stat_term(j_compress_ptr cinfo) {
+  
+  SPH_JPEG_STATCTX *ps = (SPH_JPEG_STATCTX *) (cinfo->client_data);
+  
+  (ps->pub).bytes += (int64_t) (ps->mark_free -
+                                  (cinfo->dest)->free_in_buffer);
+  ps->mark_free = (cinfo->dest)->free_in_buffer;
+  (*(ps->term_destination))(cinfo);
+}
+
+/*
+ * Install the memory manager wrappers on a newly created libjpeg
+ * object.
+ * 
+ * Parameters:
+ * 
+ *   cinfo - the libjpeg object
+ * 
+ *   ps - the instrumentation state of the object
+ */
+static void sph_jpeg_stat_attach(
+    j_common_ptr       cinfo,
+    SPH_JPEG_STATCTX * ps) {
+  
+  struct jpeg_memory_mgr *pm = NULL;
+  
+  /* Check parameters */
+  if ((cinfo == NULL) || (ps == NULL)) {
+    abort();
+  }
+  
+  /* Keep the original methods and point libjpeg at the wrappers */
+  pm = cinfo->mem;
+  cinfo->client_data = (void *) ps;
+  memcpy(&(ps->mem), pm, sizeof(struct jpeg_memory_mgr));
+  pm->alloc_small = &sph_jpeg_stat_small;
+  pm->alloc_large = &sph_jpeg_stat_large;
+  pm->alloc_sarray = &sph_jpeg_stat_sarray;
+  pm->alloc_barray = &sph_jpeg_stat_barray;
+  pm->request_virt_sarray = &sph_jpeg_stat_vsarray;
+  pm->request_virt_barray = &sph_jpeg_stat_vbarray;
+  pm->free_pool = &sph_jpeg_stat_free;
+}
+
+/*
+ * Add the bytes consumed from the current source manager of a reader
+ * to its bytes counter, before the reader switches to a new source.
+ * 
+ * Parameters:
+ * 
+ *   pr - the JPEG reader object
+ */
+static void sph_jpeg_stat_settle(SPH_JPEG_READER *pr) {
+  
+  SPH_JPEG_STATCTX *ps = NULL;
+  
+  /* Check parameter */
+  if (pr == NULL) {
+    abort();
+  }
+  ps = &(pr->stats);
+  
+  /* Count everything delivered except what is still buffered */
+  if ((pr->cinfo).src != NULL) {
+    ps->delivered -= (int64_t) ((pr->cinfo).src)->bytes_in_buffer;
+  }
+  (ps->pub).bytes += ps->delivered;
+  ps->delivered = 0;
+}
+#endif
+
+/*
+ * Compute the size in bytes of one row of an image buffer in a given
+ * pixel layout, without any alignment padding.
+ * 
+ * An invalid chcount or layout causes a fault.
+ * 
+ * Parameters:
+ * 
+ *   width - the width of the image in pixels
+ * 
+ *   chcount - the number of color channels
+ * 
+ *   layout - the pixel layout
+ * 
+ * Return:
+ * 
+ *   the row size in bytes
+ */
+static size_t sph_jpeg_layout_rowsize(
+    int32_t width,
+    int     chcount,
+    int     layout) {
+  
+  size_t row_size = 0;
+  
+  /* Check parameters */
+  if ((width < 1) || (width > SPH_JPEG_MAXDIM)) {
+    abort();
+  }
+  if ((chcount != 1) && (chcount != 3)) {
+    abort();
+  }
+  
+  /* Padded layouts always use four bytes per pixel */
+  if (layout == SPH_JPEG_LAYOUT_PACKED) {
+    row_size = ((size_t) width) * ((size_t) chcount);
+    
+  } else if ((layout == SPH_JPEG_LAYOUT_RGBX) ||
+              (layout == SPH_JPEG_LAYOUT_BGRX)) {
+    row_size = ((size_t) width) * 4;
+    
+  } else {
+    abort();
+  }
+  
+  /* Return the row size */
+  return row_size;
+}
+
+/*
+ * Expand a decoded scanline in place into a padded layout.
+ * 
+ * pRow holds a scanline in the format of sph_jpeg_reader_get() at its
+ * start, and must have room for (width * 4) bytes.  The pixels are
+ * expanded from the last one backwards, so each source pixel is read
+ * before its bytes are overwritten.
+ * 
+ * Parameters:
+ * 
+ *   pRow - the row to expand
+ * 
+ *   width - the width of the row in pixels
+ * 
+ *   chcount - the number of color channels, 1 or 3
+ * 
+ *   layout - SPH_JPEG_LAYOUT_RGBX or SPH_JPEG_LAYOUT_BGRX
+ */
+static void sph_jpeg_layout_expand(
+    uint8_t * pRow,
+    int32_t   width,
+    int       chcount,
+    int       layout) {
+  
+  int32_t x = 0;
+  uint8_t c0 = 0;
+  uint8_t c1 = 0;
+  uint8_t c2 = 0;
+  uint8_t *pd = NULL;
+  
+  /* Check parameters */
+  if ((pRow == NULL) || (width < 1)) {
+    abort();
+  }
+  if ((layout != SPH_JPEG_LAYOUT_RGBX) &&
+      (layout != SPH_JPEG_LAYOUT_BGRX)) {
+    abort();
+  }
+  
+  /* Expand the pixels from the end of the row */
+  if (chcount == 1) {
+    for(x = width - 1; x >= 0; x--) {
+      c0 = pRow[x];
+      pd = pRow + (((size_t) x) * 4);
+      pd[0] = c0;
+      pd[1] = c0;
+      pd[2] = c0;
+      pd[3] = (uint8_t) 255;
+    }
+    
+  } else if (chcount == 3) {
+    for(x = width - 1; x >= 0; x--) {
+      c0 = pRow[(((size_t) x) * 3)    ];
+      c1 = pRow[(((size_t) x) * 3) + 1];
+      c2 = pRow[(((size_t) x) * 3) + 2];
+      pd = pRow + (((size_t) x) * 4);
+      if (layout == SPH_JPEG_LAYOUT_RGBX) {
+        pd[0] = c0;
+        pd[2] = c2;
+      } else {
+        pd[0] = c2;
+        pd[2] = c0;
+      }
+      pd[1] = c1;
+      pd[3] = (uint8_t) 255;
+    }
+    
+  } else {
+    abort();
+  }
+}
+
+/*
+ * Pack a row of a padded layout into a scanline for the encoder.
+ * 
+ * pSrc holds (width * 4) bytes in the padded layout, and pDest
+ * receives (width * chcount) bytes in the format of
+ * sph_jpeg_writer_put().  The padding bytes are ignored, and for
+ * grayscale the green byte of each pixel is taken.
+ * 
+ * Parameters:
+ * 
+ *   pDest - the scanline to receive the packed row
+ * 
+ *   pSrc - the row to pack
+ * 
+ *   width - the width of the row in pixels
+ * 
+ *   chcount - the number of color channels, 1 or 3
+ * 
+ *   layout - SPH_JPEG_LAYOUT_RGBX or SPH_JPEG_LAYOUT_BGRX
+ */
+static void sph_jpeg_layout_pack(
+          uint8_t * pDest,
+    const uint8_t * pSrc,
+          int32_t   width,
+          int       chcount,
+          int       layout) {
+  
+  int32_t x = 0;
+  
+  /* Check parameters */
+  if ((pDest == NULL) || (pSrc == NULL) || (width < 1)) {
+    abort();
+  }
+  if ((layout != SPH_JPEG_LAYOUT_RGBX) &&
+      (layout != SPH_JPEG_LAYOUT_BGRX)) {
+    abort();
+  }
+  
+  /* Pack the pixels */
+  if (chcount == 1) {
+    for(x = 0; x < width; x++) {
+      pDest[x] = pSrc[1];
+      pSrc += 4;
+    }
+    
+  } else if ((chcount == 3) && (layout == SPH_JPEG_LAYOUT_RGBX)) {
+    for(x = 0; x < width; x++) {
+      pDest[0] = pSrc[0];
+      pDest[1] = pSrc[1];
+      pDest[2] = pSrc[2];
+      pDest += 3;
+      pSrc += 4;
+    }
+    
+  } else if (chcount == 3) {
+    for(x = 0; x < width; x++) {
+      pDest[0] = pSrc[2];
+      pDest[1] = pSrc[1];
+      pDest[2] = pSrc[0];
+      pDest += 3;
+      pSrc += 4;
+    }
+    
+  } else {
+    abort();
+  }
+}
+
+/*
+ * Public function implementations
+ * ===============================
+ * 
+ * See the header for specifications.
+ */
+
+/*
+ * sph_jpeg_errstr function.
+ */
+const char *sph_jpeg_errstr(int status) {
+  
+  const char *pResult = NULL;
+  
+  switch (status) {
+    case SPH_JPEG_ERR_OK:
       pResult = "No error";
       break;
     
-    case SPH_JPEG_ERR_LIBJ:
-      pResult = "Error reading header of JPEG file";
-      break;
+    case SPH_JPEG_ERR_LIBJ:
+      pResult = "Error reading header of JPEG file";
+      break;
+    
+    case SPH_JPEG_ERR_IDIM:
+      pResult = "Image dimensions out of range";
+      break;
+    
+    case SPH_JPEG_ERR_CCNT:
+      pResult = "Invalid number of color channels";
+      break;
+    
+    case SPH_JPEG_ERR_READ:
+      pResult = "Error decoding JPEG file";
+      break;
+    
+    case SPH_JPEG_ERR_MORE:
+      pResult = "Not enough data to read JPEG header";
+      break;
+    
+    case SPH_JPEG_ERR_WRIT:
+      pResult = "Error writing JPEG file";
+      break;
+    
+    case SPH_JPEG_ERR_MEM:
+      pResult = "Memory limit exceeded or allocation failed";
+      break;
+    
+    default:
+      pResult = "Unknown error";
+  }
+  
+  return pResult;
+}
+
+/*
+ * sph_jpeg_probe function.
+ */
+int sph_jpeg_probe(FILE *pIn, SPH_JPEG_PROBE *pInfo) {
+  
+  /* Check parameters */
+  if ((pIn == NULL) || (pInfo == NULL)) {
+    abort();
+  }
+  
+  /* Probe the file */
+  return sph_jpeg_probe_run(pIn, NULL, 0, pInfo);
+}
+
+/*
+ * sph_jpeg_probe_mem function.
+ */
+int sph_jpeg_probe_mem(
+    const void           * pData,
+          size_t           len,
+          SPH_JPEG_PROBE * pInfo) {
+  
+  /* Check parameters */
+  if ((pData == NULL) || (pInfo == NULL)) {
+    abort();
+  }
+  
+  /* Probe the memory buffer */
+  return sph_jpeg_probe_run(NULL, pData, len, pInfo);
+}
+
+/*
+ * sph_jpeg_transcode function.
+ */
+int sph_jpeg_transcode(FILE *pIn, FILE *pOut, int flags) {
+  
+  /* status, writing, and pCoef are volatile because they are changed
+   * after setjmp() */
+  volatile int status = SPH_JPEG_ERR_OK;
+  volatile int writing = 0;
+  jvirt_barray_ptr * volatile pCoef = NULL;
+  int m = 0;
+  struct jpeg_decompress_struct dinfo;
+  struct jpeg_compress_struct cinfo;
+  SPH_JPEG_ERRMAN errman;
+  jpeg_saved_marker_ptr pMark = NULL;
+  
+  /* Initialize structures */
+  memset(&dinfo, 0, sizeof(struct jpeg_decompress_struct));
+  memset(&cinfo, 0, sizeof(struct jpeg_compress_struct));
+  memset(&errman, 0, sizeof(SPH_JPEG_ERRMAN));
+  
+  /* Check parameters */
+  if ((pIn == NULL) || (pOut == NULL)) {
+    abort();
+  }
+  if ((flags &
+        ~(SPH_JPEG_TRANS_OPTIMIZE | SPH_JPEG_TRANS_MARKERS)) != 0) {
+    abort();
+  }
+  
+  /* Set up the error handler, shared by both libjpeg objects */
+  dinfo.err = jpeg_std_error(&(errman.pub));
+  cinfo.err = &(errman.pub);
+  (errman.pub).error_exit = &sph_jpeg_error_exit;
+  
+  /* Establish the callback error handler */
+  if (setjmp(errman.setjmp_buffer)) {
+    /* This is run if libjpeg indicates an error; destroying objects
+     * that were never created is harmless since they were zeroed */
+    jpeg_destroy_compress(&cinfo);
+    jpeg_destroy_decompress(&dinfo);
+    if (writing) {
+      return sph_jpeg_errcode(&errman, SPH_JPEG_ERR_WRIT);
+    } else {
+      return sph_jpeg_errcode(&errman, SPH_JPEG_ERR_READ);
+    }
+  }
+  
+  /* Create the libjpeg objects */
+  jpeg_create_decompress(&dinfo);
+  jpeg_create_compress(&cinfo);
+  
+  /* Read the header, saving metadata markers if requested */
+  jpeg_stdio_src(&dinfo, pIn);
+  if (flags & SPH_JPEG_TRANS_MARKERS) {
+    jpeg_save_markers(&dinfo, JPEG_COM, 0xFFFF);
+    for(m = 0; m < 16; m++) {
+      jpeg_save_markers(&dinfo, JPEG_APP0 + m, 0xFFFF);
+    }
+  }
+  (void) jpeg_read_header(&dinfo, TRUE);
+  
+  /* Range-check the dimensions, for consistency with reader objects */
+  if ((dinfo.image_width < 1) ||
+      (dinfo.image_width > (JDIMENSION) SPH_JPEG_MAXDIM) ||
+      (dinfo.image_height < 1) ||
+      (dinfo.image_height > (JDIMENSION) SPH_JPEG_MAXDIM)) {
+    status = SPH_JPEG_ERR_IDIM;
+  }
+  
+  /* Read all the DCT coefficients without decoding to pixels */
+  if (status == SPH_JPEG_ERR_OK) {
+    pCoef = jpeg_read_coefficients(&dinfo);
+  }
+  
+  /* Write the same coefficients with the same quantization tables and
+   * sampling factors, so that no generational loss occurs; the scan
+   * mode and restart interval are not critical parameters, so they are
+   * carried over here */
+  if (status == SPH_JPEG_ERR_OK) {
+    writing = 1;
+    jpeg_copy_critical_parameters(&dinfo, &cinfo);
+    if (dinfo.progressive_mode) {
+      jpeg_simple_progression(&cinfo);
+    }
+    cinfo.restart_interval = dinfo.restart_interval;
+    if (flags & SPH_JPEG_TRANS_OPTIMIZE) {
+      cinfo.optimize_coding = TRUE;
+    }
+    jpeg_stdio_dest(&cinfo, pOut);
+    jpeg_write_coefficients(&cinfo, pCoef);
+    
+    /* Copy saved markers, except for JFIF and Adobe markers that
+     * libjpeg already writes itself */
+    for(pMark = dinfo.marker_list; pMark != NULL; pMark = pMark->next) {
+      if (cinfo.write_JFIF_header &&
+          (pMark->marker == JPEG_APP0) &&
+          (pMark->data_length >= 5) &&
+          (memcmp(pMark->data, "JFIF", 5) == 0)) {
+        continue;
+      }
+      if (cinfo.write_Adobe_marker &&
+          (pMark->marker == JPEG_APP0 + 14) &&
+          (pMark->data_length >= 5) &&
+          (memcmp(pMark->data, "Adobe", 5) == 0)) {
+        continue;
+      }
+      jpeg_write_marker(&cinfo, pMark->marker,
+                          pMark->data, pMark->data_length);
+    }
+    
+    jpeg_finish_compress(&cinfo);
+    writing = 0;
+    
+    /* Finish reading so that the input file pointer is positioned
+     * after the JPEG file */
+    (void) jpeg_finish_decompress(&dinfo);
+  }
+  
+  /* Release the libjpeg objects */
+  jpeg_destroy_compress(&cinfo);
+  jpeg_destroy_decompress(&dinfo);
+  
+  /* Return status */
+  return status;
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * sph_jpeg_membuf_init function.
+ */
+void sph_jpeg_membuf_init(SPH_JPEG_MEMBUF *pBuf) {
+  
+  if (pBuf == NULL) {
+    abort();
+  }
+  memset(pBuf, 0, sizeof(SPH_JPEG_MEMBUF));
+  pBuf->pData = NULL;
+  pBuf->len = 0;
+  pBuf->cap = 0;
+}
+
+/*
+ * sph_jpeg_membuf_free function.
+ */
+void sph_jpeg_membuf_free(SPH_JPEG_MEMBUF *pBuf) {
+  
+  if (pBuf == NULL) {
+    abort();
+  }
+  if (pBuf->pData != NULL) {
+    free(pBuf->pData);
+  }
+  pBuf->pData = NULL;
+  pBuf->len = 0;
+  pBuf->cap = 0;
+}
+
+/*
+ * sph_jpeg_stride function.
+ */
+size_t sph_jpeg_stride(
+    int32_t width,
+    int     chcount,
+    int     layout,
+    size_t  align) {
+  
+  size_t row_size = 0;
+  size_t r = 0;
+  
+  /* Check parameters */
+  if (align < 1) {
+    abort();
+  }
+  
+  /* Get the row size and round it up to the alignment */
+  row_size = sph_jpeg_layout_rowsize(width, chcount, layout);
+  r = row_size % align;
+  if (r > 0) {
+    if (align - r > SIZE_MAX - row_size) {
+      abort();
+    }
+    row_size += (align - r);
+  }
+  
+  /* Return the stride */
+  return row_size;
+}
+
+/*
+ * sph_jpeg_writer_opts_init function.
+ */
+void sph_jpeg_writer_opts_init(SPH_JPEG_WRITER_OPTS *pOpts) {
+  
+  /* Check parameter */
+  if (pOpts == NULL) {
+    abort();
+  }
+  
+  /* Fill in defaults */
+  memset(pOpts, 0, sizeof(SPH_JPEG_WRITER_OPTS));
+  pOpts->optimize = 0;
+  pOpts->progressive = 0;
+  pOpts->sampling = SPH_JPEG_SAMP_420;
+  pOpts->dct = SPH_JPEG_DCT_ISLOW;
+  pOpts->restart_rows = 0;
+  pOpts->color = SPH_JPEG_COLOR_RGB;
+  pOpts->max_memory = 0;
+  pOpts->pAlloc = NULL;
+}
+
+/*
+ * sph_jpeg_writer_new function.
+ */
+SPH_JPEG_WRITER *sph_jpeg_writer_new(
+    FILE    * pOut,
+    int32_t   width,
+    int32_t   height,
+    int       chcount,
+    int       quality) {
+  
+  SPH_JPEG_WRITER *pw = NULL;
+  
+  /* Check parameter */
+  if (pOut == NULL) {
+    abort();
+  }
+  
+  /* Start compression to the file */
+  pw = sph_jpeg_writer_alloc();
+  if (pw != NULL) {
+    sph_jpeg_writer_start(
+      pw, pOut, NULL, NULL, NULL, width, height, chcount, quality);
+  }
+  return pw;
+}
+
+/*
+ * sph_jpeg_writer_new_mem function.
+ */
+SPH_JPEG_WRITER *sph_jpeg_writer_new_mem(
+    SPH_JPEG_MEMBUF * pBuf,
+    int32_t           width,
+    int32_t           height,
+    int               chcount,
+    int               quality) {
+  
+  SPH_JPEG_WRITER *pw = NULL;
+  
+  /* Check parameters */
+  if (pBuf == NULL) {
+    abort();
+  }
+  if ((pBuf->len > pBuf->cap) ||
+      ((pBuf->pData == NULL) && (pBuf->cap > 0))) {
+    abort();
+  }
+  
+  /* Start compression to the memory buffer */
+  pw = sph_jpeg_writer_alloc();
+  if (pw != NULL) {
+    sph_jpeg_writer_start(
+      pw, NULL, pBuf, NULL, NULL, width, height, chcount, quality);
+  }
+  return pw;
+}
+
+/*
+ * sph_jpeg_writer_new_sink function.
+ */
+SPH_JPEG_WRITER *sph_jpeg_writer_new_sink(
+    SPH_JPEG_SINK   fSink,
+    void          * pCustom,
+    int32_t         width,
+    int32_t         height,
+    int             chcount,
+    int             quality) {
+  
+  SPH_JPEG_WRITER *pw = NULL;
+  
+  /* Check parameter */
+  if (fSink == NULL) {
+    abort();
+  }
+  
+  /* Start compression to the sink callback */
+  pw = sph_jpeg_writer_alloc();
+  if (pw != NULL) {
+    sph_jpeg_writer_start(
+      pw, NULL, NULL, fSink, pCustom, width, height, chcount, quality);
+  }
+  return pw;
+}
+
+/*
+ * sph_jpeg_writer_new_ex function.
+ */
+SPH_JPEG_WRITER *sph_jpeg_writer_new_ex(
+          FILE                 * pOut,
+          int32_t                width,
+          int32_t                height,
+          int                    chcount,
+          int                    quality,
+    const SPH_JPEG_WRITER_OPTS * pOpts) {
+  
+  SPH_JPEG_WRITER *pw = NULL;
+  
+  /* Check parameter */
+  if (pOut == NULL) {
+    abort();
+  }
+  
+  /* Start compression to the file with the options */
+  pw = sph_jpeg_writer_alloc();
+  if (pw != NULL) {
+    sph_jpeg_writer_setopts(pw, pOpts);
+    sph_jpeg_writer_start(
+      pw, pOut, NULL, NULL, NULL, width, height, chcount, quality);
+  }
+  return pw;
+}
+
+/*
+ * sph_jpeg_writer_new_mem_ex function.
+ */
+SPH_JPEG_WRITER *sph_jpeg_writer_new_mem_ex(
+          SPH_JPEG_MEMBUF      * pBuf,
+          int32_t                width,
+          int32_t                height,
+          int                    chcount,
+          int                    quality,
+    const SPH_JPEG_WRITER_OPTS * pOpts) {
+  
+  SPH_JPEG_WRITER *pw = NULL;
+  
+  /* Check parameters */
+  if (pBuf == NULL) {
+    abort();
+  }
+  if ((pBuf->len > pBuf->cap) ||
+      ((pBuf->pData == NULL) && (pBuf->cap > 0))) {
+    abort();
+  }
+  
+  /* Start compression to the memory buffer with the options */
+  pw = sph_jpeg_writer_alloc();
+  if (pw != NULL) {
+    sph_jpeg_writer_setopts(pw, pOpts);
+    sph_jpeg_writer_start(
+      pw, NULL, pBuf, NULL, NULL, width, height, chcount, quality);
+  }
+  return pw;
+}
+
+/*
+ * sph_jpeg_writer_new_sink_ex function.
+ */
+SPH_JPEG_WRITER *sph_jpeg_writer_new_sink_ex(
+          SPH_JPEG_SINK          fSink,
+          void                 * pCustom,
+          int32_t                width,
+          int32_t                height,
+          int                    chcount,
+          int                    quality,
+    const SPH_JPEG_WRITER_OPTS * pOpts) {
+  
+  SPH_JPEG_WRITER *pw = NULL;
+  
+  /* Check parameter */
+  if (fSink == NULL) {
+    abort();
+  }
+  
+  /* Start compression to the sink callback with the options */
+  pw = sph_jpeg_writer_alloc();
+  if (pw != NULL) {
+    sph_jpeg_writer_setopts(pw, pOpts);
+    sph_jpeg_writer_start(
+      pw, NULL, NULL, fSink, pCustom, width, height, chcount, quality);
+  }
+  return pw;
+}
+
+/*
+ * sph_jpeg_writer_new_push function.
+ */
+SPH_JPEG_WRITER *sph_jpeg_writer_new_push(
+    int32_t width,
+    int32_t height,
+    int     chcount,
+    int     quality) {
+  
+  SPH_JPEG_WRITER *pw = NULL;
+  
+  /* Start compression to the push buffer */
+  pw = sph_jpeg_writer_alloc();
+  if (pw != NULL) {
+    sph_jpeg_writer_start(
+      pw, NULL, &(pw->pushbuf), NULL, NULL,
+      width, height, chcount, quality);
+  }
+  return pw;
+}
+
+/*
+ * sph_jpeg_writer_new_push_ex function.
+ */
+SPH_JPEG_WRITER *sph_jpeg_writer_new_push_ex(
+          int32_t                width,
+          int32_t                height,
+          int                    chcount,
+          int                    quality,
+    const SPH_JPEG_WRITER_OPTS * pOpts) {
+  
+  SPH_JPEG_WRITER *pw = NULL;
+  
+  /* Start compression to the push buffer with the options */
+  pw = sph_jpeg_writer_alloc();
+  if (pw != NULL) {
+    sph_jpeg_writer_setopts(pw, pOpts);
+    sph_jpeg_writer_start(
+      pw, NULL, &(pw->pushbuf), NULL, NULL,
+      width, height, chcount, quality);
+  }
+  return pw;
+}
+
+/*
+ * sph_jpeg_writer_reset function.
+ */
+void sph_jpeg_writer_reset(
+    SPH_JPEG_WRITER * pw,
+    FILE            * pOut,
+    int32_t           width,
+    int32_t           height,
+    int               chcount,
+    int               quality) {
+  
+  /* Check parameters */
+  if ((pw == NULL) || (pOut == NULL)) {
+    abort();
+  }
+  
+  /* Restart compression to the file */
+  sph_jpeg_writer_start(
+    pw, pOut, NULL, NULL, NULL, width, height, chcount, quality);
+}
+
+/*
+ * sph_jpeg_writer_reset_mem function.
+ */
+void sph_jpeg_writer_reset_mem(
+    SPH_JPEG_WRITER * pw,
+    SPH_JPEG_MEMBUF * pBuf,
+    int32_t           width,
+    int32_t           height,
+    int               chcount,
+    int               quality) {
+  
+  /* Check parameters */
+  if ((pw == NULL) || (pBuf == NULL)) {
+    abort();
+  }
+  if ((pBuf->len > pBuf->cap) ||
+      ((pBuf->pData == NULL) && (pBuf->cap > 0))) {
+    abort();
+  }
+  
+  /* Restart compression to the memory buffer */
+  sph_jpeg_writer_start(
+    pw, NULL, pBuf, NULL, NULL, width, height, chcount, quality);
+}
+
+/*
+ * sph_jpeg_writer_reset_sink function.
+ */
+void sph_jpeg_writer_reset_sink(
+    SPH_JPEG_WRITER * pw,
+    SPH_JPEG_SINK     fSink,
+    void            * pCustom,
+    int32_t           width,
+    int32_t           height,
+    int               chcount,
+    int               quality) {
+  
+  /* Check parameters */
+  if ((pw == NULL) || (fSink == NULL)) {
+    abort();
+  }
+  
+  /* Restart compression to the sink callback */
+  sph_jpeg_writer_start(
+    pw, NULL, NULL, fSink, pCustom, width, height, chcount, quality);
+}
+
+/*
+ * sph_jpeg_writer_reset_push function.
+ */
+void sph_jpeg_writer_reset_push(
+    SPH_JPEG_WRITER * pw,
+    int32_t           width,
+    int32_t           height,
+    int               chcount,
+    int               quality) {
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Discard any output that has not been consumed */
+  (pw->pushbuf).len = 0;
+  pw->push_taken = 0;
+  
+  /* Restart compression to the push buffer */
+  sph_jpeg_writer_start(
+    pw, NULL, &(pw->pushbuf), NULL, NULL,
+    width, height, chcount, quality);
+}
+
+/*
+ * sph_jpeg_writer_set_opts function.
+ */
+void sph_jpeg_writer_set_opts(
+          SPH_JPEG_WRITER      * pw,
+    const SPH_JPEG_WRITER_OPTS * pOpts) {
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Store the options for the next image */
+  sph_jpeg_writer_setopts(pw, pOpts);
+}
+
+/*
+ * sph_jpeg_writer_free function.
+ */
+void sph_jpeg_writer_free(SPH_JPEG_WRITER *pw) {
+  
+  /* Only proceed if non-NULL passed */
+  if (pw != NULL) {
+    
+    /* Establish the callback error handler */
+    if (setjmp(((pw->errman).setjmp_buffer))) {
+      /* This is run if libjpeg indicates an error */
+      free(pw);
+      return;
+    }
     
-    case SPH_JPEG_ERR_IDIM:
-      pResult = "Image dimensions out of range";
-      break;
+    /* Free the push buffer and the staging buffer */
+    sph_jpeg_membuf_free(&(pw->pushbuf));
+    free(pw->pRowBuf);
+    pw->pRowBuf = NULL;
     
-    case SPH_JPEG_ERR_CCNT:
-      pResult = "Invalid number of color channels";
-      break;
+    /* Free JPEG object */
+    jpeg_destroy_compress(&(pw->cinfo));
     
-    case SPH_JPEG_ERR_READ:
-      pResult = "Error decoding JPEG file";
-      break;
+    /* Free structure */
+    free(pw);
+  }
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * sph_jpeg_writer_status function.
+ */
+int sph_jpeg_writer_status(SPH_JPEG_WRITER *pw) {
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Return status */
+  return pw->status;
+}
+
+/*
+ * sph_jpeg_writer_put function.
+ */
+void sph_jpeg_writer_put(SPH_JPEG_WRITER *pw, uint8_t *pscan) {
+  
+  JSAMPROW row_pointer[1];
+  
+  /* Initialize arrays */
+  memset(&(row_pointer[0]), 0, sizeof(JSAMPROW));
+  
+  /* Check parameters */
+  if ((pw == NULL) || (pscan == NULL)) {
+    abort();
+  }
+  
+  /* Check state */
+  if (pw->written >= pw->height) {
+    abort();
+  }
+  
+  /* Increment the written count */
+  (pw->written)++;
+  
+  /* Proceed only if not already in error state */
+  if (pw->status == SPH_JPEG_ERR_OK) {
     
-    default:
-      pResult = "Unknown error";
+    /* Establish the callback error handler */
+    if (setjmp(((pw->errman).setjmp_buffer))) {
+      /* This is run if libjpeg indicates an error */
+      pw->status = sph_jpeg_errcode(&(pw->errman), SPH_JPEG_ERR_WRIT);
+      return;
+    }
+    
+    /* Set row pointer to scanline buffer */
+    row_pointer[0] = (JSAMPROW) pscan;
+    
+    /* Write the scanline */
+    SPH_JPEG_STAT_MARK(pw->stats);
+    jpeg_write_scanlines(&(pw->cinfo), row_pointer, 1);
+    SPH_JPEG_STAT_TIME(pw->stats, scan_ns);
+    SPH_JPEG_STAT_COUNT(pw->stats, rows, 1);
+    
+    /* If we just wrote the last scanline, finish the image */
+    if (pw->written >= pw->height) {
+      SPH_JPEG_STAT_MARK(pw->stats);
+      jpeg_finish_compress(&(pw->cinfo));
+      SPH_JPEG_STAT_TIME(pw->stats, finish_ns);
+    }
+  }
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * sph_jpeg_writer_put_rows function.
+ */
+void sph_jpeg_writer_put_rows(
+    SPH_JPEG_WRITER * pw,
+    uint8_t         * buf,
+    size_t            stride,
+    int32_t           rows) {
+  
+  JSAMPROW row_pointer[SPH_JPEG_ROWSET];
+  int32_t done = 0;
+  int32_t i = 0;
+  int32_t n = 0;
+  int32_t got = 0;
+  
+  /* Initialize arrays */
+  memset(&(row_pointer[0]), 0, sizeof(JSAMPROW) * SPH_JPEG_ROWSET);
+  
+  /* Check parameters */
+  if ((pw == NULL) || (buf == NULL)) {
+    abort();
+  }
+  if (stride < (size_t) (pw->width * ((int32_t) pw->chcount))) {
+    abort();
+  }
+  if ((rows < 1) || (rows > pw->height - pw->written)) {
+    abort();
+  }
+  
+  /* Update the written count */
+  pw->written += rows;
+  
+  /* Proceed only if not already in error state */
+  if (pw->status == SPH_JPEG_ERR_OK) {
+    
+    /* Establish the callback error handler */
+    if (setjmp(((pw->errman).setjmp_buffer))) {
+      /* This is run if libjpeg indicates an error */
+      pw->status = sph_jpeg_errcode(&(pw->errman), SPH_JPEG_ERR_WRIT);
+      return;
+    }
+    
+    /* Write the rows in sets that fit in the row pointer array */
+    SPH_JPEG_STAT_MARK(pw->stats);
+    SPH_JPEG_STAT_COUNT(pw->stats, rows, rows);
+    for(done = 0; done < rows; done += got) {
+      
+      /* Determine how many rows to pass in this call */
+      n = rows - done;
+      if (n > SPH_JPEG_ROWSET) {
+        n = SPH_JPEG_ROWSET;
+      }
+      
+      /* Point the row pointers into the caller's buffer */
+      for(i = 0; i < n; i++) {
+        row_pointer[i] = (JSAMPROW) (buf +
+                            (((size_t) (done + i)) * stride));
+      }
+      
+      /* Write the scanlines; with a non-suspending destination,
+       * libjpeg always accepts every row passed */
+      got = (int32_t) jpeg_write_scanlines(&(pw->cinfo), row_pointer,
+                                            (JDIMENSION) n);
+      if ((got < 1) || (got > n)) {
+        abort();
+      }
+    }
+    SPH_JPEG_STAT_TIME(pw->stats, scan_ns);
+    
+    /* If we just wrote the last scanline, finish the image */
+    if (pw->written >= pw->height) {
+      SPH_JPEG_STAT_MARK(pw->stats);
+      jpeg_finish_compress(&(pw->cinfo));
+      SPH_JPEG_STAT_TIME(pw->stats, finish_ns);
+    }
+  }
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * sph_jpeg_writer_encode_from function.
+ */
+void sph_jpeg_writer_encode_from(
+          SPH_JPEG_WRITER * pw,
+    const uint8_t         * base,
+          size_t            stride,
+          int               layout) {
+  
+  size_t packed = 0;
+  size_t need = 0;
+  int32_t row = 0;
+  int32_t n = 0;
+  int32_t i = 0;
+  
+  /* Check parameters */
+  if ((pw == NULL) || (base == NULL)) {
+    abort();
+  }
+  if (stride < sph_jpeg_layout_rowsize(
+                  pw->width, pw->chcount, layout)) {
+    abort();
+  }
+  if (pw->written >= pw->height) {
+    abort();
+  }
+  
+  /* The packed layout can be encoded straight from the buffer */
+  if (layout == SPH_JPEG_LAYOUT_PACKED) {
+    sph_jpeg_writer_put_rows(
+      pw, (uint8_t *) base, stride, pw->height - pw->written);
+    return;
+  }
+  
+  /* Make sure the staging buffer can hold a full set of rows */
+  packed = ((size_t) pw->width) * ((size_t) pw->chcount);
+  if (pw->status == SPH_JPEG_ERR_OK) {
+    need = packed * SPH_JPEG_ROWSET;
+    if ((pw->pRowBuf == NULL) || (pw->row_cap < need)) {
+      free(pw->pRowBuf);
+      pw->row_cap = 0;
+      pw->pRowBuf = (uint8_t *) malloc(need);
+      if (pw->pRowBuf == NULL) {
+        pw->status = SPH_JPEG_ERR_MEM;
+      } else {
+        pw->row_cap = need;
+      }
+    }
+  }
+  
+  /* If there is an error status, just count the remaining rows */
+  if (pw->status != SPH_JPEG_ERR_OK) {
+    pw->written = pw->height;
+    return;
+  }
+  
+  /* Pack and write the rows in sets that fit in the staging buffer */
+  for(row = 0; pw->written < pw->height; row += n) {
+    n = pw->height - pw->written;
+    if (n > SPH_JPEG_ROWSET) {
+      n = SPH_JPEG_ROWSET;
+    }
+    for(i = 0; i < n; i++) {
+      sph_jpeg_layout_pack(
+        pw->pRowBuf + (((size_t) i) * packed),
+        base + (((size_t) (row + i)) * stride),
+        pw->width,
+        pw->chcount,
+        layout);
+    }
+    sph_jpeg_writer_put_rows(pw, pw->pRowBuf, packed, n);
+  }
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * sph_jpeg_writer_output function.
+ */
+const uint8_t *sph_jpeg_writer_output(
+    SPH_JPEG_WRITER * pw,
+    size_t          * pLen) {
+  
+  size_t end = 0;
+  
+  /* Check parameters */
+  if ((pw == NULL) || (pLen == NULL)) {
+    abort();
+  }
+  if (!(pw->pushing)) {
+    abort();
   }
   
-  return pResult;
+  /* Output is only available while there is no error; libjpeg stores
+   * its output position back into the destination manager before each
+   * call returns, so everything before it is final */
+  if ((pw->status == SPH_JPEG_ERR_OK) &&
+      ((pw->pushbuf).pData != NULL)) {
+    end = (size_t) (((uint8_t *) (pw->memdest).pub.next_output_byte) -
+                      (pw->pushbuf).pData);
+  }
+  
+  /* Return the unconsumed part */
+  if (end > pw->push_taken) {
+    *pLen = end - pw->push_taken;
+  } else {
+    *pLen = 0;
+  }
+  if ((pw->pushbuf).pData == NULL) {
+    return NULL;
+  }
+  return ((pw->pushbuf).pData + pw->push_taken);
+  /* CAUTION: alternate return statement earlier! */
 }
 
 /*
- * sph_jpeg_writer_new function.
+ * sph_jpeg_writer_consume function.
  */
-SPH_JPEG_WRITER *sph_jpeg_writer_new(
-    FILE    * pOut,
-    int32_t   width,
-    int32_t   height,
-    int       chcount,
-    int       quality) {
+void sph_jpeg_writer_consume(SPH_JPEG_WRITER *pw, size_t n) {
   
-  SPH_JPEG_WRITER *pw = NULL;
+  size_t avail = 0;
+  size_t shift = 0;
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Check that the bytes are available */
+  (void) sph_jpeg_writer_output(pw, &avail);
+  if (n > avail) {
+    abort();
+  }
+  pw->push_taken += n;
+  
+  /* Once everything has been consumed, writing starts again at the
+   * start of the buffer; once at least half the buffer has been
+   * consumed, the rest is moved to the start, so that the buffer only
+   * grows as far as the output the client leaves unconsumed */
+  if (n == avail) {
+    shift = pw->push_taken;
+  } else if (pw->push_taken >= (pw->pushbuf).cap / 2) {
+    shift = pw->push_taken;
+    memmove(
+      (pw->pushbuf).pData,
+      (pw->pushbuf).pData + shift,
+      avail - n);
+  }
+  
+  /* Move the output position back by the shifted amount */
+  if ((shift > 0) && (pw->status == SPH_JPEG_ERR_OK)) {
+    (pw->memdest).pub.next_output_byte -= shift;
+    (pw->memdest).pub.free_in_buffer += shift;
+#ifdef SPH_JPEG_ENABLE_STATS
+    (pw->stats).mark_free += shift;
+#endif
+    pw->push_taken = 0;
+  }
+}
+
+/*
+ * sph_jpeg_writer_stats function.
+ */
+int sph_jpeg_writer_stats(SPH_JPEG_WRITER *pw, SPH_JPEG_STATS *pStats) {
+  
+  int result = 0;
   
   /* Check parameters */
-  if (pOut == NULL) {
+  if ((pw == NULL) || (pStats == NULL)) {
     abort();
   }
-  if ((width < 1) || (width > SPH_JPEG_MAXDIM) ||
-      (height < 1) || (height > SPH_JPEG_MAXDIM)) {
+  
+  /* Copy the counters, if there are any */
+#ifdef SPH_JPEG_ENABLE_STATS
+  memcpy(pStats, &((pw->stats).pub), sizeof(SPH_JPEG_STATS));
+  result = 1;
+#else
+  memset(pStats, 0, sizeof(SPH_JPEG_STATS));
+#endif
+  
+  return result;
+}
+
+/*
+ * sph_jpeg_reader_opts_init function.
+ */
+void sph_jpeg_reader_opts_init(SPH_JPEG_READER_OPTS *pOpts) {
+  
+  /* Check parameter */
+  if (pOpts == NULL) {
     abort();
   }
-  if ((chcount != 1) && (chcount != 3)) {
+  
+  /* Fill in defaults */
+  memset(pOpts, 0, sizeof(SPH_JPEG_READER_OPTS));
+  pOpts->dct = SPH_JPEG_DCT_ISLOW;
+  pOpts->fancy_upsampling = 1;
+  pOpts->block_smoothing = 1;
+  pOpts->max_scans = 0;
+  pOpts->color = SPH_JPEG_COLOR_RGB;
+  pOpts->max_memory = 0;
+  pOpts->pAlloc = NULL;
+}
+
+/*
+ * sph_jpeg_reader_new function.
+ */
+SPH_JPEG_READER *sph_jpeg_reader_new(FILE *pIn) {
+  
+  SPH_JPEG_READER *pr = NULL;
+  
+  /* Check parameter */
+  if (pIn == NULL) {
     abort();
   }
   
-  /* Clamp quality value */
-  if (quality < SPH_JPEG_MINQ) {
-    quality = SPH_JPEG_MINQ;
+  /* Start an unscaled decompression */
+  pr = sph_jpeg_reader_alloc();
+  if (pr != NULL) {
+    sph_jpeg_reader_start(pr, pIn, NULL, 0, 1);
   }
-  if (quality > SPH_JPEG_MAXQ) {
-    quality = SPH_JPEG_MAXQ;
+  return pr;
+}
+
+/*
+ * sph_jpeg_reader_new_mem function.
+ */
+SPH_JPEG_READER *sph_jpeg_reader_new_mem(
+    const void   * pData,
+          size_t   len) {
+  
+  SPH_JPEG_READER *pr = NULL;
+  
+  /* Check parameter */
+  if (pData == NULL) {
+    abort();
   }
   
-  /* Allocate new object */
-  pw = (SPH_JPEG_WRITER *) malloc(sizeof(SPH_JPEG_WRITER));
-  if (pw == NULL) {
+  /* Start an unscaled decompression from memory */
+  pr = sph_jpeg_reader_alloc();
+  if (pr != NULL) {
+    sph_jpeg_reader_start(pr, NULL, pData, len, 1);
+  }
+  return pr;
+}
+
+/*
+ * sph_jpeg_reader_new_scaled function.
+ */
+SPH_JPEG_READER *sph_jpeg_reader_new_scaled(FILE *pIn, int denom) {
+  
+  SPH_JPEG_READER *pr = NULL;
+  
+  /* Check parameters */
+  if (pIn == NULL) {
+    abort();
+  }
+  if ((denom != 1) && (denom != 2) && (denom != 4) && (denom != 8)) {
     abort();
   }
-  memset(pw, 0, sizeof(SPH_JPEG_WRITER));
   
-  /* Initialize simple fields */
-  pw->width = width;
-  pw->height = height;
-  pw->written = 0;
-  pw->chcount = chcount;
+  /* Start a scaled decompression */
+  pr = sph_jpeg_reader_alloc();
+  if (pr != NULL) {
+    sph_jpeg_reader_start(pr, pIn, NULL, 0, denom);
+  }
+  return pr;
+}
+
+/*
+ * sph_jpeg_reader_new_ex function.
+ */
+SPH_JPEG_READER *sph_jpeg_reader_new_ex(
+          FILE                 * pIn,
+          int                    denom,
+    const SPH_JPEG_READER_OPTS * pOpts) {
   
-  /* Initialize JPEG compressor */
-  (pw->cinfo).err = jpeg_std_error(&(pw->jerr));
-  jpeg_create_compress(&(pw->cinfo));
+  SPH_JPEG_READER *pr = NULL;
   
-  /* Set output destination */
-  jpeg_stdio_dest(&(pw->cinfo), pOut);
+  /* Check parameters */
+  if (pIn == NULL) {
+    abort();
+  }
+  if ((denom != 1) && (denom != 2) && (denom != 4) && (denom != 8)) {
+    abort();
+  }
   
-  /* Initialize JPEG information */
-  (pw->cinfo).image_width = (int) width;
-  (pw->cinfo).image_height = (int) height;
+  /* Start a scaled decompression with the options */
+  pr = sph_jpeg_reader_alloc();
+  if (pr != NULL) {
+    sph_jpeg_reader_setopts(pr, pOpts);
+    sph_jpeg_reader_start(pr, pIn, NULL, 0, denom);
+  }
+  return pr;
+}
+
+/*
+ * sph_jpeg_reader_new_mem_ex function.
+ */
+SPH_JPEG_READER *sph_jpeg_reader_new_mem_ex(
+    const void                 * pData,
+          size_t                 len,
+    const SPH_JPEG_READER_OPTS * pOpts) {
   
-  if (chcount == 3) {
-    (pw->cinfo).input_components = 3;
-    (pw->cinfo).in_color_space = JCS_RGB;
+  SPH_JPEG_READER *pr = NULL;
   
-  } else if (chcount == 1) {
-    (pw->cinfo).input_components = 1;
-    (pw->cinfo).in_color_space = JCS_GRAYSCALE;
+  /* Check parameter */
+  if (pData == NULL) {
+    abort();
+  }
   
-  } else {
-    /* Shouldn't happen */
+  /* Start an unscaled decompression from memory with the options */
+  pr = sph_jpeg_reader_alloc();
+  if (pr != NULL) {
+    sph_jpeg_reader_setopts(pr, pOpts);
+    sph_jpeg_reader_start(pr, NULL, pData, len, 1);
+  }
+  return pr;
+}
+
+/*
+ * sph_jpeg_reader_new_feed function.
+ */
+SPH_JPEG_READER *sph_jpeg_reader_new_feed(
+          int                    denom,
+    const SPH_JPEG_READER_OPTS * pOpts) {
+  
+  SPH_JPEG_READER *pr = NULL;
+  
+  /* Check parameter */
+  if ((denom != 1) && (denom != 2) && (denom != 4) && (denom != 8)) {
+    abort();
+  }
+  
+  /* Start a decompression that is fed later */
+  pr = sph_jpeg_reader_alloc();
+  if (pr != NULL) {
+    sph_jpeg_reader_setopts(pr, pOpts);
+    sph_jpeg_reader_start(pr, NULL, NULL, 0, denom);
+  }
+  return pr;
+}
+
+/*
+ * sph_jpeg_reader_new_header function.
+ */
+SPH_JPEG_READER *sph_jpeg_reader_new_header(FILE *pIn) {
+  
+  SPH_JPEG_READER *pr = NULL;
+  
+  /* Check parameter */
+  if (pIn == NULL) {
+    abort();
+  }
+  
+  /* Read only the header */
+  pr = sph_jpeg_reader_alloc();
+  if (pr != NULL) {
+    sph_jpeg_reader_start(pr, pIn, NULL, 0, 0);
+  }
+  return pr;
+}
+
+/*
+ * sph_jpeg_reader_scale function.
+ */
+void sph_jpeg_reader_scale(SPH_JPEG_READER *pr, int denom) {
+  
+  /* Check parameters */
+  if (pr == NULL) {
+    abort();
+  }
+  if ((denom != 1) && (denom != 2) && (denom != 4) && (denom != 8)) {
+    abort();
+  }
+  
+  /* Check state */
+  if (!(pr->pending)) {
     abort();
   }
+  pr->pending = 0;
+  
+  /* Only proceed if not in error state */
+  if (pr->status == SPH_JPEG_ERR_OK) {
     
-  jpeg_set_defaults(&(pw->cinfo));
+    /* Establish the callback error handler */
+    if (setjmp(((pr->errman).setjmp_buffer))) {
+      /* This is run if libjpeg indicates an error */
+      pr->width = 1;
+      pr->height = 1;
+      pr->chcount = 1;
+      pr->status = sph_jpeg_errcode(&(pr->errman), SPH_JPEG_ERR_LIBJ);
+      return;
+    }
     
-  /* Set quality on scale 0-100, avoid < 25 */
-  jpeg_set_quality(&(pw->cinfo), quality, TRUE);
+    /* Request DCT-domain scaling, apply the decoder options, and
+     * start decompression */
+    SPH_JPEG_STAT_MARK(pr->stats);
+    (pr->cinfo).scale_num = 1;
+    (pr->cinfo).scale_denom = (unsigned int) denom;
+    sph_jpeg_reader_apply(pr);
+    (void) jpeg_start_decompress(&(pr->cinfo));
+    if (pr->preview) {
+      (void) sph_jpeg_reader_preview(pr);
+    }
+    SPH_JPEG_STAT_TIME(pr->stats, setup_ns);
+    
+    /* Read and check the scaled image information */
+    sph_jpeg_reader_dims(pr);
+  }
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * sph_jpeg_reader_set_crop function.
+ */
+void sph_jpeg_reader_set_crop(
+    SPH_JPEG_READER * pr,
+    int32_t           x,
+    int32_t           y,
+    int32_t           w,
+    int32_t           h) {
   
-  /* Start compression */
-  jpeg_start_compress(&(pw->cinfo), TRUE);
+  JDIMENSION xoff = 0;
+  JDIMENSION cw = 0;
+  size_t need = 0;
+  
+  /* Check parameters */
+  if (pr == NULL) {
+    abort();
+  }
+  if ((x < 0) || (y < 0) || (w < 1) || (h < 1)) {
+    abort();
+  }
+  
+  /* Check state */
+  if (pr->pending || pr->cropped || pr->feeding ||
+      (pr->readcount > 0)) {
+    abort();
+  }
+  pr->cropped = 1;
+  
+  /* Only proceed if not in error state */
+  if (pr->status == SPH_JPEG_ERR_OK) {
+    
+    /* Check that the crop is within the image */
+    if ((x >= pr->width) || (w > pr->width - x) ||
+        (y >= pr->height) || (h > pr->height - y)) {
+      abort();
+    }
+    
+    /* Establish the callback error handler */
+    if (setjmp(((pr->errman).setjmp_buffer))) {
+      /* This is run if libjpeg indicates an error */
+      pr->width = 1;
+      pr->height = 1;
+      pr->chcount = 1;
+      pr->staged = 0;
+      pr->status = sph_jpeg_errcode(&(pr->errman), SPH_JPEG_ERR_LIBJ);
+      return;
+    }
+    
+#ifdef SPH_JPEG_HAVE_SKIP
+    /* Have libjpeg decode only the iMCU columns that cover the crop,
+     * which may widen the decoded rows to iMCU boundaries, and skip the
+     * rows above the crop without color conversion or upsampling */
+    xoff = (JDIMENSION) x;
+    cw = (JDIMENSION) w;
+    if ((x > 0) || (w < pr->width)) {
+      jpeg_crop_scanline(&(pr->cinfo), &xoff, &cw);
+    }
+    if (y > 0) {
+      SPH_JPEG_STAT_MARK(pr->stats);
+      (void) jpeg_skip_scanlines(&(pr->cinfo), (JDIMENSION) y);
+      SPH_JPEG_STAT_TIME(pr->stats, scan_ns);
+    }
+    pr->crop_skip = 0;
+#else
+    /* Decode full rows, discarding the rows above the crop in the crop
+     * buffer without copying them */
+    xoff = 0;
+    cw = (JDIMENSION) pr->width;
+    pr->crop_skip = y;
+#endif
+    
+    /* Rows go through the crop buffer unless they exactly match the
+     * crop */
+    pr->crop_offset = ((size_t) (((int32_t) (x - ((int32_t) xoff))) *
+                        ((int32_t) pr->chcount)));
+    if ((pr->crop_offset > 0) || (((int32_t) cw) != w) ||
+        (pr->crop_skip > 0)) {
+      pr->staged = 1;
+      need = ((size_t) cw) * ((size_t) pr->chcount);
+      if ((pr->pCropBuf == NULL) || (pr->crop_cap < need)) {
+        free(pr->pCropBuf);
+        pr->crop_cap = 0;
+        pr->pCropBuf = (uint8_t *) malloc(need);
+        if (pr->pCropBuf == NULL) {
+          /* Report through the error handler above */
+          ERREXIT1(&(pr->cinfo), JERR_OUT_OF_MEMORY, 12);
+        }
+        pr->crop_cap = need;
+      }
+    } else {
+      pr->staged = 0;
+    }
+    
+    /* The reader now reports the crop dimensions */
+    pr->width = w;
+    pr->height = h;
+  }
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * sph_jpeg_reader_reset function.
+ */
+void sph_jpeg_reader_reset(SPH_JPEG_READER *pr, FILE *pIn) {
+  
+  /* Check parameters */
+  if ((pr == NULL) || (pIn == NULL)) {
+    abort();
+  }
+  
+  /* Restart an unscaled decompression */
+  sph_jpeg_reader_start(pr, pIn, NULL, 0, 1);
+}
+
+/*
+ * sph_jpeg_reader_reset_scaled function.
+ */
+void sph_jpeg_reader_reset_scaled(
+    SPH_JPEG_READER * pr,
+    FILE            * pIn,
+    int               denom) {
+  
+  /* Check parameters */
+  if ((pr == NULL) || (pIn == NULL)) {
+    abort();
+  }
+  if ((denom != 1) && (denom != 2) && (denom != 4) && (denom != 8)) {
+    abort();
+  }
+  
+  /* Restart a scaled decompression */
+  sph_jpeg_reader_start(pr, pIn, NULL, 0, denom);
+}
+
+/*
+ * sph_jpeg_reader_reset_header function.
+ */
+void sph_jpeg_reader_reset_header(SPH_JPEG_READER *pr, FILE *pIn) {
+  
+  /* Check parameters */
+  if ((pr == NULL) || (pIn == NULL)) {
+    abort();
+  }
   
-  /* Return writer object */
-  return pw;
+  /* Restart, reading only the header */
+  sph_jpeg_reader_start(pr, pIn, NULL, 0, 0);
 }
 
 /*
- * sph_jpeg_writer_free function.
+ * sph_jpeg_reader_reset_mem function.
  */
-void sph_jpeg_writer_free(SPH_JPEG_WRITER *pw) {
+void sph_jpeg_reader_reset_mem(
+          SPH_JPEG_READER * pr,
+    const void            * pData,
+          size_t            len) {
   
-  /* Only proceed if non-NULL passed */
-  if (pw != NULL) {
-    
-    /* Free JPEG object */
-    jpeg_destroy_compress(&(pw->cinfo));
-    
-    /* Free structure */
-    free(pw);
+  /* Check parameters */
+  if ((pr == NULL) || (pData == NULL)) {
+    abort();
   }
+  
+  /* Restart an unscaled decompression from memory */
+  sph_jpeg_reader_start(pr, NULL, pData, len, 1);
 }
 
 /*
- * sph_jpeg_writer_put function.
+ * sph_jpeg_reader_reset_feed function.
  */
-void sph_jpeg_writer_put(SPH_JPEG_WRITER *pw, uint8_t *pscan) {
+void sph_jpeg_reader_reset_feed(SPH_JPEG_READER *pr, int denom) {
   
-  JSAMPROW row_pointer[1];
+  /* Check parameters */
+  if (pr == NULL) {
+    abort();
+  }
+  if ((denom != 1) && (denom != 2) && (denom != 4) && (denom != 8)) {
+    abort();
+  }
   
-  /* Initialize arrays */
-  memset(&(row_pointer[0]), 0, sizeof(JSAMPROW));
+  /* Restart a decompression that is fed later */
+  sph_jpeg_reader_start(pr, NULL, NULL, 0, denom);
+}
+
+/*
+ * sph_jpeg_reader_feed function.
+ */
+int sph_jpeg_reader_feed(
+          SPH_JPEG_READER * pr,
+    const void            * pData,
+          size_t            len) {
   
   /* Check parameters */
-  if ((pw == NULL) || (pscan == NULL)) {
+  if (pr == NULL) {
+    abort();
+  }
+  if ((pData == NULL) && (len > 0)) {
     abort();
   }
   
   /* Check state */
-  if (pw->written >= pw->height) {
+  if ((!(pr->feeding)) || (pr->feedsrc).ended) {
     abort();
   }
   
-  /* Set row pointer to scanline buffer */
-  row_pointer[0] = (JSAMPROW) pscan;
-  
-  /* Write the scanline */
-  jpeg_write_scanlines(&(pw->cinfo), row_pointer, 1);
-  
-  /* Increment the written count */
-  (pw->written)++;
-  
-  /* If we just wrote the last scanline, finish the image */
-  if (pw->written >= pw->height) {
-    jpeg_finish_compress(&(pw->cinfo));
+  /* Proceed only if not in error state */
+  if (pr->status == SPH_JPEG_ERR_OK) {
+    
+    /* Add the data to the buffer */
+    if (sph_jpeg_feedsrc_append(&(pr->feedsrc), pData, len)) {
+#ifdef SPH_JPEG_ENABLE_STATS
+      (pr->stats).delivered += (int64_t) len;
+#endif
+    } else {
+      pr->status = SPH_JPEG_ERR_MEM;
+    }
+    
+    /* Get as far as possible towards decompression */
+    if ((pr->status == SPH_JPEG_ERR_OK) && (pr->feed_stage < 3)) {
+      sph_jpeg_reader_advance(pr);
+    }
   }
+  
+  return sph_jpeg_reader_feedstate(pr);
 }
 
 /*
- * sph_jpeg_reader_new function.
+ * sph_jpeg_reader_feed_end function.
  */
-SPH_JPEG_READER *sph_jpeg_reader_new(FILE *pIn) {
-  
-  int status = 1;
-  SPH_JPEG_READER *pr = NULL;
+int sph_jpeg_reader_feed_end(SPH_JPEG_READER *pr) {
   
   /* Check parameter */
-  if (pIn == NULL) {
+  if (pr == NULL) {
     abort();
   }
   
-  /* Allocate a new reader object */
-  pr = (SPH_JPEG_READER *) malloc(sizeof(SPH_JPEG_READER));
-  if (pr == NULL) {
+  /* Check state */
+  if ((!(pr->feeding)) || (pr->feedsrc).ended) {
     abort();
   }
-  memset(pr, 0, sizeof(SPH_JPEG_READER));
-  
-  /* Initialize the simple fields with default values */
-  pr->width = 1;
-  pr->height = 1;
-  pr->readcount = 0;
-  pr->chcount = 1;
-  pr->status = SPH_JPEG_ERR_OK;
-  
-  /* Set up the error handler */
-  (pr->cinfo).err = jpeg_std_error(&((pr->errman).pub));
-  ((pr->errman).pub).error_exit = &sph_jpeg_error_exit;
+  (pr->feedsrc).ended = 1;
   
-  /* Establish the callback error handler */
-  if (setjmp(((pr->errman).setjmp_buffer))) {
-    /* This is run if libjpeg indicates an error */
-    pr->width = 1;
-    pr->height = 1;
-    pr->chcount = 1;
-    pr->status = SPH_JPEG_ERR_LIBJ;
-    return pr;
+  /* Finish starting decompression if it is still waiting for data,
+   * which now never suspends */
+  if ((pr->status == SPH_JPEG_ERR_OK) && (pr->feed_stage < 3)) {
+    sph_jpeg_reader_advance(pr);
   }
   
-  /* Create the decompressor object */
-  jpeg_create_decompress(&(pr->cinfo));
-  
-  /* Specify file handle to read from */
-  jpeg_stdio_src(&(pr->cinfo), pIn);
-
-  /* Read file parameters */
-  (void) jpeg_read_header(&(pr->cinfo), TRUE);
+  return sph_jpeg_reader_feedstate(pr);
+}
 
-  /* Start decompression */
-  (void) jpeg_start_decompress(&(pr->cinfo));
-  
-  /* Read the image information */
-  pr->width = (int32_t) (pr->cinfo).output_width;
-  pr->height = (int32_t) (pr->cinfo).output_height;
-  pr->chcount = (int) (pr->cinfo).output_components;
-  
-  /* Range-check information */
-  if ((pr->width < 1) || (pr->width > SPH_JPEG_MAXDIM) ||
-      (pr->height < 1) || (pr->height > SPH_JPEG_MAXDIM)) {
-    status = 0;
-    pr->status = SPH_JPEG_ERR_IDIM;
-  }
-  
-  if (status && (pr->chcount != 1) && (pr->chcount != 3)) {
-    status = 0;
-    pr->status = SPH_JPEG_ERR_CCNT;
-  }
+/*
+ * sph_jpeg_reader_set_opts function.
+ */
+void sph_jpeg_reader_set_opts(
+          SPH_JPEG_READER      * pr,
+    const SPH_JPEG_READER_OPTS * pOpts) {
   
-  /* If there was an error, reset the fields */
-  if (!status) {
-    pr->width = 1;
-    pr->height = 1;
-    pr->chcount = 1;
+  /* Check parameter */
+  if (pr == NULL) {
+    abort();
   }
   
-  /* Return the new reader object */
-  return pr;
-  /* CAUTION: alternate return statement earlier! */
+  /* Store the options for the next decompression */
+  sph_jpeg_reader_setopts(pr, pOpts);
 }
 
 /*
@@ -408,6 +4979,12 @@ void sph_jpeg_reader_free(SPH_JPEG_READER *pr) {
   /* Only proceed if non-NULL passed */
   if (pr != NULL) {
     
+    /* Release the crop buffer and the feed buffer */
+    free(pr->pCropBuf);
+    pr->pCropBuf = NULL;
+    free((pr->feedsrc).pBuf);
+    (pr->feedsrc).pBuf = NULL;
+    
     /* Establish the callback error handler */
     if (setjmp(((pr->errman).setjmp_buffer))) {
       /* This is run if libjpeg indicates an error */
@@ -468,6 +5045,26 @@ int sph_jpeg_reader_channels(SPH_JPEG_READER *pr) {
   return pr->chcount;
 }
 
+/*
+ * sph_jpeg_reader_color function.
+ */
+int sph_jpeg_reader_color(SPH_JPEG_READER *pr) {
+  
+  int result = SPH_JPEG_COLOR_RGB;
+  
+  if (pr == NULL) {
+    abort();
+  }
+  
+  if ((pr->status == SPH_JPEG_ERR_OK) && (pr->chcount == 3)) {
+    if ((pr->cinfo).out_color_space == JCS_YCbCr) {
+      result = SPH_JPEG_COLOR_YCC;
+    }
+  }
+  
+  return result;
+}
+
 /*
  * sph_jpeg_reader_get function.
  */
@@ -485,7 +5082,10 @@ int sph_jpeg_reader_get(SPH_JPEG_READER *pr, uint8_t *pscan) {
   }
   
   /* Check state */
-  if (pr->readcount >= pr->height) {
+  if ((pr->readcount >= pr->height) || pr->pending) {
+    abort();
+  }
+  if (pr->feeding && (!((pr->feedsrc).ended))) {
     abort();
   }
   
@@ -506,18 +5106,29 @@ int sph_jpeg_reader_get(SPH_JPEG_READER *pr, uint8_t *pscan) {
     /* Establish the callback error handler */
     if (setjmp(((pr->errman).setjmp_buffer))) {
       /* This is run if libjpeg indicates an error */
-      pr->status = SPH_JPEG_ERR_READ;
+      pr->status = sph_jpeg_errcode(&(pr->errman), SPH_JPEG_ERR_READ);
       memset(pscan, 0, (size_t) (pr->width * ((int32_t) pr->chcount)));
       return 0;
     }
     
-    /* Read a scanline */
-    (void) jpeg_read_scanlines(&(pr->cinfo), row_pointer, 1);
+    /* Read a scanline, through the crop buffer if necessary */
+    SPH_JPEG_STAT_MARK(pr->stats);
+    if (pr->staged) {
+      sph_jpeg_reader_croprow(pr, pscan);
+    } else {
+      (void) jpeg_read_scanlines(&(pr->cinfo), row_pointer, 1);
+    }
+    SPH_JPEG_STAT_TIME(pr->stats, scan_ns);
+    SPH_JPEG_STAT_COUNT(pr->stats, rows, 1);
     
     /* If we just finished reading the last scanline, finish
-     * decompression */
-    if (pr->readcount >= pr->height) {
+     * decompression, unless a crop ends above the bottom of the image,
+     * in which case the rest of the image is never decoded */
+    if ((pr->readcount >= pr->height) && (!(pr->preview)) &&
+        ((pr->cinfo).output_scanline >= (pr->cinfo).output_height)) {
+      SPH_JPEG_STAT_MARK(pr->stats);
       (void) jpeg_finish_decompress(&(pr->cinfo));
+      SPH_JPEG_STAT_TIME(pr->stats, finish_ns);
     }
   }
   
@@ -530,3 +5141,324 @@ int sph_jpeg_reader_get(SPH_JPEG_READER *pr, uint8_t *pscan) {
   return status;
   /* CAUTION: alternate return statement earlier! */
 }
+
+/*
+ * sph_jpeg_reader_get_rows function.
+ */
+int32_t sph_jpeg_reader_get_rows(
+    SPH_JPEG_READER * pr,
+    uint8_t         * buf,
+    size_t            stride,
+    int32_t           max_rows) {
+  
+  JSAMPROW row_pointer[SPH_JPEG_ROWSET];
+  int32_t count = 0;
+  int32_t done = 0;
+  int32_t i = 0;
+  int32_t n = 0;
+  int32_t got = 0;
+  size_t row_size = 0;
+  
+  /* Initialize arrays */
+  memset(&(row_pointer[0]), 0, sizeof(JSAMPROW) * SPH_JPEG_ROWSET);
+  
+  /* Check parameters */
+  if ((pr == NULL) || (buf == NULL)) {
+    abort();
+  }
+  if (max_rows < 1) {
+    abort();
+  }
+  row_size = (size_t) (pr->width * ((int32_t) pr->chcount));
+  if (stride < row_size) {
+    abort();
+  }
+  
+  /* Check state */
+  if ((pr->readcount >= pr->height) || pr->pending) {
+    abort();
+  }
+  if (pr->feeding && (!((pr->feedsrc).ended))) {
+    abort();
+  }
+  
+  /* Determine the number of rows this call covers, and update the read
+   * counter */
+  count = pr->height - pr->readcount;
+  if (count > max_rows) {
+    count = max_rows;
+  }
+  pr->readcount += count;
+  
+  /* Proceed only if not already in error state */
+  if (pr->status == SPH_JPEG_ERR_OK) {
+    
+    /* Establish the callback error handler */
+    if (setjmp(((pr->errman).setjmp_buffer))) {
+      /* This is run if libjpeg indicates an error */
+      pr->status = sph_jpeg_errcode(&(pr->errman), SPH_JPEG_ERR_READ);
+      for(i = 0; i < count; i++) {
+        memset(buf + (((size_t) i) * stride), 0, row_size);
+      }
+      return 0;
+    }
+    
+    /* Read cropped rows one at a time through the crop buffer */
+    SPH_JPEG_STAT_MARK(pr->stats);
+    if (pr->staged) {
+      for(i = 0; i < count; i++) {
+        sph_jpeg_reader_croprow(pr, buf + (((size_t) i) * stride));
+      }
+      
+    } else {
+      /* Otherwise, read the rows in sets that fit in the row pointer
+       * array */
+      for(done = 0; done < count; done += got) {
+        
+        /* Determine how many rows to request in this call */
+        n = count - done;
+        if (n > SPH_JPEG_ROWSET) {
+          n = SPH_JPEG_ROWSET;
+        }
+        
+        /* Point the row pointers into the caller's buffer */
+        for(i = 0; i < n; i++) {
+          row_pointer[i] = (JSAMPROW) (buf +
+                              (((size_t) (done + i)) * stride));
+        }
+        
+        /* Read scanlines; libjpeg returns at most one row group per
+         * call, and never returns zero with a non-suspending data
+         * source */
+        got = (int32_t) jpeg_read_scanlines(
+                          &(pr->cinfo), row_pointer, (JDIMENSION) n);
+        if (got < 1) {
+          pr->status = SPH_JPEG_ERR_READ;
+          break;
+        }
+      }
+    }
+    SPH_JPEG_STAT_TIME(pr->stats, scan_ns);
+    
+    /* If we just finished reading the last scanline, finish
+     * decompression, unless a crop ends above the bottom of the
+     * image */
+    if ((pr->status == SPH_JPEG_ERR_OK) &&
+        (pr->readcount >= pr->height) && (!(pr->preview)) &&
+        ((pr->cinfo).output_scanline >= (pr->cinfo).output_height)) {
+      SPH_JPEG_STAT_MARK(pr->stats);
+      (void) jpeg_finish_decompress(&(pr->cinfo));
+      SPH_JPEG_STAT_TIME(pr->stats, finish_ns);
+    }
+  }
+  
+  /* If there was an error, blank the buffer */
+  if (pr->status != SPH_JPEG_ERR_OK) {
+    for(i = 0; i < count; i++) {
+      memset(buf + (((size_t) i) * stride), 0, row_size);
+    }
+    count = 0;
+  }
+  SPH_JPEG_STAT_COUNT(pr->stats, rows, count);
+  
+  /* Return number of rows read */
+  return count;
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * sph_jpeg_reader_poll_rows function.
+ */
+int32_t sph_jpeg_reader_poll_rows(
+    SPH_JPEG_READER * pr,
+    uint8_t         * buf,
+    size_t            stride,
+    int32_t           max_rows) {
+  
+  JSAMPROW row_pointer[SPH_JPEG_ROWSET];
+  int32_t count = 0;
+  int32_t done = 0;
+  int32_t i = 0;
+  int32_t n = 0;
+  int32_t got = 0;
+  size_t row_size = 0;
+  
+  /* Initialize arrays */
+  memset(&(row_pointer[0]), 0, sizeof(JSAMPROW) * SPH_JPEG_ROWSET);
+  
+  /* Check parameters */
+  if ((pr == NULL) || (buf == NULL)) {
+    abort();
+  }
+  if (max_rows < 1) {
+    abort();
+  }
+  if (!(pr->feeding)) {
+    abort();
+  }
+  
+  /* No rows are available before decompression has started or after
+   * an error */
+  if ((pr->feed_stage < 3) || (pr->status != SPH_JPEG_ERR_OK)) {
+    return 0;
+  }
+  
+  /* Check the stride and the state */
+  row_size = (size_t) (pr->width * ((int32_t) pr->chcount));
+  if (stride < row_size) {
+    abort();
+  }
+  if (pr->readcount >= pr->height) {
+    abort();
+  }
+  
+  /* Determine the maximum number of rows this call covers */
+  count = pr->height - pr->readcount;
+  if (count > max_rows) {
+    count = max_rows;
+  }
+  
+  /* Establish the callback error handler */
+  if (setjmp(((pr->errman).setjmp_buffer))) {
+    /* This is run if libjpeg indicates an error */
+    pr->status = sph_jpeg_errcode(&(pr->errman), SPH_JPEG_ERR_READ);
+    return 0;
+  }
+  
+  /* Read rows in sets that fit in the row pointer array, until libjpeg
+   * suspends for lack of data */
+  SPH_JPEG_STAT_MARK(pr->stats);
+  for(done = 0; done < count; done += got) {
+    
+    /* Determine how many rows to request in this call */
+    n = count - done;
+    if (n > SPH_JPEG_ROWSET) {
+      n = SPH_JPEG_ROWSET;
+    }
+    
+    /* Point the row pointers into the caller's buffer */
+    for(i = 0; i < n; i++) {
+      row_pointer[i] = (JSAMPROW) (buf +
+                          (((size_t) (done + i)) * stride));
+    }
+    
+    /* Read scanlines; zero rows means libjpeg suspended */
+    got = (int32_t) jpeg_read_scanlines(
+                      &(pr->cinfo), row_pointer, (JDIMENSION) n);
+    if (got < 1) {
+      break;
+    }
+  }
+  SPH_JPEG_STAT_TIME(pr->stats, scan_ns);
+  SPH_JPEG_STAT_COUNT(pr->stats, rows, done);
+  pr->readcount += done;
+  
+  /* If we just finished reading the last scanline, finish
+   * decompression; if this suspends before the end of the file, the
+   * image is complete anyway, so the rest of the file is ignored */
+  if ((pr->readcount >= pr->height) && (!(pr->preview))) {
+    SPH_JPEG_STAT_MARK(pr->stats);
+    (void) jpeg_finish_decompress(&(pr->cinfo));
+    SPH_JPEG_STAT_TIME(pr->stats, finish_ns);
+  }
+  
+  /* Return number of rows read */
+  return done;
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * sph_jpeg_reader_decode_into function.
+ */
+int sph_jpeg_reader_decode_into(
+    SPH_JPEG_READER * pr,
+    uint8_t         * base,
+    size_t            stride,
+    int               layout) {
+  
+  size_t row_size = 0;
+  uint8_t *pRow = NULL;
+  int32_t row = 0;
+  int32_t n = 0;
+  int32_t i = 0;
+  int result = 1;
+  
+  /* Check parameters */
+  if ((pr == NULL) || (base == NULL)) {
+    abort();
+  }
+  row_size = sph_jpeg_layout_rowsize(pr->width, pr->chcount, layout);
+  if (stride < row_size) {
+    abort();
+  }
+  if (pr->readcount >= pr->height) {
+    abort();
+  }
+  
+  /* The packed layout can be decoded straight into the buffer */
+  if (layout == SPH_JPEG_LAYOUT_PACKED) {
+    if (sph_jpeg_reader_get_rows(
+          pr, base, stride, pr->height - pr->readcount) < 1) {
+      result = 0;
+    }
+    return result;
+  }
+  
+  /* Decode sets of rows and expand them while they are still cached */
+  for(row = 0; pr->readcount < pr->height; row += n) {
+    n = pr->height - pr->readcount;
+    if (n > SPH_JPEG_ROWSET) {
+      n = SPH_JPEG_ROWSET;
+    }
+    pRow = base + (((size_t) row) * stride);
+    
+    if (sph_jpeg_reader_get_rows(pr, pRow, stride, n) > 0) {
+      for(i = 0; i < n; i++) {
+        sph_jpeg_layout_expand(
+          pRow + (((size_t) i) * stride),
+          pr->width,
+          pr->chcount,
+          layout);
+      }
+      
+    } else {
+      /* Blank the padded rows in full */
+      result = 0;
+      for(i = 0; i < n; i++) {
+        memset(pRow + (((size_t) i) * stride), 0, row_size);
+      }
+    }
+  }
+  
+  /* Return result */
+  return result;
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * sph_jpeg_reader_stats function.
+ */
+int sph_jpeg_reader_stats(SPH_JPEG_READER *pr, SPH_JPEG_STATS *pStats) {
+  
+  int result = 0;
+  
+  /* Check parameters */
+  if ((pr == NULL) || (pStats == NULL)) {
+    abort();
+  }
+  
+  /* Copy the counters, if there are any, adding the bytes consumed
+   * from the current source so far */
+#ifdef SPH_JPEG_ENABLE_STATS
+  memcpy(pStats, &((pr->stats).pub), sizeof(SPH_JPEG_STATS));
+  pStats->bytes += (pr->stats).delivered;
+  if ((pr->cinfo).src != NULL) {
+    pStats->bytes -= (int64_t) ((pr->cinfo).src)->bytes_in_buffer;
+  }
+  result = 1;
+#else
+  memset(pStats, 0, sizeof(SPH_JPEG_STATS));
+#endif
+  
+  return result;
+}
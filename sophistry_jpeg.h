@@ -9,227 +9,1835 @@
  * 
  * This library can read and write JPEG files using libjpeg.
  * 
+ * Thread safety
+ * -------------
+ * 
+ * Reader and writer objects are completely independent of each other.
+ * Each object has its own libjpeg state and its own error recovery
+ * buffer, and the library has no static state that is modified, so
+ * different threads may freely create and use different objects at
+ * the same time.  However, a single object must not be used by more
+ * than one thread at the same time.
+ * 
+ * Errors while reading or writing JPEG data, including errors reported
+ * by libjpeg and allocation failures, never exit the process.  They are
+ * recorded in the error status of the object instead, which can be
+ * queried with sph_jpeg_reader_status() or sph_jpeg_writer_status().
+ * 
  * Compilation
  * -----------
  * 
  * Requires libjpeg (or compatible).  Use -ljpeg to include the library.
  * 
- * Make sure the development package for libjpeg is installed.
+ * Make sure the development package for libjpeg is installed.
+ * 
+ * Define SPH_JPEG_ENABLE_STATS when compiling sophistry_jpeg.c (and
+ * jpegshrink.c, if it is used) to collect the timers and counters that
+ * sph_jpeg_reader_stats() and sph_jpeg_writer_stats() report.  This
+ * requires clock_gettime() from POSIX.  Without it, the instrumentation
+ * is compiled out entirely and the query functions report zeros.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Error status definitions.
+ */
+#define SPH_JPEG_ERR_OK   (0)   /* No error */
+#define SPH_JPEG_ERR_LIBJ (1)   /* libjpeg internal error during load */
+#define SPH_JPEG_ERR_IDIM (2)   /* Invalid image dimensions */
+#define SPH_JPEG_ERR_CCNT (3)   /* Invalid color channel count */
+#define SPH_JPEG_ERR_READ (4)   /* libjpeg read error */
+#define SPH_JPEG_ERR_MORE (5)   /* Not enough data for JPEG header */
+#define SPH_JPEG_ERR_WRIT (6)   /* libjpeg write error */
+#define SPH_JPEG_ERR_MEM  (7)   /* Memory limit or allocation failure */
+
+/*
+ * Flags for sph_jpeg_transcode().
+ */
+#define SPH_JPEG_TRANS_OPTIMIZE (0x1)   /* Optimize Huffman tables */
+#define SPH_JPEG_TRANS_MARKERS  (0x2)   /* Keep APPn and COM markers */
+
+/*
+ * Chroma subsampling modes for SPH_JPEG_WRITER_OPTS.
+ */
+#define SPH_JPEG_SAMP_420 (0)   /* Chroma halved in both directions */
+#define SPH_JPEG_SAMP_422 (1)   /* Chroma halved horizontally only */
+#define SPH_JPEG_SAMP_444 (2)   /* Chroma at full resolution */
+
+/*
+ * DCT methods for SPH_JPEG_WRITER_OPTS and SPH_JPEG_READER_OPTS.
+ */
+#define SPH_JPEG_DCT_ISLOW (0)  /* Accurate integer DCT */
+#define SPH_JPEG_DCT_IFAST (1)  /* Fast but less accurate integer DCT */
+#define SPH_JPEG_DCT_FLOAT (2)  /* Floating-point DCT */
+
+/*
+ * Color spaces of scanlines exchanged with color images, for
+ * SPH_JPEG_WRITER_OPTS and SPH_JPEG_READER_OPTS.  SPH_JPEG_COLOR_GRAY
+ * is only for readers.
+ */
+#define SPH_JPEG_COLOR_RGB  (0) /* Red, green, blue */
+#define SPH_JPEG_COLOR_YCC  (1) /* JPEG YCbCr, no color conversion */
+#define SPH_JPEG_COLOR_GRAY (2) /* Luma only, chroma never decoded */
+
+/*
+ * Pixel layouts of image buffers for sph_jpeg_reader_decode_into() and
+ * sph_jpeg_writer_encode_from().
+ */
+#define SPH_JPEG_LAYOUT_PACKED (0)  /* Same as scanlines */
+#define SPH_JPEG_LAYOUT_RGBX   (1)  /* Red, green, blue, padding */
+#define SPH_JPEG_LAYOUT_BGRX   (2)  /* Blue, green, red, padding */
+
+/*
+ * The maximum restart interval in MCU rows for SPH_JPEG_WRITER_OPTS.
+ */
+#define SPH_JPEG_MAXRESTART (65535)
+
+/*
+ * The maximum number of pixels for the width and height dimensions of
+ * JPEG files that are read and written.
+ */
+#define SPH_JPEG_MAXDIM (INT32_C(32000))
+
+/*
+ * The minimum and maximum compression quality values.
+ * 
+ * Higher values indicate higher quality images but less compression,
+ * while lower values indicate more compression but lower image quality.
+ */
+#define SPH_JPEG_MINQ (25)
+#define SPH_JPEG_MAXQ (90)
+
+/*
+ * A growable memory buffer that JPEG writers can encode into.
+ * 
+ * pData is the buffer, or NULL if nothing has been allocated yet.  If
+ * it is not NULL, it must have been allocated with malloc(), because
+ * writers grow it with realloc().  The client owns the buffer and must
+ * eventually free it, for example with sph_jpeg_membuf_free().
+ * 
+ * len is the number of bytes of valid data at the start of the buffer.
+ * Writers append after this length, so several JPEG files can be
+ * written one after another into the same buffer.
+ * 
+ * cap is the allocated capacity of the buffer in bytes, which is always
+ * at least len.
+ */
+typedef struct {
+  uint8_t *pData;
+  size_t len;
+  size_t cap;
+} SPH_JPEG_MEMBUF;
+
+/*
+ * Function pointer type for a sink callback that receives encoded JPEG
+ * data from a writer.
+ * 
+ * pCustom is the custom parameter that was passed when creating the
+ * writer.  pData points to the next len bytes of encoded output, where
+ * len is always at least one.  The data is only valid during the
+ * callback.
+ * 
+ * The callback returns non-zero if successful, zero if the data could
+ * not be consumed.
+ */
+typedef int (*SPH_JPEG_SINK)(
+          void    * pCustom,
+    const uint8_t * pData,
+          size_t    len);
+
+/*
+ * Structure that receives the results of probing a JPEG header.
+ * 
+ * See sph_jpeg_probe().
+ */
+typedef struct {
+  
+  /*
+   * The full-size width and height of the image in pixels.
+   */
+  int32_t width;
+  int32_t height;
+  
+  /*
+   * The number of color components stored in the JPEG file, which is
+   * one for grayscale or three for color.
+   */
+  int chcount;
+  
+  /*
+   * Non-zero if the JPEG file is progressive, zero if it is sequential.
+   */
+  int progressive;
+  
+  /*
+   * The estimated quality in range [1, 100] that the JPEG file was
+   * compressed with, or -1 if it could not be estimated.
+   * 
+   * This is the libjpeg quality value whose standard luminance
+   * quantization table most closely matches the first quantization
+   * table in the file.  It is exact for files written by libjpeg with
+   * the standard tables, and only a rough guide for other encoders.
+   */
+  int quality;
+  
+} SPH_JPEG_PROBE;
+
+/*
+ * Structure that receives the instrumentation counters of a reader or a
+ * writer.
+ * 
+ * The counters accumulate over every image the object has handled since
+ * it was created, so clients measure a single image by taking the
+ * difference between counters queried before and after it.  Times are
+ * in nanoseconds of monotonic wall-clock time on the calling thread.
+ * 
+ * See sph_jpeg_reader_stats() and sph_jpeg_writer_stats().
+ */
+typedef struct {
+  
+  /*
+   * The number of images started.
+   */
+  int64_t images;
+  
+  /*
+   * The time spent setting up each image, which is reading the header
+   * and starting decompression for readers, and starting compression
+   * and writing the header for writers.
+   */
+  int64_t setup_ns;
+  
+  /*
+   * The time spent inside libjpeg decoding or encoding scanlines.
+   * 
+   * For readers, this includes entropy decoding, the inverse DCT,
+   * upsampling, and color conversion, which libjpeg performs together
+   * for each row group and does not time separately, as well as rows
+   * skipped by a crop.  For writers, it includes color conversion,
+   * downsampling, the forward DCT, and entropy coding.
+   */
+  int64_t scan_ns;
+  
+  /*
+   * The time spent finishing each image.
+   * 
+   * For writers, this is where optimized Huffman tables are computed
+   * and where progressive files are entropy coded, so it can be large.
+   */
+  int64_t finish_ns;
+  
+  /*
+   * The number of compressed bytes consumed by a reader or produced by
+   * a writer.
+   */
+  int64_t bytes;
+  
+  /*
+   * The number of scanlines returned by a reader or accepted by a
+   * writer.
+   */
+  int64_t rows;
+  
+  /*
+   * The number of bytes currently requested from the libjpeg memory
+   * pools, and the highest this has been.
+   * 
+   * This counts the sizes requested through the libjpeg memory manager,
+   * including whole-image arrays, but not the memory manager's own
+   * overhead and alignment padding.
+   */
+  int64_t pool_bytes;
+  int64_t pool_peak;
+  
+} SPH_JPEG_STATS;
+
+/*
+ * A custom allocator for the libjpeg memory of readers and writers.
+ * 
+ * fAlloc is called with the pCustom value of the structure and a size
+ * in bytes.  It returns a block of at least that size that is aligned
+ * for any object, or NULL if the block can't be allocated.  fFree
+ * releases a block that fAlloc returned.  Neither callback may call
+ * back into sophistry_jpeg.
+ * 
+ * Blocks are allocated in large chunks while images are started, and
+ * the whole set of blocks belonging to an image is released when the
+ * image ends or the object is reset, so an arena or a per-thread pool
+ * that recycles blocks fits this pattern well.  Blocks are always
+ * released through the allocator that returned them, even if the
+ * object is later given a different allocator.
+ * 
+ * The structure is not copied, so it must remain valid as long as any
+ * reader or writer uses it.  If the same allocator is shared by
+ * objects on different threads, the callbacks must be thread-safe.
+ * 
+ * See the pAlloc fields of SPH_JPEG_WRITER_OPTS and
+ * SPH_JPEG_READER_OPTS.
+ */
+typedef struct {
+  void *(*fAlloc)(void *pCustom, size_t size);
+  void (*fFree)(void *pCustom, void *pBlock);
+  void *pCustom;
+} SPH_JPEG_ALLOCATOR;
+
+/*
+ * Encoder options for JPEG writers.
+ * 
+ * Use sph_jpeg_writer_opts_init() to fill in the defaults, which match
+ * the encoding used by writers that are constructed without options,
+ * and then change the fields of interest.
+ * 
+ * See sph_jpeg_writer_new_ex().
+ */
+typedef struct {
+  
+  /*
+   * Non-zero to compute optimal Huffman tables for each image, which
+   * makes files smaller at the cost of an extra pass over the image
+   * data during encoding.  Default zero.
+   */
+  int optimize;
+  
+  /*
+   * Non-zero to write a progressive JPEG file with the standard libjpeg
+   * scan script.  This always uses optimized Huffman tables regardless
+   * of the optimize field.  Default zero.
+   */
+  int progressive;
+  
+  /*
+   * One of the SPH_JPEG_SAMP constants, selecting the chroma
+   * subsampling of color images.  Ignored for grayscale images.
+   * Default SPH_JPEG_SAMP_420.
+   */
+  int sampling;
+  
+  /*
+   * One of the SPH_JPEG_DCT constants, selecting the forward DCT
+   * method.  Default SPH_JPEG_DCT_ISLOW.
+   */
+  int dct;
+  
+  /*
+   * The restart interval in MCU rows, in range
+   * [0, SPH_JPEG_MAXRESTART].  Zero means no restart markers are
+   * written.  Default zero.  Non-progressive files with restart
+   * markers can be decoded on several threads with sophistry_jpeg_par.
+   */
+  int restart_rows;
+  
+  /*
+   * One of the SPH_JPEG_COLOR constants, selecting the color space of
+   * the scanlines passed to writers of color images.  With
+   * SPH_JPEG_COLOR_YCC, the three channels of each pixel are Y, Cb, and
+   * Cr in the full-range JPEG convention, and the RGB to YCbCr
+   * conversion of the encoder is skipped.  SPH_JPEG_COLOR_GRAY is not
+   * allowed.  Ignored for grayscale images.  Default
+   * SPH_JPEG_COLOR_RGB.
+   */
+  int color;
+  
+  /*
+   * The maximum number of bytes of libjpeg memory the writer may have
+   * allocated at any one time, or zero for no limit.  Default zero.
+   * 
+   * The limit covers everything libjpeg allocates for an image,
+   * including the whole-image buffers of optimized and progressive
+   * files.  If the limit is exceeded, the writer stops with the error
+   * status SPH_JPEG_ERR_MEM.
+   */
+  size_t max_memory;
+  
+  /*
+   * The custom allocator for libjpeg memory, or NULL to use malloc()
+   * and free().  Default NULL.  See SPH_JPEG_ALLOCATOR.
+   */
+  const SPH_JPEG_ALLOCATOR *pAlloc;
+  
+} SPH_JPEG_WRITER_OPTS;
+
+/*
+ * Decoder options for JPEG readers.
+ * 
+ * Use sph_jpeg_reader_opts_init() to fill in the defaults, which match
+ * the decoding used by readers that are constructed without options,
+ * and then change the fields of interest.
+ * 
+ * The faster settings trade a small amount of accuracy for decoding
+ * speed.  The loss is hardly visible in images that are reduced after
+ * decoding.
+ * 
+ * See sph_jpeg_reader_new_ex().
+ */
+typedef struct {
+  
+  /*
+   * One of the SPH_JPEG_DCT constants, selecting the inverse DCT
+   * method.  Default SPH_JPEG_DCT_ISLOW.
+   */
+  int dct;
+  
+  /*
+   * Non-zero to use smooth upsampling of subsampled chroma channels,
+   * zero to duplicate chroma samples, which is faster.  Default
+   * non-zero.
+   */
+  int fancy_upsampling;
+  
+  /*
+   * Non-zero to smooth blocks in the early scans of progressive files,
+   * zero to skip it, which is faster.  Default non-zero.
+   */
+  int block_smoothing;
+  
+  /*
+   * The number of scans of a progressive file to decode, or zero to
+   * decode all of them.  Default zero.
+   * 
+   * If a progressive file has more scans than this, the reader returns
+   * the coarse image that libjpeg reconstructs from the first max_scans
+   * scans, and the rest of the file is never read or decoded.  The
+   * first scan usually holds only the DC coefficients, which give one
+   * color per 8 by 8 block, smoothed out if block_smoothing is set.
+   * Combined with a DCT scaling denominator of 8, this is a cheap
+   * preview with nearly the full detail of the scaled image.  The file
+   * position of the input is undefined afterwards.  Files with a single
+   * scan are always decoded in full.  Must not be negative.
+   */
+  int max_scans;
+  
+  /*
+   * One of the SPH_JPEG_COLOR constants, selecting the color space of
+   * the scanlines read from color images.  With SPH_JPEG_COLOR_YCC, the
+   * three channels of each pixel are the Y, Cb, and Cr values decoded
+   * from the file, and the YCbCr to RGB conversion of the decoder is
+   * skipped.
+   * 
+   * With SPH_JPEG_COLOR_GRAY, color images are read as grayscale
+   * images with one channel, which is the Y channel of the file.  The
+   * chroma channels are never decoded, upsampled, or converted, which
+   * roughly halves the decoding work.  The reader reports one channel
+   * from sph_jpeg_reader_channels().
+   * 
+   * Color files that are not stored as YCbCr are still read as RGB, so
+   * use sph_jpeg_reader_channels() and sph_jpeg_reader_color() to check
+   * which color space the scanlines are in.  Ignored for grayscale
+   * images.  Default SPH_JPEG_COLOR_RGB.
+   */
+  int color;
+  
+  /*
+   * The maximum number of bytes of libjpeg memory the reader may have
+   * allocated at any one time, or zero for no limit.  Default zero.
+   * 
+   * The limit covers everything libjpeg allocates for an image,
+   * including the whole-image buffers that progressive files need.
+   * Exceeding the limit stops the image with SPH_JPEG_ERR_MEM, which
+   * protects clients against hostile files that declare huge
+   * progressive images.
+   */
+  size_t max_memory;
+  
+  /*
+   * The custom allocator for libjpeg memory, or NULL to use malloc()
+   * and free().  Default NULL.  See SPH_JPEG_ALLOCATOR.
+   */
+  const SPH_JPEG_ALLOCATOR *pAlloc;
+  
+} SPH_JPEG_READER_OPTS;
+
+/*
+ * Structure prototype for SPH_JPEG_READER.
+ * 
+ * Definition given in implementation.
+ */
+struct SPH_JPEG_READER_TAG;
+typedef struct SPH_JPEG_READER_TAG SPH_JPEG_READER;
+
+/*
+ * Structure prototype for SPH_JPEG_WRITER.
+ * 
+ * Definition given in implementation.
+ */
+struct SPH_JPEG_WRITER_TAG;
+typedef struct SPH_JPEG_WRITER_TAG SPH_JPEG_WRITER;
+
+/*
+ * Return an error message for a given Sophistry JPEG error status code.
+ * 
+ * status is the status code.  If SPH_JPEG_ERR_OK is passed, the return
+ * string is "No error".  If an unrecognized status is passed, the
+ * return string is "Unknown error".
+ * 
+ * Error messages begin with a capital letter.  At the end of the
+ * string, there is no punctuation and no line break.
+ * 
+ * The error message strings are statically defined and should NOT be
+ * freed.
+ * 
+ * Parameters:
+ * 
+ *   status - the status code
+ * 
+ * Return:
+ * 
+ *   an error message
+ */
+const char *sph_jpeg_errstr(int status);
+
+/*
+ * Initialize a memory buffer structure to an empty state.
+ * 
+ * This does not allocate anything.  Capacity is only allocated once a
+ * writer needs it.
+ * 
+ * Parameters:
+ * 
+ *   pBuf - the memory buffer to initialize
+ */
+void sph_jpeg_membuf_init(SPH_JPEG_MEMBUF *pBuf);
+
+/*
+ * Release the storage of a memory buffer and return it to an empty
+ * state.
+ * 
+ * The structure itself is not freed, and it may be used again.  Do not
+ * call this while a writer is still writing into the buffer.
+ * 
+ * Parameters:
+ * 
+ *   pBuf - the memory buffer to release
+ */
+void sph_jpeg_membuf_free(SPH_JPEG_MEMBUF *pBuf);
+
+/*
+ * Compute the row stride of an image buffer.
+ * 
+ * width is the width of the image in pixels, in range 1 to
+ * SPH_JPEG_MAXDIM, chcount is the number of color channels, 1 or 3,
+ * and layout is one of the SPH_JPEG_LAYOUT constants.  Rows in the
+ * packed layout take (width * chcount) bytes, and rows in the other
+ * layouts take (width * 4) bytes.
+ * 
+ * The row size is rounded up to a multiple of align bytes, which must
+ * be at least one.  For example, an align of 16 keeps each row of an
+ * RGBX buffer on a 16-byte boundary, which pads the rows to a multiple
+ * of four pixels, as SIMD code and texture uploads often require.
+ * Invalid parameters cause a fault.
+ * 
+ * Parameters:
+ * 
+ *   width - the width of the image in pixels
+ * 
+ *   chcount - the number of color channels
+ * 
+ *   layout - the pixel layout
+ * 
+ *   align - the alignment of the stride in bytes
+ * 
+ * Return:
+ * 
+ *   the stride in bytes
+ */
+size_t sph_jpeg_stride(
+    int32_t width,
+    int     chcount,
+    int     layout,
+    size_t  align);
+
+/*
+ * Read the header of a JPEG file without decoding it.
+ * 
+ * pIn is the file to read the JPEG header from.  Reading starts at the
+ * current file position.  Only the markers up to the start of the first
+ * scan are parsed, and no decompression state is set up, so this is
+ * much cheaper than sph_jpeg_reader_new().  libjpeg reads ahead in
+ * blocks, so the file position afterwards is undefined.
+ * 
+ * If the data ends before the start of the first scan, but after the
+ * frame header has been read, the probe still succeeds.  This means a
+ * prefix of the file is usually enough.  If the data ends before the
+ * frame header, SPH_JPEG_ERR_MORE is returned.
+ * 
+ * pInfo receives the results.  It is filled in on success and cleared
+ * to zero on failure (with quality set to -1).
+ * 
+ * The same dimension and channel count checks as sph_jpeg_reader_new()
+ * are applied to the full-size image, and the return value is the
+ * corresponding status code.
+ * 
+ * Parameters:
+ * 
+ *   pIn - the file handle to read the JPEG header from
+ * 
+ *   pInfo - the structure to receive the results
+ * 
+ * Return:
+ * 
+ *   SPH_JPEG_ERR_OK if successful, otherwise an error status code
+ */
+int sph_jpeg_probe(FILE *pIn, SPH_JPEG_PROBE *pInfo);
+
+/*
+ * Read the header of a JPEG file in memory without decoding it.
+ * 
+ * This is the same as sph_jpeg_probe(), except that the header is read
+ * from the len bytes at pData.  pData may be just a prefix of the file.
+ * 
+ * Parameters:
+ * 
+ *   pData - the JPEG data, or a prefix of it
+ * 
+ *   len - the length of the data in bytes
+ * 
+ *   pInfo - the structure to receive the results
+ * 
+ * Return:
+ * 
+ *   SPH_JPEG_ERR_OK if successful, otherwise an error status code
+ */
+int sph_jpeg_probe_mem(
+    const void           * pData,
+          size_t           len,
+          SPH_JPEG_PROBE * pInfo);
+
+/*
+ * Losslessly copy a JPEG file from one file handle to another.
+ * 
+ * Instead of decoding the image to pixels and encoding it again, this
+ * reads the quantized DCT coefficients of the input, and writes them
+ * unchanged to the output with the same quantization tables and
+ * sampling factors.  There is therefore no generational quality loss,
+ * and it is much faster than decoding and re-encoding, since there is
+ * no inverse or forward DCT, no color conversion, and no resampling of
+ * color channels.  The output is a baseline or progressive file
+ * according to the input, with the standard libjpeg progression for
+ * progressive files, and it has the restart interval of the input, so
+ * that files with restart markers keep them.
+ * 
+ * This is useful for stripping metadata and normalizing files.  Unless
+ * the SPH_JPEG_TRANS_MARKERS flag is given, all APPn and COM markers of
+ * the input (such as Exif and ICC profiles) are dropped, and only the
+ * standard JFIF or Adobe marker that libjpeg writes is present in the
+ * output.  With that flag, APPn and COM markers are copied.
+ * 
+ * If the SPH_JPEG_TRANS_OPTIMIZE flag is given, optimal Huffman tables
+ * are computed for the output, which usually makes it a few percent
+ * smaller at the cost of an extra pass over the coefficients.
+ * Otherwise, the standard Huffman tables are used.
+ * 
+ * Unlike reader objects, any number of color channels is accepted,
+ * since the image is never converted to RGB or grayscale.
+ * 
+ * pIn is read sequentially from the current file position, and pOut is
+ * written sequentially from the current file position.  Neither handle
+ * is closed.  The whole coefficient image is held in memory while
+ * copying.
+ * 
+ * Parameters:
+ * 
+ *   pIn - the file handle to read the JPEG file from
+ * 
+ *   pOut - the file handle to write the JPEG file to
+ * 
+ *   flags - zero or more SPH_JPEG_TRANS flags combined with OR
+ * 
+ * Return:
+ * 
+ *   SPH_JPEG_ERR_OK (0) if successful, else SPH_JPEG_ERR_READ if the
+ *   input could not be read, SPH_JPEG_ERR_IDIM if the dimensions are
+ *   out of range, SPH_JPEG_ERR_WRIT if the output could not be
+ *   written, or SPH_JPEG_ERR_MEM if memory ran out
+ */
+int sph_jpeg_transcode(FILE *pIn, FILE *pOut, int flags);
+
+/*
+ * Allocate a new JPEG writer object.
+ * 
+ * The returned object must eventually be freed by calling the function
+ * sph_jpeg_writer_free().
+ * 
+ * pOut is the file to write the JPEG data to.  This file must be open
+ * for binary writing or undefined behavior occurs.  The JPEG file will
+ * be written sequentially starting at the current file pointer.
+ * Undefined behavior occurs if the file pointer is modified externally
+ * while the JPEG writer object is still allocated.
+ * 
+ * If the program ends or the JPEG writer object is freed before all the
+ * scanlines have been written, only a partial JPEG file will have been
+ * written to output.
+ * 
+ * Although the client must not touch the file handle while the writer
+ * object is allocated, the client still remains the owner of the file
+ * handle.  sph_jpeg_writer_free() does NOT close the file handle.
+ * 
+ * width and height are the width and height of the output image in
+ * pixels.  Both dimensions must be at least one, and both dimensions
+ * may not exceed SPH_JPEG_MAXDIM.
+ * 
+ * chcount is the number of color channels in the image to write.  This
+ * must either be one (indicating a grayscale file) or three (indicating
+ * an RGB file).
+ * 
+ * quality is the desired image quality.  Higher values indicate that
+ * the image quality will be better but the compression will be lower.
+ * Lower values indicate that the compression will be higher but the
+ * image quality will be lower.  Passed values are automatically clamped
+ * to the range [SPH_JPEG_MINQ, SPH_JPEG_MAXQ].
+ * 
+ * If libjpeg reports an error, or the output can't be written, the
+ * error is recorded in the error status of the writer and the rest of
+ * the image is ignored.  See sph_jpeg_writer_status().
+ * 
+ * Parameters:
+ * 
+ *   pOut - the file handle to write the JPEG file to
+ * 
+ *   width - the width of the JPEG file in pixels
+ * 
+ *   height - the height of the JPEG file in pixels
+ * 
+ *   chcount - the number of color channels
+ * 
+ *   quality - the compression quality
+ * 
+ * Return:
+ * 
+ *   a new JPEG writer object, or NULL if it could not be allocated
+ */
+SPH_JPEG_WRITER *sph_jpeg_writer_new(
+    FILE    * pOut,
+    int32_t   width,
+    int32_t   height,
+    int       chcount,
+    int       quality);
+
+/*
+ * Fill in default encoder options.
+ * 
+ * The defaults produce the same encoding as writers that are
+ * constructed without options.  See SPH_JPEG_WRITER_OPTS for the
+ * default of each field.
+ * 
+ * Parameters:
+ * 
+ *   pOpts - the options structure to initialize
+ */
+void sph_jpeg_writer_opts_init(SPH_JPEG_WRITER_OPTS *pOpts);
+
+/*
+ * Allocate a new JPEG writer object with encoder options.
+ * 
+ * This is the same as sph_jpeg_writer_new(), except that the encoder is
+ * configured with the options in pOpts instead of the defaults.  The
+ * options are copied into the writer, so the structure need not remain
+ * valid after the call.  If pOpts is NULL, the defaults are used.  If
+ * any option is out of range, a fault occurs.
+ * 
+ * The options stay with the writer object, so they also apply to each
+ * image written after the writer is reset, until they are changed with
+ * sph_jpeg_writer_set_opts().
+ * 
+ * Parameters:
+ * 
+ *   pOut - the file handle to write the JPEG file to
+ * 
+ *   width - the width of the JPEG file in pixels
+ * 
+ *   height - the height of the JPEG file in pixels
+ * 
+ *   chcount - the number of color channels
+ * 
+ *   quality - the compression quality
+ * 
+ *   pOpts - the encoder options, or NULL
+ * 
+ * Return:
+ * 
+ *   a new JPEG writer object, or NULL if it could not be allocated
+ */
+SPH_JPEG_WRITER *sph_jpeg_writer_new_ex(
+          FILE                 * pOut,
+          int32_t                width,
+          int32_t                height,
+          int                    chcount,
+          int                    quality,
+    const SPH_JPEG_WRITER_OPTS * pOpts);
+
+/*
+ * Allocate a new JPEG writer object that encodes into memory.
+ * 
+ * This is the same as sph_jpeg_writer_new(), except that the encoded
+ * JPEG file is appended to the memory buffer pBuf instead of being
+ * written to a file.  No stdio is involved.  libjpeg writes directly
+ * into the buffer, which is grown with realloc() as necessary.
+ * 
+ * The buffer structure must remain valid, and it must not be modified
+ * by the client, while the writer object is allocated.  The len field
+ * of the buffer is only brought up to date once all scanlines have been
+ * written.  If the buffer can't be grown, the writer stops with the
+ * error status SPH_JPEG_ERR_MEM.
+ * 
+ * Parameters:
+ * 
+ *   pBuf - the memory buffer to append to
+ * 
+ *   width - the width of the JPEG file in pixels
+ * 
+ *   height - the height of the JPEG file in pixels
+ * 
+ *   chcount - the number of color channels
+ * 
+ *   quality - the compression quality
+ * 
+ * Return:
+ * 
+ *   a new JPEG writer object, or NULL if it could not be allocated
+ */
+SPH_JPEG_WRITER *sph_jpeg_writer_new_mem(
+    SPH_JPEG_MEMBUF * pBuf,
+    int32_t           width,
+    int32_t           height,
+    int               chcount,
+    int               quality);
+
+/*
+ * Allocate a new JPEG writer object that delivers its output to a sink
+ * callback.
+ * 
+ * This is the same as sph_jpeg_writer_new(), except that the encoded
+ * JPEG data is passed in blocks to the sink callback fSink instead of
+ * being written to a file.  No stdio is involved.  pCustom is passed
+ * through to each callback invocation, and it may be NULL.
+ * 
+ * The last block is delivered when the last scanline is written.  If
+ * the sink callback reports failure, the writer stops with the error
+ * status SPH_JPEG_ERR_WRIT.
+ * 
+ * Parameters:
+ * 
+ *   fSink - the sink callback
+ * 
+ *   pCustom - the custom parameter for the callback
+ * 
+ *   width - the width of the JPEG file in pixels
+ * 
+ *   height - the height of the JPEG file in pixels
+ * 
+ *   chcount - the number of color channels
+ * 
+ *   quality - the compression quality
+ * 
+ * Return:
+ * 
+ *   a new JPEG writer object, or NULL if it could not be allocated
+ */
+SPH_JPEG_WRITER *sph_jpeg_writer_new_sink(
+    SPH_JPEG_SINK   fSink,
+    void          * pCustom,
+    int32_t         width,
+    int32_t         height,
+    int             chcount,
+    int             quality);
+
+/*
+ * Allocate a new JPEG writer object with encoder options that encodes
+ * into memory.
+ * 
+ * This combines sph_jpeg_writer_new_mem() with the encoder options of
+ * sph_jpeg_writer_new_ex().
+ * 
+ * Parameters:
+ * 
+ *   pBuf - the memory buffer to append to
+ * 
+ *   width - the width of the JPEG file in pixels
+ * 
+ *   height - the height of the JPEG file in pixels
+ * 
+ *   chcount - the number of color channels
+ * 
+ *   quality - the compression quality
+ * 
+ *   pOpts - the encoder options, or NULL
+ * 
+ * Return:
+ * 
+ *   a new JPEG writer object, or NULL if it could not be allocated
+ */
+SPH_JPEG_WRITER *sph_jpeg_writer_new_mem_ex(
+          SPH_JPEG_MEMBUF      * pBuf,
+          int32_t                width,
+          int32_t                height,
+          int                    chcount,
+          int                    quality,
+    const SPH_JPEG_WRITER_OPTS * pOpts);
+
+/*
+ * Allocate a new JPEG writer object with encoder options that delivers
+ * its output to a sink callback.
+ * 
+ * This combines sph_jpeg_writer_new_sink() with the encoder options of
+ * sph_jpeg_writer_new_ex().
+ * 
+ * Parameters:
+ * 
+ *   fSink - the sink callback
+ * 
+ *   pCustom - the custom parameter for the callback
+ * 
+ *   width - the width of the JPEG file in pixels
+ * 
+ *   height - the height of the JPEG file in pixels
+ * 
+ *   chcount - the number of color channels
+ * 
+ *   quality - the compression quality
+ * 
+ *   pOpts - the encoder options, or NULL
+ * 
+ * Return:
+ * 
+ *   a new JPEG writer object, or NULL if it could not be allocated
+ */
+SPH_JPEG_WRITER *sph_jpeg_writer_new_sink_ex(
+          SPH_JPEG_SINK          fSink,
+          void                 * pCustom,
+          int32_t                width,
+          int32_t                height,
+          int                    chcount,
+          int                    quality,
+    const SPH_JPEG_WRITER_OPTS * pOpts);
+
+/*
+ * Allocate a new JPEG writer object that queues its output for the
+ * client to take, for use with event loops and non-blocking I/O.
+ * 
+ * This is the same as sph_jpeg_writer_new(), except that the encoded
+ * JPEG data is queued in a buffer owned by the writer.  Writing
+ * scanlines never blocks on output.  After each call that writes
+ * scanlines, the client takes whatever output is ready with
+ * sph_jpeg_writer_output() and releases the bytes it managed to send
+ * with sph_jpeg_writer_consume().  The buffer only grows as far as the
+ * output that the client leaves unconsumed, and it is kept when the
+ * writer is reset.
+ * 
+ * Output becomes ready as the scanlines are encoded, except with the
+ * optimize and progressive options, where libjpeg produces nearly all
+ * of it once the last scanline has been written.  If the buffer can't
+ * be grown, the writer stops with the error status SPH_JPEG_ERR_MEM.
+ * 
+ * Parameters:
+ * 
+ *   width - the width of the JPEG file in pixels
+ * 
+ *   height - the height of the JPEG file in pixels
+ * 
+ *   chcount - the number of color channels
+ * 
+ *   quality - the compression quality
+ * 
+ * Return:
+ * 
+ *   a new JPEG writer object, or NULL if it could not be allocated
+ */
+SPH_JPEG_WRITER *sph_jpeg_writer_new_push(
+    int32_t width,
+    int32_t height,
+    int     chcount,
+    int     quality);
+
+/*
+ * Allocate a new JPEG writer object with encoder options that queues
+ * its output for the client to take.
+ * 
+ * This combines sph_jpeg_writer_new_push() with the encoder options of
+ * sph_jpeg_writer_new_ex().
+ * 
+ * Parameters:
+ * 
+ *   width - the width of the JPEG file in pixels
+ * 
+ *   height - the height of the JPEG file in pixels
+ * 
+ *   chcount - the number of color channels
+ * 
+ *   quality - the compression quality
+ * 
+ *   pOpts - the encoder options, or NULL
+ * 
+ * Return:
+ * 
+ *   a new JPEG writer object, or NULL if it could not be allocated
+ */
+SPH_JPEG_WRITER *sph_jpeg_writer_new_push_ex(
+          int32_t                width,
+          int32_t                height,
+          int                    chcount,
+          int                    quality,
+    const SPH_JPEG_WRITER_OPTS * pOpts);
+
+/*
+ * Reuse an existing JPEG writer object to write another JPEG file to a
+ * file handle.
+ * 
+ * The parameters after pw have the same meaning as for the
+ * sph_jpeg_writer_new() function, and the writer object is afterwards
+ * in the same state as a newly constructed one.  The difference is that
+ * the internal libjpeg memory pools and tables of pw are kept rather
+ * than being released and allocated again, which saves a significant
+ * amount of time when writing many small images.
+ * 
+ * The encoder options of the writer are also kept.  See
+ * sph_jpeg_writer_set_opts() to change them.
+ * 
+ * If not all scanlines of the previous image have been written, that
+ * image is abandoned and only a partial JPEG file will be present in
+ * its output.
+ * 
+ * The writer may have been constructed or last reset with any kind of
+ * output.
+ * 
+ * The error status of the writer is cleared, so a writer that stopped
+ * with an error can be reused for the next image.
+ * 
+ * Parameters:
+ * 
+ *   pw - the JPEG writer object to reuse
+ * 
+ *   pOut - the file handle to write the JPEG file to
+ * 
+ *   width - the width of the JPEG file in pixels
+ * 
+ *   height - the height of the JPEG file in pixels
+ * 
+ *   chcount - the number of color channels, 1 or 3
+ * 
+ *   quality - the compression quality
+ */
+void sph_jpeg_writer_reset(
+    SPH_JPEG_WRITER * pw,
+    FILE            * pOut,
+    int32_t           width,
+    int32_t           height,
+    int               chcount,
+    int               quality);
+
+/*
+ * Reuse an existing JPEG writer object to write another JPEG file to a
+ * memory buffer.
+ * 
+ * This is the memory buffer equivalent of sph_jpeg_writer_reset().  See
+ * sph_jpeg_writer_new_mem() for the meaning of pBuf.
+ * 
+ * Parameters:
+ * 
+ *   pw - the JPEG writer object to reuse
+ * 
+ *   pBuf - the memory buffer to append the JPEG file to
+ * 
+ *   width - the width of the JPEG file in pixels
+ * 
+ *   height - the height of the JPEG file in pixels
+ * 
+ *   chcount - the number of color channels, 1 or 3
+ * 
+ *   quality - the compression quality
+ */
+void sph_jpeg_writer_reset_mem(
+    SPH_JPEG_WRITER * pw,
+    SPH_JPEG_MEMBUF * pBuf,
+    int32_t           width,
+    int32_t           height,
+    int               chcount,
+    int               quality);
+
+/*
+ * Reuse an existing JPEG writer object to write another JPEG file to a
+ * sink callback.
+ * 
+ * This is the sink callback equivalent of sph_jpeg_writer_reset().  See
+ * sph_jpeg_writer_new_sink() for the meaning of fSink and pCustom.
+ * 
+ * Parameters:
+ * 
+ *   pw - the JPEG writer object to reuse
+ * 
+ *   fSink - the sink callback
+ * 
+ *   pCustom - the custom parameter passed through to the sink
+ * 
+ *   width - the width of the JPEG file in pixels
+ * 
+ *   height - the height of the JPEG file in pixels
+ * 
+ *   chcount - the number of color channels, 1 or 3
+ * 
+ *   quality - the compression quality
+ */
+void sph_jpeg_writer_reset_sink(
+    SPH_JPEG_WRITER * pw,
+    SPH_JPEG_SINK     fSink,
+    void            * pCustom,
+    int32_t           width,
+    int32_t           height,
+    int               chcount,
+    int               quality);
+
+/*
+ * Reuse an existing JPEG writer object to queue another JPEG file for
+ * the client to take.
+ * 
+ * This is the push equivalent of sph_jpeg_writer_reset().  See
+ * sph_jpeg_writer_new_push().  Any output of the previous image that
+ * was not consumed is discarded.
+ * 
+ * Parameters:
+ * 
+ *   pw - the JPEG writer object to reuse
+ * 
+ *   width - the width of the JPEG file in pixels
+ * 
+ *   height - the height of the JPEG file in pixels
+ * 
+ *   chcount - the number of color channels, 1 or 3
+ * 
+ *   quality - the compression quality
+ */
+void sph_jpeg_writer_reset_push(
+    SPH_JPEG_WRITER * pw,
+    int32_t           width,
+    int32_t           height,
+    int               chcount,
+    int               quality);
+
+/*
+ * Change the encoder options of a JPEG writer object.
+ * 
+ * The new options take effect for the next image, when the writer is
+ * reset with one of the reset functions.  The image currently being
+ * written is not affected.  The options are copied into the writer.  If
+ * pOpts is NULL, the defaults are restored.  If any option is out of
+ * range, a fault occurs.
+ * 
+ * Parameters:
+ * 
+ *   pw - the JPEG writer object
+ * 
+ *   pOpts - the encoder options, or NULL
+ */
+void sph_jpeg_writer_set_opts(
+          SPH_JPEG_WRITER      * pw,
+    const SPH_JPEG_WRITER_OPTS * pOpts);
+
+/*
+ * Release an allocated JPEG writer object.
+ * 
+ * pw is the writer object to release.  The function call is ignored if
+ * pw is NULL.
+ * 
+ * This function does NOT close the file handle that was used to
+ * initialize the JPEG writer object.  The client retains ownership of
+ * the file handle.
+ * 
+ * If all scanlines have been written, then after this function call the
+ * file pointer will be at the location just after the JPEG file that
+ * was written.  If not all scanlines have been written, then only a
+ * partial JPEG file will be present.
+ * 
+ * The client may safely use the file handle again after the writer
+ * object has been released.  If the writer is in an error state, only
+ * a partial JPEG file will be present.
+ * 
+ * Parameters:
+ * 
+ *   pw - the JPEG writer object to free, or NULL
+ */
+void sph_jpeg_writer_free(SPH_JPEG_WRITER *pw);
+
+/*
+ * Return the error status of a JPEG writer object.
+ * 
+ * pw is the writer object to query.  The return value is the status
+ * code, which is one of the SPH_JPEG_ERR constants.  To get an error
+ * message for an error status, use sph_jpeg_errstr().
+ * 
+ * If the writer object hasn't encountered an error yet, the return
+ * status will be SPH_JPEG_ERR_OK.  Once an error status occurs, the
+ * writer object no longer tries to write the JPEG file any further and
+ * further scanlines are ignored.  The error status remains until the
+ * writer is reset with sph_jpeg_writer_reset().
+ * 
+ * An image is only known to be complete and valid once all scanlines
+ * have been written and the status is still SPH_JPEG_ERR_OK.
+ * 
+ * Parameters:
+ * 
+ *   pw - the JPEG writer object
+ * 
+ * Return:
+ * 
+ *   the current status code 
+ */
+int sph_jpeg_writer_status(SPH_JPEG_WRITER *pw);
+
+/*
+ * Write an image scanline row to the JPEG file.
+ * 
+ * pw is the JPEG writer object.  sph_jpeg_writer_put() must be called
+ * once for each scanline row in the image, in top-down order.  If the
+ * sph_jpeg_writer_free() function is called before all rows have been
+ * written, the JPEG file will be incomplete and invalid.  If more than
+ * (height) scanlines are written to a JPEG writer object, a fault
+ * occurs.
+ * 
+ * pscan points to the scanline data to write.  Each pixel either has
+ * one byte indicating a grayscale value (zero is black and 255 is
+ * white), or three bytes in Red, Green, Blue order, depending on the
+ * chcount parameter that was used to initialize the writer object.  The
+ * pixels must be ordered from left to right.  The total number of
+ * pixels in a scanline is given by the (width) parameter passed to the
+ * initialization routine.
+ * 
+ * The function does nothing if there is already an error status, but
+ * the scanline still counts towards the height of the image.  Errors
+ * are recorded in the error status, see sph_jpeg_writer_status().
+ * 
+ * Parameters:
+ * 
+ *   pw - the JPEG writer object
+ * 
+ *   pscan - the scanline data to write
+ */
+void sph_jpeg_writer_put(SPH_JPEG_WRITER *pw, uint8_t *pscan);
+
+/*
+ * Write several image scanline rows to the JPEG file in one call.
+ * 
+ * This has the same effect as calling sph_jpeg_writer_put() once for
+ * each row, but the rows are handed to libjpeg in batches, which avoids
+ * per-row call overhead and allows libjpeg to process whole row groups
+ * at once.
+ * 
+ * buf points to the first row to write.  Each row has the same format
+ * as for sph_jpeg_writer_put().  stride is the distance in bytes from
+ * the start of one row to the start of the next.  It must be at least
+ * (width * chcount) or a fault occurs.  Row padding beyond that is
+ * ignored.
+ * 
+ * rows is the number of rows to write.  It must be at least one, and it
+ * may not exceed the number of rows that remain to be written in the
+ * image, or a fault occurs.
+ * 
+ * The function does nothing if there is already an error status, but
+ * the rows still count towards the height of the image.  Errors are
+ * recorded in the error status, see sph_jpeg_writer_status().
+ * 
+ * Parameters:
+ * 
+ *   pw - the JPEG writer object
+ * 
+ *   buf - the first row to write
+ * 
+ *   stride - the distance in bytes between rows
+ * 
+ *   rows - the number of rows to write
+ */
+void sph_jpeg_writer_put_rows(
+    SPH_JPEG_WRITER * pw,
+    uint8_t         * buf,
+    size_t            stride,
+    int32_t           rows);
+
+/*
+ * Encode the rest of the image from a buffer provided by the caller.
+ * 
+ * All scanlines that have not been written yet are written, the first
+ * of them from the row at base, and each following one from stride
+ * bytes after the previous one.  The buffer is not modified.
+ * 
+ * layout is one of the SPH_JPEG_LAYOUT constants, with the same pixel
+ * formats as for sph_jpeg_reader_decode_into().  In the packed layout,
+ * libjpeg reads the rows straight from the buffer.  In the RGBX and
+ * BGRX layouts, the padding bytes are ignored, and rows are packed in
+ * a small staging buffer owned by the writer before they are encoded.
+ * Grayscale writers take the green byte of each pixel as the gray
+ * value.  If the staging buffer can't be allocated, the writer stops
+ * with the error status SPH_JPEG_ERR_MEM.
+ * 
+ * stride must be at least the row size of the layout, see
+ * sph_jpeg_stride().  If no scanlines remain, the layout is invalid,
+ * or the stride is too small, a fault occurs.
+ * 
+ * The function does nothing if there is already an error status, but
+ * the rows still count towards the height of the image.  Errors are
+ * recorded in the error status, see sph_jpeg_writer_status().
+ * 
+ * Parameters:
+ * 
+ *   pw - the JPEG writer object
+ * 
+ *   base - the first row to write
+ * 
+ *   stride - the distance in bytes between rows
+ * 
+ *   layout - the pixel layout
+ */
+void sph_jpeg_writer_encode_from(
+          SPH_JPEG_WRITER * pw,
+    const uint8_t         * base,
+          size_t            stride,
+          int               layout);
+
+/*
+ * Get the output of a push writer that is ready to be taken.
+ * 
+ * pw must be a push writer, see sph_jpeg_writer_new_push(), or a fault
+ * occurs.  The return value points to the first byte of output that has
+ * not been consumed yet, and pLen receives the number of bytes ready.
+ * The bytes remain valid and unchanged until the next call to any
+ * other function on the writer.  Taking the output doesn't consume it;
+ * call sph_jpeg_writer_consume() for the bytes that were sent.
+ * 
+ * The image is complete once all scanlines have been written and all
+ * the output has been consumed.  If the writer is in an error state, no
+ * output is ready, since the file could never be completed.
+ * 
+ * Parameters:
+ * 
+ *   pw - the JPEG writer object
+ * 
+ *   pLen - receives the number of bytes ready
+ * 
+ * Return:
+ * 
+ *   pointer to the output that is ready, which may be NULL if no bytes
+ *   are ready
+ */
+const uint8_t *sph_jpeg_writer_output(
+    SPH_JPEG_WRITER * pw,
+    size_t          * pLen);
+
+/*
+ * Consume output of a push writer that the client has taken.
+ * 
+ * pw must be a push writer.  n is the number of bytes at the start of
+ * the output returned by sph_jpeg_writer_output() that the client no
+ * longer needs.  n may be less than the bytes ready, for example after
+ * a partial write to a non-blocking socket, and the remaining bytes are
+ * returned again by the next call to sph_jpeg_writer_output().  A fault
+ * occurs if n is more than the bytes ready.
+ * 
+ * Parameters:
+ * 
+ *   pw - the JPEG writer object
+ * 
+ *   n - the number of bytes to consume
+ */
+void sph_jpeg_writer_consume(SPH_JPEG_WRITER *pw, size_t n);
+
+/*
+ * Get the instrumentation counters of a JPEG writer object.
+ * 
+ * pw is the writer object and pStats receives its counters.  If
+ * sophistry_jpeg was compiled without SPH_JPEG_ENABLE_STATS, every
+ * counter is zero and the return value is zero.
+ * 
+ * Parameters:
+ * 
+ *   pw - the JPEG writer object
+ * 
+ *   pStats - receives the counters
+ * 
+ * Return:
+ * 
+ *   non-zero if instrumentation is compiled in, zero if not
+ */
+int sph_jpeg_writer_stats(SPH_JPEG_WRITER *pw, SPH_JPEG_STATS *pStats);
+
+/*
+ * Allocate a new JPEG reader object.
+ * 
+ * The returned object must eventually be freed by calling the function
+ * sph_jpeg_reader_free().
+ * 
+ * pIn is the file to read the JPEG data from.  This file must be open
+ * for binary reading or undefined behavior occurs.  The JPEG file will
+ * be read sequentially starting at the current file pointer.  Undefined
+ * behavior occurs if the file pointer is modified externally while the
+ * JPEG reader object is still allocated.
+ * 
+ * Although the client must not touch the file handle while the reader
+ * object is allocated, the client still remains the owner of the file
+ * handle.  sph_jpeg_reader_free() does NOT close the file handle.
+ * 
+ * If there is any problem reading the file, if the color format is not
+ * supported, or if the image dimensions exceed the SPH_JPEG_MAXDIM
+ * limit, then a new reader object is returned with an error status set
+ * (see sph_jpeg_reader_status()).
+ * 
+ * Parameters:
+ * 
+ *   pIn - the file handle to read the JPEG file from
+ * 
+ * Return:
+ * 
+ *   a new JPEG reader object, or NULL if it could not be allocated
+ */
+SPH_JPEG_READER *sph_jpeg_reader_new(FILE *pIn);
+
+/*
+ * Allocate a new JPEG reader object that decodes at a reduced scale.
+ * 
+ * This is the same as sph_jpeg_reader_new(), except that libjpeg is
+ * asked to scale the image down by a factor of denom during the inverse
+ * DCT.  This is much faster than decoding at full resolution and then
+ * reducing, since most of the IDCT and color conversion work is never
+ * performed.
+ * 
+ * denom must be one of 1, 2, 4, or 8, or a fault occurs.  A value of
+ * one is equivalent to sph_jpeg_reader_new().  These are the scaling
+ * factors supported by every version of libjpeg since 6B.
+ * 
+ * The width and height reported by the reader object are the scaled
+ * dimensions, which are the full-size dimensions divided by denom and
+ * rounded up.  The SPH_JPEG_MAXDIM limit is applied to the scaled
+ * dimensions.
+ * 
+ * Parameters:
+ * 
+ *   pIn - the file handle to read the JPEG file from
+ * 
+ *   denom - the scaling denominator
+ * 
+ * Return:
+ * 
+ *   a new JPEG reader object, or NULL if it could not be allocated
+ */
+SPH_JPEG_READER *sph_jpeg_reader_new_scaled(FILE *pIn, int denom);
+
+/*
+ * Fill in default decoder options.
+ * 
+ * The defaults produce the same decoding as readers that are
+ * constructed without options.  See SPH_JPEG_READER_OPTS for the
+ * default of each field.
+ * 
+ * Parameters:
+ * 
+ *   pOpts - the options structure to initialize
+ */
+void sph_jpeg_reader_opts_init(SPH_JPEG_READER_OPTS *pOpts);
+
+/*
+ * Allocate a new JPEG reader object with decoder options.
+ * 
+ * This is the same as sph_jpeg_reader_new_scaled(), except that the
+ * decoder is configured with the options in pOpts instead of the
+ * defaults.  The options are copied into the reader, so the structure
+ * need not remain valid after the call.  If pOpts is NULL, the defaults
+ * are used.  If any option is out of range, a fault occurs.
+ * 
+ * The options stay with the reader object, so they also apply to each
+ * image read after the reader is reset, until they are changed with
+ * sph_jpeg_reader_set_opts().
+ * 
+ * Parameters:
+ * 
+ *   pIn - the file handle to read the JPEG file from
+ * 
+ *   denom - the scaling denominator, 1, 2, 4, or 8
+ * 
+ *   pOpts - the decoder options, or NULL
+ * 
+ * Return:
+ * 
+ *   a new JPEG reader object, or NULL if it could not be allocated
+ */
+SPH_JPEG_READER *sph_jpeg_reader_new_ex(
+          FILE                 * pIn,
+          int                    denom,
+    const SPH_JPEG_READER_OPTS * pOpts);
+
+/*
+ * Allocate a new JPEG reader object that decodes from memory.
+ * 
+ * This is the same as sph_jpeg_reader_new(), except that the JPEG file
+ * is decoded directly from the len bytes at pData instead of from a
+ * file.  No stdio is involved and the data is not copied.
+ * 
+ * The buffer must remain valid and unmodified while the reader object
+ * is allocated.  The client remains the owner of the buffer.
+ * 
+ * If the data ends before the JPEG file is complete, libjpeg prints a
+ * warning and decodes as much of the image as it can, in the same way
+ * as with a truncated file.
+ * 
+ * Parameters:
+ * 
+ *   pData - the JPEG data to decode
+ * 
+ *   len - the length of the JPEG data in bytes
+ * 
+ * Return:
+ * 
+ *   a new JPEG reader object, or NULL if it could not be allocated
+ */
+SPH_JPEG_READER *sph_jpeg_reader_new_mem(
+    const void   * pData,
+          size_t   len);
+
+/*
+ * Allocate a new JPEG reader object with decoder options that decodes
+ * from memory.
+ * 
+ * This combines sph_jpeg_reader_new_mem() with the decoder options of
+ * sph_jpeg_reader_new_ex().
+ * 
+ * Parameters:
+ * 
+ *   pData - the JPEG data to decode
+ * 
+ *   len - the length of the JPEG data in bytes
+ * 
+ *   pOpts - the decoder options, or NULL
+ * 
+ * Return:
+ * 
+ *   a new JPEG reader object, or NULL if it could not be allocated
  */
-
-#include <stddef.h>
-#include <stdint.h>
-#include <stdio.h>
+SPH_JPEG_READER *sph_jpeg_reader_new_mem_ex(
+    const void                 * pData,
+          size_t                 len,
+    const SPH_JPEG_READER_OPTS * pOpts);
 
 /*
- * Error status definitions.
+ * Reuse an existing JPEG reader object to read another JPEG file from
+ * a file handle.
+ * 
+ * pIn has the same meaning as for sph_jpeg_reader_new(), and the reader
+ * object is afterwards in the same state as a newly constructed one,
+ * including its error status.  The difference is that the internal
+ * libjpeg memory pools of pr are kept rather than being released and
+ * allocated again, which saves a significant amount of time when
+ * reading many small images.
+ * 
+ * The decoder options of the reader are also kept.  See
+ * sph_jpeg_reader_set_opts() to change them.
+ * 
+ * Any image that was still being read is abandoned.  The reader may
+ * have been constructed or last reset with any kind of input, and it
+ * may be in an error state.
+ * 
+ * Parameters:
+ * 
+ *   pr - the JPEG reader object to reuse
+ * 
+ *   pIn - the file handle to read the JPEG file from
  */
-#define SPH_JPEG_ERR_OK   (0)   /* No error */
-#define SPH_JPEG_ERR_LIBJ (1)   /* libjpeg internal error during load */
-#define SPH_JPEG_ERR_IDIM (2)   /* Invalid image dimensions */
-#define SPH_JPEG_ERR_CCNT (3)   /* Invalid color channel count */
-#define SPH_JPEG_ERR_READ (4)   /* libjpeg read error */
+void sph_jpeg_reader_reset(SPH_JPEG_READER *pr, FILE *pIn);
 
 /*
- * The maximum number of pixels for the width and height dimensions of
- * JPEG files that are read and written.
+ * Reuse an existing JPEG reader object to read another JPEG file with
+ * DCT-domain scaling.
+ * 
+ * This is the equivalent of sph_jpeg_reader_reset() for
+ * sph_jpeg_reader_new_scaled().  See that function for the meaning of
+ * denom.
+ * 
+ * Parameters:
+ * 
+ *   pr - the JPEG reader object to reuse
+ * 
+ *   pIn - the file handle to read the JPEG file from
+ * 
+ *   denom - the scaling denominator, 1, 2, 4, or 8
  */
-#define SPH_JPEG_MAXDIM (INT32_C(32000))
+void sph_jpeg_reader_reset_scaled(
+    SPH_JPEG_READER * pr,
+    FILE            * pIn,
+    int               denom);
 
 /*
- * The minimum and maximum compression quality values.
+ * Reuse an existing JPEG reader object to read another JPEG file from
+ * memory.
  * 
- * Higher values indicate higher quality images but less compression,
- * while lower values indicate more compression but lower image quality.
+ * This is the equivalent of sph_jpeg_reader_reset() for
+ * sph_jpeg_reader_new_mem().  See that function for the meaning of
+ * pData and len.
+ * 
+ * Parameters:
+ * 
+ *   pr - the JPEG reader object to reuse
+ * 
+ *   pData - the JPEG file in memory
+ * 
+ *   len - the number of bytes at pData
  */
-#define SPH_JPEG_MINQ (25)
-#define SPH_JPEG_MAXQ (90)
+void sph_jpeg_reader_reset_mem(
+          SPH_JPEG_READER * pr,
+    const void            * pData,
+          size_t            len);
 
 /*
- * Structure prototype for SPH_JPEG_READER.
+ * Allocate a new JPEG reader object that is fed the JPEG file in chunks
+ * as it arrives, for use with event loops and non-blocking I/O.
+ * 
+ * The reader never waits for data.  The client passes each chunk of the
+ * file to sph_jpeg_reader_feed() as it arrives and, once decompression
+ * has started, takes whatever scanlines can be decoded from the data
+ * fed so far with sph_jpeg_reader_poll_rows().  When libjpeg runs out
+ * of data, it suspends and resumes where it left off once more data has
+ * been fed.  The end of the file is signalled with
+ * sph_jpeg_reader_feed_end().
+ * 
+ * Data that has been fed but not consumed by libjpeg yet is copied into
+ * a buffer owned by the reader, so chunks may be released as soon as
+ * they have been fed.  The buffer grows as needed, and is kept when the
+ * reader is reset.
+ * 
+ * Until decompression has started, the width, height, and channel count
+ * functions return one, one, and one.  Progressive files are only
+ * started once the whole file has been fed, because libjpeg decodes
+ * all their scans before it returns the first scanline, unless the
+ * max_scans decoder option limits the scans that are decoded.
+ * 
+ * denom is the DCT scaling denominator, with the same meaning as for
+ * sph_jpeg_reader_new_scaled().  pOpts are the decoder options, as for
+ * sph_jpeg_reader_new_ex(), or NULL for the defaults.
+ * 
+ * Feed readers can't be cropped.  sph_jpeg_reader_get() and
+ * sph_jpeg_reader_get_rows() may only be used once the end of the file
+ * has been signalled, since they can't return without a scanline.
  * 
- * Definition given in implementation.
+ * Parameters:
+ * 
+ *   denom - the scaling denominator, 1, 2, 4, or 8
+ * 
+ *   pOpts - the decoder options, or NULL
+ * 
+ * Return:
+ * 
+ *   a new JPEG reader object waiting for data, or NULL if it could not
+ *   be allocated
  */
-struct SPH_JPEG_READER_TAG;
-typedef struct SPH_JPEG_READER_TAG SPH_JPEG_READER;
+SPH_JPEG_READER *sph_jpeg_reader_new_feed(
+          int                    denom,
+    const SPH_JPEG_READER_OPTS * pOpts);
 
 /*
- * Structure prototype for SPH_JPEG_WRITER.
+ * Reuse an existing JPEG reader object to be fed another JPEG file.
  * 
- * Definition given in implementation.
+ * This is the equivalent of sph_jpeg_reader_reset() for
+ * sph_jpeg_reader_new_feed().  Any data fed for the previous image that
+ * was not consumed is discarded.  The reader may have been constructed
+ * or last reset with any kind of input.
+ * 
+ * Parameters:
+ * 
+ *   pr - the JPEG reader object to reuse
+ * 
+ *   denom - the scaling denominator, 1, 2, 4, or 8
  */
-struct SPH_JPEG_WRITER_TAG;
-typedef struct SPH_JPEG_WRITER_TAG SPH_JPEG_WRITER;
+void sph_jpeg_reader_reset_feed(SPH_JPEG_READER *pr, int denom);
 
 /*
- * Return an error message for a given Sophistry JPEG error status code.
+ * Feed the next chunk of the JPEG file to a feed reader.
  * 
- * status is the status code.  If SPH_JPEG_ERR_OK is passed, the return
- * string is "No error".  If an unrecognized status is passed, the
- * return string is "Unknown error".
+ * pr must have been constructed with sph_jpeg_reader_new_feed() or
+ * reset with sph_jpeg_reader_reset_feed(), and the end of the file must
+ * not have been signalled yet.  Otherwise, a fault occurs.
  * 
- * Error messages begin with a capital letter.  At the end of the
- * string, there is no punctuation and no line break.
+ * The len bytes at pData are copied into the reader, and the header is
+ * read and decompression started as far as the data fed so far allows.
+ * len may be zero, in which case pData may be NULL.  Once decompression
+ * has started, feeding never decodes anything by itself; scanlines are
+ * decoded by sph_jpeg_reader_poll_rows().
  * 
- * The error message strings are statically defined and should NOT be
- * freed.
+ * If the reader is already in an error state, the data is ignored.  If
+ * the data can't be stored, the reader enters the error state
+ * SPH_JPEG_ERR_MEM.
  * 
  * Parameters:
  * 
- *   status - the status code
+ *   pr - the JPEG reader object
+ * 
+ *   pData - the next chunk of the JPEG file
+ * 
+ *   len - the number of bytes at pData
  * 
  * Return:
  * 
- *   an error message
+ *   SPH_JPEG_ERR_OK (0) if decompression has started, so the image
+ *   dimensions are available, SPH_JPEG_ERR_MORE if more data is needed
+ *   to start decompression, or else the error status of the reader
  */
-const char *sph_jpeg_errstr(int status);
+int sph_jpeg_reader_feed(
+          SPH_JPEG_READER * pr,
+    const void            * pData,
+          size_t            len);
 
 /*
- * Allocate a new JPEG writer object.
- * 
- * The returned object must eventually be freed by calling the function
- * sph_jpeg_writer_free().
+ * Signal the end of the JPEG file to a feed reader.
  * 
- * pOut is the file to write the JPEG data to.  This file must be open
- * for binary writing or undefined behavior occurs.  The JPEG file will
- * be written sequentially starting at the current file pointer.
- * Undefined behavior occurs if the file pointer is modified externally
- * while the JPEG writer object is still allocated.
+ * The same state requirements as for sph_jpeg_reader_feed() apply.
+ * Afterwards, libjpeg no longer suspends.  If the file ends early, the
+ * rest of the image decodes as far as possible in the same way as for
+ * a truncated file read with sph_jpeg_reader_new().  If decompression
+ * has not started yet, it is started now, so the return value is never
+ * SPH_JPEG_ERR_MORE.
  * 
- * If the program ends or the JPEG writer object is freed before all the
- * scanlines have been written, only a partial JPEG file will have been
- * written to output.
+ * Afterwards, sph_jpeg_reader_get() and sph_jpeg_reader_get_rows() may
+ * also be used to read the remaining scanlines.
  * 
- * Although the client must not touch the file handle while the writer
- * object is allocated, the client still remains the owner of the file
- * handle.  sph_jpeg_writer_free() does NOT close the file handle.
+ * Parameters:
  * 
- * width and height are the width and height of the output image in
- * pixels.  Both dimensions must be at least one, and both dimensions
- * may not exceed SPH_JPEG_MAXDIM.
+ *   pr - the JPEG reader object
  * 
- * chcount is the number of color channels in the image to write.  This
- * must either be one (indicating a grayscale file) or three (indicating
- * an RGB file).
+ * Return:
  * 
- * quality is the desired image quality.  Higher values indicate that
- * the image quality will be better but the compression will be lower.
- * Lower values indicate that the compression will be higher but the
- * image quality will be lower.  Passed values are automatically clamped
- * to the range [SPH_JPEG_MINQ, SPH_JPEG_MAXQ].
+ *   SPH_JPEG_ERR_OK (0) if decompression has started, or else the
+ *   error status of the reader
+ */
+int sph_jpeg_reader_feed_end(SPH_JPEG_READER *pr);
+
+/*
+ * Allocate a new JPEG reader object that only reads the header of the
+ * JPEG file, so that the client can choose a DCT scaling denominator
+ * based on the image dimensions.
  * 
- * Errors cause faults.  Errors originating within libjpeg may print an
- * error message to stderr.
+ * This is the same as sph_jpeg_reader_new(), except that decompression
+ * is not started.  The width, height, and channel count functions
+ * return the full, unscaled image information, and the status function
+ * reports any error reading the header.  The client must then call
+ * sph_jpeg_reader_scale() before reading scanlines.  Reading scanlines
+ * before that causes a fault.
  * 
  * Parameters:
  * 
- *   pOut - the file handle to write the JPEG file to
+ *   pIn - the file handle to read the JPEG file from
  * 
- *   width - the width of the JPEG file in pixels
+ * Return:
  * 
- *   height - the height of the JPEG file in pixels
+ *   a new JPEG reader object that has only read the header, or NULL if
+ *   it could not be allocated
+ */
+SPH_JPEG_READER *sph_jpeg_reader_new_header(FILE *pIn);
+
+/*
+ * Reuse an existing JPEG reader object to read only the header of
+ * another JPEG file.
  * 
- *   chcount - the number of color channels
+ * This is the equivalent of sph_jpeg_reader_reset() for
+ * sph_jpeg_reader_new_header().
  * 
- *   quality - the compression quality
+ * Parameters:
  * 
- * Return:
+ *   pr - the JPEG reader object to reuse
  * 
- *   a new JPEG writer object
+ *   pIn - the file handle to read the JPEG file from
  */
-SPH_JPEG_WRITER *sph_jpeg_writer_new(
-    FILE    * pOut,
-    int32_t   width,
-    int32_t   height,
-    int       chcount,
-    int       quality);
+void sph_jpeg_reader_reset_header(SPH_JPEG_READER *pr, FILE *pIn);
 
 /*
- * Release an allocated JPEG writer object.
- * 
- * pw is the writer object to release.  The function call is ignored if
- * pw is NULL.
- * 
- * This function does NOT close the file handle that was used to
- * initialize the JPEG writer object.  The client retains ownership of
- * the file handle.
+ * Start decompression on a JPEG reader object that has only read the
+ * header.
  * 
- * If all scanlines have been written, then after this function call the
- * file pointer will be at the location just after the JPEG file that
- * was written.  If not all scanlines have been written, then only a
- * partial JPEG file will be present.
+ * pr must have been constructed with sph_jpeg_reader_new_header() or
+ * reset with sph_jpeg_reader_reset_header(), and this function must not
+ * have been called on it since.  Otherwise, a fault occurs.
  * 
- * The client may safely use the file handle again after the writer
- * object has been released.
+ * denom is the DCT scaling denominator, with the same meaning as for
+ * sph_jpeg_reader_new_scaled().  Afterwards, the width and height
+ * functions return the scaled dimensions, and scanlines can be read
+ * normally.
  * 
- * Errors cause faults.  Errors originating within libjpeg may print an
- * error message to stderr.
+ * If the reader is already in an error state, the call has no effect
+ * other than allowing scanlines to be read, which will all be blank.
  * 
  * Parameters:
  * 
- *   pw - the JPEG writer object to free, or NULL
+ *   pr - the JPEG reader object
+ * 
+ *   denom - the scaling denominator, 1, 2, 4, or 8
  */
-void sph_jpeg_writer_free(SPH_JPEG_WRITER *pw);
+void sph_jpeg_reader_scale(SPH_JPEG_READER *pr, int denom);
 
 /*
- * Write an image scanline row to the JPEG file.
+ * Restrict a JPEG reader object to a rectangle of the image.
+ * 
+ * Decompression must have started, and no scanlines may have been read
+ * yet.  This function may be called at most once per image, and not at
+ * all for feed readers.  Otherwise, a fault occurs.  For readers that
+ * only read the header, this means this function must be called after
+ * sph_jpeg_reader_scale().
+ * 
+ * The rectangle is given in the output dimensions of the reader, so it
+ * is scaled if a DCT scaling denominator is in effect.  x and y are the
+ * left and top of the rectangle, and w and h are its width and height.
+ * The rectangle must be within the image, or a fault occurs.
+ * 
+ * Afterwards, the width and height functions return the dimensions of
+ * the rectangle, and scanlines only cover the rectangle.  The rest of
+ * the image is not returned.
+ * 
+ * When libjpeg is libjpeg-turbo 1.5 or later, the rows above the
+ * rectangle are skipped without being upsampled or color converted,
+ * and only the columns of iMCUs that overlap the rectangle are decoded.
+ * Otherwise, the rows above the rectangle are fully decoded into an
+ * internal buffer and discarded, but columns outside the rectangle are
+ * never copied to the caller.  Either way, decoding stops after the
+ * last row of the rectangle, so the file position of the input is
+ * undefined afterwards.
+ * 
+ * If the reader is in an error state, the call has no effect.  If
+ * libjpeg reports an error while setting up the crop, the reader enters
+ * an error state.
  * 
- * pw is the JPEG writer object.  sph_jpeg_writer_put() must be called
- * once for each scanline row in the image, in top-down order.  If the
- * sph_jpeg_writer_free() function is called before all rows have been
- * written, the JPEG file will be incomplete and invalid.  If more than
- * (height) scanlines are written to a JPEG writer object, a fault
- * occurs.
+ * Parameters:
  * 
- * pscan points to the scanline data to write.  Each pixel either has
- * one byte indicating a grayscale value (zero is black and 255 is
- * white), or three bytes in Red, Green, Blue order, depending on the
- * chcount parameter that was used to initialize the writer object.  The
- * pixels must be ordered from left to right.  The total number of
- * pixels in a scanline is given by the (width) parameter passed to the
- * initialization routine.
+ *   pr - the JPEG reader object
  * 
- * Errors cause faults.  Errors originating within libjpeg may print an
- * error message to stderr.
+ *   x - the left of the rectangle
  * 
- * Parameters:
+ *   y - the top of the rectangle
  * 
- *   pw - the JPEG writer object
+ *   w - the width of the rectangle
  * 
- *   pscan - the scanline data to write
+ *   h - the height of the rectangle
  */
-void sph_jpeg_writer_put(SPH_JPEG_WRITER *pw, uint8_t *pscan);
+void sph_jpeg_reader_set_crop(
+    SPH_JPEG_READER * pr,
+    int32_t           x,
+    int32_t           y,
+    int32_t           w,
+    int32_t           h);
 
 /*
- * Allocate a new JPEG reader object.
- * 
- * The returned object must eventually be freed by calling the function
- * sph_jpeg_reader_free().
- * 
- * pIn is the file to read the JPEG data from.  This file must be open
- * for binary reading or undefined behavior occurs.  The JPEG file will
- * be read sequentially starting at the current file pointer.  Undefined
- * behavior occurs if the file pointer is modified externally while the
- * JPEG reader object is still allocated.
+ * Change the decoder options of a JPEG reader object.
  * 
- * Although the client must not touch the file handle while the reader
- * object is allocated, the client still remains the owner of the file
- * handle.  sph_jpeg_reader_free() does NOT close the file handle.
+ * The new options take effect for the next image, when the reader is
+ * reset with one of the reset functions.  If the reader has only read
+ * the header, they also take effect when sph_jpeg_reader_scale() is
+ * called.  Decompression that has already started is not affected.
  * 
- * If there is any problem reading the file, if the color format is not
- * supported, or if the image dimensions exceed the SPH_JPEG_MAXDIM
- * limit, then a new reader object is returned with an error status set
- * (see sph_jpeg_reader_status()).
+ * The options are copied into the reader.  If pOpts is NULL, the
+ * defaults are restored.  If any option is out of range, a fault
+ * occurs.
  * 
  * Parameters:
  * 
- *   pIn - the file handle to read the JPEG file from
- * 
- * Return:
+ *   pr - the JPEG reader object
  * 
- *   a new JPEG reader object
+ *   pOpts - the decoder options, or NULL
  */
-SPH_JPEG_READER *sph_jpeg_reader_new(FILE *pIn);
+void sph_jpeg_reader_set_opts(
+          SPH_JPEG_READER      * pr,
+    const SPH_JPEG_READER_OPTS * pOpts);
 
 /*
  * Free an allocated JPEG reader object.
@@ -338,6 +1946,28 @@ int32_t sph_jpeg_reader_height(SPH_JPEG_READER *pr);
  */
 int sph_jpeg_reader_channels(SPH_JPEG_READER *pr);
 
+/*
+ * Get the color space of the scanlines read from a JPEG reader object.
+ * 
+ * This is SPH_JPEG_COLOR_YCC if the reader has three channels and the
+ * color option of its decoder options is SPH_JPEG_COLOR_YCC and the
+ * file is stored as YCbCr.  Otherwise, it is SPH_JPEG_COLOR_RGB,
+ * including for single-channel images and readers in an error state.
+ * 
+ * If the reader has only read the header, this is the color space that
+ * will be used if the decoder options are not changed before
+ * sph_jpeg_reader_scale() is called.
+ * 
+ * Parameters:
+ * 
+ *   pr - the JPEG reader object
+ * 
+ * Return:
+ * 
+ *   the color space of the scanlines
+ */
+int sph_jpeg_reader_color(SPH_JPEG_READER *pr);
+
 /*
  * Read a scanline from the JPEG file.
  * 
@@ -358,6 +1988,10 @@ int sph_jpeg_reader_channels(SPH_JPEG_READER *pr);
  * be cleared to zero values.  sph_jpeg_reader_status() can be used to
  * check the error status code.
  * 
+ * For feed readers, this function may only be called once the end of
+ * the file has been signalled with sph_jpeg_reader_feed_end().
+ * Otherwise, a fault occurs.
+ * 
  * Parameters:
  * 
  *   pr - the JPEG reader object
@@ -370,4 +2004,155 @@ int sph_jpeg_reader_channels(SPH_JPEG_READER *pr);
  */
 int sph_jpeg_reader_get(SPH_JPEG_READER *pr, uint8_t *pscan);
 
+/*
+ * Read several scanlines from the JPEG file in one call.
+ * 
+ * This has the same effect as calling sph_jpeg_reader_get() once for
+ * each row, but the rows are requested from libjpeg in batches, and
+ * the error handler and argument checks are only set up once per call.
+ * 
+ * buf points to the buffer that receives the first row.  Each row has
+ * the same format as for sph_jpeg_reader_get().  stride is the distance
+ * in bytes from the start of one row to the start of the next.  It must
+ * be at least (width * channels) or a fault occurs.  Row padding beyond
+ * that is left unmodified.
+ * 
+ * max_rows is the maximum number of rows to read, which must be at
+ * least one.  Fewer rows are read if fewer remain in the image.  A
+ * fault occurs if all rows have already been read.
+ * 
+ * The function fails immediately if there is already an error status
+ * present in the reader object.  If the function fails, all the rows
+ * that would have been read are cleared to zero values, and they still
+ * count against the total number of rows in the image.
+ * sph_jpeg_reader_status() can be used to check the error status code.
+ * 
+ * Parameters:
+ * 
+ *   pr - the JPEG reader object
+ * 
+ *   buf - pointer to the buffer for the first row
+ * 
+ *   stride - the distance in bytes between rows
+ * 
+ *   max_rows - the maximum number of rows to read
+ * 
+ * Return:
+ * 
+ *   the number of rows read if successful, zero if error
+ */
+int32_t sph_jpeg_reader_get_rows(
+    SPH_JPEG_READER * pr,
+    uint8_t         * buf,
+    size_t            stride,
+    int32_t           max_rows);
+
+/*
+ * Read the scanlines that can be decoded from the data fed to a feed
+ * reader so far, without waiting for more data.
+ * 
+ * pr must be a feed reader, see sph_jpeg_reader_new_feed().  buf,
+ * stride, and max_rows are as for sph_jpeg_reader_get_rows().  Up to
+ * max_rows rows are decoded into buf, stopping early when libjpeg runs
+ * out of data.  The rows returned count towards the height of the
+ * image, and the next call continues with the row after them.  Rows of
+ * buf beyond the rows returned may have been modified.
+ * 
+ * If decompression has not started yet, or the reader is in an error
+ * state, no rows are returned.  Otherwise, a fault occurs if all rows
+ * have already been read.  Once the last row has been returned,
+ * decompression is finished, and data after the end of the image is
+ * ignored.
+ * 
+ * When zero rows are returned and sph_jpeg_reader_status() reports no
+ * error, more data must be fed before more rows can be decoded.
+ * 
+ * Parameters:
+ * 
+ *   pr - the JPEG reader object
+ * 
+ *   buf - pointer to the buffer for the first row
+ * 
+ *   stride - the distance in bytes between rows
+ * 
+ *   max_rows - the maximum number of rows to read
+ * 
+ * Return:
+ * 
+ *   the number of rows read, which may be zero
+ */
+int32_t sph_jpeg_reader_poll_rows(
+    SPH_JPEG_READER * pr,
+    uint8_t         * buf,
+    size_t            stride,
+    int32_t           max_rows);
+
+/*
+ * Decode the rest of the image into a buffer provided by the caller.
+ * 
+ * All scanlines that have not been read yet are decoded, the first of
+ * them into the row at base, and each following one stride bytes after
+ * the previous one.  The buffer must have room for that many rows.
+ * Usually, this is called before any scanlines have been read, so the
+ * buffer receives the whole image.
+ * 
+ * layout is one of the SPH_JPEG_LAYOUT constants.  In the packed
+ * layout, rows have the same format as for sph_jpeg_reader_get(), and
+ * libjpeg decodes them straight into the buffer.  In the RGBX and BGRX
+ * layouts, each pixel is four bytes: the three channels in order or in
+ * reverse order, followed by a padding byte of 255.  Grayscale images
+ * repeat the gray value in all three channels.  The channels are in
+ * the color space reported by sph_jpeg_reader_color().  Rows are
+ * decoded into the buffer and then expanded in place, so no other
+ * buffer is involved.
+ * 
+ * stride must be at least the row size of the layout, see
+ * sph_jpeg_stride().  Row padding beyond that is left unmodified.  If
+ * no scanlines remain, the layout is invalid, or the stride is too
+ * small, a fault occurs.  For feed readers, the same restriction as
+ * for sph_jpeg_reader_get() applies.
+ * 
+ * Errors are handled in the same way as for sph_jpeg_reader_get_rows():
+ * once the reader is in an error state, the remaining rows are cleared
+ * to zero, including their padding bytes.
+ * 
+ * Parameters:
+ * 
+ *   pr - the JPEG reader object
+ * 
+ *   base - pointer to the buffer for the first row
+ * 
+ *   stride - the distance in bytes between rows
+ * 
+ *   layout - the pixel layout
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int sph_jpeg_reader_decode_into(
+    SPH_JPEG_READER * pr,
+    uint8_t         * base,
+    size_t            stride,
+    int               layout);
+
+/*
+ * Get the instrumentation counters of a JPEG reader object.
+ * 
+ * This is the reader equivalent of sph_jpeg_writer_stats().  Counters
+ * keep accumulating when the reader is in an error state, so the time
+ * spent on images that fail to decode is also counted.
+ * 
+ * Parameters:
+ * 
+ *   pr - the JPEG reader object
+ * 
+ *   pStats - receives the counters
+ * 
+ * Return:
+ * 
+ *   non-zero if instrumentation is compiled in, zero if not
+ */
+int sph_jpeg_reader_stats(SPH_JPEG_READER *pr, SPH_JPEG_STATS *pStats);
+
 #endif
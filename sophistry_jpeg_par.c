@@ -0,0 +1,2134 @@
+/*
+ * sophistry_jpeg_par.c
+ * ====================
+ * 
+ * Implementation of sophistry_jpeg_par.h
+ * 
+ * See the header for further information.
+ */
+#include "sophistry_jpeg_par.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Constants
+ * =========
+ */
+
+/*
+ * Band status value meaning that the band has not been decoded yet.
+ * Decoded bands have a sophistry_jpeg status code instead.
+ */
+#define SPH_JPEG_PAR_PENDING (-1)
+
+/*
+ * The number of bands aimed for per worker thread, so that threads
+ * that finish early have more bands to take.
+ */
+#define SPH_JPEG_PAR_BANDSPER (4)
+
+/*
+ * Stripe states of a parallel writer.
+ * 
+ * A stripe is FILLING while the client writes its scanlines into its
+ * slot, READY once all of its scanlines are there, and DONE once a
+ * worker has encoded it.
+ */
+#define SPH_JPEG_PAR_FILLING (0)
+#define SPH_JPEG_PAR_READY   (1)
+#define SPH_JPEG_PAR_DONE    (2)
+
+/*
+ * Type declarations
+ * =================
+ */
+
+/*
+ * The private state of a worker thread.
+ */
+typedef struct {
+  
+  /*
+   * The parallel decoder this worker belongs to.
+   */
+  SPH_JPEG_PAR *pp;
+  
+  /*
+   * The reader used for every band this worker decodes, or NULL before
+   * the first band.
+   */
+  SPH_JPEG_READER *pr;
+  
+  /*
+   * The buffer holding the synthetic JPEG file of the current band, and
+   * its capacity in bytes.
+   */
+  uint8_t *pSynth;
+  size_t synth_cap;
+  
+} SPH_JPEG_PAR_WORKER;
+
+/*
+ * SPH_JPEG_PAR structure definition.
+ */
+struct SPH_JPEG_PAR_TAG {
+  
+  /*
+   * The JPEG file data owned by the client, and the decoder options.
+   */
+  const uint8_t *pData;
+  size_t len;
+  SPH_JPEG_READER_OPTS opts;
+  
+  /*
+   * The reader used when the image is decoded sequentially, or NULL if
+   * the image is decoded in bands.
+   */
+  SPH_JPEG_READER *pSeq;
+  
+  /*
+   * The image information, the current status, and the number of
+   * scanlines the client has read.
+   */
+  int32_t width;
+  int32_t height;
+  int chcount;
+  int color;
+  int status;
+  int32_t readcount;
+  
+  /*
+   * The layout of the file.
+   * 
+   * sof_y is the offset of the image height in the SOF marker, and
+   * sos_end is the offset just after the SOS marker, where the entropy
+   * coded data starts.  data_end is the offset of the EOI marker.
+   * pSegOff has the offset of the start of each of the seg_count
+   * restart segments.
+   */
+  size_t sof_y;
+  size_t sos_end;
+  size_t data_end;
+  size_t *pSegOff;
+  int32_t seg_count;
+  
+  /*
+   * The MCU geometry.
+   * 
+   * mcu_h is the MCU height in scanlines, mcu_wide is the number of
+   * MCUs per MCU row, and mcu_rows is the number of MCU rows.  ri is
+   * the restart interval in MCUs.  step is the number of MCU rows
+   * between restart boundaries that fall at the start of an MCU row.
+   */
+  int32_t mcu_h;
+  int32_t mcu_wide;
+  int32_t mcu_rows;
+  int32_t ri;
+  int32_t step;
+  
+  /*
+   * The bands.
+   * 
+   * Each band except possibly the last has band_mcu MCU rows.  The
+   * decoded scanlines of band k are stored in slot k modulo window,
+   * where each slot has room for a full band of row_size byte rows.
+   * pBandStatus has the status of each band.
+   */
+  int32_t band_mcu;
+  int32_t band_count;
+  int32_t window;
+  size_t row_size;
+  uint8_t **ppSlot;
+  int *pBandStatus;
+  
+  /*
+   * Lock protecting the band indices and statuses and the cancel flag,
+   * with a condition that is signalled whenever any of them changes.
+   * 
+   * next_band is the next band a worker will decode.  cur_band is the
+   * band the client is reading from, and cur_row is the number of its
+   * rows already read.
+   */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int32_t next_band;
+  int32_t cur_band;
+  int32_t cur_row;
+  int cancel;
+  
+  /*
+   * The worker threads.
+   */
+  int thread_count;
+  pthread_t *pThreads;
+  SPH_JPEG_PAR_WORKER *pWorkers;
+};
+
+/*
+ * The private state of an encoding worker thread.
+ */
+typedef struct {
+  
+  /*
+   * The parallel writer this worker belongs to.
+   */
+  SPH_JPEG_PAR_WRITER *pw;
+  
+  /*
+   * The writer used for every stripe this worker encodes, or NULL
+   * before the first stripe.
+   */
+  SPH_JPEG_WRITER *pEnc;
+  
+} SPH_JPEG_PAR_ENCODER;
+
+/*
+ * A slot of a parallel writer, holding one stripe at a time.
+ */
+typedef struct {
+  
+  /*
+   * The scanlines of the stripe.
+   */
+  uint8_t *pRows;
+  
+  /*
+   * The encoded stripe.
+   * 
+   * The part of the encoded data that goes into the output file is from
+   * out_start up to out_end.  This is everything but the EOI marker for
+   * the first stripe, and only the entropy coded data for the others.
+   */
+  SPH_JPEG_MEMBUF enc;
+  size_t out_start;
+  size_t out_end;
+  
+} SPH_JPEG_PAR_SLOT;
+
+/*
+ * SPH_JPEG_PAR_WRITER structure definition.
+ */
+struct SPH_JPEG_PAR_WRITER_TAG {
+  
+  /*
+   * The output, which is either a file handle or a sink callback.
+   */
+  FILE *pOut;
+  SPH_JPEG_SINK fSink;
+  void *pSinkCustom;
+  
+  /*
+   * The writer used when the image is encoded sequentially, or NULL if
+   * the image is encoded in stripes.
+   */
+  SPH_JPEG_WRITER *pSeq;
+  
+  /*
+   * The image information, the encoder options used for each stripe,
+   * and the number of scanlines the client has written.
+   */
+  int32_t width;
+  int32_t height;
+  int chcount;
+  int quality;
+  SPH_JPEG_WRITER_OPTS opts;
+  int32_t writecount;
+  
+  /*
+   * The MCU geometry.
+   * 
+   * mcu_h is the MCU height in scanlines, mcu_wide is the number of
+   * MCUs per MCU row, and mcu_rows is the number of MCU rows.  ri is
+   * the restart interval in MCU rows.
+   */
+  int32_t mcu_h;
+  int32_t mcu_wide;
+  int32_t mcu_rows;
+  int32_t ri;
+  
+  /*
+   * The stripes.
+   * 
+   * Each stripe except possibly the last has stripe_mcu MCU rows, which
+   * is a multiple of the restart interval.  Stripe k is held in slot k
+   * modulo window.  pStripeState has the state of each stripe.
+   * flushed is the number of stripes written to the output.
+   */
+  int32_t stripe_mcu;
+  int32_t stripe_count;
+  int32_t window;
+  size_t row_size;
+  SPH_JPEG_PAR_SLOT *pSlots;
+  int *pStripeState;
+  int32_t flushed;
+  
+  /*
+   * Lock protecting the stripe states and indices, the status, and the
+   * cancel flag, with a condition that is signalled whenever any of
+   * them changes.
+   * 
+   * next_stripe is the next stripe a worker will encode.  status is
+   * the first error encountered by any thread, or SPH_JPEG_ERR_OK.
+   * Once it is set, no more stripes are encoded or written out.
+   */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int32_t next_stripe;
+  int status;
+  int cancel;
+  
+  /*
+   * The worker threads.
+   */
+  int thread_count;
+  pthread_t *pThreads;
+  SPH_JPEG_PAR_ENCODER *pEncoders;
+};
+
+/*
+ * Local functions
+ * ===============
+ */
+
+/* Prototypes */
+static int32_t sph_jpeg_par_get16(const uint8_t *p);
+static int32_t sph_jpeg_par_gcd(int32_t a, int32_t b);
+static int sph_jpeg_par_parse(SPH_JPEG_PAR *pp);
+static int32_t sph_jpeg_par_seg(SPH_JPEG_PAR *pp, int32_t r);
+static int32_t sph_jpeg_par_band_rows(SPH_JPEG_PAR *pp, int32_t k);
+static int sph_jpeg_par_decode(SPH_JPEG_PAR_WORKER *pw, int32_t k);
+static void *sph_jpeg_par_worker(void *pParam);
+static void sph_jpeg_par_lock(SPH_JPEG_PAR *pp);
+static void sph_jpeg_par_unlock(SPH_JPEG_PAR *pp);
+static int32_t sph_jpeg_par_stripe_rows(
+    SPH_JPEG_PAR_WRITER * pw,
+    int32_t               k);
+static int sph_jpeg_par_encode(SPH_JPEG_PAR_ENCODER *pe, int32_t k);
+static void *sph_jpeg_par_encoder(void *pParam);
+static void sph_jpeg_par_wlock(SPH_JPEG_PAR_WRITER *pw);
+static void sph_jpeg_par_wunlock(SPH_JPEG_PAR_WRITER *pw);
+static void sph_jpeg_par_wfail(SPH_JPEG_PAR_WRITER *pw, int status);
+static int sph_jpeg_par_wstatus(SPH_JPEG_PAR_WRITER *pw);
+static void sph_jpeg_par_emit(
+          SPH_JPEG_PAR_WRITER * pw,
+    const uint8_t             * pData,
+          size_t                len);
+static void sph_jpeg_par_flush(SPH_JPEG_PAR_WRITER *pw);
+static SPH_JPEG_PAR_WRITER *sph_jpeg_par_writer_alloc(
+          FILE                 * pOut,
+          SPH_JPEG_SINK          fSink,
+          void                 * pCustom,
+          int32_t                width,
+          int32_t                height,
+          int                    chcount,
+          int                    quality,
+    const SPH_JPEG_WRITER_OPTS * pOpts,
+          int                    threads);
+
+/*
+ * Read a big-endian 16-bit value.
+ * 
+ * Parameters:
+ * 
+ *   p - pointer to the two bytes
+ * 
+ * Return:
+ * 
+ *   the value
+ */
+static int32_t sph_jpeg_par_get16(const uint8_t *p) {
+  return (((int32_t) p[0]) << 8) | ((int32_t) p[1]);
+}
+
+/*
+ * Compute the greatest common divisor of two positive integers.
+ * 
+ * Parameters:
+ * 
+ *   a - the first integer
+ * 
+ *   b - the second integer
+ * 
+ * Return:
+ * 
+ *   the greatest common divisor
+ */
+static int32_t sph_jpeg_par_gcd(int32_t a, int32_t b) {
+  
+  int32_t t = 0;
+  
+  while (b != 0) {
+    t = a % b;
+    a = b;
+    b = t;
+  }
+  
+  return a;
+}
+
+/*
+ * Parse the layout of the JPEG file.
+ * 
+ * The markers up to the first SOS marker are read to get the frame
+ * header and the restart interval, and the entropy coded data is then
+ * scanned for restart markers.  The layout fields of pp are filled in.
+ * 
+ * If the file is not a single-scan sequential Huffman-coded image with
+ * a restart interval, or the restart markers found don't match the
+ * number of segments the image should have, the file can't be split
+ * and zero is returned.  The file may still be valid in that case,
+ * since it is then decoded normally.
+ * 
+ * Parameters:
+ * 
+ *   pp - the parallel decoder
+ * 
+ * Return:
+ * 
+ *   non-zero if the file can be split, zero if not
+ */
+static int sph_jpeg_par_parse(SPH_JPEG_PAR *pp) {
+  
+  const uint8_t *d = NULL;
+  size_t n = 0;
+  size_t pos = 0;
+  size_t seglen = 0;
+  size_t body = 0;
+  int m = 0;
+  int b = 0;
+  int found_sof = 0;
+  int found_eoi = 0;
+  int nf = 0;
+  int ns = 0;
+  int hmax = 1;
+  int vmax = 1;
+  int h = 0;
+  int v = 0;
+  int i = 0;
+  int32_t width = 0;
+  int32_t height = 0;
+  int32_t mcu_w = 0;
+  int32_t k = 0;
+  int64_t total = 0;
+  
+  /* Check parameter */
+  if (pp == NULL) {
+    abort();
+  }
+  d = pp->pData;
+  n = pp->len;
+  
+  /* Check for the SOI marker */
+  if (n < 4) {
+    return 0;
+  }
+  if ((d[0] != 0xff) || (d[1] != 0xd8)) {
+    return 0;
+  }
+  
+  /* Go through the marker segments up to the first SOS marker */
+  for(pos = 2; ; pos += seglen) {
+    
+    /* Read the marker code, skipping any fill bytes */
+    if ((pos >= n) || (d[pos] != 0xff)) {
+      return 0;
+    }
+    while ((pos < n) && (d[pos] == 0xff)) {
+      pos++;
+    }
+    if (pos >= n) {
+      return 0;
+    }
+    m = (int) d[pos];
+    pos++;
+    
+    /* Standalone markers are not expected before the first scan */
+    if ((m == 0x01) || ((m >= 0xd0) && (m <= 0xd9))) {
+      return 0;
+    }
+    
+    /* Get the marker segment length and body */
+    if (n - pos < 2) {
+      return 0;
+    }
+    seglen = (size_t) sph_jpeg_par_get16(d + pos);
+    if ((seglen < 2) || (seglen > n - pos)) {
+      return 0;
+    }
+    body = pos + 2;
+    
+    if ((m == 0xc0) || (m == 0xc1)) {
+      /* Sequential Huffman-coded frame, so read frame header */
+      if ((seglen < 8) || (d[body] != 8)) {
+        return 0;
+      }
+      pp->sof_y = body + 1;
+      height = sph_jpeg_par_get16(d + body + 1);
+      width = sph_jpeg_par_get16(d + body + 3);
+      nf = (int) d[body + 5];
+      if ((nf < 1) || (nf > 4) || (seglen < 8 + 3 * ((size_t) nf))) {
+        return 0;
+      }
+      for(i = 0; i < nf; i++) {
+        h = ((int) d[body + 7 + 3 * i]) >> 4;
+        v = ((int) d[body + 7 + 3 * i]) & 0xf;
+        if ((h < 1) || (h > 4) || (v < 1) || (v > 4)) {
+          return 0;
+        }
+        if (h > hmax) {
+          hmax = h;
+        }
+        if (v > vmax) {
+          vmax = v;
+        }
+      }
+      found_sof = 1;
+      
+    } else if ((m >= 0xc2) && (m <= 0xcf) &&
+                (m != 0xc4) && (m != 0xc8) && (m != 0xcc)) {
+      /* Progressive, lossless, hierarchical, or arithmetic-coded
+       * frames can't be split */
+      return 0;
+      
+    } else if (m == 0xdd) {
+      /* Restart interval definition */
+      if (seglen < 4) {
+        return 0;
+      }
+      pp->ri = sph_jpeg_par_get16(d + body);
+      
+    } else if (m == 0xda) {
+      /* Start of scan, which ends the header */
+      if ((!found_sof) || (seglen < 3)) {
+        return 0;
+      }
+      ns = (int) d[body];
+      pp->sos_end = pos + seglen;
+      break;
+    }
+  }
+  
+  /* Check the frame, which must have a restart interval and agree with
+   * the reader; images with a DNL marker have a zero height here */
+  if ((width < 1) || (height < 1) || (pp->ri < 1)) {
+    return 0;
+  }
+  if ((width != pp->width) || (height != pp->height)) {
+    return 0;
+  }
+  
+  /* Determine the MCU geometry, which is a single block for scans with
+   * only one component */
+  if ((nf > 1) && (ns == nf)) {
+    mcu_w = 8 * hmax;
+    pp->mcu_h = 8 * vmax;
+  } else if ((nf == 1) && (ns == 1)) {
+    mcu_w = 8;
+    pp->mcu_h = 8;
+  } else {
+    return 0;
+  }
+  pp->mcu_wide = (width + mcu_w - 1) / mcu_w;
+  pp->mcu_rows = (height + pp->mcu_h - 1) / pp->mcu_h;
+  
+  /* Compute the number of restart segments */
+  total = ((int64_t) pp->mcu_wide) * ((int64_t) pp->mcu_rows);
+  pp->seg_count = (int32_t) ((total + pp->ri - 1) / pp->ri);
+  
+  /* Record the start of each segment, checking the restart marker
+   * numbers along the way */
+  pp->pSegOff = (size_t *) calloc(
+                  (size_t) pp->seg_count, sizeof(size_t));
+  if (pp->pSegOff == NULL) {
+    abort();
+  }
+  (pp->pSegOff)[0] = pp->sos_end;
+  k = 1;
+  
+  pos = pp->sos_end;
+  while (n - pos >= 2) {
+    
+    /* Skip ordinary bytes */
+    if (d[pos] != 0xff) {
+      pos++;
+      continue;
+    }
+    
+    /* Skip stuffed zero bytes and fill bytes */
+    b = (int) d[pos + 1];
+    if (b == 0) {
+      pos += 2;
+      continue;
+    } else if (b == 0xff) {
+      pos++;
+      continue;
+    }
+    
+    /* Record restart markers, which must be in sequence */
+    if ((b >= 0xd0) && (b <= 0xd7)) {
+      if ((k >= pp->seg_count) || (b != 0xd0 + ((k - 1) & 0x7))) {
+        return 0;
+      }
+      (pp->pSegOff)[k] = pos + 2;
+      k++;
+      pos += 2;
+      continue;
+    }
+    
+    /* Any other marker ends the scan, which must be the only scan */
+    if (b == 0xd9) {
+      found_eoi = 1;
+    }
+    break;
+  }
+  if ((!found_eoi) || (k != pp->seg_count)) {
+    return 0;
+  }
+  pp->data_end = pos;
+  
+  /* Restart boundaries fall at the start of an MCU row every step MCU
+   * rows */
+  pp->step = pp->ri / sph_jpeg_par_gcd(pp->ri, pp->mcu_wide);
+  
+  return 1;
+}
+
+/*
+ * Return the index of the restart segment that starts at a given MCU
+ * row, which must be a restart boundary.
+ * 
+ * Parameters:
+ * 
+ *   pp - the parallel decoder
+ * 
+ *   r - the MCU row
+ * 
+ * Return:
+ * 
+ *   the segment index
+ */
+static int32_t sph_jpeg_par_seg(SPH_JPEG_PAR *pp, int32_t r) {
+  return (int32_t) ((((int64_t) r) * ((int64_t) pp->mcu_wide)) /
+                      pp->ri);
+}
+
+/*
+ * Return the number of scanlines in a band.
+ * 
+ * Parameters:
+ * 
+ *   pp - the parallel decoder
+ * 
+ *   k - the band index
+ * 
+ * Return:
+ * 
+ *   the number of scanlines
+ */
+static int32_t sph_jpeg_par_band_rows(SPH_JPEG_PAR *pp, int32_t k) {
+  
+  int32_t r0 = 0;
+  int32_t r1 = 0;
+  
+  r0 = k * pp->band_mcu;
+  r1 = r0 + pp->band_mcu;
+  if (r1 >= pp->mcu_rows) {
+    return pp->height - (r0 * pp->mcu_h);
+  }
+  return (r1 - r0) * pp->mcu_h;
+}
+
+/*
+ * Decode one band into its slot.
+ * 
+ * The band is decoded from a synthetic JPEG file holding the segments
+ * from one restart boundary above the band to one restart boundary
+ * below it, and the overlap is cropped off.  This is called on a
+ * worker thread without holding the lock.
+ * 
+ * Parameters:
+ * 
+ *   pw - the worker state
+ * 
+ *   k - the band index
+ * 
+ * Return:
+ * 
+ *   the status of the band
+ */
+static int sph_jpeg_par_decode(SPH_JPEG_PAR_WORKER *pw, int32_t k) {
+  
+  SPH_JPEG_PAR *pp = NULL;
+  int status = SPH_JPEG_ERR_OK;
+  int32_t r0 = 0;
+  int32_t r1 = 0;
+  int32_t d0 = 0;
+  int32_t d1 = 0;
+  int32_t s0 = 0;
+  int32_t s1 = 0;
+  int32_t img_h = 0;
+  int32_t out_top = 0;
+  int32_t out_rows = 0;
+  int32_t done = 0;
+  int32_t got = 0;
+  int32_t i = 0;
+  size_t dstart = 0;
+  size_t dend = 0;
+  size_t need = 0;
+  uint8_t *pSlot = NULL;
+  
+  /* Check parameters */
+  if (pw == NULL) {
+    abort();
+  }
+  pp = pw->pp;
+  if ((k < 0) || (k >= pp->band_count)) {
+    abort();
+  }
+  pSlot = (pp->ppSlot)[k % pp->window];
+  
+  /* Get the MCU rows of the band, and the MCU rows to decode with one
+   * restart boundary of overlap on each side */
+  r0 = k * pp->band_mcu;
+  r1 = r0 + pp->band_mcu;
+  if (r1 > pp->mcu_rows) {
+    r1 = pp->mcu_rows;
+  }
+  d0 = 0;
+  if (r0 > 0) {
+    d0 = r0 - pp->step;
+  }
+  d1 = pp->mcu_rows;
+  if (r1 < pp->mcu_rows) {
+    d1 = r1 + pp->step;
+    if (d1 > pp->mcu_rows) {
+      d1 = pp->mcu_rows;
+    }
+  }
+  
+  /* Get the segments and the entropy coded data to decode */
+  s0 = sph_jpeg_par_seg(pp, d0);
+  dstart = (pp->pSegOff)[s0];
+  if (d1 < pp->mcu_rows) {
+    s1 = sph_jpeg_par_seg(pp, d1);
+    dend = (pp->pSegOff)[s1] - 2;
+  } else {
+    s1 = pp->seg_count;
+    dend = pp->data_end;
+  }
+  
+  /* Get the height of the synthetic image and the scanlines of the band
+   * within it */
+  if (d1 < pp->mcu_rows) {
+    img_h = (d1 - d0) * pp->mcu_h;
+  } else {
+    img_h = pp->height - (d0 * pp->mcu_h);
+  }
+  out_top = (r0 - d0) * pp->mcu_h;
+  out_rows = sph_jpeg_par_band_rows(pp, k);
+  
+  /* Build the synthetic JPEG file from the headers with the height
+   * changed, the segments with their restart markers renumbered, and
+   * an EOI marker */
+  need = pp->sos_end + (dend - dstart) + 2;
+  if ((pw->pSynth == NULL) || (pw->synth_cap < need)) {
+    free(pw->pSynth);
+    pw->pSynth = (uint8_t *) malloc(need);
+    if (pw->pSynth == NULL) {
+      abort();
+    }
+    pw->synth_cap = need;
+  }
+  memcpy(pw->pSynth, pp->pData, pp->sos_end);
+  (pw->pSynth)[pp->sof_y] = (uint8_t) (img_h >> 8);
+  (pw->pSynth)[pp->sof_y + 1] = (uint8_t) (img_h & 0xff);
+  memcpy(pw->pSynth + pp->sos_end, pp->pData + dstart, dend - dstart);
+  for(i = s0 + 1; i < s1; i++) {
+    (pw->pSynth)[pp->sos_end + ((pp->pSegOff)[i] - 1 - dstart)] =
+      (uint8_t) (0xd0 + ((i - s0 - 1) & 0x7));
+  }
+  (pw->pSynth)[need - 2] = (uint8_t) 0xff;
+  (pw->pSynth)[need - 1] = (uint8_t) 0xd9;
+  
+  /* Open the synthetic file, reusing the reader of the worker */
+  if (pw->pr != NULL) {
+    sph_jpeg_reader_reset_mem(pw->pr, pw->pSynth, need);
+  } else {
+    pw->pr = sph_jpeg_reader_new_mem_ex(pw->pSynth, need, &(pp->opts));
+    if (pw->pr == NULL) {
+      abort();
+    }
+  }
+  status = sph_jpeg_reader_status(pw->pr);
+  
+  /* The synthetic image must decode to the expected geometry */
+  if (status == SPH_JPEG_ERR_OK) {
+    if ((sph_jpeg_reader_width(pw->pr) != pp->width) ||
+        (sph_jpeg_reader_height(pw->pr) != img_h) ||
+        (sph_jpeg_reader_channels(pw->pr) != pp->chcount)) {
+      status = SPH_JPEG_ERR_READ;
+    }
+  }
+  
+  /* Crop off the overlap and decode the band into its slot */
+  if (status == SPH_JPEG_ERR_OK) {
+    if ((out_top > 0) || (out_rows < img_h)) {
+      sph_jpeg_reader_set_crop(pw->pr, 0, out_top, pp->width, out_rows);
+    }
+    for(done = 0; done < out_rows; done += got) {
+      got = sph_jpeg_reader_get_rows(
+              pw->pr,
+              pSlot + (((size_t) done) * pp->row_size),
+              pp->row_size,
+              out_rows - done);
+      if (got < 1) {
+        break;
+      }
+    }
+    status = sph_jpeg_reader_status(pw->pr);
+  }
+  
+  return status;
+}
+
+/*
+ * Worker thread procedure.
+ * 
+ * pParam points to the SPH_JPEG_PAR_WORKER state.  The worker keeps
+ * taking the next band and decoding it, waiting whenever the band
+ * would be more than the window ahead of the band the client is
+ * reading, until all bands are taken or the decoder is released.
+ * 
+ * Parameters:
+ * 
+ *   pParam - the worker state
+ * 
+ * Return:
+ * 
+ *   always NULL
+ */
+static void *sph_jpeg_par_worker(void *pParam) {
+  
+  SPH_JPEG_PAR_WORKER *pw = NULL;
+  SPH_JPEG_PAR *pp = NULL;
+  int32_t k = 0;
+  int status = 0;
+  
+  /* Get the worker state */
+  if (pParam == NULL) {
+    abort();
+  }
+  pw = (SPH_JPEG_PAR_WORKER *) pParam;
+  pp = pw->pp;
+  
+  for( ; ; ) {
+    
+    /* Wait for a band that fits in the window */
+    sph_jpeg_par_lock(pp);
+    while ((!(pp->cancel)) && (pp->next_band < pp->band_count) &&
+            (pp->next_band >= pp->cur_band + pp->window)) {
+      if (pthread_cond_wait(&(pp->cond), &(pp->lock))) {
+        abort();
+      }
+    }
+    if ((pp->cancel) || (pp->next_band >= pp->band_count)) {
+      sph_jpeg_par_unlock(pp);
+      break;
+    }
+    k = pp->next_band;
+    (pp->next_band)++;
+    sph_jpeg_par_unlock(pp);
+    
+    /* Decode the band without holding the lock */
+    status = sph_jpeg_par_decode(pw, k);
+    
+    /* Report the band */
+    sph_jpeg_par_lock(pp);
+    (pp->pBandStatus)[k] = status;
+    sph_jpeg_par_unlock(pp);
+  }
+  
+  return NULL;
+}
+
+/*
+ * Acquire the lock of a parallel decoder, faulting on failure.
+ * 
+ * Parameters:
+ * 
+ *   pp - the parallel decoder
+ */
+static void sph_jpeg_par_lock(SPH_JPEG_PAR *pp) {
+  if (pthread_mutex_lock(&(pp->lock))) {
+    abort();
+  }
+}
+
+/*
+ * Release the lock of a parallel decoder and wake any waiting thread,
+ * faulting on failure.
+ * 
+ * Parameters:
+ * 
+ *   pp - the parallel decoder
+ */
+static void sph_jpeg_par_unlock(SPH_JPEG_PAR *pp) {
+  if (pthread_cond_broadcast(&(pp->cond))) {
+    abort();
+  }
+  if (pthread_mutex_unlock(&(pp->lock))) {
+    abort();
+  }
+}
+
+/*
+ * Return the number of scanlines in a stripe.
+ * 
+ * Parameters:
+ * 
+ *   pw - the parallel writer
+ * 
+ *   k - the stripe index
+ * 
+ * Return:
+ * 
+ *   the number of scanlines
+ */
+static int32_t sph_jpeg_par_stripe_rows(
+    SPH_JPEG_PAR_WRITER * pw,
+    int32_t               k) {
+  
+  int32_t r0 = 0;
+  
+  r0 = k * pw->stripe_mcu;
+  if (r0 + pw->stripe_mcu >= pw->mcu_rows) {
+    return pw->height - (r0 * pw->mcu_h);
+  }
+  return pw->stripe_mcu * pw->mcu_h;
+}
+
+/*
+ * Encode one stripe from its slot.
+ * 
+ * The stripe is encoded as a separate JPEG image into the memory
+ * buffer of its slot.  The restart markers within it are then
+ * renumbered to their position in the whole image, and the part that
+ * goes into the output is recorded.  For the first stripe, the image
+ * height in the frame header is changed to the height of the whole
+ * image.  This is called on a worker thread without holding the lock.
+ * 
+ * Parameters:
+ * 
+ *   pe - the worker state
+ * 
+ *   k - the stripe index
+ * 
+ * Return:
+ * 
+ *   SPH_JPEG_ERR_OK if successful, or the status of the stripe writer
+ *   if it failed
+ */
+static int sph_jpeg_par_encode(SPH_JPEG_PAR_ENCODER *pe, int32_t k) {
+  
+  SPH_JPEG_PAR_WRITER *pw = NULL;
+  SPH_JPEG_PAR_SLOT *ps = NULL;
+  uint8_t *d = NULL;
+  size_t n = 0;
+  size_t pos = 0;
+  size_t sof_y = 0;
+  size_t seglen = 0;
+  size_t i = 0;
+  int32_t rows = 0;
+  int m = 0;
+  int shift = 0;
+  
+  /* Check parameters */
+  if (pe == NULL) {
+    abort();
+  }
+  pw = pe->pw;
+  if ((k < 0) || (k >= pw->stripe_count)) {
+    abort();
+  }
+  ps = &((pw->pSlots)[k % pw->window]);
+  rows = sph_jpeg_par_stripe_rows(pw, k);
+  
+  /* Encode the stripe, reusing the writer of the worker */
+  ps->enc.len = 0;
+  if (pe->pEnc != NULL) {
+    sph_jpeg_writer_reset_mem(
+      pe->pEnc, &(ps->enc), pw->width, rows, pw->chcount, pw->quality);
+  } else {
+    pe->pEnc = sph_jpeg_writer_new_mem_ex(
+                &(ps->enc), pw->width, rows, pw->chcount, pw->quality,
+                &(pw->opts));
+    if (pe->pEnc == NULL) {
+      abort();
+    }
+  }
+  sph_jpeg_writer_put_rows(pe->pEnc, ps->pRows, pw->row_size, rows);
+  if (sph_jpeg_writer_status(pe->pEnc) != SPH_JPEG_ERR_OK) {
+    return sph_jpeg_writer_status(pe->pEnc);
+  }
+  
+  d = ps->enc.pData;
+  n = ps->enc.len;
+  
+  /* Go through the marker segments up to the SOS marker, recording the
+   * offset of the image height; libjpeg writes no fill bytes */
+  if ((n < 4) || (d[0] != 0xff) || (d[1] != 0xd8)) {
+    abort();
+  }
+  for(pos = 2; ; pos += seglen) {
+    if ((n - pos < 4) || (d[pos] != 0xff)) {
+      abort();
+    }
+    m = (int) d[pos + 1];
+    pos += 2;
+    seglen = (size_t) sph_jpeg_par_get16(d + pos);
+    if ((seglen < 2) || (seglen > n - pos)) {
+      abort();
+    }
+    if (((m == 0xc0) || (m == 0xc1)) && (seglen >= 8)) {
+      sof_y = pos + 3;
+    } else if (m == 0xda) {
+      pos += seglen;
+      break;
+    }
+  }
+  if ((sof_y < 1) || (n - pos < 2) ||
+      (d[n - 2] != 0xff) || (d[n - 1] != 0xd9)) {
+    abort();
+  }
+  
+  /* Renumber the restart markers in the entropy coded data, where all
+   * other 0xff bytes are followed by stuffed zero bytes */
+  shift = (int) ((k * (pw->stripe_mcu / pw->ri)) & 0x7);
+  if (shift != 0) {
+    for(i = pos; i < n - 2; i++) {
+      if ((d[i] == 0xff) && (d[i + 1] >= 0xd0) && (d[i + 1] <= 0xd7)) {
+        d[i + 1] = (uint8_t) (0xd0 + ((d[i + 1] - 0xd0 + shift) & 0x7));
+        i++;
+      }
+    }
+  }
+  
+  /* Record the part for the output, and give the first stripe the
+   * height of the whole image */
+  if (k == 0) {
+    d[sof_y] = (uint8_t) (pw->height >> 8);
+    d[sof_y + 1] = (uint8_t) (pw->height & 0xff);
+    ps->out_start = 0;
+  } else {
+    ps->out_start = pos;
+  }
+  ps->out_end = n - 2;
+  
+  return SPH_JPEG_ERR_OK;
+  /* CAUTION: alternate return statement earlier! */
+}
+
+/*
+ * Encoding worker thread procedure.
+ * 
+ * pParam points to the SPH_JPEG_PAR_ENCODER state.  The worker keeps
+ * taking the next stripe once the client has filled it and encoding
+ * it, until all stripes are taken or the writer is released.  Once the
+ * writer has an error status, stripes are only marked as done without
+ * being encoded.
+ * 
+ * Parameters:
+ * 
+ *   pParam - the worker state
+ * 
+ * Return:
+ * 
+ *   always NULL
+ */
+static void *sph_jpeg_par_encoder(void *pParam) {
+  
+  SPH_JPEG_PAR_ENCODER *pe = NULL;
+  SPH_JPEG_PAR_WRITER *pw = NULL;
+  int32_t k = 0;
+  int status = 0;
+  
+  /* Get the worker state */
+  if (pParam == NULL) {
+    abort();
+  }
+  pe = (SPH_JPEG_PAR_ENCODER *) pParam;
+  pw = pe->pw;
+  
+  for( ; ; ) {
+    
+    /* Wait for the next stripe to be filled */
+    sph_jpeg_par_wlock(pw);
+    while ((!(pw->cancel)) && (pw->next_stripe < pw->stripe_count) &&
+        ((pw->pStripeState)[pw->next_stripe] != SPH_JPEG_PAR_READY)) {
+      if (pthread_cond_wait(&(pw->cond), &(pw->lock))) {
+        abort();
+      }
+    }
+    if ((pw->cancel) || (pw->next_stripe >= pw->stripe_count)) {
+      sph_jpeg_par_wunlock(pw);
+      break;
+    }
+    k = pw->next_stripe;
+    (pw->next_stripe)++;
+    status = pw->status;
+    sph_jpeg_par_wunlock(pw);
+    
+    /* Encode the stripe without holding the lock, unless the writer
+     * has already failed */
+    if (status == SPH_JPEG_ERR_OK) {
+      status = sph_jpeg_par_encode(pe, k);
+    }
+    
+    /* Report the stripe, and record the first error */
+    sph_jpeg_par_wlock(pw);
+    if ((status != SPH_JPEG_ERR_OK) &&
+        (pw->status == SPH_JPEG_ERR_OK)) {
+      pw->status = status;
+    }
+    (pw->pStripeState)[k] = SPH_JPEG_PAR_DONE;
+    sph_jpeg_par_wunlock(pw);
+  }
+  
+  return NULL;
+}
+
+/*
+ * Acquire the lock of a parallel writer, faulting on failure.
+ * 
+ * Parameters:
+ * 
+ *   pw - the parallel writer
+ */
+static void sph_jpeg_par_wlock(SPH_JPEG_PAR_WRITER *pw) {
+  if (pthread_mutex_lock(&(pw->lock))) {
+    abort();
+  }
+}
+
+/*
+ * Release the lock of a parallel writer and wake any waiting thread,
+ * faulting on failure.
+ * 
+ * Parameters:
+ * 
+ *   pw - the parallel writer
+ */
+static void sph_jpeg_par_wunlock(SPH_JPEG_PAR_WRITER *pw) {
+  if (pthread_cond_broadcast(&(pw->cond))) {
+    abort();
+  }
+  if (pthread_mutex_unlock(&(pw->lock))) {
+    abort();
+  }
+}
+
+/*
+ * Record an error in the status of a parallel writer, unless an
+ * earlier error is already recorded.
+ * 
+ * Parameters:
+ * 
+ *   pw - the parallel writer
+ * 
+ *   status - the error status
+ */
+static void sph_jpeg_par_wfail(SPH_JPEG_PAR_WRITER *pw, int status) {
+  sph_jpeg_par_wlock(pw);
+  if (pw->status == SPH_JPEG_ERR_OK) {
+    pw->status = status;
+  }
+  sph_jpeg_par_wunlock(pw);
+}
+
+/*
+ * Get the status of a parallel writer.
+ * 
+ * Parameters:
+ * 
+ *   pw - the parallel writer
+ * 
+ * Return:
+ * 
+ *   the status
+ */
+static int sph_jpeg_par_wstatus(SPH_JPEG_PAR_WRITER *pw) {
+  
+  int status = 0;
+  
+  if (pthread_mutex_lock(&(pw->lock))) {
+    abort();
+  }
+  status = pw->status;
+  if (pthread_mutex_unlock(&(pw->lock))) {
+    abort();
+  }
+  
+  return status;
+}
+
+/*
+ * Deliver data to the output of a parallel writer.
+ * 
+ * If the data can't be written, SPH_JPEG_ERR_WRIT is recorded in the
+ * status.  The caller must check that the status is OK before calling.
+ * 
+ * Parameters:
+ * 
+ *   pw - the parallel writer
+ * 
+ *   pData - the data to write
+ * 
+ *   len - the number of bytes to write
+ */
+static void sph_jpeg_par_emit(
+          SPH_JPEG_PAR_WRITER * pw,
+    const uint8_t             * pData,
+          size_t                len) {
+  
+  int ok = 1;
+  
+  if (len > 0) {
+    if (pw->pOut != NULL) {
+      if (fwrite(pData, 1, len, pw->pOut) != len) {
+        ok = 0;
+      }
+    } else {
+      if (!((*(pw->fSink))(pw->pSinkCustom, pData, len))) {
+        ok = 0;
+      }
+    }
+  }
+  
+  if (!ok) {
+    sph_jpeg_par_wfail(pw, SPH_JPEG_ERR_WRIT);
+  }
+}
+
+/*
+ * Write the next stripe to the output, waiting for it to be encoded if
+ * necessary.
+ * 
+ * Stripes after the first are preceded by the restart marker that ends
+ * the last restart segment of the stripe before, and the last stripe
+ * is followed by an EOI marker.  The slot of the stripe is free again
+ * afterwards.  If the writer has an error status once the stripe is
+ * encoded, nothing is written.
+ * 
+ * Parameters:
+ * 
+ *   pw - the parallel writer
+ */
+static void sph_jpeg_par_flush(SPH_JPEG_PAR_WRITER *pw) {
+  
+  SPH_JPEG_PAR_SLOT *ps = NULL;
+  uint8_t mark[2];
+  int32_t k = 0;
+  int status = 0;
+  
+  /* Check state */
+  k = pw->flushed;
+  if (k >= pw->stripe_count) {
+    abort();
+  }
+  ps = &((pw->pSlots)[k % pw->window]);
+  
+  /* Wait for the stripe to be encoded */
+  sph_jpeg_par_wlock(pw);
+  while ((pw->pStripeState)[k] != SPH_JPEG_PAR_DONE) {
+    if (pthread_cond_wait(&(pw->cond), &(pw->lock))) {
+      abort();
+    }
+  }
+  status = pw->status;
+  if (pthread_mutex_unlock(&(pw->lock))) {
+    abort();
+  }
+  (pw->flushed)++;
+  
+  /* Write the stripe, stopping at the first error */
+  if ((status == SPH_JPEG_ERR_OK) && (k > 0)) {
+    mark[0] = (uint8_t) 0xff;
+    mark[1] = (uint8_t) (0xd0 +
+                (((k * (pw->stripe_mcu / pw->ri)) - 1) & 0x7));
+    sph_jpeg_par_emit(pw, mark, 2);
+    status = sph_jpeg_par_wstatus(pw);
+  }
+  if (status == SPH_JPEG_ERR_OK) {
+    sph_jpeg_par_emit(
+      pw, ps->enc.pData + ps->out_start, ps->out_end - ps->out_start);
+    status = sph_jpeg_par_wstatus(pw);
+  }
+  if ((status == SPH_JPEG_ERR_OK) &&
+      (pw->flushed >= pw->stripe_count)) {
+    mark[0] = (uint8_t) 0xff;
+    mark[1] = (uint8_t) 0xd9;
+    sph_jpeg_par_emit(pw, mark, 2);
+  }
+}
+
+/*
+ * Allocate a new parallel writer with either a file handle or a sink
+ * callback as output.
+ * 
+ * Exactly one of pOut and fSink must be non-NULL.  The other parameters
+ * are as for sph_jpeg_par_writer_new_sink().
+ * 
+ * Parameters:
+ * 
+ *   pOut - the file handle, or NULL
+ * 
+ *   fSink - the sink callback, or NULL
+ * 
+ *   pCustom - the custom parameter for the sink callback
+ * 
+ *   width - the width of the JPEG file in pixels
+ * 
+ *   height - the height of the JPEG file in pixels
+ * 
+ *   chcount - the number of color channels
+ * 
+ *   quality - the compression quality
+ * 
+ *   pOpts - the encoder options, or NULL
+ * 
+ *   threads - the number of worker threads
+ * 
+ * Return:
+ * 
+ *   a new parallel writer
+ */
+static SPH_JPEG_PAR_WRITER *sph_jpeg_par_writer_alloc(
+          FILE                 * pOut,
+          SPH_JPEG_SINK          fSink,
+          void                 * pCustom,
+          int32_t                width,
+          int32_t                height,
+          int                    chcount,
+          int                    quality,
+    const SPH_JPEG_WRITER_OPTS * pOpts,
+          int                    threads) {
+  
+  SPH_JPEG_PAR_WRITER *pw = NULL;
+  int split = 0;
+  int32_t mcu_w = 0;
+  int32_t lim = 0;
+  int32_t i = 0;
+  
+  /* Check parameters */
+  if (((pOut == NULL) && (fSink == NULL)) ||
+      ((pOut != NULL) && (fSink != NULL))) {
+    abort();
+  }
+  if ((width < 1) || (width > SPH_JPEG_MAXDIM) ||
+      (height < 1) || (height > SPH_JPEG_MAXDIM)) {
+    abort();
+  }
+  if ((chcount != 1) && (chcount != 3)) {
+    abort();
+  }
+  if ((threads < 1) || (threads > SPH_JPEG_PAR_MAXTHREADS)) {
+    abort();
+  }
+  
+  /* Allocate the structure */
+  pw = (SPH_JPEG_PAR_WRITER *) calloc(1, sizeof(SPH_JPEG_PAR_WRITER));
+  if (pw == NULL) {
+    abort();
+  }
+  pw->pOut = pOut;
+  pw->fSink = fSink;
+  pw->pSinkCustom = pCustom;
+  pw->pSeq = NULL;
+  pw->width = width;
+  pw->height = height;
+  pw->chcount = chcount;
+  pw->quality = quality;
+  if (pOpts != NULL) {
+    memcpy(&(pw->opts), pOpts, sizeof(SPH_JPEG_WRITER_OPTS));
+  } else {
+    sph_jpeg_writer_opts_init(&(pw->opts));
+  }
+  pw->row_size = ((size_t) width) * ((size_t) chcount);
+  pw->pSlots = NULL;
+  pw->pStripeState = NULL;
+  pw->pThreads = NULL;
+  pw->pEncoders = NULL;
+  pw->status = SPH_JPEG_ERR_OK;
+  
+  if (pthread_mutex_init(&(pw->lock), NULL)) {
+    abort();
+  }
+  if (pthread_cond_init(&(pw->cond), NULL)) {
+    abort();
+  }
+  
+  /* Stripes can only be stitched together for sequential files with
+   * the standard Huffman tables, which are the same in every stripe */
+  if ((threads > 1) && (!((pw->opts).optimize)) &&
+      (!((pw->opts).progressive))) {
+    split = 1;
+  }
+  
+  /* Determine the MCU geometry */
+  if (split) {
+    if ((chcount == 3) && ((pw->opts).sampling == SPH_JPEG_SAMP_420)) {
+      mcu_w = 16;
+      pw->mcu_h = 16;
+    } else if ((chcount == 3) &&
+                ((pw->opts).sampling == SPH_JPEG_SAMP_422)) {
+      mcu_w = 16;
+      pw->mcu_h = 8;
+    } else {
+      mcu_w = 8;
+      pw->mcu_h = 8;
+    }
+    pw->mcu_wide = (width + mcu_w - 1) / mcu_w;
+    pw->mcu_rows = (height + pw->mcu_h - 1) / pw->mcu_h;
+  }
+  
+  /* Divide the image into stripes in the same way as a parallel decoder
+   * divides an image into bands, and choose a restart interval that the
+   * stripe size is a multiple of; the restart interval in MCUs must fit
+   * in the DRI marker */
+  if (split) {
+    pw->stripe_mcu = (pw->mcu_rows +
+                      (threads * SPH_JPEG_PAR_BANDSPER) - 1) /
+                        (threads * SPH_JPEG_PAR_BANDSPER);
+    lim = (int32_t) (SPH_JPEG_PAR_BANDMAX /
+                      (((size_t) pw->mcu_h) * pw->row_size));
+    if (lim < 1) {
+      lim = 1;
+    }
+    if (pw->stripe_mcu > lim) {
+      pw->stripe_mcu = lim;
+    }
+    
+    lim = 65535 / pw->mcu_wide;
+    if ((pw->opts).restart_rows > 0) {
+      pw->ri = (pw->opts).restart_rows;
+    } else {
+      pw->ri = pw->stripe_mcu;
+    }
+    if (pw->ri > lim) {
+      pw->ri = lim;
+    }
+    (pw->opts).restart_rows = (int) pw->ri;
+    
+    pw->stripe_mcu = ((pw->stripe_mcu + pw->ri - 1) / pw->ri) * pw->ri;
+    pw->stripe_count = (pw->mcu_rows + pw->stripe_mcu - 1) /
+                          pw->stripe_mcu;
+    if (pw->stripe_count < 2) {
+      split = 0;
+      if (pOpts != NULL) {
+        memcpy(&(pw->opts), pOpts, sizeof(SPH_JPEG_WRITER_OPTS));
+      } else {
+        sph_jpeg_writer_opts_init(&(pw->opts));
+      }
+    }
+  }
+  
+  if (split) {
+    /* Allocate the stripe states and the slots */
+    pw->window = threads * 2;
+    if (pw->window > pw->stripe_count) {
+      pw->window = pw->stripe_count;
+    }
+    pw->pStripeState = (int *) calloc(
+                        (size_t) pw->stripe_count, sizeof(int));
+    pw->pSlots = (SPH_JPEG_PAR_SLOT *) calloc(
+                    (size_t) pw->window, sizeof(SPH_JPEG_PAR_SLOT));
+    if ((pw->pStripeState == NULL) || (pw->pSlots == NULL)) {
+      abort();
+    }
+    for(i = 0; i < pw->stripe_count; i++) {
+      (pw->pStripeState)[i] = SPH_JPEG_PAR_FILLING;
+    }
+    for(i = 0; i < pw->window; i++) {
+      sph_jpeg_membuf_init(&((pw->pSlots)[i].enc));
+      (pw->pSlots)[i].pRows = (uint8_t *) malloc(
+                    ((size_t) (pw->stripe_mcu * pw->mcu_h)) *
+                      pw->row_size);
+      if ((pw->pSlots)[i].pRows == NULL) {
+        abort();
+      }
+    }
+    
+    /* Start the worker threads */
+    pw->thread_count = threads;
+    if (pw->thread_count > pw->stripe_count) {
+      pw->thread_count = pw->stripe_count;
+    }
+    pw->pThreads = (pthread_t *) calloc(
+                    (size_t) pw->thread_count, sizeof(pthread_t));
+    pw->pEncoders = (SPH_JPEG_PAR_ENCODER *) calloc(
+                      (size_t) pw->thread_count,
+                      sizeof(SPH_JPEG_PAR_ENCODER));
+    if ((pw->pThreads == NULL) || (pw->pEncoders == NULL)) {
+      abort();
+    }
+    for(i = 0; i < pw->thread_count; i++) {
+      (pw->pEncoders)[i].pw = pw;
+      (pw->pEncoders)[i].pEnc = NULL;
+    }
+    for(i = 0; i < pw->thread_count; i++) {
+      if (pthread_create(
+            &((pw->pThreads)[i]), NULL,
+            &sph_jpeg_par_encoder, &((pw->pEncoders)[i]))) {
+        abort();
+      }
+    }
+    
+  } else {
+    /* Encode sequentially with a single writer */
+    pw->stripe_count = 1;
+    if (pOut != NULL) {
+      pw->pSeq = sph_jpeg_writer_new_ex(
+                  pOut, width, height, chcount, quality, &(pw->opts));
+    } else {
+      pw->pSeq = sph_jpeg_writer_new_sink_ex(
+                  fSink, pCustom, width, height, chcount, quality,
+                  &(pw->opts));
+    }
+    if (pw->pSeq == NULL) {
+      abort();
+    }
+    pw->status = sph_jpeg_writer_status(pw->pSeq);
+  }
+  
+  return pw;
+}
+
+/*
+ * Public function implementations
+ * ===============================
+ * 
+ * See the header for specifications.
+ */
+
+/*
+ * sph_jpeg_par_new function.
+ */
+SPH_JPEG_PAR *sph_jpeg_par_new(
+    const void                 * pData,
+          size_t                 len,
+          int                    threads,
+    const SPH_JPEG_READER_OPTS * pOpts) {
+  
+  SPH_JPEG_PAR *pp = NULL;
+  int split = 0;
+  int32_t lim = 0;
+  int32_t i = 0;
+  
+  /* Check parameters */
+  if ((pData == NULL) || (len < 1)) {
+    abort();
+  }
+  if ((threads < 1) || (threads > SPH_JPEG_PAR_MAXTHREADS)) {
+    abort();
+  }
+  
+  /* Allocate the structure */
+  pp = (SPH_JPEG_PAR *) calloc(1, sizeof(SPH_JPEG_PAR));
+  if (pp == NULL) {
+    abort();
+  }
+  pp->pData = (const uint8_t *) pData;
+  pp->len = len;
+  if (pOpts != NULL) {
+    memcpy(&(pp->opts), pOpts, sizeof(SPH_JPEG_READER_OPTS));
+  } else {
+    sph_jpeg_reader_opts_init(&(pp->opts));
+  }
+  pp->pSeq = NULL;
+  pp->pSegOff = NULL;
+  pp->ppSlot = NULL;
+  pp->pBandStatus = NULL;
+  pp->pThreads = NULL;
+  pp->pWorkers = NULL;
+  
+  if (pthread_mutex_init(&(pp->lock), NULL)) {
+    abort();
+  }
+  if (pthread_cond_init(&(pp->cond), NULL)) {
+    abort();
+  }
+  
+  /* Open the file normally to get the image information and to check
+   * for errors; this reader is kept if the image is decoded
+   * sequentially */
+  pp->pSeq = sph_jpeg_reader_new_mem_ex(pData, len, &(pp->opts));
+  if (pp->pSeq == NULL) {
+    abort();
+  }
+  pp->status = sph_jpeg_reader_status(pp->pSeq);
+  pp->width = sph_jpeg_reader_width(pp->pSeq);
+  pp->height = sph_jpeg_reader_height(pp->pSeq);
+  pp->chcount = sph_jpeg_reader_channels(pp->pSeq);
+  pp->color = sph_jpeg_reader_color(pp->pSeq);
+  pp->row_size = ((size_t) pp->width) * ((size_t) pp->chcount);
+  
+  /* Check whether the image can be split */
+  if ((threads > 1) && (pp->status == SPH_JPEG_ERR_OK)) {
+    split = sph_jpeg_par_parse(pp);
+  }
+  
+  /* Divide the image into bands, aiming for several bands per thread
+   * but keeping each band within the size limit, and rounding to the
+   * restart boundaries */
+  if (split) {
+    pp->band_mcu = (pp->mcu_rows +
+                    (threads * SPH_JPEG_PAR_BANDSPER) - 1) /
+                      (threads * SPH_JPEG_PAR_BANDSPER);
+    lim = (int32_t) (SPH_JPEG_PAR_BANDMAX /
+                      (((size_t) pp->mcu_h) * pp->row_size));
+    if (lim < 1) {
+      lim = 1;
+    }
+    if (pp->band_mcu > lim) {
+      pp->band_mcu = lim;
+    }
+    pp->band_mcu = ((pp->band_mcu + pp->step - 1) / pp->step) *
+                      pp->step;
+    pp->band_count = (pp->mcu_rows + pp->band_mcu - 1) / pp->band_mcu;
+    if (pp->band_count < 2) {
+      split = 0;
+    }
+  }
+  
+  if (split) {
+    /* Release the sequential reader */
+    sph_jpeg_reader_free(pp->pSeq);
+    pp->pSeq = NULL;
+    
+    /* Allocate the band statuses and the slots */
+    pp->window = threads * 2;
+    if (pp->window > pp->band_count) {
+      pp->window = pp->band_count;
+    }
+    pp->pBandStatus = (int *) calloc(
+                        (size_t) pp->band_count, sizeof(int));
+    pp->ppSlot = (uint8_t **) calloc(
+                    (size_t) pp->window, sizeof(uint8_t *));
+    if ((pp->pBandStatus == NULL) || (pp->ppSlot == NULL)) {
+      abort();
+    }
+    for(i = 0; i < pp->band_count; i++) {
+      (pp->pBandStatus)[i] = SPH_JPEG_PAR_PENDING;
+    }
+    for(i = 0; i < pp->window; i++) {
+      (pp->ppSlot)[i] = (uint8_t *) malloc(
+                          ((size_t) (pp->band_mcu * pp->mcu_h)) *
+                            pp->row_size);
+      if ((pp->ppSlot)[i] == NULL) {
+        abort();
+      }
+    }
+    
+    /* Start the worker threads */
+    pp->thread_count = threads;
+    if (pp->thread_count > pp->band_count) {
+      pp->thread_count = pp->band_count;
+    }
+    pp->pThreads = (pthread_t *) calloc(
+                    (size_t) pp->thread_count, sizeof(pthread_t));
+    pp->pWorkers = (SPH_JPEG_PAR_WORKER *) calloc(
+                      (size_t) pp->thread_count,
+                      sizeof(SPH_JPEG_PAR_WORKER));
+    if ((pp->pThreads == NULL) || (pp->pWorkers == NULL)) {
+      abort();
+    }
+    for(i = 0; i < pp->thread_count; i++) {
+      (pp->pWorkers)[i].pp = pp;
+      (pp->pWorkers)[i].pr = NULL;
+      (pp->pWorkers)[i].pSynth = NULL;
+      (pp->pWorkers)[i].synth_cap = 0;
+    }
+    for(i = 0; i < pp->thread_count; i++) {
+      if (pthread_create(
+            &((pp->pThreads)[i]), NULL,
+            &sph_jpeg_par_worker, &((pp->pWorkers)[i]))) {
+        abort();
+      }
+    }
+    
+  } else {
+    /* Decode sequentially with the single reader */
+    pp->band_count = 1;
+  }
+  
+  return pp;
+}
+
+/*
+ * sph_jpeg_par_free function.
+ */
+void sph_jpeg_par_free(SPH_JPEG_PAR *pp) {
+  
+  int32_t i = 0;
+  
+  /* Only proceed if non-NULL */
+  if (pp != NULL) {
+    
+    /* Stop the worker threads */
+    if (pp->pThreads != NULL) {
+      sph_jpeg_par_lock(pp);
+      pp->cancel = 1;
+      sph_jpeg_par_unlock(pp);
+      
+      for(i = 0; i < pp->thread_count; i++) {
+        if (pthread_join((pp->pThreads)[i], NULL)) {
+          abort();
+        }
+      }
+      free(pp->pThreads);
+      pp->pThreads = NULL;
+    }
+    
+    /* Release the workers */
+    if (pp->pWorkers != NULL) {
+      for(i = 0; i < pp->thread_count; i++) {
+        sph_jpeg_reader_free((pp->pWorkers)[i].pr);
+        free((pp->pWorkers)[i].pSynth);
+      }
+      free(pp->pWorkers);
+      pp->pWorkers = NULL;
+    }
+    
+    /* Release the slots and the layout */
+    if (pp->ppSlot != NULL) {
+      for(i = 0; i < pp->window; i++) {
+        free((pp->ppSlot)[i]);
+      }
+      free(pp->ppSlot);
+      pp->ppSlot = NULL;
+    }
+    free(pp->pBandStatus);
+    pp->pBandStatus = NULL;
+    free(pp->pSegOff);
+    pp->pSegOff = NULL;
+    
+    /* Release the sequential reader */
+    sph_jpeg_reader_free(pp->pSeq);
+    pp->pSeq = NULL;
+    
+    /* Release the structure */
+    if (pthread_cond_destroy(&(pp->cond))) {
+      abort();
+    }
+    if (pthread_mutex_destroy(&(pp->lock))) {
+      abort();
+    }
+    free(pp);
+  }
+}
+
+/*
+ * sph_jpeg_par_status function.
+ */
+int sph_jpeg_par_status(SPH_JPEG_PAR *pp) {
+  if (pp == NULL) {
+    abort();
+  }
+  return pp->status;
+}
+
+/*
+ * sph_jpeg_par_width function.
+ */
+int32_t sph_jpeg_par_width(SPH_JPEG_PAR *pp) {
+  if (pp == NULL) {
+    abort();
+  }
+  return pp->width;
+}
+
+/*
+ * sph_jpeg_par_height function.
+ */
+int32_t sph_jpeg_par_height(SPH_JPEG_PAR *pp) {
+  if (pp == NULL) {
+    abort();
+  }
+  return pp->height;
+}
+
+/*
+ * sph_jpeg_par_channels function.
+ */
+int sph_jpeg_par_channels(SPH_JPEG_PAR *pp) {
+  if (pp == NULL) {
+    abort();
+  }
+  return pp->chcount;
+}
+
+/*
+ * sph_jpeg_par_color function.
+ */
+int sph_jpeg_par_color(SPH_JPEG_PAR *pp) {
+  if (pp == NULL) {
+    abort();
+  }
+  return pp->color;
+}
+
+/*
+ * sph_jpeg_par_bands function.
+ */
+int32_t sph_jpeg_par_bands(SPH_JPEG_PAR *pp) {
+  if (pp == NULL) {
+    abort();
+  }
+  return pp->band_count;
+}
+
+/*
+ * sph_jpeg_par_get function.
+ */
+int sph_jpeg_par_get(SPH_JPEG_PAR *pp, uint8_t *pscan) {
+  
+  /* Check parameters */
+  if ((pp == NULL) || (pscan == NULL)) {
+    abort();
+  }
+  
+  /* Read a single row */
+  if (sph_jpeg_par_get_rows(pp, pscan, pp->row_size, 1) < 1) {
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * sph_jpeg_par_get_rows function.
+ */
+int32_t sph_jpeg_par_get_rows(
+    SPH_JPEG_PAR * pp,
+    uint8_t      * buf,
+    size_t         stride,
+    int32_t        max_rows) {
+  
+  int32_t count = 0;
+  int32_t done = 0;
+  int32_t n = 0;
+  int32_t i = 0;
+  int32_t band_rows = 0;
+  int status = 0;
+  const uint8_t *pSlot = NULL;
+  
+  /* Check parameters */
+  if ((pp == NULL) || (buf == NULL)) {
+    abort();
+  }
+  if ((max_rows < 1) || (stride < pp->row_size)) {
+    abort();
+  }
+  
+  /* Check state */
+  if (pp->readcount >= pp->height) {
+    abort();
+  }
+  
+  /* Determine the number of rows this call covers, and update the read
+   * counter */
+  count = pp->height - pp->readcount;
+  if (count > max_rows) {
+    count = max_rows;
+  }
+  pp->readcount += count;
+  
+  if ((pp->status == SPH_JPEG_ERR_OK) && (pp->pSeq != NULL)) {
+    /* Sequential decoding, so read straight from the reader */
+    if (sph_jpeg_reader_get_rows(pp->pSeq, buf, stride, count) < 1) {
+      pp->status = sph_jpeg_reader_status(pp->pSeq);
+    }
+    
+  } else if (pp->status == SPH_JPEG_ERR_OK) {
+    /* Copy rows out of the bands in order */
+    for(done = 0; done < count; done += n) {
+      
+      /* Wait for the current band to be decoded */
+      sph_jpeg_par_lock(pp);
+      while ((pp->pBandStatus)[pp->cur_band] == SPH_JPEG_PAR_PENDING) {
+        if (pthread_cond_wait(&(pp->cond), &(pp->lock))) {
+          abort();
+        }
+      }
+      status = (pp->pBandStatus)[pp->cur_band];
+      if (pthread_mutex_unlock(&(pp->lock))) {
+        abort();
+      }
+      
+      /* Stop if the band failed */
+      if (status != SPH_JPEG_ERR_OK) {
+        pp->status = status;
+        break;
+      }
+      
+      /* Copy rows from the slot of the band */
+      pSlot = (pp->ppSlot)[pp->cur_band % pp->window];
+      band_rows = sph_jpeg_par_band_rows(pp, pp->cur_band);
+      n = band_rows - pp->cur_row;
+      if (n > count - done) {
+        n = count - done;
+      }
+      for(i = 0; i < n; i++) {
+        memcpy(
+          buf + (((size_t) (done + i)) * stride),
+          pSlot + (((size_t) (pp->cur_row + i)) * pp->row_size),
+          pp->row_size);
+      }
+      pp->cur_row += n;
+      
+      /* Move to the next band once this one is read, which frees its
+       * slot for a worker */
+      if (pp->cur_row >= band_rows) {
+        sph_jpeg_par_lock(pp);
+        (pp->cur_band)++;
+        pp->cur_row = 0;
+        sph_jpeg_par_unlock(pp);
+      }
+    }
+  }
+  
+  /* If there was an error, blank the rows */
+  if (pp->status != SPH_JPEG_ERR_OK) {
+    for(i = 0; i < count; i++) {
+      memset(buf + (((size_t) i) * stride), 0, pp->row_size);
+    }
+    return 0;
+  }
+  
+  return count;
+}
+
+/*
+ * sph_jpeg_par_writer_new function.
+ */
+SPH_JPEG_PAR_WRITER *sph_jpeg_par_writer_new(
+          FILE                 * pOut,
+          int32_t                width,
+          int32_t                height,
+          int                    chcount,
+          int                    quality,
+    const SPH_JPEG_WRITER_OPTS * pOpts,
+          int                    threads) {
+  
+  if (pOut == NULL) {
+    abort();
+  }
+  return sph_jpeg_par_writer_alloc(
+          pOut, NULL, NULL,
+          width, height, chcount, quality, pOpts, threads);
+}
+
+/*
+ * sph_jpeg_par_writer_new_sink function.
+ */
+SPH_JPEG_PAR_WRITER *sph_jpeg_par_writer_new_sink(
+          SPH_JPEG_SINK          fSink,
+          void                 * pCustom,
+          int32_t                width,
+          int32_t                height,
+          int                    chcount,
+          int                    quality,
+    const SPH_JPEG_WRITER_OPTS * pOpts,
+          int                    threads) {
+  
+  if (fSink == NULL) {
+    abort();
+  }
+  return sph_jpeg_par_writer_alloc(
+          NULL, fSink, pCustom,
+          width, height, chcount, quality, pOpts, threads);
+}
+
+/*
+ * sph_jpeg_par_writer_free function.
+ */
+void sph_jpeg_par_writer_free(SPH_JPEG_PAR_WRITER *pw) {
+  
+  int32_t i = 0;
+  
+  /* Only proceed if non-NULL */
+  if (pw != NULL) {
+    
+    /* Stop the worker threads */
+    if (pw->pThreads != NULL) {
+      sph_jpeg_par_wlock(pw);
+      pw->cancel = 1;
+      sph_jpeg_par_wunlock(pw);
+      
+      for(i = 0; i < pw->thread_count; i++) {
+        if (pthread_join((pw->pThreads)[i], NULL)) {
+          abort();
+        }
+      }
+      free(pw->pThreads);
+      pw->pThreads = NULL;
+    }
+    
+    /* Release the workers */
+    if (pw->pEncoders != NULL) {
+      for(i = 0; i < pw->thread_count; i++) {
+        sph_jpeg_writer_free((pw->pEncoders)[i].pEnc);
+      }
+      free(pw->pEncoders);
+      pw->pEncoders = NULL;
+    }
+    
+    /* Release the slots */
+    if (pw->pSlots != NULL) {
+      for(i = 0; i < pw->window; i++) {
+        free((pw->pSlots)[i].pRows);
+        sph_jpeg_membuf_free(&((pw->pSlots)[i].enc));
+      }
+      free(pw->pSlots);
+      pw->pSlots = NULL;
+    }
+    free(pw->pStripeState);
+    pw->pStripeState = NULL;
+    
+    /* Release the sequential writer */
+    sph_jpeg_writer_free(pw->pSeq);
+    pw->pSeq = NULL;
+    
+    /* Release the structure */
+    if (pthread_cond_destroy(&(pw->cond))) {
+      abort();
+    }
+    if (pthread_mutex_destroy(&(pw->lock))) {
+      abort();
+    }
+    free(pw);
+  }
+}
+
+/*
+ * sph_jpeg_par_writer_stripes function.
+ */
+int32_t sph_jpeg_par_writer_stripes(SPH_JPEG_PAR_WRITER *pw) {
+  if (pw == NULL) {
+    abort();
+  }
+  return pw->stripe_count;
+}
+
+/*
+ * sph_jpeg_par_writer_status function.
+ */
+int sph_jpeg_par_writer_status(SPH_JPEG_PAR_WRITER *pw) {
+  if (pw == NULL) {
+    abort();
+  }
+  return sph_jpeg_par_wstatus(pw);
+}
+
+/*
+ * sph_jpeg_par_writer_put function.
+ */
+void sph_jpeg_par_writer_put(SPH_JPEG_PAR_WRITER *pw, uint8_t *pscan) {
+  
+  /* Check parameters */
+  if ((pw == NULL) || (pscan == NULL)) {
+    abort();
+  }
+  
+  /* Write a single row */
+  sph_jpeg_par_writer_put_rows(pw, pscan, pw->row_size, 1);
+}
+
+/*
+ * sph_jpeg_par_writer_put_rows function.
+ */
+void sph_jpeg_par_writer_put_rows(
+    SPH_JPEG_PAR_WRITER * pw,
+    uint8_t             * buf,
+    size_t                stride,
+    int32_t               rows) {
+  
+  SPH_JPEG_PAR_SLOT *ps = NULL;
+  int32_t done = 0;
+  int32_t n = 0;
+  int32_t i = 0;
+  int32_t k = 0;
+  int32_t row = 0;
+  int32_t stripe_h = 0;
+  int32_t stripe_rows = 0;
+  
+  /* Check parameters */
+  if ((pw == NULL) || (buf == NULL)) {
+    abort();
+  }
+  if ((rows < 1) || (rows > pw->height - pw->writecount) ||
+      (stride < pw->row_size)) {
+    abort();
+  }
+  
+  /* Sequential encoding, so write straight to the writer, which
+   * ignores the rows itself after an error */
+  if (pw->pSeq != NULL) {
+    sph_jpeg_writer_put_rows(pw->pSeq, buf, stride, rows);
+    pw->status = sph_jpeg_writer_status(pw->pSeq);
+    pw->writecount += rows;
+    return;
+  }
+  
+  /* After an error, the rows only count towards the height */
+  if (sph_jpeg_par_wstatus(pw) != SPH_JPEG_ERR_OK) {
+    pw->writecount += rows;
+    return;
+  }
+  
+  stripe_h = pw->stripe_mcu * pw->mcu_h;
+  for(done = 0; done < rows; done += n) {
+    
+    /* Get the stripe the next row goes into */
+    k = pw->writecount / stripe_h;
+    row = pw->writecount - (k * stripe_h);
+    ps = &((pw->pSlots)[k % pw->window]);
+    stripe_rows = sph_jpeg_par_stripe_rows(pw, k);
+    
+    /* Before starting a stripe, write out the stripe that last used
+     * its slot */
+    if (row == 0) {
+      while (pw->flushed + pw->window <= k) {
+        sph_jpeg_par_flush(pw);
+      }
+    }
+    
+    /* Copy rows into the slot */
+    n = stripe_rows - row;
+    if (n > rows - done) {
+      n = rows - done;
+    }
+    for(i = 0; i < n; i++) {
+      memcpy(
+        ps->pRows + (((size_t) (row + i)) * pw->row_size),
+        buf + (((size_t) (done + i)) * stride),
+        pw->row_size);
+    }
+    pw->writecount += n;
+    
+    /* Hand the stripe to the workers once it is filled */
+    if (row + n >= stripe_rows) {
+      sph_jpeg_par_wlock(pw);
+      (pw->pStripeState)[k] = SPH_JPEG_PAR_READY;
+      sph_jpeg_par_wunlock(pw);
+    }
+  }
+  
+  /* After the last row, write out all remaining stripes */
+  if (pw->writecount >= pw->height) {
+    while (pw->flushed < pw->stripe_count) {
+      sph_jpeg_par_flush(pw);
+    }
+  }
+  /* CAUTION: alternate return statement earlier! */
+}
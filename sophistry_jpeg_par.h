@@ -0,0 +1,472 @@
+#ifndef SOPHISTRY_JPEG_PAR_H_INCLUDED
+#define SOPHISTRY_JPEG_PAR_H_INCLUDED
+
+/*
+ * sophistry_jpeg_par.h
+ * ====================
+ * 
+ * Optional module that decodes or encodes a single large JPEG image on
+ * several threads by splitting it at restart markers.
+ * 
+ * When a JPEG file has a restart interval (a DRI marker), the entropy
+ * coded data is divided into segments that each start with fresh DC
+ * predictions, so the segments can be decoded independently of each
+ * other.  This module splits the image into horizontal bands that start
+ * and end at segment boundaries, decodes the bands with ordinary
+ * sophistry_jpeg readers on a pool of worker threads, and delivers the
+ * scanlines in order through the same kind of interface as a reader.
+ * 
+ * Each band is decoded from a small synthetic JPEG file made of the
+ * headers of the input file, the segments of the band with their
+ * restart markers renumbered, and an EOI marker.  Bands are decoded
+ * with one extra restart boundary of overlap above and below, which is
+ * cropped off with sph_jpeg_reader_set_crop(), so that chroma
+ * upsampling at the band edges sees the same neighboring rows as a
+ * sequential decode.  The scanlines are therefore identical to those of
+ * a sequential decode with the same options.
+ * 
+ * Only sequential Huffman-coded images with a single scan can be split
+ * (the baseline and extended sequential processes).  Files written by
+ * sophistry_jpeg with the restart_rows writer option set and the
+ * progressive option clear qualify.  Images that can't be split,
+ * including images without restart markers, are decoded sequentially
+ * on the calling thread, with the same results.
+ * 
+ * Parallel writers work the other way around.  The scanlines the client
+ * writes are collected into horizontal stripes that are a whole number
+ * of restart intervals high.  Each stripe is encoded as a separate JPEG
+ * image into memory by an ordinary sophistry_jpeg writer on a worker
+ * thread, and the entropy coded data of the stripes is stitched
+ * together with restart markers into a single baseline JPEG file.
+ * Since each stripe starts at a restart boundary and at an MCU row, the
+ * output is identical to that of a sequential writer with the same
+ * options and restart interval.  The standard Huffman tables are used
+ * in every stripe, so images with the optimize or progressive writer
+ * option are encoded sequentially instead.
+ * 
+ * Compilation
+ * -----------
+ * 
+ * Compile with sophistry_jpeg.  Requires POSIX threads, so use -pthread
+ * (or -lpthread) when compiling and linking.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "sophistry_jpeg.h"
+
+/*
+ * The maximum number of worker threads.
+ */
+#define SPH_JPEG_PAR_MAXTHREADS (64)
+
+/*
+ * The target maximum size in bytes of the decoded scanlines of one
+ * band, or of the scanlines of one stripe that is to be encoded.
+ * 
+ * At most two bands or stripes per worker thread are held in memory at
+ * a time, so this bounds the memory used for scanlines, except that a
+ * band or stripe is never smaller than the rows between two restart
+ * boundaries.
+ */
+#define SPH_JPEG_PAR_BANDMAX (8388608)
+
+/*
+ * SPH_JPEG_PAR structure prototype.
+ * 
+ * See the implementation file for definition.
+ */
+struct SPH_JPEG_PAR_TAG;
+typedef struct SPH_JPEG_PAR_TAG SPH_JPEG_PAR;
+
+/*
+ * SPH_JPEG_PAR_WRITER structure prototype.
+ * 
+ * See the implementation file for definition.
+ */
+struct SPH_JPEG_PAR_WRITER_TAG;
+typedef struct SPH_JPEG_PAR_WRITER_TAG SPH_JPEG_PAR_WRITER;
+
+/*
+ * Allocate a new parallel decoder for a JPEG file in memory.
+ * 
+ * pData points to the complete JPEG file and len is its length in
+ * bytes.  The data is NOT copied, so it must remain valid and unchanged
+ * until the decoder is released with sph_jpeg_par_free().
+ * 
+ * threads is the number of worker threads, in range
+ * [1, SPH_JPEG_PAR_MAXTHREADS].  If it is one, or if the image can't be
+ * split at restart markers, the image is decoded sequentially on the
+ * calling thread.  Otherwise, the worker threads are started right away
+ * and begin decoding bands in the background.
+ * 
+ * pOpts are the decoder options used for every band, with the same
+ * meaning as for sph_jpeg_reader_new_mem_ex().  If pOpts is NULL, the
+ * defaults are used.
+ * 
+ * Errors reading the file are reported through sph_jpeg_par_status(),
+ * in the same way as for reader objects.  Allocation failures and
+ * failure to create a thread cause faults.
+ * 
+ * Parameters:
+ * 
+ *   pData - the JPEG file data
+ * 
+ *   len - the length of the JPEG file data in bytes
+ * 
+ *   threads - the number of worker threads
+ * 
+ *   pOpts - the decoder options, or NULL
+ * 
+ * Return:
+ * 
+ *   a new parallel decoder
+ */
+SPH_JPEG_PAR *sph_jpeg_par_new(
+    const void                 * pData,
+          size_t                 len,
+          int                    threads,
+    const SPH_JPEG_READER_OPTS * pOpts);
+
+/*
+ * Release a parallel decoder.
+ * 
+ * Worker threads that are still running are stopped.  The call is
+ * ignored if pp is NULL.  This does NOT release the JPEG file data.
+ * 
+ * Parameters:
+ * 
+ *   pp - the parallel decoder to release, or NULL
+ */
+void sph_jpeg_par_free(SPH_JPEG_PAR *pp);
+
+/*
+ * Return the status of a parallel decoder.
+ * 
+ * This works the same way as sph_jpeg_reader_status().
+ * 
+ * Parameters:
+ * 
+ *   pp - the parallel decoder
+ * 
+ * Return:
+ * 
+ *   the status code
+ */
+int sph_jpeg_par_status(SPH_JPEG_PAR *pp);
+
+/*
+ * Return the width of the image in pixels.
+ * 
+ * Parameters:
+ * 
+ *   pp - the parallel decoder
+ * 
+ * Return:
+ * 
+ *   the image width
+ */
+int32_t sph_jpeg_par_width(SPH_JPEG_PAR *pp);
+
+/*
+ * Return the height of the image in pixels.
+ * 
+ * Parameters:
+ * 
+ *   pp - the parallel decoder
+ * 
+ * Return:
+ * 
+ *   the image height
+ */
+int32_t sph_jpeg_par_height(SPH_JPEG_PAR *pp);
+
+/*
+ * Return the number of channels in each decoded pixel.
+ * 
+ * This has the same meaning as sph_jpeg_reader_channels().
+ * 
+ * Parameters:
+ * 
+ *   pp - the parallel decoder
+ * 
+ * Return:
+ * 
+ *   the channel count, 1 or 3
+ */
+int sph_jpeg_par_channels(SPH_JPEG_PAR *pp);
+
+/*
+ * Return the color space of the decoded scanlines.
+ * 
+ * This has the same meaning as sph_jpeg_reader_color().
+ * 
+ * Parameters:
+ * 
+ *   pp - the parallel decoder
+ * 
+ * Return:
+ * 
+ *   one of the SPH_JPEG_COLOR constants
+ */
+int sph_jpeg_par_color(SPH_JPEG_PAR *pp);
+
+/*
+ * Return the number of bands the image is decoded in.
+ * 
+ * This is one if the image is decoded sequentially on the calling
+ * thread.
+ * 
+ * Parameters:
+ * 
+ *   pp - the parallel decoder
+ * 
+ * Return:
+ * 
+ *   the band count
+ */
+int32_t sph_jpeg_par_bands(SPH_JPEG_PAR *pp);
+
+/*
+ * Read a scanline from a parallel decoder.
+ * 
+ * This works the same way as sph_jpeg_reader_get().  If the band
+ * containing the scanline has not been decoded yet, the call waits for
+ * it.
+ * 
+ * Parameters:
+ * 
+ *   pp - the parallel decoder
+ * 
+ *   pscan - the scanline buffer
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int sph_jpeg_par_get(SPH_JPEG_PAR *pp, uint8_t *pscan);
+
+/*
+ * Read several scanlines from a parallel decoder.
+ * 
+ * This works the same way as sph_jpeg_reader_get_rows().  Rows are
+ * copied out of the decoded bands in order, waiting for each band to
+ * be decoded if necessary.
+ * 
+ * Parameters:
+ * 
+ *   pp - the parallel decoder
+ * 
+ *   buf - the buffer to receive the rows
+ * 
+ *   stride - the distance in bytes between rows in buf
+ * 
+ *   max_rows - the maximum number of rows to read
+ * 
+ * Return:
+ * 
+ *   the number of rows read, or zero if there was an error
+ */
+int32_t sph_jpeg_par_get_rows(
+    SPH_JPEG_PAR * pp,
+    uint8_t      * buf,
+    size_t         stride,
+    int32_t        max_rows);
+
+/*
+ * Allocate a new parallel writer that writes a JPEG file to a file
+ * handle.
+ * 
+ * The parameters up to pOpts have the same meaning as for
+ * sph_jpeg_writer_new_ex(), and the JPEG file is written in the same
+ * way.  The writer must eventually be released with
+ * sph_jpeg_par_writer_free(), which does NOT close the file handle.
+ * 
+ * threads is the number of worker threads, in range
+ * [1, SPH_JPEG_PAR_MAXTHREADS].  If it is one, if the optimize or
+ * progressive option is set, or if the image is too small to split
+ * into at least two stripes, the image is encoded sequentially on the
+ * calling thread by an ordinary writer.  Otherwise, the worker threads
+ * are started right away and wait for stripes to encode.
+ * 
+ * Stripes are always separated by restart markers.  If the restart_rows
+ * option is zero, the restart interval is the height of a stripe, so
+ * there is one restart marker between each stripe and the next.  If it
+ * is not zero, the stripes are a multiple of restart_rows high.  In
+ * either case, the restart interval is reduced if necessary so that it
+ * is at most 65535 MCUs, which is the largest that a JPEG file can
+ * record.
+ * 
+ * The encoded data is written to the file handle on the calling thread,
+ * during the calls to sph_jpeg_par_writer_put() and
+ * sph_jpeg_par_writer_put_rows().  The last of the data is written by
+ * the call that writes the last scanline.
+ * 
+ * Errors encoding a stripe, such as a memory limit set in pOpts, and
+ * errors writing the output are recorded in the error status of the
+ * parallel writer, in the same way as for ordinary writers.  After the
+ * first error, no more stripes are encoded or written, and further
+ * scanlines are ignored.  See sph_jpeg_par_writer_status().  Failure
+ * to allocate the parallel writer's own buffers or to create a thread
+ * causes a fault.
+ * 
+ * Parameters:
+ * 
+ *   pOut - the file handle to write the JPEG file to
+ * 
+ *   width - the width of the JPEG file in pixels
+ * 
+ *   height - the height of the JPEG file in pixels
+ * 
+ *   chcount - the number of color channels
+ * 
+ *   quality - the compression quality
+ * 
+ *   pOpts - the encoder options, or NULL
+ * 
+ *   threads - the number of worker threads
+ * 
+ * Return:
+ * 
+ *   a new parallel writer
+ */
+SPH_JPEG_PAR_WRITER *sph_jpeg_par_writer_new(
+          FILE                 * pOut,
+          int32_t                width,
+          int32_t                height,
+          int                    chcount,
+          int                    quality,
+    const SPH_JPEG_WRITER_OPTS * pOpts,
+          int                    threads);
+
+/*
+ * Allocate a new parallel writer that delivers its output to a sink
+ * callback.
+ * 
+ * This is the same as sph_jpeg_par_writer_new(), except that the
+ * encoded JPEG data is passed to the sink callback fSink with the
+ * custom parameter pCustom, in the same way as for
+ * sph_jpeg_writer_new_sink_ex().  The callback is always invoked on the
+ * calling thread.  If it reports failure, the status of the parallel
+ * writer becomes SPH_JPEG_ERR_WRIT.
+ * 
+ * Parameters:
+ * 
+ *   fSink - the sink callback
+ * 
+ *   pCustom - the custom parameter for the callback
+ * 
+ *   width - the width of the JPEG file in pixels
+ * 
+ *   height - the height of the JPEG file in pixels
+ * 
+ *   chcount - the number of color channels
+ * 
+ *   quality - the compression quality
+ * 
+ *   pOpts - the encoder options, or NULL
+ * 
+ *   threads - the number of worker threads
+ * 
+ * Return:
+ * 
+ *   a new parallel writer
+ */
+SPH_JPEG_PAR_WRITER *sph_jpeg_par_writer_new_sink(
+          SPH_JPEG_SINK          fSink,
+          void                 * pCustom,
+          int32_t                width,
+          int32_t                height,
+          int                    chcount,
+          int                    quality,
+    const SPH_JPEG_WRITER_OPTS * pOpts,
+          int                    threads);
+
+/*
+ * Release a parallel writer.
+ * 
+ * Worker threads that are still running are stopped.  The call is
+ * ignored if pw is NULL.  If not all scanlines have been written, only
+ * a partial JPEG file will be present in the output.
+ * 
+ * Parameters:
+ * 
+ *   pw - the parallel writer to release, or NULL
+ */
+void sph_jpeg_par_writer_free(SPH_JPEG_PAR_WRITER *pw);
+
+/*
+ * Return the number of stripes the image is encoded in.
+ * 
+ * This is one if the image is encoded sequentially on the calling
+ * thread.
+ * 
+ * Parameters:
+ * 
+ *   pw - the parallel writer
+ * 
+ * Return:
+ * 
+ *   the stripe count
+ */
+int32_t sph_jpeg_par_writer_stripes(SPH_JPEG_PAR_WRITER *pw);
+
+/*
+ * Return the error status of a parallel writer.
+ * 
+ * This works the same way as sph_jpeg_writer_status().  The status is
+ * SPH_JPEG_ERR_OK until the first error, which is kept from then on.
+ * An image is only known to be complete and valid once all scanlines
+ * have been written and the status is still SPH_JPEG_ERR_OK.
+ * 
+ * Parameters:
+ * 
+ *   pw - the parallel writer
+ * 
+ * Return:
+ * 
+ *   the current status code
+ */
+int sph_jpeg_par_writer_status(SPH_JPEG_PAR_WRITER *pw);
+
+/*
+ * Write a scanline to a parallel writer.
+ * 
+ * This works the same way as sph_jpeg_writer_put().  The scanline is
+ * copied into the stripe it belongs to, and once the stripe is full, it
+ * is handed to the worker threads.  If all the stripes held in memory
+ * are still waiting to be encoded, the call waits for the oldest of
+ * them to be encoded and written out.
+ * 
+ * Parameters:
+ * 
+ *   pw - the parallel writer
+ * 
+ *   pscan - the scanline data to write
+ */
+void sph_jpeg_par_writer_put(SPH_JPEG_PAR_WRITER *pw, uint8_t *pscan);
+
+/*
+ * Write several scanlines to a parallel writer in one call.
+ * 
+ * This works the same way as sph_jpeg_writer_put_rows(), and buffers
+ * the rows in the same way as sph_jpeg_par_writer_put().
+ * 
+ * Parameters:
+ * 
+ *   pw - the parallel writer
+ * 
+ *   buf - the first row to write
+ * 
+ *   stride - the distance in bytes between rows
+ * 
+ *   rows - the number of rows to write
+ */
+void sph_jpeg_par_writer_put_rows(
+    SPH_JPEG_PAR_WRITER * pw,
+    uint8_t             * buf,
+    size_t                stride,
+    int32_t               rows);
+
+#endif
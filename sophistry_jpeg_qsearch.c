@@ -0,0 +1,852 @@
+/*
+ * sophistry_jpeg_qsearch.c
+ * ========================
+ * 
+ * Implementation of sophistry_jpeg_qsearch.h
+ * 
+ * See the header for further information.
+ */
+#include "sophistry_jpeg_qsearch.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Constants
+ * =========
+ */
+
+/*
+ * The size of the SSIM windows in pixels, and the spacing between
+ * them.
+ */
+#define SPH_JPEG_QSEARCH_WIN  (8)
+#define SPH_JPEG_QSEARCH_STEP (4)
+
+/*
+ * The SSIM stabilizing constants for 8-bit samples, which are
+ * (0.01 * 255)^2 and (0.03 * 255)^2.
+ */
+#define SPH_JPEG_QSEARCH_C1 (6.5025)
+#define SPH_JPEG_QSEARCH_C2 (58.5225)
+
+/*
+ * Type declarations
+ * =================
+ */
+
+/*
+ * The image being searched, which all the trials share without
+ * modifying it.
+ */
+typedef struct {
+  
+  /*
+   * The image scanlines and their format.
+   */
+  uint8_t *pPixels;
+  size_t stride;
+  int32_t width;
+  int32_t height;
+  int chcount;
+  
+  /*
+   * The encoder options of every trial.
+   */
+  SPH_JPEG_WRITER_OPTS opts;
+  
+  /*
+   * The luma of the image, with width bytes per scanline, or NULL if
+   * there is no SSIM target.
+   */
+  uint8_t *pLuma;
+  
+} SPH_JPEG_QIMAGE;
+
+/*
+ * The state of one trial slot.
+ * 
+ * The writer, reader, and buffers of a slot are reused for every trial
+ * that runs in the slot.
+ */
+typedef struct {
+  
+  /*
+   * The image to encode.
+   */
+  const SPH_JPEG_QIMAGE *pImage;
+  
+  /*
+   * The quality of the trial.
+   */
+  int quality;
+  
+  /*
+   * The writer and the reader of the slot, or NULL before the first
+   * trial that needs them.
+   */
+  SPH_JPEG_WRITER *pw;
+  SPH_JPEG_READER *pr;
+  
+  /*
+   * The encoded file of the trial.
+   */
+  SPH_JPEG_MEMBUF enc;
+  
+  /*
+   * The decoded luma of the trial and its capacity in bytes.
+   */
+  uint8_t *pDec;
+  size_t dec_cap;
+  
+  /*
+   * The SSIM of the trial, or -1.0 if it is not measured.
+   */
+  double ssim;
+  
+  /*
+   * The status of the trial, which is SPH_JPEG_ERR_OK unless encoding
+   * or decoding failed.
+   */
+  int status;
+  
+} SPH_JPEG_QTRIAL;
+
+/*
+ * A trial kept at one end of the search range.
+ */
+typedef struct {
+  
+  /*
+   * The quality, which is outside the quality range if there is no
+   * trial at this end yet.
+   */
+  int quality;
+  
+  /*
+   * The encoded file and its SSIM.
+   */
+  SPH_JPEG_MEMBUF enc;
+  double ssim;
+  
+} SPH_JPEG_QHELD;
+
+/*
+ * Local functions
+ * ===============
+ */
+
+/* Prototypes */
+static void sph_jpeg_qsearch_luma(SPH_JPEG_QIMAGE *pi);
+static double sph_jpeg_qsearch_ssim(
+    const uint8_t * pA,
+    const uint8_t * pB,
+          int32_t   width,
+          int32_t   height);
+static void sph_jpeg_qsearch_trial(SPH_JPEG_QTRIAL *pt);
+static void *sph_jpeg_qsearch_thread(void *pParam);
+static void sph_jpeg_qsearch_keep(
+    SPH_JPEG_QHELD  * ph,
+    SPH_JPEG_QTRIAL * pt);
+static int sph_jpeg_qsearch_pass(
+    const SPH_JPEG_QTARGET * pTarget,
+    const SPH_JPEG_QTRIAL  * pt);
+
+/*
+ * Compute the luma of the image being searched.
+ * 
+ * The luma is computed with the same fixed-point formula that libjpeg
+ * uses when it converts RGB to YCbCr, so that it matches the luma the
+ * encoder compresses.  Grayscale images and YCbCr scanlines already
+ * have their luma in the first channel.
+ * 
+ * Parameters:
+ * 
+ *   pi - the image, whose pLuma buffer is filled in
+ */
+static void sph_jpeg_qsearch_luma(SPH_JPEG_QIMAGE *pi) {
+  
+  const uint8_t *ps = NULL;
+  uint8_t *pd = NULL;
+  int32_t x = 0;
+  int32_t y = 0;
+  int rgb = 0;
+  
+  /* Check parameters */
+  if ((pi == NULL) || (pi->pLuma == NULL)) {
+    abort();
+  }
+  
+  /* Determine whether the luma needs to be computed */
+  if ((pi->chcount == 3) && ((pi->opts).color == SPH_JPEG_COLOR_RGB)) {
+    rgb = 1;
+  }
+  
+  for(y = 0; y < pi->height; y++) {
+    ps = pi->pPixels + (((size_t) y) * pi->stride);
+    pd = pi->pLuma + (((size_t) y) * ((size_t) pi->width));
+    
+    if (rgb) {
+      for(x = 0; x < pi->width; x++) {
+        pd[x] = (uint8_t) ((UINT32_C(19595) * ps[0] +
+                            UINT32_C(38470) * ps[1] +
+                            UINT32_C(7471) * ps[2] +
+                            UINT32_C(32768)) >> 16);
+        ps += 3;
+      }
+    } else {
+      for(x = 0; x < pi->width; x++) {
+        pd[x] = ps[0];
+        ps += pi->chcount;
+      }
+    }
+  }
+}
+
+/*
+ * Compute the SSIM between two luma planes.
+ * 
+ * Each plane has width bytes per scanline.  The SSIM is computed for
+ * each window of SPH_JPEG_QSEARCH_WIN by SPH_JPEG_QSEARCH_WIN pixels
+ * whose top-left corner is a multiple of SPH_JPEG_QSEARCH_STEP in both
+ * directions, and the mean over all windows is returned.  Images
+ * smaller than a window in either direction use a single window that
+ * is as large as possible.
+ * 
+ * Parameters:
+ * 
+ *   pA - the first plane
+ * 
+ *   pB - the second plane
+ * 
+ *   width - the width of the planes
+ * 
+ *   height - the height of the planes
+ * 
+ * Return:
+ * 
+ *   the mean SSIM
+ */
+static double sph_jpeg_qsearch_ssim(
+    const uint8_t * pA,
+    const uint8_t * pB,
+          int32_t   width,
+          int32_t   height) {
+  
+  int32_t win_w = SPH_JPEG_QSEARCH_WIN;
+  int32_t win_h = SPH_JPEG_QSEARCH_WIN;
+  int32_t x = 0;
+  int32_t y = 0;
+  int32_t i = 0;
+  int32_t j = 0;
+  uint32_t sa = 0;
+  uint32_t sb = 0;
+  uint32_t saa = 0;
+  uint32_t sbb = 0;
+  uint32_t sab = 0;
+  uint32_t a = 0;
+  uint32_t b = 0;
+  double n = 0.0;
+  double ma = 0.0;
+  double mb = 0.0;
+  double va = 0.0;
+  double vb = 0.0;
+  double cov = 0.0;
+  double total = 0.0;
+  long count = 0;
+  const uint8_t *pa = NULL;
+  const uint8_t *pb = NULL;
+  
+  /* Check parameters */
+  if ((pA == NULL) || (pB == NULL) || (width < 1) || (height < 1)) {
+    abort();
+  }
+  
+  /* Shrink the window for small images */
+  if (win_w > width) {
+    win_w = width;
+  }
+  if (win_h > height) {
+    win_h = height;
+  }
+  n = (double) (win_w * win_h);
+  
+  /* Go through the windows */
+  for(y = 0; y + win_h <= height; y += SPH_JPEG_QSEARCH_STEP) {
+    for(x = 0; x + win_w <= width; x += SPH_JPEG_QSEARCH_STEP) {
+      
+      /* Get the sums over the window */
+      sa = 0;
+      sb = 0;
+      saa = 0;
+      sbb = 0;
+      sab = 0;
+      for(j = 0; j < win_h; j++) {
+        pa = pA + (((size_t) (y + j)) * ((size_t) width)) + x;
+        pb = pB + (((size_t) (y + j)) * ((size_t) width)) + x;
+        for(i = 0; i < win_w; i++) {
+          a = pa[i];
+          b = pb[i];
+          sa += a;
+          sb += b;
+          saa += a * a;
+          sbb += b * b;
+          sab += a * b;
+        }
+      }
+      
+      /* Compute the SSIM of the window */
+      ma = ((double) sa) / n;
+      mb = ((double) sb) / n;
+      va = (((double) saa) / n) - (ma * ma);
+      vb = (((double) sbb) / n) - (mb * mb);
+      cov = (((double) sab) / n) - (ma * mb);
+      
+      total += ((2.0 * ma * mb + SPH_JPEG_QSEARCH_C1) *
+                (2.0 * cov + SPH_JPEG_QSEARCH_C2)) /
+               ((ma * ma + mb * mb + SPH_JPEG_QSEARCH_C1) *
+                (va + vb + SPH_JPEG_QSEARCH_C2));
+      count++;
+    }
+  }
+  
+  return total / ((double) count);
+}
+
+/*
+ * Run one trial encoding.
+ * 
+ * The image is encoded at the quality of the trial into the memory
+ * buffer of the slot.  If the image has a luma plane, the encoded file
+ * is then decoded to luma only and its SSIM against the image is
+ * measured.  This may be called on any thread, as long as no other
+ * thread is using the same slot.  Errors are recorded in the status of
+ * the slot.
+ * 
+ * Parameters:
+ * 
+ *   pt - the trial slot
+ */
+static void sph_jpeg_qsearch_trial(SPH_JPEG_QTRIAL *pt) {
+  
+  const SPH_JPEG_QIMAGE *pi = NULL;
+  SPH_JPEG_READER_OPTS ropts;
+  int32_t done = 0;
+  int32_t got = 0;
+  
+  /* Initialize structures */
+  memset(&ropts, 0, sizeof(SPH_JPEG_READER_OPTS));
+  
+  /* Check parameters */
+  if ((pt == NULL) || (pt->pImage == NULL)) {
+    abort();
+  }
+  pi = pt->pImage;
+  pt->status = SPH_JPEG_ERR_OK;
+  pt->ssim = -1.0;
+  
+  /* Encode the image, reusing the writer of the slot */
+  (pt->enc).len = 0;
+  if (pt->pw != NULL) {
+    sph_jpeg_writer_reset_mem(
+      pt->pw, &(pt->enc), pi->width, pi->height, pi->chcount,
+      pt->quality);
+  } else {
+    pt->pw = sph_jpeg_writer_new_mem_ex(
+              &(pt->enc), pi->width, pi->height, pi->chcount,
+              pt->quality, &(pi->opts));
+    if (pt->pw == NULL) {
+      abort();
+    }
+  }
+  sph_jpeg_writer_put_rows(pt->pw, pi->pPixels, pi->stride, pi->height);
+  pt->status = sph_jpeg_writer_status(pt->pw);
+  if (pt->status != SPH_JPEG_ERR_OK) {
+    return;
+  }
+  
+  /* Measure the SSIM if there is a target for it */
+  if (pi->pLuma != NULL) {
+    
+    /* Decode only the luma of the trial file, reusing the reader of the
+     * slot; the file was just written, so it can only fail to decode if
+     * memory runs out */
+    if (pt->pr != NULL) {
+      sph_jpeg_reader_reset_mem(pt->pr, (pt->enc).pData, (pt->enc).len);
+    } else {
+      sph_jpeg_reader_opts_init(&ropts);
+      ropts.color = SPH_JPEG_COLOR_GRAY;
+      pt->pr = sph_jpeg_reader_new_mem_ex(
+                (pt->enc).pData, (pt->enc).len, &ropts);
+      if (pt->pr == NULL) {
+        abort();
+      }
+    }
+    pt->status = sph_jpeg_reader_status(pt->pr);
+    if (pt->status != SPH_JPEG_ERR_OK) {
+      return;
+    }
+    if ((sph_jpeg_reader_width(pt->pr) != pi->width) ||
+        (sph_jpeg_reader_height(pt->pr) != pi->height) ||
+        (sph_jpeg_reader_channels(pt->pr) != 1)) {
+      abort();
+    }
+    
+    if ((pt->pDec == NULL) ||
+        (pt->dec_cap < ((size_t) pi->width) * ((size_t) pi->height))) {
+      free(pt->pDec);
+      pt->dec_cap = ((size_t) pi->width) * ((size_t) pi->height);
+      pt->pDec = (uint8_t *) malloc(pt->dec_cap);
+      if (pt->pDec == NULL) {
+        pt->dec_cap = 0;
+        pt->status = SPH_JPEG_ERR_MEM;
+        return;
+      }
+    }
+    
+    for(done = 0; done < pi->height; done += got) {
+      got = sph_jpeg_reader_get_rows(
+              pt->pr,
+              pt->pDec + (((size_t) done) * ((size_t) pi->width)),
+              (size_t) pi->width,
+              pi->height - done);
+      if (got < 1) {
+        pt->status = sph_jpeg_reader_status(pt->pr);
+        if (pt->status == SPH_JPEG_ERR_OK) {
+          abort();
+        }
+        return;
+      }
+    }
+    
+    /* Compare against the image */
+    pt->ssim = sph_jpeg_qsearch_ssim(
+                pi->pLuma, pt->pDec, pi->width, pi->height);
+  }
+  /* CAUTION: alternate return statements earlier! */
+}
+
+/*
+ * Thread procedure that runs one trial.
+ * 
+ * Parameters:
+ * 
+ *   pParam - the SPH_JPEG_QTRIAL slot
+ * 
+ * Return:
+ * 
+ *   always NULL
+ */
+static void *sph_jpeg_qsearch_thread(void *pParam) {
+  
+  if (pParam == NULL) {
+    abort();
+  }
+  sph_jpeg_qsearch_trial((SPH_JPEG_QTRIAL *) pParam);
+  return NULL;
+}
+
+/*
+ * Keep a trial at one end of the search range.
+ * 
+ * The encoded file is moved from the trial slot to the held trial by
+ * exchanging their memory buffers, so nothing is copied, and the slot
+ * gets the buffer that was held before for its next trial.
+ * 
+ * Parameters:
+ * 
+ *   ph - the held trial
+ * 
+ *   pt - the trial slot
+ */
+static void sph_jpeg_qsearch_keep(
+    SPH_JPEG_QHELD  * ph,
+    SPH_JPEG_QTRIAL * pt) {
+  
+  SPH_JPEG_MEMBUF tmp;
+  
+  /* Check parameters */
+  if ((ph == NULL) || (pt == NULL)) {
+    abort();
+  }
+  
+  /* Exchange the buffers and record the trial */
+  memcpy(&tmp, &(ph->enc), sizeof(SPH_JPEG_MEMBUF));
+  memcpy(&(ph->enc), &(pt->enc), sizeof(SPH_JPEG_MEMBUF));
+  memcpy(&(pt->enc), &tmp, sizeof(SPH_JPEG_MEMBUF));
+  ph->quality = pt->quality;
+  ph->ssim = pt->ssim;
+}
+
+/*
+ * Check whether a trial is at or above the quality the search is
+ * looking for.
+ * 
+ * With an SSIM target, this is whether the trial meets the target, and
+ * the search looks for the lowest quality that passes.  Otherwise, this
+ * is whether the trial is over the size limit, and the search looks for
+ * the highest quality just below the lowest that passes.
+ * 
+ * Parameters:
+ * 
+ *   pTarget - the search target
+ * 
+ *   pt - the trial
+ * 
+ * Return:
+ * 
+ *   non-zero if the trial passes, zero if not
+ */
+static int sph_jpeg_qsearch_pass(
+    const SPH_JPEG_QTARGET * pTarget,
+    const SPH_JPEG_QTRIAL  * pt) {
+  
+  int result = 0;
+  
+  if (pTarget->min_ssim > 0.0) {
+    if (pt->ssim >= pTarget->min_ssim) {
+      result = 1;
+    }
+  } else {
+    if ((pt->enc).len > (size_t) pTarget->max_bytes) {
+      result = 1;
+    }
+  }
+  
+  return result;
+}
+
+/*
+ * Public function implementations
+ * ===============================
+ * 
+ * See the header for specifications.
+ */
+
+/*
+ * sph_jpeg_qsearch_pixels function.
+ */
+int sph_jpeg_qsearch_pixels(
+          uint8_t              * pPixels,
+          size_t                 stride,
+          int32_t                width,
+          int32_t                height,
+          int                    chcount,
+    const SPH_JPEG_WRITER_OPTS * pOpts,
+    const SPH_JPEG_QTARGET     * pTarget,
+          int                    threads,
+          SPH_JPEG_MEMBUF      * pBuf,
+          SPH_JPEG_QRESULT     * pResult) {
+  
+  int retval = SPH_JPEG_ERR_OK;
+  SPH_JPEG_QIMAGE img;
+  SPH_JPEG_QTRIAL *pTrials = NULL;
+  pthread_t *pThreads = NULL;
+  SPH_JPEG_QHELD below;
+  SPH_JPEG_QHELD above;
+  SPH_JPEG_QHELD *pWin = NULL;
+  uint8_t *pGrow = NULL;
+  int trials = 0;
+  int k = 0;
+  int i = 0;
+  int gap = 0;
+  
+  /* Initialize structures */
+  memset(&img, 0, sizeof(SPH_JPEG_QIMAGE));
+  memset(&below, 0, sizeof(SPH_JPEG_QHELD));
+  memset(&above, 0, sizeof(SPH_JPEG_QHELD));
+  
+  /* Check parameters */
+  if ((pPixels == NULL) || (pTarget == NULL) || (pBuf == NULL)) {
+    abort();
+  }
+  if ((width < 1) || (width > SPH_JPEG_MAXDIM) ||
+      (height < 1) || (height > SPH_JPEG_MAXDIM)) {
+    abort();
+  }
+  if ((chcount != 1) && (chcount != 3)) {
+    abort();
+  }
+  if (stride < ((size_t) width) * ((size_t) chcount)) {
+    abort();
+  }
+  if ((threads < 1) || (threads > SPH_JPEG_QSEARCH_MAXTHREADS)) {
+    abort();
+  }
+  if ((pTarget->max_bytes < 0) && (!(pTarget->min_ssim > 0.0))) {
+    abort();
+  }
+  if (pTarget->min_ssim > 1.0) {
+    abort();
+  }
+  
+  /* Set up the image */
+  img.pPixels = pPixels;
+  img.stride = stride;
+  img.width = width;
+  img.height = height;
+  img.chcount = chcount;
+  if (pOpts != NULL) {
+    memcpy(&(img.opts), pOpts, sizeof(SPH_JPEG_WRITER_OPTS));
+  } else {
+    sph_jpeg_writer_opts_init(&(img.opts));
+  }
+  img.pLuma = NULL;
+  if (pTarget->min_ssim > 0.0) {
+    img.pLuma = (uint8_t *) malloc(
+                  ((size_t) width) * ((size_t) height));
+    if (img.pLuma == NULL) {
+      retval = SPH_JPEG_ERR_MEM;
+    } else {
+      sph_jpeg_qsearch_luma(&img);
+    }
+  }
+  
+  /* Allocate the trial slots */
+  if (retval == SPH_JPEG_ERR_OK) {
+    pTrials = (SPH_JPEG_QTRIAL *) calloc(
+                (size_t) threads, sizeof(SPH_JPEG_QTRIAL));
+    pThreads = (pthread_t *) calloc(
+                (size_t) threads, sizeof(pthread_t));
+    if ((pTrials == NULL) || (pThreads == NULL)) {
+      free(pTrials);
+      pTrials = NULL;
+      retval = SPH_JPEG_ERR_MEM;
+    }
+  }
+  if (retval == SPH_JPEG_ERR_OK) {
+    for(i = 0; i < threads; i++) {
+      pTrials[i].pImage = &img;
+      pTrials[i].pw = NULL;
+      pTrials[i].pr = NULL;
+      sph_jpeg_membuf_init(&(pTrials[i].enc));
+      pTrials[i].pDec = NULL;
+      pTrials[i].dec_cap = 0;
+      pTrials[i].status = SPH_JPEG_ERR_OK;
+    }
+  }
+  
+  /* Every quality below the below trial fails to pass, and every
+   * quality from the above trial up passes; start with both ends just
+   * outside the quality range */
+  below.quality = SPH_JPEG_MINQ - 1;
+  above.quality = SPH_JPEG_MAXQ + 1;
+  sph_jpeg_membuf_init(&(below.enc));
+  sph_jpeg_membuf_init(&(above.enc));
+  
+  /* Narrow down the range until the ends are adjacent, trying up to one
+   * quality per thread in each round, spaced evenly over the range, and
+   * stopping at the first trial that fails */
+  while ((retval == SPH_JPEG_ERR_OK) &&
+          (above.quality - below.quality > 1)) {
+    gap = above.quality - below.quality;
+    k = gap - 1;
+    if (k > threads) {
+      k = threads;
+    }
+    for(i = 0; i < k; i++) {
+      pTrials[i].quality = below.quality + ((i + 1) * gap) / (k + 1);
+    }
+    
+    /* Run the trials, one of them on the calling thread */
+    for(i = 1; i < k; i++) {
+      if (pthread_create(
+            &(pThreads[i]), NULL,
+            &sph_jpeg_qsearch_thread, &(pTrials[i]))) {
+        abort();
+      }
+    }
+    sph_jpeg_qsearch_trial(&(pTrials[0]));
+    for(i = 1; i < k; i++) {
+      if (pthread_join(pThreads[i], NULL)) {
+        abort();
+      }
+    }
+    trials += k;
+    
+    /* Stop if any trial failed */
+    for(i = 0; i < k; i++) {
+      if (pTrials[i].status != SPH_JPEG_ERR_OK) {
+        retval = pTrials[i].status;
+        break;
+      }
+    }
+    if (retval != SPH_JPEG_ERR_OK) {
+      break;
+    }
+    
+    /* Move the ends in to the lowest trial that passes and the trial
+     * just below it */
+    for(i = 0; i < k; i++) {
+      if (sph_jpeg_qsearch_pass(pTarget, &(pTrials[i]))) {
+        sph_jpeg_qsearch_keep(&above, &(pTrials[i]));
+        break;
+      }
+      sph_jpeg_qsearch_keep(&below, &(pTrials[i]));
+    }
+  }
+  
+  /* Pick the winning end, which is the lowest quality that meets the
+   * SSIM target, or the highest quality within the size limit */
+  if (retval != SPH_JPEG_ERR_OK) {
+    pWin = NULL;
+  } else if (pTarget->min_ssim > 0.0) {
+    if (above.quality <= SPH_JPEG_MAXQ) {
+      pWin = &above;
+      if ((pTarget->max_bytes >= 0) &&
+          ((above.enc).len > (size_t) pTarget->max_bytes)) {
+        pWin = NULL;
+      }
+    }
+  } else {
+    if (below.quality >= SPH_JPEG_MINQ) {
+      pWin = &below;
+    }
+  }
+  
+  /* Append the winning file to the client buffer */
+  if ((pWin != NULL) && (pBuf->cap - pBuf->len < (pWin->enc).len)) {
+    pGrow = (uint8_t *) realloc(
+                pBuf->pData, pBuf->len + (pWin->enc).len);
+    if (pGrow != NULL) {
+      pBuf->pData = pGrow;
+      pBuf->cap = pBuf->len + (pWin->enc).len;
+    } else {
+      pWin = NULL;
+      retval = SPH_JPEG_ERR_MEM;
+    }
+  }
+  if (pWin != NULL) {
+    memcpy(pBuf->pData + pBuf->len, (pWin->enc).pData, (pWin->enc).len);
+    pBuf->len += (pWin->enc).len;
+  } else if (retval == SPH_JPEG_ERR_OK) {
+    retval = -1;
+  }
+  
+  /* Report the outcome */
+  if (pResult != NULL) {
+    memset(pResult, 0, sizeof(SPH_JPEG_QRESULT));
+    if (pWin != NULL) {
+      pResult->quality = pWin->quality;
+      if ((pWin->enc).len > (size_t) INT32_MAX) {
+        pResult->bytes = INT32_MAX;
+      } else {
+        pResult->bytes = (int32_t) (pWin->enc).len;
+      }
+      pResult->ssim = pWin->ssim;
+    } else {
+      pResult->quality = -1;
+      pResult->bytes = -1;
+      pResult->ssim = -1.0;
+    }
+    pResult->trials = trials;
+  }
+  
+  /* Release everything */
+  for(i = 0; (pTrials != NULL) && (i < threads); i++) {
+    sph_jpeg_writer_free(pTrials[i].pw);
+    sph_jpeg_reader_free(pTrials[i].pr);
+    sph_jpeg_membuf_free(&(pTrials[i].enc));
+    free(pTrials[i].pDec);
+  }
+  free(pTrials);
+  free(pThreads);
+  sph_jpeg_membuf_free(&(below.enc));
+  sph_jpeg_membuf_free(&(above.enc));
+  free(img.pLuma);
+  
+  return retval;
+}
+
+/*
+ * sph_jpeg_qsearch function.
+ */
+int sph_jpeg_qsearch(
+          FILE                 * pIn,
+    const SPH_JPEG_WRITER_OPTS * pOpts,
+    const SPH_JPEG_QTARGET     * pTarget,
+          int                    threads,
+          SPH_JPEG_MEMBUF      * pBuf,
+          SPH_JPEG_QRESULT     * pResult) {
+  
+  int retval = SPH_JPEG_ERR_OK;
+  SPH_JPEG_READER *pr = NULL;
+  SPH_JPEG_READER_OPTS ropts;
+  SPH_JPEG_WRITER_OPTS wopts;
+  uint8_t *pPixels = NULL;
+  size_t row_size = 0;
+  int32_t width = 0;
+  int32_t height = 0;
+  int chcount = 0;
+  int32_t done = 0;
+  int32_t got = 0;
+  
+  /* Initialize structures */
+  memset(&ropts, 0, sizeof(SPH_JPEG_READER_OPTS));
+  memset(&wopts, 0, sizeof(SPH_JPEG_WRITER_OPTS));
+  
+  /* Check parameters */
+  if ((pIn == NULL) || (pTarget == NULL) || (pBuf == NULL)) {
+    abort();
+  }
+  
+  /* Open the file, keeping color images in YCbCr */
+  sph_jpeg_reader_opts_init(&ropts);
+  ropts.color = SPH_JPEG_COLOR_YCC;
+  pr = sph_jpeg_reader_new_ex(pIn, 1, &ropts);
+  if (pr == NULL) {
+    abort();
+  }
+  retval = sph_jpeg_reader_status(pr);
+  
+  /* Decode the whole image */
+  if (retval == SPH_JPEG_ERR_OK) {
+    width = sph_jpeg_reader_width(pr);
+    height = sph_jpeg_reader_height(pr);
+    chcount = sph_jpeg_reader_channels(pr);
+    row_size = ((size_t) width) * ((size_t) chcount);
+    
+    pPixels = (uint8_t *) malloc(row_size * ((size_t) height));
+    if (pPixels == NULL) {
+      retval = SPH_JPEG_ERR_MEM;
+    }
+    
+    for(done = 0; (pPixels != NULL) && (done < height); done += got) {
+      got = sph_jpeg_reader_get_rows(
+              pr, pPixels + (((size_t) done) * row_size), row_size,
+              height - done);
+      if (got < 1) {
+        retval = sph_jpeg_reader_status(pr);
+        break;
+      }
+    }
+  }
+  
+  /* Search with the encoder taking the color space of the reader */
+  if (retval == SPH_JPEG_ERR_OK) {
+    if (pOpts != NULL) {
+      memcpy(&wopts, pOpts, sizeof(SPH_JPEG_WRITER_OPTS));
+    } else {
+      sph_jpeg_writer_opts_init(&wopts);
+    }
+    wopts.color = sph_jpeg_reader_color(pr);
+    
+    retval = sph_jpeg_qsearch_pixels(
+              pPixels, row_size, width, height, chcount, &wopts,
+              pTarget, threads, pBuf, pResult);
+              
+  } else if (pResult != NULL) {
+    memset(pResult, 0, sizeof(SPH_JPEG_QRESULT));
+    pResult->quality = -1;
+    pResult->bytes = -1;
+    pResult->ssim = -1.0;
+    pResult->trials = 0;
+  }
+  
+  /* Release the reader and the pixels */
+  sph_jpeg_reader_free(pr);
+  free(pPixels);
+  
+  return retval;
+}
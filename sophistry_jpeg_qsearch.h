@@ -0,0 +1,212 @@
+#ifndef SOPHISTRY_JPEG_QSEARCH_H_INCLUDED
+#define SOPHISTRY_JPEG_QSEARCH_H_INCLUDED
+
+/*
+ * sophistry_jpeg_qsearch.h
+ * ========================
+ * 
+ * Optional module that searches for the compression quality that meets
+ * a target file size or a target structural similarity (SSIM).
+ * 
+ * The image is only decoded once, or not at all if the client already
+ * has its pixels.  Trial encodings at different qualities are then
+ * written into memory, and the quality range from SPH_JPEG_MINQ to
+ * SPH_JPEG_MAXQ is narrowed down until the target is met exactly.  With
+ * several threads, each round of the search tries several qualities at
+ * once and splits the remaining range into more parts, so the search
+ * takes fewer rounds.  The encoded file of the winning trial is kept,
+ * so the result doesn't need to be encoded again.
+ * 
+ * The search assumes that the file size and the SSIM both increase with
+ * the quality, which is true of libjpeg for all practical purposes.
+ * 
+ * SSIM is measured on the luma channel, using 8 by 8 pixel windows
+ * spaced 4 pixels apart, against luma computed from the original pixels
+ * in the same way as the encoder computes it.  Trial files are decoded
+ * with luma-only decoding (see SPH_JPEG_COLOR_GRAY in sophistry_jpeg.h)
+ * for the measurement, so only searches with an SSIM target decode the
+ * trial files at all.
+ * 
+ * Compilation
+ * -----------
+ * 
+ * Compile with sophistry_jpeg.  Requires POSIX threads, so use -pthread
+ * (or -lpthread) when compiling and linking.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "sophistry_jpeg.h"
+
+/*
+ * The maximum number of threads that trial encodings are run on.
+ */
+#define SPH_JPEG_QSEARCH_MAXTHREADS (16)
+
+/*
+ * Structure declaring the target of a quality search.
+ * 
+ * At least one of the fields must be set.
+ */
+typedef struct {
+  
+  /*
+   * The maximum size of the encoded file in bytes, or -1 if the size is
+   * not constrained.
+   * 
+   * If there is no SSIM target, the search finds the highest quality
+   * whose file is no larger than this.  If there is an SSIM target, the
+   * file of the chosen quality must also be no larger than this.
+   */
+  int32_t max_bytes;
+  
+  /*
+   * The minimum SSIM of the encoded file, in range (0.0, 1.0], or -1.0
+   * if the SSIM is not constrained.
+   * 
+   * The search finds the lowest quality, and therefore the smallest
+   * file, whose SSIM is at least this.
+   */
+  double min_ssim;
+  
+} SPH_JPEG_QTARGET;
+
+/*
+ * Structure that receives the outcome of a quality search.
+ */
+typedef struct {
+  
+  /*
+   * The chosen quality, or -1 if the target can't be met.
+   */
+  int quality;
+  
+  /*
+   * The size in bytes of the file at the chosen quality, or -1 if the
+   * target can't be met.
+   */
+  int32_t bytes;
+  
+  /*
+   * The SSIM of the file at the chosen quality, or -1.0 if there is no
+   * SSIM target or the target can't be met.
+   */
+  double ssim;
+  
+  /*
+   * The number of trial encodings performed.
+   */
+  int trials;
+  
+} SPH_JPEG_QRESULT;
+
+/*
+ * Search for the quality that meets a target, for an image whose pixels
+ * are already in memory.
+ * 
+ * pPixels points to the first scanline of the image, and stride is the
+ * distance in bytes from the start of one scanline to the start of the
+ * next, which must be at least (width * chcount).  Each scanline has
+ * the same format as for sph_jpeg_writer_put().  The pixels are not
+ * modified.
+ * 
+ * width, height, and chcount are as for sph_jpeg_writer_new().  pOpts
+ * are the encoder options used for every trial, or NULL for the
+ * defaults.  With SPH_JPEG_COLOR_YCC, the first channel of each pixel
+ * is taken as the luma for SSIM.
+ * 
+ * pTarget is the search target, see SPH_JPEG_QTARGET.  threads is the
+ * number of trial encodings to run at the same time, in range
+ * [1, SPH_JPEG_QSEARCH_MAXTHREADS].  With one thread, the trials run on
+ * the calling thread.
+ * 
+ * If the target can be met, the file encoded at the chosen quality is
+ * appended to the memory buffer pBuf, in the same way as for
+ * sph_jpeg_writer_new_mem().  Otherwise, nothing is appended.  In both
+ * cases, pResult receives the outcome of the search, if it is not NULL.
+ * 
+ * If a trial encoding or decoding fails, for example because of a
+ * max_memory limit in pOpts, the search stops and the status of the
+ * failed trial is returned.  SPH_JPEG_ERR_MEM is returned if the
+ * buffers for the search can't be allocated.  Nothing is appended to
+ * pBuf in either case.  Failure to create a thread causes a fault.
+ * 
+ * Parameters:
+ * 
+ *   pPixels - the image scanlines
+ * 
+ *   stride - the distance in bytes between scanlines
+ * 
+ *   width - the width of the image in pixels
+ * 
+ *   height - the height of the image in pixels
+ * 
+ *   chcount - the number of color channels
+ * 
+ *   pOpts - the encoder options, or NULL
+ * 
+ *   pTarget - the search target
+ * 
+ *   threads - the number of threads
+ * 
+ *   pBuf - the memory buffer to append the chosen file to
+ * 
+ *   pResult - receives the outcome, or NULL
+ * 
+ * Return:
+ * 
+ *   SPH_JPEG_ERR_OK (0) if the target was met, -1 if it can't be met,
+ *   or else a sophistry_jpeg error code if a trial failed
+ */
+int sph_jpeg_qsearch_pixels(
+          uint8_t              * pPixels,
+          size_t                 stride,
+          int32_t                width,
+          int32_t                height,
+          int                    chcount,
+    const SPH_JPEG_WRITER_OPTS * pOpts,
+    const SPH_JPEG_QTARGET     * pTarget,
+          int                    threads,
+          SPH_JPEG_MEMBUF      * pBuf,
+          SPH_JPEG_QRESULT     * pResult);
+
+/*
+ * Search for the quality that meets a target when re-encoding a JPEG
+ * file.
+ * 
+ * The JPEG file is read from pIn and decoded once into a buffer that is
+ * kept for the whole search, and the search is then performed as for
+ * sph_jpeg_qsearch_pixels().  Color images are decoded and encoded in
+ * the color space they are stored in, so there is no color conversion,
+ * and the color field of pOpts is ignored.
+ * 
+ * Parameters:
+ * 
+ *   pIn - the JPEG file to read
+ * 
+ *   pOpts - the encoder options, or NULL
+ * 
+ *   pTarget - the search target
+ * 
+ *   threads - the number of threads
+ * 
+ *   pBuf - the memory buffer to append the chosen file to
+ * 
+ *   pResult - receives the outcome, or NULL
+ * 
+ * Return:
+ * 
+ *   SPH_JPEG_ERR_OK (0) if the target was met, -1 if it can't be met,
+ *   or else a sophistry_jpeg error code if the file can't be read or
+ *   a trial failed
+ */
+int sph_jpeg_qsearch(
+          FILE                 * pIn,
+    const SPH_JPEG_WRITER_OPTS * pOpts,
+    const SPH_JPEG_QTARGET     * pTarget,
+          int                    threads,
+          SPH_JPEG_MEMBUF      * pBuf,
+          SPH_JPEG_QRESULT     * pResult);
+
+#endif